@@ -1,12 +1,12 @@
-#include <Arduino.h>
+#include "hal.h"
 #include "ad5522_lib.h"
-#include <SPI.h>
-#include "utility.h"
-#include <string>
+#include "log_lib.h"
+#include "reg_lib.h"
 
 #define PMU_BUSY_MAX 5        // Max delay waiting for busy (in ms)
-
-//#define PMU_DEBUG
+#define PMU_BUSY_SPIN 100     // Spin on busy before waiting in ms steps (in us)
+#define PMU_DAC_ADDR_NUM 0x20 // DAC X1 register addresses (shadowed)
+#define PMU_BATCH_MAX 48      // Writes verified at end of a batch
 
 
 /*
@@ -20,10 +20,18 @@
  * 
  */
 
-SPIClass *SPI_PMU;
-int8_t pin_ad5522_busy;
-int8_t pin_ad5522_cs;
-int8_t pin_ad5522_reset;
+// Device and channel mask of channel (see ad5522_ch_t)
+#define AD5522_DEV(ch)  ((ch) >> 2)
+#define AD5522_MASK(ch) (1 << ((ch) & 3))
+
+typedef struct {
+  SPIClass *spi;
+  int8_t busy;
+  int8_t cs;
+  int8_t reset;
+} ad5522_dev_t;
+
+ad5522_dev_t ad5522_dev[AD5522_DEV_NUM];
 
 typedef struct {
                         // 21:18 (def 0) - Enable clamps (set in ch)
@@ -61,8 +69,108 @@ typedef struct {
                         //     5 (def 1) - Unlatched alarm bar
 } ad5522_pmuctrl_reg_t;
 
-ad5522_sysctrl_reg_t sysctrl_reg;
-ad5522_pmuctrl_reg_t pmuctrl_reg[4];
+// Serial word (29 bits), rw = 1 reads the register back on the next word
+struct ad5522_word {
+  typedef reg_field<28, 1>                rw;
+  typedef reg_field<24, 4>                ch;             // Channel mask (0 = SYSCTRL)
+  typedef reg_field<22, 2>                mode;           // 00 = control, else DAC register
+  typedef reg_field< 0, 22>               data;
+
+  typedef reg_map<rw, ch, mode, data> map;
+};
+
+// SYSCTRL register layout (mode 00, no channel bits set)
+struct ad5522_sysctrl {
+  typedef reg_field<18, 4>                clamp_en;       // Bit per channel
+  typedef reg_field<14, 4>                cmp_out_en;     // Bit per channel
+  typedef reg_field<13, 1>                cmp_en;
+  typedef reg_field<12, 1>                ch_dutgnd_en;
+  typedef reg_field<11, 1>                guard_alarm_en;
+  typedef reg_field<10, 1>                clamp_alarm_en;
+  typedef reg_field< 9, 1>                int_sense_en;
+  typedef reg_field< 8, 1>                guard_en;
+  typedef reg_field< 6, 2>                meas_gain;
+  typedef reg_field< 5, 1, 1>             therm_en;
+  typedef reg_field< 3, 2>                therm_thresh;
+  typedef reg_field< 2, 1>                alarm_latch_en;
+
+  typedef reg_map<clamp_en, cmp_out_en, cmp_en, ch_dutgnd_en, guard_alarm_en,
+                  clamp_alarm_en, int_sense_en, guard_en, meas_gain, therm_en,
+                  therm_thresh, alarm_latch_en> map;
+};
+
+// PMU register layout (mode 00, channel bits select the channels)
+//  - bit 6 clears the latched alarm on write and reads the alarm, it
+//    isn't compared on read-back
+struct ad5522_pmuctrl {
+  typedef reg_field<21, 1>                ch_en;
+  typedef reg_field<20, 1>                hiz_en;
+  typedef reg_field<19, 1>                mode;
+  typedef reg_field<15, 3, 3>             range;
+  typedef reg_field<13, 2, 3>             meas_sel;
+  typedef reg_field<12, 1>                dac_en;
+  typedef reg_field<11, 1>                sys_force_en;
+  typedef reg_field<10, 1>                sys_sense_en;
+  typedef reg_field< 9, 1>                clamp_en;
+  typedef reg_field< 8, 1>                cmp_en;
+  typedef reg_field< 7, 1>                cmp_fv_en;
+  typedef reg_field< 6, 1, 0, REG_WO>     alarm_clr;
+
+  typedef reg_map<ch_en, hiz_en, mode, range, meas_sel, dac_en, sys_force_en,
+                  sys_sense_en, clamp_en, cmp_en, cmp_fv_en, alarm_clr> map;
+};
+
+// DAC register write (mode 01-11), the address selects the DAC and only
+//  the code reads back
+struct ad5522_dac {
+  typedef reg_field<16, 6, 0, REG_WO>     addr;
+  typedef reg_field< 0, 16>               code;
+
+  typedef reg_map<addr, code> map;
+};
+
+static_assert((ad5522_sysctrl::map::mask & ~ad5522_word::data::mask) == 0, "SYSCTRL outside data bits");
+static_assert((ad5522_pmuctrl::map::mask & ~ad5522_word::data::mask) == 0, "PMU register outside data bits");
+static_assert((ad5522_dac::map::mask & ~ad5522_word::data::mask) == 0, "DAC register outside data bits");
+
+// Layouts pack like the hand shifts they replaced, read-back compares
+//  the old masks less unused and write-only bits
+static_assert(ad5522_word::map::pack(1, 0xA, 2, 0x3FFFFF)
+    == ((1UL << 28) | (0xAUL << 24) | (2UL << 22) | 0x3FFFFF), "serial word packing changed");
+static_assert(ad5522_dac::map::pack(0x2A, 0xBEEF) == ((0x2AUL << 16) | 0xBEEF), "DAC packing changed");
+static_assert(ad5522_sysctrl::map::pack(0x9, 0x6, 1, 0, 1, 0, 1, 0, 2, 1, 1, 0)
+    == ((0x9UL << 18) | (0x6UL << 14) | (1UL << 13) | (1UL << 11) | (1UL << 9)
+        | (2UL << 6) | (1UL << 5) | (1UL << 3)), "SYSCTRL packing changed");
+static_assert(ad5522_sysctrl::map::pack(0xF, 0xF, 1, 1, 1, 1, 1, 1, 3, 1, 3, 1) == 0x3FFFFC, "SYSCTRL packing changed");
+static_assert(ad5522_pmuctrl::map::pack(1, 0, 1, 5, 2, 1, 0, 1, 0, 1, 0, 0)
+    == ((1UL << 21) | (1UL << 19) | (5UL << 15) | (2UL << 13) | (1UL << 12)
+        | (1UL << 10) | (1UL << 8)), "PMU packing changed");
+static_assert(ad5522_pmuctrl::map::pack(1, 1, 1, 7, 3, 1, 1, 1, 1, 1, 1, 0) == 0x3BFF80, "PMU packing changed");
+static_assert(ad5522_sysctrl::map::verify == (0xFFFFFF & 0x3FFFFC), "SYSCTRL verify mask changed");
+static_assert(ad5522_pmuctrl::map::verify == (0xFFFF80 & 0x3BFF80), "PMU verify mask changed");
+static_assert(ad5522_dac::map::verify == 0xFFFF, "DAC verify mask changed");
+static_assert(ad5522_pmuctrl::map::reset == ((3UL << 15) | (3UL << 13)), "PMU reset value changed");
+
+ad5522_sysctrl_reg_t sysctrl_reg[AD5522_DEV_NUM];
+ad5522_pmuctrl_reg_t pmuctrl_reg[AD5522_CH_NUM];
+
+// Last verified X1 code of each DAC (valid bit per address)
+uint16_t ad5522_dac_shadow[AD5522_CH_NUM][PMU_DAC_ADDR_NUM];
+uint32_t ad5522_dac_valid[AD5522_CH_NUM];
+
+// Writes waiting for read-back (see ad5522_batch_begin)
+typedef struct {
+  uint8_t  dev;
+  uint8_t  ch;          // Channel mask
+  uint8_t  mode;
+  uint8_t  addr;
+  uint32_t data;
+  uint32_t mask;        // Bits compared on read-back
+} ad5522_check_t;
+
+ad5522_check_t ad5522_batch[PMU_BATCH_MAX];
+uint8_t ad5522_batch_num = 0;
+bool ad5522_batch_active = false;
 
 /**************************************************
  *
@@ -70,179 +178,184 @@ ad5522_pmuctrl_reg_t pmuctrl_reg[4];
  *
  **************************************************/
 
-bool ad5522_busy() {
+// Wait for busy to go high, a DAC or register update takes a few us so
+//  busy is spun on first (a delay(1) would hold every write for a tick),
+//  longer waits (reset) give the core away
+bool ad5522_busy(uint8_t dev) {
+  uint32_t start = micros();
   uint8_t count = 0;
-  while ((digitalRead(pin_ad5522_busy) == LOW) && (count++ < PMU_BUSY_MAX)) {
-    delay(1);
-  }
 
-  if (count >= PMU_BUSY_MAX) {
-    return false;
+  while (digitalRead(ad5522_dev[dev].busy) == LOW) {
+    if (micros() - start < PMU_BUSY_SPIN) continue;
+    if (count++ >= PMU_BUSY_MAX) return false;
+    delay(1);
   }
 
   return true;
 }
 
-ad5522_ch_t ad5522_int2ch(int ch) {
-  switch(ch) {
-    case 0:
-      return AD5522_CH0;
-    case 1:
-      return AD5522_CH1;
-    case 2:
-      return AD5522_CH2;
-    case 3:
-      return AD5522_CH3;
-  }
-  return AD5522_CH0;
-}
-
 // rw = 1 for read
-int32_t ad5522_transaction(uint8_t rw, uint8_t ch, uint8_t mode, uint32_t data) {
+int32_t ad5522_transaction(uint8_t dev, uint8_t rw, uint8_t ch, uint8_t mode, uint32_t data) {
+  SPIClass *spi = ad5522_dev[dev].spi;
+  int8_t cs = ad5522_dev[dev].cs;
   uint32_t ret = 0;
   uint32_t spi_word;
 
   // Start SPI transaction (1MHz)
-  SPI_PMU->beginTransaction(SPISettings(1000000, MSBFIRST, SPI_MODE1));
+  spi->beginTransaction(SPISettings(1000000, MSBFIRST, SPI_MODE1));
 
   // Select the PMU
-  digitalWrite(pin_ad5522_cs, LOW);
+  digitalWrite(cs, LOW);
 
   // Create spi word
-  spi_word = ((rw & 1) << 28) | ((ch & 0xF) << 24) | ((mode & 3) << 22) | (data & 0x3FFFFF);
+  spi_word = ad5522_word::map::pack(rw, ch, mode, data);
 
   // Write data
   for (uint32_t i = 0; i <= 3; i++){
     uint8_t write_byte;
 
     write_byte = (spi_word >> (8*(3-i))) & 0xFF;
-    SPI_PMU->transfer(write_byte);
+    spi->transfer(write_byte);
   }
 
   // SYNC toggle between write/read
-  digitalWrite(pin_ad5522_cs, HIGH);
+  digitalWrite(cs, HIGH);
   delayMicroseconds(1);
-  digitalWrite(pin_ad5522_cs, LOW);
+  digitalWrite(cs, LOW);
 
   // Read data
   if (rw) {
     for (uint32_t i = 0; i <= 2; i++){
       uint8_t read_byte;
 
-      read_byte = SPI_PMU->transfer(0xFF);
+      read_byte = spi->transfer(0xFF);
       ret = ret | (read_byte << (8*(2-i)));
 
-//#ifdef PMU_DEBUG
-//      char str_buffer[128];
-//      snprintf(str_buffer, sizeof(str_buffer), "read_byte = 0x%X, ret = 0x%X", read_byte, ret);
-//      std::string log_msg(str_buffer);
-//      log_add(log_msg);
-//#endif
+      LOG_V(PMU, "read_byte = 0x%X, ret = 0x%X", read_byte, ret);
     }
   }
 
-  // Wait for busy to go high
-  if (!ad5522_busy()) return -1;
+  // Wait for busy to go high (the bus is given back either way)
+  if (!ad5522_busy(dev)) {
+    digitalWrite(cs, HIGH);
+    spi->endTransaction();
+    LOG_E(PMU, "PMU%d busy timeout: ch = 0x%X, mode = 0x%X", dev, ch, mode);
+    return -1;
+  }
 
   // Deselect the PMU while ending SPI control
-  digitalWrite(pin_ad5522_cs, HIGH);
+  digitalWrite(cs, HIGH);
 
   // End SPI transaction
-  SPI_PMU->endTransaction();
+  spi->endTransaction();
 
   // Print the result (for debugging purposes)
-  //debugD("PMU transaction: rw = %d, ch = 0x%X, mode = 0x%X, data = 0x%X, read = 0x%X", rw, ch, mode, data, ret);
-#ifdef PMU_DEBUG
-  char str_buffer[128];
-  snprintf(str_buffer, sizeof(str_buffer), "PMU transaction: rw = %d, ch = 0x%X, mode = 0x%X, data = 0x%X, read = 0x%X", rw, ch, mode, data, ret);
-  std::string log_msg(str_buffer);
-  log_add(log_msg);
-#endif
+  LOG_D(PMU, "PMU%d transaction: rw = %d, ch = 0x%X, mode = 0x%X, data = 0x%X, read = 0x%X", dev, rw, ch, mode, data, ret);
 
   return (int32_t) ret;
 }
 
-bool ad5522_write(uint8_t ch, uint8_t mode, uint8_t addr, uint32_t data) {
+bool ad5522_write(uint8_t dev, uint8_t ch, uint8_t mode, uint8_t addr, uint32_t data) {
   // Writing to DAC (addr is valid)
   if (mode > 0) {
-    data = ((addr & 0x3F) << 16) | (data & 0xFFFF);
+    data = ad5522_dac::map::pack(addr, data);
   }
-  if (ad5522_transaction(0, ch, mode, data) < 0) return false;
+  if (ad5522_transaction(dev, 0, ch, mode, data) < 0) return false;
 
   return true;
 }
 
-int32_t ad5522_read(uint8_t ch, uint8_t mode, uint8_t addr) {
+int32_t ad5522_read(uint8_t dev, uint8_t ch, uint8_t mode, uint8_t addr) {
   uint32_t data = 0;
 
   // Reading from DAC (addr is valid)
   if (mode > 0) {
-    data = ((addr & 0x3F) << 16);
+    data = ad5522_dac::addr::pack(addr);
   }
-  return ad5522_transaction(1, ch, mode, data);
+  return ad5522_transaction(dev, 1, ch, mode, data);
+}
+
+// Queue read-back of a write while a batch is open
+//  - returns false if there is no batch (or it is full), verify now
+bool ad5522_batch_add(uint8_t dev, uint8_t ch, uint8_t mode, uint8_t addr, uint32_t data, uint32_t mask) {
+  if (!ad5522_batch_active || ad5522_batch_num >= PMU_BATCH_MAX) return false;
+
+  ad5522_check_t *check = &ad5522_batch[ad5522_batch_num++];
+  check->dev  = dev;
+  check->ch   = ch;
+  check->mode = mode;
+  check->addr = addr;
+  check->data = data;
+  check->mask = mask;
+
+  return true;
 }
 
-bool ad5522_write_sysctrl() {
-  uint32_t write_data = 0;
+void ad5522_dac_update(ad5522_ch_t ch, uint8_t addr, uint16_t code, bool valid) {
+  if (addr >= PMU_DAC_ADDR_NUM) return;
+
+  ad5522_dac_shadow[ch][addr] = code;
+  if (valid) ad5522_dac_valid[ch] |=  (1UL << addr);
+  else       ad5522_dac_valid[ch] &= ~(1UL << addr);
+}
+
+bool ad5522_write_sysctrl(uint8_t dev) {
+  typedef ad5522_sysctrl R;
+  ad5522_sysctrl_reg_t *reg = &sysctrl_reg[dev];
+  ad5522_pmuctrl_reg_t *ch  = &pmuctrl_reg[dev * 4];
+  uint32_t write_data;
   int32_t  read_data;
+  uint8_t  clamp_en = 0;
+  uint8_t  cmp_en   = 0;
 
-  write_data |= (pmuctrl_reg[AD5522_CH3].clamp_en & 1) << 21;
-  write_data |= (pmuctrl_reg[AD5522_CH2].clamp_en & 1) << 20;
-  write_data |= (pmuctrl_reg[AD5522_CH1].clamp_en & 1) << 19;
-  write_data |= (pmuctrl_reg[AD5522_CH0].clamp_en & 1) << 18;
-  write_data |= (pmuctrl_reg[AD5522_CH3].cmp_en   & 1) << 17;
-  write_data |= (pmuctrl_reg[AD5522_CH2].cmp_en   & 1) << 16;
-  write_data |= (pmuctrl_reg[AD5522_CH1].cmp_en   & 1) << 15;
-  write_data |= (pmuctrl_reg[AD5522_CH0].cmp_en   & 1) << 14;
-  write_data |= (sysctrl_reg.cmp_en               & 1) << 13;
-  write_data |= (sysctrl_reg.ch_dutgnd_en         & 1) << 12;
-  write_data |= (sysctrl_reg.guard_alarm_en       & 1) << 11;
-  write_data |= (sysctrl_reg.clamp_alarm_en       & 1) << 10;
-  write_data |= (sysctrl_reg.int_sense_en         & 1) <<  9;
-  write_data |= (sysctrl_reg.guard_en             & 1) <<  8;
-  write_data |= (sysctrl_reg.meas_gain            & 3) <<  6;
-  write_data |= (sysctrl_reg.therm_en             & 1) <<  5;
-  write_data |= (sysctrl_reg.therm_thresh         & 3) <<  3;
-  write_data |= (sysctrl_reg.alarm_latch_en       & 1) <<  2;
+  for (int i = 0; i < 4; i++) {
+    clamp_en |= (ch[i].clamp_en & 1) << i;
+    cmp_en   |= (ch[i].cmp_en   & 1) << i;
+  }
+
+  write_data = R::map::pack(clamp_en, cmp_en, reg->cmp_en, reg->ch_dutgnd_en,
+      reg->guard_alarm_en, reg->clamp_alarm_en, reg->int_sense_en, reg->guard_en,
+      reg->meas_gain, reg->therm_en, reg->therm_thresh, reg->alarm_latch_en);
 
   // Write to sysctrl register (ch = 00, mode = 00, addr = NA, data = write_data)
-  if (!ad5522_write(0, 0, 0, write_data)) return false;
+  if (!ad5522_write(dev, 0, 0, 0, write_data)) return false;
 
   // Read sysctrl & validate register
-  read_data = ad5522_read(0, 0, 0);
-  if (read_data < 0 || (((uint32_t) read_data) & 0xFFFFFF) != write_data) return false;
-//#ifdef PMU_DEBUG
-//  char str_buffer[128];
-//  snprintf(str_buffer, sizeof(str_buffer), "PMU sysctrl write: write = 0x%X, read_int = 0x%X, read_uint = 0x%X", write_data, read_data, (uint32_t) read_data);
-//  std::string log_msg(str_buffer);
-//  log_add(log_msg);
-//#endif
+  if (ad5522_batch_add(dev, 0, 0, 0, write_data, R::map::verify)) return true;
+  read_data = ad5522_read(dev, 0, 0, 0);
+  if (read_data < 0 || !R::map::check(write_data, read_data)) {
+    LOG_E(PMU, "PMU%d sysctrl verify failed: write = 0x%X, read = 0x%X", dev, write_data, (uint32_t) read_data);
+    return false;
+  }
 
   return true;
 }
 
+// Pmuctrl register word of channel from its shadow
+uint32_t ad5522_pmuctrl_word(ad5522_ch_t ch) {
+  const ad5522_pmuctrl_reg_t *reg = &pmuctrl_reg[ch];
+
+  return ad5522_pmuctrl::map::pack(reg->ch_en, reg->hiz_en, reg->mode, reg->range,
+      reg->meas_sel, reg->dac_en, reg->sys_force_en, reg->sys_sense_en, reg->clamp_en,
+      reg->cmp_en, reg->cmp_fv_en, 0);
+}
+
 bool ad5522_write_pmuctrl(ad5522_ch_t ch) {
-  uint32_t write_data = 0;
+  uint32_t write_data;
   int32_t  read_data;
 
-  write_data |= (pmuctrl_reg[ch].ch_en        & 1) << 21;
-  write_data |= (pmuctrl_reg[ch].hiz_en       & 1) << 20;
-  write_data |= (pmuctrl_reg[ch].mode         & 1) << 19;
-  write_data |= (pmuctrl_reg[ch].range        & 7) << 15;
-  write_data |= (pmuctrl_reg[ch].meas_sel     & 3) << 13;
-  write_data |= (pmuctrl_reg[ch].dac_en       & 1) << 12;
-  write_data |= (pmuctrl_reg[ch].sys_force_en & 1) << 11;
-  write_data |= (pmuctrl_reg[ch].sys_sense_en & 1) << 10;
-  write_data |= (pmuctrl_reg[ch].clamp_en     & 1) <<  9;
-  write_data |= (pmuctrl_reg[ch].cmp_en       & 1) <<  8;
-  write_data |= (pmuctrl_reg[ch].cmp_fv_en    & 1) <<  7;
+  write_data = ad5522_pmuctrl_word(ch);
 
   // Write to pmuctrl register (ch = xxxx, mode = 00, addr = NA, data = write_data)
-  if (!ad5522_write((1 << ch), 0, 0, write_data)) return false;
+  if (!ad5522_write(AD5522_DEV(ch), AD5522_MASK(ch), 0, 0, write_data)) return false;
 
   // Read and validate write
-  read_data = ad5522_read((1 << ch), 0, 0);
-  if (read_data < 0 || (((uint32_t) read_data) & 0xFFFF80) != write_data) return false;
+  if (ad5522_batch_add(AD5522_DEV(ch), AD5522_MASK(ch), 0, 0, write_data, ad5522_pmuctrl::map::verify)) return true;
+  read_data = ad5522_read(AD5522_DEV(ch), AD5522_MASK(ch), 0, 0);
+  if (read_data < 0 || !ad5522_pmuctrl::map::check(write_data, read_data)) {
+    LOG_E(PMU, "PMU ch%d pmuctrl verify failed: write = 0x%X, read = 0x%X", ch, write_data, (uint32_t) read_data);
+    return false;
+  }
 
   return true;
 }
@@ -255,45 +368,61 @@ bool ad5522_write_pmuctrl(ad5522_ch_t ch) {
  **************************************************/
 
 
-bool ad5522_init(SPIClass *spi, int8_t cs, int8_t rst, int8_t busy) {
-  SPI_PMU = spi;
-  pin_ad5522_busy  = busy;
-  pin_ad5522_cs    = cs;
-  pin_ad5522_reset = rst;
+// Initialize device dev (channels dev * 4 to dev * 4 + 3)
+//  - a reset shared with a device initialized before isn't pulsed again
+bool ad5522_init(uint8_t dev, SPIClass *spi, int8_t cs, int8_t rst, int8_t busy) {
+  ad5522_sysctrl_reg_t *reg = &sysctrl_reg[dev];
+  bool reset = true;
+
+  if (dev >= AD5522_DEV_NUM) return false;
+
+  ad5522_dev[dev].spi   = spi;
+  ad5522_dev[dev].busy  = busy;
+  ad5522_dev[dev].cs    = cs;
+  ad5522_dev[dev].reset = rst;
+
+  for (int i = 0; i < dev; i++) {
+    if (ad5522_dev[i].reset == rst) reset = false;
+  }
 
   // Set PMU rstb high
-  pinMode(pin_ad5522_reset, OUTPUT);
-  digitalWrite(pin_ad5522_reset, LOW);
-  delayMicroseconds(10);
-  digitalWrite(pin_ad5522_reset, HIGH);
+  if (reset) {
+    pinMode(rst, OUTPUT);
+    digitalWrite(rst, LOW);
+    delayMicroseconds(10);
+    digitalWrite(rst, HIGH);
+  }
 
   // Set PMU csb high
-  pinMode(pin_ad5522_cs, OUTPUT);
-  digitalWrite(pin_ad5522_cs, HIGH);
+  pinMode(cs, OUTPUT);
+  digitalWrite(cs, HIGH);
 
   // Set PMU busy as input (pullup on board?)
-  pinMode(pin_ad5522_busy, INPUT);
+  pinMode(busy, INPUT);
 
   // Wait for busy to go high
-  if (!ad5522_busy()) return false;
+  if (!ad5522_busy(dev)) return false;
+
+  // DAC contents unknown until written
+  memset(&ad5522_dac_valid[dev * 4], 0, 4 * sizeof(ad5522_dac_valid[0]));
 
   // Initialize sysctrl register struct
-  sysctrl_reg.cmp_en          = 0; // (default = 0)
-  //sysctrl_reg.ch_dutgnd_en    = 1; // (default = 0) TODO leave at default for eval board
-  sysctrl_reg.ch_dutgnd_en    = 0; // (default = 0)
-  sysctrl_reg.guard_alarm_en  = 0; // (default = 0)
-  sysctrl_reg.clamp_alarm_en  = 0; // (default = 0)
-  sysctrl_reg.int_sense_en    = 0; // (default = 0)
-  sysctrl_reg.guard_en        = 0; // (default = 0)
-  sysctrl_reg.meas_gain       = AD5522_MEASGAIN_ATTEN; // (default = 0)
-  sysctrl_reg.therm_en        = 1; // (default = 1)
-  sysctrl_reg.therm_thresh     = 0; // (default = 0) - 130C
-  sysctrl_reg.alarm_latch_en  = 0; // (default = 0)
-                                   //
-  if (!ad5522_write_sysctrl()) return false;
+  reg->cmp_en          = 0; // (default = 0)
+  //reg->ch_dutgnd_en    = 1; // (default = 0) TODO leave at default for eval board
+  reg->ch_dutgnd_en    = 0; // (default = 0)
+  reg->guard_alarm_en  = 0; // (default = 0)
+  reg->clamp_alarm_en  = 0; // (default = 0)
+  reg->int_sense_en    = 0; // (default = 0)
+  reg->guard_en        = 0; // (default = 0)
+  reg->meas_gain       = AD5522_MEASGAIN_ATTEN; // (default = 0)
+  reg->therm_en        = 1; // (default = 1)
+  reg->therm_thresh    = 0; // (default = 0) - 130C
+  reg->alarm_latch_en  = 0; // (default = 0)
+                            //
+  if (!ad5522_write_sysctrl(dev)) return false;
 
   // Initialize pmuctrl register struct
-  for (int i = 0; i < 4; i++) {
+  for (int i = dev * 4; i < dev * 4 + 4; i++) {
     pmuctrl_reg[i].ch_en         = 0; // (default = 0)
     pmuctrl_reg[i].hiz_en        = AD5522_HIZ; // (default = 0)
     pmuctrl_reg[i].mode          = AD5522_FV; // (default = 0)
@@ -306,15 +435,10 @@ bool ad5522_init(SPIClass *spi, int8_t cs, int8_t rst, int8_t busy) {
     pmuctrl_reg[i].cmp_en        = 0; // (default = 0)
     pmuctrl_reg[i].cmp_fv_en     = 0; // (default = 0)
                                       //
-    if (!ad5522_write_pmuctrl(ad5522_int2ch(i))) return false;
+    if (!ad5522_write_pmuctrl((ad5522_ch_t) i)) return false;
   }
 
-#ifdef PMU_DEBUG
-  char str_buffer[128];
-  snprintf(str_buffer, sizeof(str_buffer), "PMU finished init");
-  std::string log_msg(str_buffer);
-  log_add(log_msg);
-#endif
+  LOG_I(PMU, "PMU%d finished init", dev);
 
   return true;
 }
@@ -371,6 +495,39 @@ bool ad5522_set_range(ad5522_ch_t ch, ad5522_range_t range) {
   return ad5522_write_pmuctrl(ch);
 }
 
+bool ad5522_set_meas(ad5522_ch_t ch, ad5522_meas_t meas) {
+  switch (meas) {
+    case AD5522_MEAS_ISENSE:
+    case AD5522_MEAS_VSENSE:
+    case AD5522_MEAS_THERM:
+    case AD5522_MEAS_HIZ:
+      break;
+    default:
+      return false;
+  }
+
+  pmuctrl_reg[ch].meas_sel = meas;
+  return ad5522_write_pmuctrl(ch);
+}
+
+// Select MEASOUT without read-back (switched per frame by the
+//  measurement plan, like ad5522_write_dac for DAC updates)
+//  - one bus write of the pmuctrl shadow with the new selection
+bool ad5522_write_meas(ad5522_ch_t ch, ad5522_meas_t meas) {
+  switch (meas) {
+    case AD5522_MEAS_ISENSE:
+    case AD5522_MEAS_VSENSE:
+    case AD5522_MEAS_THERM:
+    case AD5522_MEAS_HIZ:
+      break;
+    default:
+      return false;
+  }
+
+  pmuctrl_reg[ch].meas_sel = meas;
+  return ad5522_write(AD5522_DEV(ch), AD5522_MASK(ch), 0, 0, ad5522_pmuctrl_word(ch));
+}
+
 bool ad5522_set_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t code){
   int32_t  read_data;
 
@@ -391,11 +548,74 @@ bool ad5522_set_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t code){
   }
 
   // ch = ch, mode = 3 (X1), addr = dac, data = code
-  if (!ad5522_write(1 << ch, 3, dac, code)) return false;
+  if (!ad5522_write(AD5522_DEV(ch), AD5522_MASK(ch), 3, dac, code)) {
+    ad5522_dac_update(ch, dac, code, false);
+    return false;
+  }
 
   // Read & validate
-  read_data = ad5522_read(1 << ch, 3, dac);
-  if (read_data < 0 || (((uint32_t) read_data) & 0xFFFF) != code) return false;
+  ad5522_dac_update(ch, dac, code, true);
+  if (ad5522_batch_add(AD5522_DEV(ch), AD5522_MASK(ch), 3, dac, code, ad5522_dac::map::verify)) return true;
+  read_data = ad5522_read(AD5522_DEV(ch), AD5522_MASK(ch), 3, dac);
+  if (read_data < 0 || !ad5522_dac::map::check(code, read_data)) {
+    LOG_E(PMU, "PMU ch%d dac 0x%X verify failed: write = 0x%X, read = 0x%X", ch, dac, code, (uint32_t) read_data);
+    ad5522_dac_update(ch, dac, code, false);
+    return false;
+  }
+
+  return true;
+}
+
+// Write DAC code without read-back (real-time updates, e.g. waveforms)
+//  - no float conversion, range lookup or verify, one bus write
+//  - the shadow holds the code, though it wasn't read back
+bool ad5522_write_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t code) {
+  bool ok = ad5522_write(AD5522_DEV(ch), AD5522_MASK(ch), 3, dac, code);
+
+  ad5522_dac_update(ch, dac, code, ok);
+  return ok;
+}
+
+// Last code written to DAC of channel
+//  - false if unknown (not written since init or write failed)
+bool ad5522_get_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t *code) {
+  if (dac >= PMU_DAC_ADDR_NUM || !((ad5522_dac_valid[ch] >> dac) & 1)) return false;
 
+  *code = ad5522_dac_shadow[ch][dac];
   return true;
 }
+
+// Start batch of writes, read-back verify is deferred to ad5522_batch_end
+//  - writes go out back to back (hold the control bus for the batch)
+void ad5522_batch_begin() {
+  ad5522_batch_num = 0;
+  ad5522_batch_active = true;
+}
+
+// Read back and verify all writes of the batch
+//  - returns false if any register doesn't match
+bool ad5522_batch_end() {
+  bool ok = true;
+
+  ad5522_batch_active = false;
+  for (uint8_t i = 0; i < ad5522_batch_num; i++) {
+    ad5522_check_t *check = &ad5522_batch[i];
+    int32_t read_data = ad5522_read(check->dev, check->ch, check->mode, check->mode ? check->addr : 0);
+
+    if (read_data < 0 || ((((uint32_t) read_data) ^ check->data) & check->mask) != 0) {
+      LOG_E(PMU, "PMU%d batch verify failed: ch 0x%X, mode %d, addr 0x%X, write = 0x%X, read = 0x%X",
+          check->dev, check->ch, check->mode, check->addr, check->data, (uint32_t) read_data);
+      ok = false;
+
+      // Shadow of a DAC that didn't take is no longer valid
+      if (check->mode == 3) {
+        for (int ch = 0; ch < 4; ch++) {
+          if ((check->ch >> ch) & 1) ad5522_dac_update((ad5522_ch_t) (check->dev * 4 + ch), check->addr, check->data, false);
+        }
+      }
+    }
+  }
+  ad5522_batch_num = 0;
+
+  return ok;
+}
@@ -1,10 +1,15 @@
 #ifndef AD5522_LIB_H
 #define AD5522_LIB_H
 
-#include <Arduino.h>
-#include <SPI.h>
+#include "hal.h"
+#include "board.h"
 
-typedef enum {
+// Devices on the control bus, channels are numbered across them (channel
+//  ch is channel ch % 4 of device ch / 4)
+#define AD5522_DEV_NUM BOARD_PMU_NUM
+#define AD5522_CH_NUM  (4 * AD5522_DEV_NUM)
+
+typedef enum : uint8_t {
   AD5522_CH0 = 0,
   AD5522_CH1 = 1,
   AD5522_CH2 = 2,
@@ -56,10 +61,21 @@ typedef enum {
   AD5522_MEAS_HIZ    = 3
 } ad5522_meas_t;
 
-bool ad5522_init(SPIClass *spi, int8_t cs, int8_t rst, int8_t busy);
+bool ad5522_init(uint8_t dev, SPIClass *spi, int8_t cs, int8_t rst, int8_t busy);
 bool ad5522_set_state(ad5522_ch_t ch, ad5522_state_t state);
 bool ad5522_set_mode(ad5522_ch_t ch, ad5522_mode_t mode);
 bool ad5522_set_range(ad5522_ch_t ch, ad5522_range_t range);
+bool ad5522_set_meas(ad5522_ch_t ch, ad5522_meas_t meas);
+bool ad5522_write_meas(ad5522_ch_t ch, ad5522_meas_t meas);
 bool ad5522_set_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t code);
+bool ad5522_get_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t *code);
+bool ad5522_write_dac(ad5522_ch_t ch, ad5522_dac_t dac, uint16_t code);
+void ad5522_batch_begin();
+bool ad5522_batch_end();
+
+// Raw register access (ch is a channel mask of device dev, no read-back
+//  verify)
+bool ad5522_write(uint8_t dev, uint8_t ch, uint8_t mode, uint8_t addr, uint32_t data);
+int32_t ad5522_read(uint8_t dev, uint8_t ch, uint8_t mode, uint8_t addr);
 
 #endif
@@ -1,10 +1,10 @@
-#include <Arduino.h>
+#include "hal.h"
 #include "ad7177_lib.h"
-#include <SPI.h>
+#include "log_lib.h"
+#include "task_lib.h"
+#include "reg_lib.h"
 #include <new>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/semphr.h>
+#include <atomic>
 
 
 // TODO
@@ -20,6 +20,76 @@ SPIClass* SPI_ADC = nullptr;
 
 #define ADC_CH 4
 
+/****************************************
+ *  Registers
+ ***************************************/
+
+#define AD7177_REG_IFMODE    0x02
+#define AD7177_REG_DATA      0x04
+#define AD7177_REG_GPIOCON   0x06
+#define AD7177_REG_CH0       0x10   // Channel i at AD7177_REG_CH0 + i
+#define AD7177_REG_SETUPCON0 0x20
+#define AD7177_REG_FILTCON0  0x28
+
+struct ad7177_ifmode {
+  typedef reg_field<8, 1>                 dout_reset;   // CSb high before DOUT is RDY
+  typedef reg_field<6, 1>                 data_stat;    // Status appended to data
+
+  typedef reg_map<dout_reset, data_stat> map;
+};
+
+// Data read with the status appended (IFMODE DATA_STAT)
+struct ad7177_data {
+  typedef reg_field<8, 24, 0, REG_RO>     data;
+  typedef reg_field<0, 2, 0, REG_RO>      ch;           // Channel converted
+
+  typedef reg_map<data, ch> map;
+};
+
+struct ad7177_gpiocon {
+  typedef reg_field<11, 1, 1>             sync_en;
+
+  typedef reg_map<sync_en> map;
+};
+
+// Channel register, ad7177_ch_reg keeps the inputs (the enable bit is
+//  written separately)
+struct ad7177_chreg {
+  typedef reg_field<15, 1>                en;
+  typedef reg_field<12, 2>                setup_sel;
+  typedef reg_field< 5, 5>                ainpos;       // ad7177_input_t
+  typedef reg_field< 0, 5, 1>             ainneg;
+
+  typedef reg_map<en, setup_sel, ainpos, ainneg> map;
+};
+
+struct ad7177_setupcon {
+  typedef reg_field<12, 1, 1>             bipolar;
+  typedef reg_field<11, 1>                refbuf_p;
+  typedef reg_field<10, 1>                refbuf_n;
+  typedef reg_field< 9, 1>                ainbuf_p;
+  typedef reg_field< 8, 1>                ainbuf_n;
+  typedef reg_field< 4, 2>                ref_sel;      // 00 = external
+
+  typedef reg_map<bipolar, refbuf_p, refbuf_n, ainbuf_p, ainbuf_n, ref_sel> map;
+};
+
+// Filter register, ad7177_sample_rate_t is the whole register value
+struct ad7177_filtcon {
+  typedef reg_field<15, 1>                sinc3_map;
+  typedef reg_field<11, 1>                enhfilt_en;
+  typedef reg_field< 8, 3, 2>             enhfilt;
+  typedef reg_field< 5, 2>                order;
+  typedef reg_field< 0, 5, 7>             odr;
+
+  typedef reg_map<sinc3_map, enhfilt_en, enhfilt, order, odr> map;
+};
+
+// Layouts pack like the literals and shifts they replaced
+static_assert(ad7177_ifmode::map::pack(1, 1) == 0x0140, "IFMODE packing changed");
+static_assert(ad7177_setupcon::map::pack(1, 0, 0, 1, 1, 0) == 0x1300, "SETUPCON packing changed");
+static_assert(ad7177_chreg::map::pack(1, 0, 0x13, 0x16) == ((1 << 15) | (0x13 << 5) | 0x16), "channel packing changed");
+
 // Mark as volatile since these values can be updated during interrupt
 volatile bool ad7177_enable_isr;
 volatile bool ad7177_active;
@@ -31,6 +101,40 @@ uint32_t ad7177_array[ADC_CH];  // ADC Readback Value
 uint32_t ad7177_array_cb[ADC_CH];
 uint16_t ad7177_ch_valid_cb;
 
+// Channels converted once along with a sample set (see ad7177_aux_once)
+std::atomic<uint16_t> ad7177_ch_aux_req;  // Requested, taken by the ad7177 task
+uint16_t ad7177_ch_aux;                   // Enabled for the current set
+uint16_t ad7177_ch_reg[ADC_CH];           // Channel inputs (without enable)
+
+// Channel frames cycled by the ad7177 task (see ad7177_set_frames), a
+//  new list is taken at the next set boundary
+ad7177_frame_t ad7177_frames[AD7177_FRAMES_MAX];
+uint8_t ad7177_frame_num;       // 0 = channels as configured
+uint8_t ad7177_frame_id;
+uint8_t ad7177_frame;           // Frame being converted
+uint8_t ad7177_frame_rep;       // Set within frame
+
+ad7177_frame_t ad7177_frames_req[AD7177_FRAMES_MAX];
+uint8_t ad7177_frame_num_req;
+uint8_t ad7177_frame_id_req;
+bool ad7177_frame_pending;
+portMUX_TYPE ad7177_frame_mux = portMUX_INITIALIZER_UNLOCKED;
+ad7177_set_t ad7177_set_cb;
+volatile uint32_t ad7177_seq;   // Sets completed (see ad7177_set_seq)
+
+// Nominal output data rate of each ODR code (in SPS)
+const float ad7177_odr_sps[] = {
+  10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000,
+  5000, 2500, 1000, 500, 397.5F, 200, 100, 59.92F,
+  49.96F, 20, 16.66F, 10, 5
+};
+
+// Sample rate and statistics (see ad7177_get_stats)
+ad7177_sample_rate_t ad7177_rate;
+ad7177_stats_t ad7177_stats;
+volatile uint32_t ad7177_isr_micros;    // Time of last data ready interrupt
+uint32_t ad7177_isr_micros_cb;          // Interrupt time of last sample in set
+
 int8_t pin_ad7177_sclk;
 int8_t pin_ad7177_miso;
 int8_t pin_ad7177_mosi;
@@ -60,6 +164,7 @@ void IRAM_ATTR ad7177_data_isr() {
     // Disable ISR until ADC sample is handled
     ad7177_int_pause();
     ad7177_enable_isr = false;
+    ad7177_isr_micros = micros();
 
     // Notify ISR task
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -81,9 +186,100 @@ void adc_cb_task(void *pvParameters) {
     // Wait for notification from the ad7177_task
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
+    // Latency from data ready of the last sample to callback
+    uint32_t latency = micros() - ad7177_isr_micros_cb;
+    ad7177_stats.sets++;
+    ad7177_stats.latency_sum += latency;
+    if (latency > ad7177_stats.latency_max) ad7177_stats.latency_max = latency;
+
     // Call the callback function with the latest data
-    adc_cb(ad7177_array_cb, ad7177_ch_valid_cb);
+    adc_cb(ad7177_array_cb, ad7177_ch_valid_cb, &ad7177_set_cb);
+  }
+}
+
+// Write enable bit of channels in mask
+void ad7177_ch_enable(uint16_t mask, bool enable) {
+  for (int i = 0; i < ADC_CH; i++) {
+    if ((mask >> i) & 1) ad7177_write(AD7177_REG_CH0 + i, ad7177_chreg::en::set(ad7177_ch_reg[i], enable), 16);
+  }
+}
+
+// Switch channels converted once (ad7177 task, after a complete set)
+//  - requested channels are enabled for the next set, then disabled
+//    after it, channels already active are left alone
+//  - the conversion in progress is on an active channel, so no sample
+//    is discarded
+// Program channels of frame (ad7177 task, or caller while stopped)
+//  - only changed channel registers are written, the conversion in
+//    progress is dropped if any was (its channel may have changed)
+//  - channels converted once stay as they are
+void ad7177_frame_load(uint8_t index) {
+  const ad7177_frame_t *frame = &ad7177_frames[index];
+  bool written = false;
+
+  for (int i = 0; i < ADC_CH; i++) {
+    uint16_t reg = ad7177_chreg::map::pack(0, 0, frame->ainpos[i], frame->ainneg[i]);
+    bool active  = (ad7177_ch_active >> i) & 1;
+
+    if ((ad7177_ch_aux >> i) & 1) continue;
+
+    if ((frame->ch >> i) & 1) {
+      if (active && !ad7177_chreg::map::diff(reg, ad7177_ch_reg[i])) continue;
+      ad7177_ch_reg[i] = reg;
+      ad7177_ch_enable(1 << i, true);
+      written = true;
+    } else if (active) {
+      ad7177_ch_enable(1 << i, false);
+      written = true;
+    }
+  }
+
+  ad7177_ch_active = (frame->ch & ((1 << ADC_CH) - 1)) | ad7177_ch_aux;
+  ad7177_ch_valid  = 0;
+  ad7177_frame     = index;
+  ad7177_frame_rep = 0;
+  if (written) ad7177_discard_next_sample = true;
+}
+
+// Take new frame list or move on to the next frame (ad7177 task, after a
+//  complete set)
+void ad7177_frame_step() {
+  bool pending;
+
+  portENTER_CRITICAL(&ad7177_frame_mux);
+  pending = ad7177_frame_pending;
+  if (pending) {
+    memcpy(ad7177_frames, ad7177_frames_req, sizeof(ad7177_frames));
+    ad7177_frame_num = ad7177_frame_num_req;
+    ad7177_frame_id  = ad7177_frame_id_req;
+    ad7177_frame_pending = false;
+  }
+  portEXIT_CRITICAL(&ad7177_frame_mux);
+
+  if (pending) {
+    ad7177_frame_load(0);
+    return;
+  }
+  if (ad7177_frame_num < 2) return;
+
+  if (++ad7177_frame_rep < ad7177_frames[ad7177_frame].repeat) return;
+  ad7177_frame_load((ad7177_frame + 1) % ad7177_frame_num);
+}
+
+void ad7177_aux_step() {
+  if (ad7177_ch_aux) {
+    ad7177_ch_enable(ad7177_ch_aux, false);
+    ad7177_ch_active &= ~ad7177_ch_aux;
+    ad7177_ch_aux = 0;
+    return;
   }
+
+  uint16_t req = ad7177_ch_aux_req.exchange(0) & ~ad7177_ch_active & ((1 << ADC_CH) - 1);
+  if (req == 0) return;
+
+  ad7177_ch_enable(req, true);
+  ad7177_ch_aux = req;
+  ad7177_ch_active |= req;
 }
 
 void ad7177_task(void *pvParameters) {
@@ -92,12 +288,13 @@ void ad7177_task(void *pvParameters) {
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
     // Read ADC and save value
-    int64_t ret   = ad7177_read(0x04, 32);
-    uint32_t data = (((uint32_t) ret) & 0xFFFFFFFF) >> 8;
-    uint32_t ch   = (((uint32_t) ret) & 0x3);
+    int64_t ret   = ad7177_read(AD7177_REG_DATA, 32);
+    uint32_t data = ad7177_data::data::unpack((uint32_t) ret);
+    uint32_t ch   = ad7177_data::ch::unpack((uint32_t) ret);
 
     // Keep sample
     if (!ad7177_discard_next_sample) {
+      ad7177_stats.samples++;
       ad7177_array[ch] = data;
       ad7177_ch_valid |= (1 << ch);
 
@@ -106,11 +303,21 @@ void ad7177_task(void *pvParameters) {
         // Copy the ADC data and channel validity
         memcpy(ad7177_array_cb, (const uint32_t *)ad7177_array, sizeof(ad7177_array));
         ad7177_ch_valid_cb = ad7177_ch_valid;
+        ad7177_isr_micros_cb = ad7177_isr_micros;
+        ad7177_set_cb.seq   = ++ad7177_seq;
+        ad7177_set_cb.id    = ad7177_frame_id;
+        ad7177_set_cb.frame = ad7177_frame;
+        ad7177_set_cb.rep   = ad7177_frame_rep;
 
         xTaskNotifyGive(adc_cb_task_handle);
 
         // Reset ch_valid to begin taking next samples
         ad7177_ch_valid = 0;
+
+        // Next frame, then take extra channels out again or add
+        //  requested ones
+        ad7177_frame_step();
+        ad7177_aux_step();
       }
     }
     // Discard sample
@@ -146,44 +353,87 @@ void ad7177_stop() {
   ad7177_enable_isr = false;
 }
 
+// Convert channels (configured, not enabled) once along with a coming
+//  sample set, results come in the callback with their valid bits set
+//  - requests made before the last one was taken are merged
+void ad7177_aux_once(uint16_t ch) {
+  ad7177_ch_aux_req.fetch_or(ch);
+}
+
+// Cycle through frames of channels, each converted for repeat sample
+//  sets in a row (replaces the channels set up with ad7177_config_ch)
+//  - taken at the next set boundary while running, programmed right
+//    away while stopped
+//  - sets come to the callback with id, frame and set within the frame
+//    (ad7177_set_t), so results can be told apart from the old list
+//  - channels used for ad7177_aux_once must be left out of the frames
+bool ad7177_set_frames(uint8_t id, const ad7177_frame_t *frames, uint8_t num) {
+  if (num == 0 || num > AD7177_FRAMES_MAX) return false;
+
+  portENTER_CRITICAL(&ad7177_frame_mux);
+  memcpy(ad7177_frames_req, frames, num * sizeof(ad7177_frame_t));
+  ad7177_frame_num_req = num;
+  ad7177_frame_id_req  = id;
+  ad7177_frame_pending = true;
+  portEXIT_CRITICAL(&ad7177_frame_mux);
+
+  if (!ad7177_active) ad7177_frame_step();
+  return true;
+}
+
+// Sets completed so far (wraps), a set with a higher number was at most
+//  being converted when this was read
+uint32_t ad7177_set_seq() {
+  return ad7177_seq;
+}
+
 void ad7177_active_ch(uint16_t ch) {
   ad7177_ch_active = ((1 << ADC_CH) - 1) & ch;
 }
 
 void ad7177_set_rate(ad7177_sample_rate_t rate) {
-  ad7177_write(0x28, rate, 16);
+  ad7177_rate = rate;
+  ad7177_write(AD7177_REG_FILTCON0, rate, 16);
+}
+
+ad7177_sample_rate_t ad7177_get_rate() {
+  return ad7177_rate;
+}
+
+// Nominal output data rate of rate (in SPS, one channel)
+float ad7177_rate_sps(ad7177_sample_rate_t rate) {
+  uint8_t odr = ad7177_filtcon::odr::unpack(rate);
+
+  if (odr >= sizeof(ad7177_odr_sps) / sizeof(ad7177_odr_sps[0])) return 0;
+  return ad7177_odr_sps[odr];
+}
+
+// Samples kept, sample sets and ISR to callback latency since last reset
+//  - counters are written by the adc tasks, copy may be one sample stale
+void ad7177_get_stats(ad7177_stats_t *stats) {
+  memcpy(stats, &ad7177_stats, sizeof(ad7177_stats_t));
+}
+
+void ad7177_reset_stats() {
+  memset(&ad7177_stats, 0, sizeof(ad7177_stats_t));
 }
 
 void ad7177_config_ch(ad7177_ch_t ch, ad7177_input_t ainpos, ad7177_input_t ainneg, bool enable) {
-  uint8_t addr;
   uint8_t cur_ch;
-  uint64_t data = 0;
 
   switch(ch) {
-    case AD7177_CH0:
-      addr   = 0x10;
-      cur_ch = 0;
-      break;
-    case AD7177_CH1:
-      addr   = 0x11;
-      cur_ch = 1;
-      break;
-    case AD7177_CH2:
-      addr   = 0x12;
-      cur_ch = 2;
-      break;
-    case AD7177_CH3:
-      addr   = 0x13;
-      cur_ch = 3;
-      break;
+    case AD7177_CH0: cur_ch = 0; break;
+    case AD7177_CH1: cur_ch = 1; break;
+    case AD7177_CH2: cur_ch = 2; break;
+    case AD7177_CH3: cur_ch = 3; break;
     default:
       return;
   }
 
   // Setup channel
   ad7177_ch_active |= (enable << cur_ch);
-  data = (enable << 15) | (ainpos << 5) | (ainneg << 0);
-  ad7177_write(addr, data, 16);
+  ad7177_ch_reg[cur_ch] = ad7177_chreg::map::pack(0, 0, ainpos, ainneg);
+  ad7177_write(AD7177_REG_CH0 + cur_ch, ad7177_chreg::map::pack(enable, 0, ainpos, ainneg), 16);
 }
 
 // rw = 0 for write, 1 for read
@@ -193,8 +443,7 @@ int64_t ad7177_transfer(uint8_t rw, uint8_t cmd, uint64_t data, uint32_t num_bit
 
   // Check that len is multiple of 8
   if (num_bits % 8 != 0){
-    //debugE("ADC transaction len must be multiple of 8.\n"
-    //  "\t adc_transaction(%d, 0x%x, 0x%x, %d)", rw, cmd, data, num_bits);
+    LOG_E(ADC, "ADC transaction len must be multiple of 8: cmd = 0x%X, bits = %u", cmd, num_bits);
     return -1;
   }
 
@@ -248,6 +497,15 @@ void ad7177_init(uint8_t spi_intf, int8_t sck, int8_t miso, int8_t mosi, int8_t
   ad7177_discard_next_sample = true;
   ad7177_ch_active = 0x1;
   ad7177_ch_valid  = 0x0;
+  ad7177_ch_aux_req.store(0);
+  ad7177_ch_aux = 0;
+  ad7177_frame_num = 0;
+  ad7177_frame_id  = 0;
+  ad7177_frame     = 0;
+  ad7177_frame_rep = 0;
+  ad7177_frame_pending = false;
+  ad7177_seq = 0;
+  ad7177_reset_stats();
 
   // Save pins
   pin_ad7177_sclk = sck;
@@ -268,16 +526,16 @@ void ad7177_init(uint8_t spi_intf, int8_t sck, int8_t miso, int8_t mosi, int8_t
 
   // Set DOUT_RESET (csb must go high before DOUT is used for RDY)
   //  & Append status to data read
-  ad7177_write(0x02, 0x0140, 16);
+  ad7177_write(AD7177_REG_IFMODE, ad7177_ifmode::map::pack(1, 1), 16);
 
   // Disable SYNC_EN
-  ad7177_write(0x06, 0x0000, 16);
+  ad7177_write(AD7177_REG_GPIOCON, ad7177_gpiocon::map::pack(0), 16);
 
-  // Use Ext Ref (setup 0)
-  ad7177_write(0x20, 0x1300, 16);
+  // Use Ext Ref, bipolar with input buffers (setup 0)
+  ad7177_write(AD7177_REG_SETUPCON0, ad7177_setupcon::map::pack(1, 0, 0, 1, 1, 0), 16);
 
   // Set 5 SPS (setup 0)
-  ad7177_write(0x28, 0x0514, 16);
+  ad7177_set_rate(AD7177_5SPS);
 
   // Configure ch0 - 3
   ad7177_config_ch(AD7177_CH0, AD7177_AIN0, AD7177_AIN1, true);
@@ -285,7 +543,7 @@ void ad7177_init(uint8_t spi_intf, int8_t sck, int8_t miso, int8_t mosi, int8_t
   ad7177_config_ch(AD7177_CH2, AD7177_AIN0, AD7177_AIN1, false);
   ad7177_config_ch(AD7177_CH3, AD7177_AIN0, AD7177_AIN1, false);
 
-  // Create adc task and save its handle (higher priority than loop())
-  xTaskCreatePinnedToCore(ad7177_task, "ad7177_task", 4096, NULL, 2, &ad7177_task_handle, 1);
-  xTaskCreatePinnedToCore(adc_cb_task, "adc_cb_task", 4096, NULL, 1, &adc_cb_task_handle, 1);
+  // Create acquisition tasks (higher priority than everything else on their core)
+  ad7177_task_handle = task_create(TASK_ADC, ad7177_task, NULL);
+  adc_cb_task_handle = task_create(TASK_ADC_CB, adc_cb_task, NULL);
 }
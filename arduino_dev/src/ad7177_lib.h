@@ -5,9 +5,6 @@
  *  AD7177 Defines
  ***************************************/
 
-//typedef void (*adc_cb_t)(uint32_t);
-typedef void (*adc_cb_t)(uint32_t *results, uint16_t valid);
-
 typedef enum {
   AD7177_AIN0      = 0x00,
   AD7177_AIN1      = 0x01,
@@ -45,6 +42,34 @@ typedef enum {
   AD7177_ALLCH  = 0x0F
 } ad7177_ch_t;
 
+// Channel frames (see ad7177_set_frames)
+#define AD7177_FRAMES_MAX 8
+
+typedef struct {
+  uint16_t ch;            // Channels enabled (ad7177_ch_t mask)
+  uint8_t  ainpos[4];     // ad7177_input_t of each channel
+  uint8_t  ainneg[4];
+  uint8_t  repeat;        // Sample sets in a row
+} ad7177_frame_t;
+
+// Sample set handed to the callback
+typedef struct {
+  uint32_t seq;       // Sets completed so far, this one included
+  uint8_t  id;        // Frame list id
+  uint8_t  frame;     // Frame of the set
+  uint8_t  rep;       // Set within the frame
+} ad7177_set_t;
+
+//typedef void (*adc_cb_t)(uint32_t);
+typedef void (*adc_cb_t)(uint32_t *results, uint16_t valid, const ad7177_set_t *set);
+
+typedef struct {
+  uint32_t samples;       // Samples kept (discarded samples not counted)
+  uint32_t sets;          // Sample sets handed to the callback
+  uint32_t latency_sum;   // Data ready interrupt to callback (in us)
+  uint32_t latency_max;
+} ad7177_stats_t;
+
 
 void ad7177_init(uint8_t spi_intf, int8_t sck, int8_t miso, int8_t mosi, int8_t ss, int8_t isr);
 void ad7177_callback(adc_cb_t cb);
@@ -54,9 +79,16 @@ int64_t ad7177_read(uint8_t addr, uint32_t num_bits);
 
 // Add?
 void ad7177_set_rate(ad7177_sample_rate_t rate);
+ad7177_sample_rate_t ad7177_get_rate();
+float ad7177_rate_sps(ad7177_sample_rate_t rate);
+void ad7177_get_stats(ad7177_stats_t *stats);
+void ad7177_reset_stats();
 //void ad7177_set_average(uint8_t type, size_t size);
 void ad7177_active_ch(uint16_t ch);
 void ad7177_config_ch(ad7177_ch_t ch, ad7177_input_t ainpos, ad7177_input_t ainneg, bool enable);
+void ad7177_aux_once(uint16_t ch);
+bool ad7177_set_frames(uint8_t id, const ad7177_frame_t *frames, uint8_t num);
+uint32_t ad7177_set_seq();
 void ad7177_stop();
 void ad7177_start();
 
@@ -1,7 +1,78 @@
 #include "ada4254_lib.h"
-#include "utility.h"
-
-#define INAMP_DEBUG
+#include "log_lib.h"
+#include "reg_lib.h"
+
+/*
+ * Registers are written through a shadow of the register map
+ *  - a write of the value the register already holds is skipped
+ *  - writes in a batch (batch_begin/batch_end) are queued and sent in one
+ *    bus transaction when the outermost batch ends, with the read-back
+ *    verify (if asked for) done in the same transaction
+ *  - queued registers at consecutive addresses go out in one CS frame
+ *    (the address auto-increments after each data byte)
+ *  - a set_* call outside of a batch is a batch of its own
+ *  - the shadow of a register that failed verify is dropped, so the
+ *    next write to it goes out
+ */
+
+// GAIN_MUX layout
+struct ada4254_gain_mux {
+  typedef reg_field<7, 1>                 gain_out;     // Output gain bit 0 (ada4254_gainout_t)
+  typedef reg_field<3, 4>                 gain_in;      // ada4254_gainin_t
+
+  typedef reg_map<gain_out, gain_in> map;
+};
+
+// INPUT_MUX layout, switch n + 1 connects input n (ada4254_switch_t) to
+//  the positive side, switch n to the negative side, switch 0 alone
+//  shorts the inputs
+struct ada4254_input_mux {
+  typedef reg_field<0, 7, 0x60>           sw;
+
+  typedef reg_map<sw> map;
+};
+
+// GPIO_DIR and SF_CFG layouts (GPIO3 is the fault output)
+struct ada4254_gpio_dir {
+  typedef reg_field<3, 1>                 gpio3_out;
+
+  typedef reg_map<gpio3_out> map;
+};
+
+struct ada4254_sf_cfg {
+  typedef reg_field<3, 1>                 fault_int_en;
+
+  typedef reg_map<fault_int_en> map;
+};
+
+// TEST_MUX layout, CAL_EN reads 1 until the internal calibration is done
+//  (it isn't kept in the shadow)
+struct ada4254_test_mux {
+  typedef reg_field<7, 1>                 gain_out;     // Output gain bit 1 (ada4254_gainout_t)
+  typedef reg_field<5, 1, 0, REG_WO>      cal_en;
+  typedef reg_field<2, 2>                 tmux_n;       // ada4254_tmux_t
+  typedef reg_field<0, 2>                 tmux_p;
+
+  typedef reg_map<gain_out, cal_en, tmux_n, tmux_p> map;
+};
+
+// Layouts pack like the shifts they replaced (output gain code 3 is
+//  split over GAIN_MUX bit 7 and TEST_MUX bit 7)
+static_assert(ada4254_gain_mux::map::pack(3, 0xB) == (((3 & 0x1) << 7) | (0xB << 3)), "GAIN_MUX packing changed");
+static_assert(ada4254_test_mux::map::pack(3 >> 1, 0, 2, 1) == (((3 & 0x2) << 6) | (2 << 2) | 1), "TEST_MUX packing changed");
+static_assert(ada4254_gpio_dir::map::pack(1) == (1 << 3) && ada4254_sf_cfg::map::pack(1) == (1 << 3), "GPIO3 fault packing changed");
+
+// Bits of register addr that read back as written
+static uint8_t ada4254_verify_mask(uint8_t addr) {
+  switch (addr) {
+    case ADA4254_REG_GAIN_MUX:  return ada4254_gain_mux::map::verify;
+    case ADA4254_REG_INPUT_MUX: return ada4254_input_mux::map::verify;
+    case ADA4254_REG_GPIO_DIR:  return ada4254_gpio_dir::map::verify;
+    case ADA4254_REG_SF_CFG:    return ada4254_sf_cfg::map::verify;
+    case ADA4254_REG_TEST_MUX:  return ada4254_test_mux::map::verify;
+    default:                    return 0xFF;
+  }
+}
 
 // Public methods
 bool ADA4254::begin(SPIClass *spi, int8_t cs){
@@ -9,25 +80,36 @@ bool ADA4254::begin(SPIClass *spi, int8_t cs){
   _SPI = spi;
   _pin_cs = cs;
 
+  // Nothing known about the registers yet
+  _reg_valid   = 0;
+  _reg_pending = 0;
+  _batch       = 0;
+  _verify      = false;
+
   // Setup csb high
   pinMode(_pin_cs, OUTPUT);
   digitalWrite(_pin_cs, HIGH);
 
   // Read ID register - should read 0x30
-  if (read(0x2F) != 0x30) return false;
+  if (!check_id()) {
+    LOG_E(INAMP, "INAMP cs %d: bad ID", _pin_cs);
+    return false;
+  }
 
   // GAIN_MUX (0x00): Gain = 1x
   //if (set_gain(ADA4254_IX0P25, ADA4254_OX1P375) < 0) return false;
 
+  batch_begin();
+
   // GPIO_DIR (0x08): Set GPIO3 as output for error detection
-  write(0x08, (1 << 3));
+  update(ADA4254_REG_GPIO_DIR, ada4254_gpio_dir::map::pack(1));
 
   // SF_CFG (0x0C): Enable Fault Interrupt Output on GPIO3
-  write(0x0C, (1 << 3));
+  update(ADA4254_REG_SF_CFG, ada4254_sf_cfg::map::pack(1));
 
-  // TODO scheduled calibration? (reg 0x0E)
+  batch_end();
 
-  // TODO Enable error interrupt
+  // Internal calibration is scheduled by the caller (cal_start)
 
   return true;
 }
@@ -174,12 +256,70 @@ bool ADA4254::set_tmux(ada4254_tmux_t pos, ada4254_tmux_t neg) {
   return true;
 }
 
+// Read ID register (one read transaction)
+bool ADA4254::check_id() {
+  return read(ADA4254_REG_ID) == 0x30;
+}
+
+// Queue register writes until batch_end (batches nest)
+void ADA4254::batch_begin() {
+  _batch++;
+}
+
+// Send writes of the batch, verify them if asked (or set_verify)
+//  - returns false if a register didn't read back
+bool ADA4254::batch_end(bool verify) {
+  if (_batch == 0) return false;
+  if (--_batch > 0) return true;
+
+  return flush(verify || _verify);
+}
+
+// Read and clear fault registers (one SPI transaction)
+//  - DIGITAL_ERR and ANALOG_ERR are adjacent, read and cleared in one
+//    burst each
+//  - GPIO3 drops once no fault bit is set
+//  - returns true if there was a fault
+bool ADA4254::read_faults(uint8_t *analog, uint8_t *digital) {
+  uint8_t err[2];
+
+  static_assert(ADA4254_REG_ANALOG_ERR == ADA4254_REG_DIGITAL_ERR + 1, "fault registers not adjacent");
+
+  _SPI->beginTransaction(SPISettings(ADA4254_SPI_HZ, MSBFIRST, SPI_MODE0));
+  burst(1, ADA4254_REG_DIGITAL_ERR, 2, err);
+
+  // Write 1 to clear the bits read (0 leaves a bit alone)
+  if (err[0] | err[1]) burst(0, ADA4254_REG_DIGITAL_ERR, 2, err);
+  _SPI->endTransaction();
+
+  *digital = err[0];
+  *analog  = err[1];
+
+  return (*analog | *digital) != 0;
+}
+
+// Start internal calibration (gain/offset trim), MV isn't valid until
+//  cal_done
+//  - the CAL_EN bit isn't kept in the shadow, it clears itself
+void ADA4254::cal_start() {
+  transaction(0, ADA4254_REG_TEST_MUX, ada4254_test_mux::cal_en::set(test_mux(), 1));
+}
+
+// Internal calibration finished (one read transaction)
+bool ADA4254::cal_done() {
+  return ada4254_test_mux::cal_en::unpack(read(ADA4254_REG_TEST_MUX)) == 0;
+}
+
+// Read back every write made outside of a batch
+void ADA4254::set_verify(bool verify) {
+  _verify = verify;
+}
+
 // Private methods
-uint8_t ADA4254::transaction(uint8_t rw, uint8_t cmd, uint8_t data) {
-  uint8_t ret;
 
-  // Start SPI transaction (0.5MHz)
-  _SPI->beginTransaction(SPISettings(500000, MSBFIRST, SPI_MODE0));
+// One register access, CS framed (call inside SPI transaction)
+uint8_t ADA4254::frame(uint8_t rw, uint8_t cmd, uint8_t data) {
+  uint8_t ret;
 
   // Select the AMP
   digitalWrite(_pin_cs, LOW);
@@ -190,32 +330,115 @@ uint8_t ADA4254::transaction(uint8_t rw, uint8_t cmd, uint8_t data) {
   // Write/read
   ret = _SPI->transfer(data);
 
-  // Deselect the AMP while ending SPI control
+  // Deselect the AMP
   digitalWrite(_pin_cs, HIGH);
 
-  // End SPI transaction
-  _SPI->endTransaction();
-
   // Print the result (for debugging purposes)
-  //debugD("INAMP transaction: rw = %d, cmd = 0x%X, data = 0x%X, read = 0x%X", rw, cmd, data, ret);
-#ifdef INAMP_DEBUG
-  char str_buffer[128];
-  snprintf(str_buffer, sizeof(str_buffer), "INAMP transaction: rw = %d, cmd = 0x%X, data = 0x%X, read = 0x%X", rw, cmd, data, ret);
-  std::string log_msg(str_buffer);
-  log_add(log_msg);
-#endif
+  LOG_V(INAMP, "INAMP transaction: rw = %d, cmd = 0x%X, data = 0x%X, read = 0x%X", rw, cmd, data, ret);
 
   return ret;
 }
 
-void ADA4254::write(uint8_t addr, uint8_t data) {
-  transaction(0, addr, data);
+// Registers addr to addr + len - 1 in one CS frame, data is written or
+//  filled with the values read (call inside SPI transaction)
+//  - command byte once, then a data byte per register
+void ADA4254::burst(uint8_t rw, uint8_t addr, uint8_t len, uint8_t *data) {
+  digitalWrite(_pin_cs, LOW);
+
+  _SPI->transfer(addr | (rw & 0x1) << 7);
+  for (uint8_t i = 0; i < len; i++) {
+    uint8_t ret = _SPI->transfer(rw ? 0x00 : data[i]);
+    if (rw) data[i] = ret;
+  }
+
+  digitalWrite(_pin_cs, HIGH);
+
+  LOG_V(INAMP, "INAMP burst: rw = %d, addr = 0x%X, len = %d", rw, addr, len);
+}
+
+uint8_t ADA4254::transaction(uint8_t rw, uint8_t cmd, uint8_t data) {
+  uint8_t ret;
+
+  _SPI->beginTransaction(SPISettings(ADA4254_SPI_HZ, MSBFIRST, SPI_MODE0));
+  ret = frame(rw, cmd, data);
+  _SPI->endTransaction();
+
+  return ret;
 }
 
 uint8_t ADA4254::read(uint8_t addr) {
   return transaction(1, addr, 0x00);
 }
 
+// Write register through the shadow, skipped if it holds data already
+//  - outside of a batch the write is sent right away
+bool ADA4254::update(uint8_t addr, uint8_t data) {
+  uint64_t bit = 1ULL << addr;
+
+  if (addr >= ADA4254_REG_NUM) return false;
+  if ((_reg_valid & bit) && _reg[addr] == data) return true;
+
+  _reg[addr] = data;
+  _reg_valid   |= bit;
+  _reg_pending |= bit;
+
+  if (_batch > 0) return true;
+  return flush(_verify);
+}
+
+// Consecutive addresses from addr set in mask
+static uint8_t ada4254_run(uint64_t mask, uint8_t addr) {
+  uint8_t len = 0;
+
+  while (addr + len < ADA4254_REG_NUM && ((mask >> (addr + len)) & 1)) len++;
+  return len;
+}
+
+// Send queued writes in one SPI transaction, then read them back
+//  - each run of consecutive registers is one burst (a gain change is
+//    two frames, GAIN_MUX and TEST_MUX aren't adjacent)
+bool ADA4254::flush(bool verify) {
+  uint64_t pending = _reg_pending;
+  uint8_t data[ADA4254_REG_NUM];
+  bool ok = true;
+
+  if (pending == 0) return true;
+  _reg_pending = 0;
+
+  _SPI->beginTransaction(SPISettings(ADA4254_SPI_HZ, MSBFIRST, SPI_MODE0));
+  for (uint8_t addr = 0; addr < ADA4254_REG_NUM; addr++) {
+    uint8_t len = ada4254_run(pending, addr);
+
+    if (len == 0) continue;
+    burst(0, addr, len, &_reg[addr]);
+    addr += len - 1;
+  }
+
+  for (uint8_t addr = 0; verify && addr < ADA4254_REG_NUM; addr++) {
+    uint8_t len = ada4254_run(pending, addr);
+
+    if (len == 0) continue;
+    burst(1, addr, len, &data[addr]);
+
+    for (uint8_t a = addr; a < addr + len; a++) {
+      if ((data[a] ^ _reg[a]) & ada4254_verify_mask(a)) {
+        LOG_E(INAMP, "INAMP cs %d: verify failed, addr = 0x%X, write = 0x%X, read = 0x%X", _pin_cs, a, _reg[a], data[a]);
+        _reg_valid &= ~(1ULL << a);
+        ok = false;
+      }
+    }
+    addr += len - 1;
+  }
+  _SPI->endTransaction();
+
+  return ok;
+}
+
+// TEST_MUX value of current test mux and output gain config
+uint8_t ADA4254::test_mux() {
+  return ada4254_test_mux::map::pack(_config_gainout >> 1, 0, _config_tmuxn, _config_tmuxp);
+}
+
 bool ADA4254::update_config(ada4254_update_t config){
   uint8_t update_reg0x00 = 0; // GAIN_MUX
   uint8_t update_reg0x06 = 0; // INPUT_MUX
@@ -236,47 +459,29 @@ bool ADA4254::update_config(ada4254_update_t config){
       return false;
   }
 
+  batch_begin();
+
   // GAIN_MUX
   if (update_reg0x00) {
-    uint8_t addr = 0x00;
-    uint8_t data = 0x00;
-
-    data |= ((((uint8_t) _config_gainin) & 0xF) << 3);
-    data |= ((((uint8_t) _config_gainout) & 0x1) << 7);
-
-    write(addr,data);
-    //if (read(addr) != data) return false;
+    update(ADA4254_REG_GAIN_MUX, ada4254_gain_mux::map::pack(_config_gainout, _config_gainin));
   }
 
   // INPUT_MUX
   if (update_reg0x06) {
-    uint8_t addr = 0x06;
-    uint8_t data = 0x00;
-
-    if(_config_swp == ADA4254_SHORT) {
-      data = 0x1;
-    } else {
-      data |= (1 << ((uint8_t) _config_swp + 1));
-      data |= (1 << ((uint8_t) _config_swn + 0));
+    uint8_t sw = 0x1;
+
+    if (_config_swp != ADA4254_SHORT) {
+      sw = (1 << ((uint8_t) _config_swp + 1)) | (1 << (uint8_t) _config_swn);
     }
 
-    write(addr,data);
-    //if (read(addr) != data) return false;
+    update(ADA4254_REG_INPUT_MUX, ada4254_input_mux::map::pack(sw));
   }
 
   // TEST_MUX
   if (update_reg0x0E) {
-    uint8_t addr = 0x0E;
-    uint8_t data = 0x00;
-
-    data |= ((((uint8_t) _config_tmuxp) & 0x3)   << 0);
-    data |= ((((uint8_t) _config_tmuxn) & 0x3)   << 2);
-    data |= ((((uint8_t) _config_gainout) & 0x2) << 6);
-
-    write(addr,data);
-    //if (read(addr) != data) return false;
+    update(ADA4254_REG_TEST_MUX, test_mux());
   }
 
-  return true;
+  return batch_end();
 }
 
@@ -1,8 +1,22 @@
 #ifndef ADA4254_LIB_H
 #define ADA4254_LIB_H
 
-#include <Arduino.h>
-#include <SPI.h>
+#include "hal.h"
+
+#define ADA4254_REG_NUM 0x30      // Register map size (shadowed)
+#define ADA4254_SPI_HZ  500000    // SPI clock
+
+// Register addresses (layouts in ada4254_lib.cpp)
+#define ADA4254_REG_GAIN_MUX    0x00
+#define ADA4254_REG_INPUT_MUX   0x06
+#define ADA4254_REG_GPIO_DIR    0x08
+#define ADA4254_REG_SF_CFG      0x0C
+#define ADA4254_REG_TEST_MUX    0x0E    // Test mux and internal calibration
+#define ADA4254_REG_ID          0x2F
+
+// Fault registers (bits set stay set until cleared)
+#define ADA4254_REG_DIGITAL_ERR 0x03
+#define ADA4254_REG_ANALOG_ERR  0x04
 
 // Input Mux Switch Settings
 typedef enum {
@@ -58,6 +72,13 @@ public:
     bool set_switch(ada4254_switch_t pos, ada4254_switch_t neg);
     bool set_tmux(ada4254_tmux_t pos, ada4254_tmux_t neg);
     float get_gain();
+    bool check_id();
+    void batch_begin();
+    bool batch_end(bool verify = false);
+    void set_verify(bool verify);
+    bool read_faults(uint8_t *analog, uint8_t *digital);
+    void cal_start();
+    bool cal_done();
 
 private:
     // Private member variables
@@ -71,10 +92,21 @@ private:
     ada4254_tmux_t    _config_tmuxp;
     ada4254_tmux_t    _config_tmuxn;
 
+    // Register shadow (bit per address)
+    uint8_t  _reg[ADA4254_REG_NUM];
+    uint64_t _reg_valid;      // Shadow holds value of register
+    uint64_t _reg_pending;    // Written to shadow, not sent yet
+    uint8_t  _batch;          // Nesting depth of open batches
+    bool     _verify;         // Read back writes outside of batches
+
     // Private helper methods (if any)
+    uint8_t frame(uint8_t rw, uint8_t cmd, uint8_t data);
+    void burst(uint8_t rw, uint8_t addr, uint8_t len, uint8_t *data);
     uint8_t transaction(uint8_t rw, uint8_t cmd, uint8_t data);
-    void write(uint8_t addr, uint8_t data);
     uint8_t read(uint8_t addr);
+    bool update(uint8_t addr, uint8_t data);
+    bool flush(bool verify);
+    uint8_t test_mux();
     bool update_config(ada4254_update_t config);
 };
 
@@ -0,0 +1,383 @@
+#include "../sim/sim_hal.h"
+#include "../sim/sim_board.h"
+#include "../quad_smu.h"
+#include "../ws_queue.h"
+#include "../log_lib.h"
+#include <time.h>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Host benchmark suite
+ *   pio run -e native_bench -t exec
+ *   .pio/build/native_bench/program [results.json]
+ *  - runs the firmware compute paths on the simulated board (src/sim/)
+ *    and reports time and cycles per operation
+ *  - each benchmark is repeated BENCH_REPEAT times, the fastest run is
+ *    reported (least disturbed by the simulator threads)
+ *  - cycles are TSC cycles on x86 hosts, -1 where there is no counter
+ *  - results are written as JSON (default bench_results.json) so they
+ *    can be compared between commits
+ */
+
+#define BENCH_REPEAT        5
+#define BENCH_OPS_CONVERT   1000000   // Ops per run for v2d/d2v
+#define BENCH_OPS_PMU       20000     // Register writes per run
+#define BENCH_OPS_PROCESS   2000      // smu_process calls per run
+#define BENCH_OPS_LOG       200000    // log_add calls per run
+#define BENCH_SWEEP_POINTS  201
+#define BENCH_SWEEP_TIMEOUT 20000     // (in ms)
+#define BENCH_RESULTS_MAX   16
+
+typedef struct {
+  const char *name;
+  const char *unit;         // What one op is
+  uint32_t ops;             // Ops in fastest run
+  uint64_t ns;              // Time of fastest run
+  int64_t  cycles;          // Cycles of fastest run (-1 if not counted)
+} bench_result_t;
+
+// Time of one run, benchmarks add only the timed sections
+typedef struct {
+  uint64_t ns;
+  int64_t  cycles;
+  uint32_t ops;
+} bench_run_t;
+
+typedef void (*bench_fn_t)(bench_run_t *run);
+
+bench_result_t bench_result[BENCH_RESULTS_MAX];
+int bench_result_num = 0;
+
+// Written by benchmarks so loops aren't optimized away
+volatile uint32_t bench_sink;
+
+// ad5522_lib.cpp internals (register packing, write and verify)
+bool ad5522_write_sysctrl(uint8_t dev);
+bool ad5522_write_pmuctrl(ad5522_ch_t ch);
+
+/**************************************************
+ *
+ * Helper Functions
+ *
+ **************************************************/
+
+inline uint64_t bench_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return (int64_t) __rdtsc();
+#else
+  return -1;
+#endif
+}
+
+// Timed section of a run
+typedef struct {
+  uint64_t ns;
+  int64_t  cycles;
+} bench_mark_t;
+
+inline void bench_start(bench_mark_t *mark) {
+  mark->cycles = bench_cycles();
+  mark->ns = bench_ns();
+}
+
+inline void bench_stop(bench_mark_t *mark, bench_run_t *run, uint32_t ops) {
+  uint64_t ns = bench_ns();
+  int64_t cycles = bench_cycles();
+
+  run->ns += ns - mark->ns;
+  run->cycles = (cycles < 0 || run->cycles < 0) ? -1 : run->cycles + cycles - mark->cycles;
+  run->ops += ops;
+}
+
+// Discard driver log messages (errors are printed)
+void bench_log_flush() {
+  char line[LOG_MSG_LEN];
+
+  while (log_pop(line, sizeof(line))) {
+    if (line[0] == 'E' && line[1] == ' ') printf("  log: %s\n", line);
+  }
+}
+
+// Client socket that accepts everything
+bool bench_send(uint8_t num, const char *message, size_t length) {
+  bench_sink += length;
+  return true;
+}
+
+// Run benchmark BENCH_REPEAT times and keep the fastest run
+void bench_run(const char *name, const char *unit, bench_fn_t fn) {
+  bench_result_t *res = &bench_result[bench_result_num];
+  bool first = true;
+
+  if (bench_result_num >= BENCH_RESULTS_MAX) return;
+
+  for (int r = 0; r < BENCH_REPEAT; r++) {
+    bench_run_t run = {0, 0, 0};
+
+    fn(&run);
+    bench_log_flush();
+    if (run.ops == 0) continue;
+
+    if (first || run.ns * res->ops < res->ns * run.ops) {
+      res->ops    = run.ops;
+      res->ns     = run.ns;
+      res->cycles = run.cycles;
+      first = false;
+    }
+  }
+  if (first) {
+    printf("%-24s failed\n", name);
+    return;
+  }
+
+  res->name = name;
+  res->unit = unit;
+  bench_result_num++;
+
+  printf("%-24s %12.1f ns/%-6s %12.0f %s/s", name, (double) res->ns / res->ops, unit,
+      res->ops * 1e9 / res->ns, unit);
+  if (res->cycles >= 0) printf(" %10.1f cycles/%s", (double) res->cycles / res->ops, unit);
+  printf("\n");
+}
+
+bool bench_write_json(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) return false;
+
+  fprintf(f, "{\n  \"suite\": \"quad_smu_bench\",\n  \"version\": 1,\n");
+  fprintf(f, "  \"time\": %ld,\n  \"compiler\": \"%s\",\n  \"repeat\": %d,\n",
+      (long) time(NULL), __VERSION__, BENCH_REPEAT);
+  fprintf(f, "  \"results\": [\n");
+  for (int i = 0; i < bench_result_num; i++) {
+    bench_result_t *res = &bench_result[i];
+
+    fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %u, \"ns\": %llu, "
+        "\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, ",
+        res->name, res->unit, res->ops, (unsigned long long) res->ns,
+        (double) res->ns / res->ops, res->ops * 1e9 / res->ns);
+    if (res->cycles >= 0) fprintf(f, "\"cycles_per_op\": %.3f}", (double) res->cycles / res->ops);
+    else fprintf(f, "\"cycles_per_op\": null}");
+    fprintf(f, "%s\n", (i + 1 < bench_result_num) ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+
+  return fclose(f) == 0;
+}
+
+/**************************************************
+ *
+ * Micro Benchmarks
+ *
+ **************************************************/
+
+// DAC value to code (FV and FI on every range)
+void bench_dac_v2d(bench_run_t *run) {
+  bench_mark_t mark;
+  uint32_t sum = 0;
+
+  bench_start(&mark);
+  for (uint32_t n = 0; n < BENCH_OPS_CONVERT; n++) {
+    smu_range_t range = (smu_range_t) (n % 6);
+    smu_dac_t dac = (n & 1) ? DAC_FV : DAC_FI;
+    float val = (dac == DAC_FV) ? (float) (n % 2001) * 0.01F - 10 : (float) (n % 2001) * 1e-6F - 1e-3F;
+    uint16_t code;
+
+    smu_dac_v2d(CH0, dac, range, &val, &code);
+    sum += code;
+  }
+  bench_stop(&mark, run, BENCH_OPS_CONVERT);
+  bench_sink = sum;
+}
+
+// ADC code to value (MV and MI on every range)
+void bench_adc_d2v(bench_run_t *run) {
+  bench_mark_t mark;
+  float sum = 0;
+
+  bench_start(&mark);
+  for (uint32_t n = 0; n < BENCH_OPS_CONVERT; n++) {
+    smu_adc_t adc = (n & 1) ? ADC_MV : ADC_MI;
+    sum += smu_adc_d2v(CH0, adc, (smu_range_t) (n % 6), (n * 2654435761UL) & ADC_RES);
+  }
+  bench_stop(&mark, run, BENCH_OPS_CONVERT);
+  bench_sink = (uint32_t) sum;
+}
+
+// PMU register packing, SPI write and read-back verify
+void bench_pmu_pmuctrl(bench_run_t *run) {
+  bench_mark_t mark;
+  uint32_t ok = 0;
+
+  bench_start(&mark);
+  for (uint32_t n = 0; n < BENCH_OPS_PMU; n++) {
+    ok += ad5522_write_pmuctrl((ad5522_ch_t) (n & 3));
+  }
+  bench_stop(&mark, run, ok);
+}
+
+void bench_pmu_sysctrl(bench_run_t *run) {
+  bench_mark_t mark;
+  uint32_t ok = 0;
+
+  bench_start(&mark);
+  for (uint32_t n = 0; n < BENCH_OPS_PMU; n++) {
+    ok += ad5522_write_sysctrl(0);
+  }
+  bench_stop(&mark, run, ok);
+}
+
+// Full telemetry (all fields, all enabled channels) for one client
+void bench_smu_process(bench_run_t *run) {
+  bench_mark_t mark;
+
+  ws_queue_open(0);
+  smu_client_connect(0);
+  for (int i = CH0; i <= CH3; i++) {
+    smu_subscribe(0, (smu_ch_t) i, SMU_FIELD_ALL, 0, 0);
+  }
+
+  for (uint32_t n = 0; n < BENCH_OPS_PROCESS; n++) {
+    smu_queue_update();
+
+    bench_start(&mark);
+    smu_process();
+    bench_stop(&mark, run, 1);
+
+    ws_queue_drain(bench_send);
+  }
+
+  smu_client_disconnect(0);
+  ws_queue_close(0);
+}
+
+// Log ring push, drained outside the timed sections
+void bench_log_add(bench_run_t *run) {
+  bench_mark_t mark;
+  const uint32_t batch = LOG_RING_SIZE / 2;
+  uint32_t ok = 0;
+
+  for (uint32_t n = 0; n < BENCH_OPS_LOG; n += batch) {
+    bench_start(&mark);
+    for (uint32_t b = 0; b < batch; b++) {
+      ok += log_add("bench %d %f", (int) b, 1.5F);
+    }
+    bench_stop(&mark, run, 0);
+    bench_log_flush();
+  }
+  run->ops = ok;
+}
+
+/**************************************************
+ *
+ * Sweep Benchmarks
+ *
+ **************************************************/
+
+// Sweep on channel 0 with back to back ADC conversions
+void bench_sweep(bench_run_t *run, smu_dac_t dac, float stop, uint8_t settle) {
+  bench_mark_t mark;
+  smu_sweep_t sweep;
+
+  smu_set_dac(CH0, DAC_FV, 0);
+  smu_set_dac(CH0, DAC_FI, 0);
+  smu_set_state(CH0, ENABLE);
+
+  sweep.ch     = CH0;
+  sweep.dac    = dac;
+  sweep.start  = 0;
+  sweep.stop   = stop;
+  sweep.points = BENCH_SWEEP_POINTS;
+  sweep.settle = settle;
+  sweep.quiet  = false;
+
+  ws_queue_open(0);
+  uint32_t start = millis();
+  bench_start(&mark);
+  if (!smu_sweep_start(&sweep)) {
+    ws_queue_close(0);
+    return;
+  }
+  while (smu_sweep_active() && millis() - start < BENCH_SWEEP_TIMEOUT) {
+    ws_queue_drain(bench_send);
+    delayMicroseconds(20);
+  }
+  bench_stop(&mark, run, smu_sweep_active() ? 0 : smu_sweep_done());
+  smu_sweep_stop();
+  while (ws_queue_drain(bench_send) > 0);
+  ws_queue_close(0);
+}
+
+void bench_sweep_fv_resistor(bench_run_t *run) {
+  sim_dut_t dut;
+
+  sim_dut_resistor(&dut, 10e3F);
+  sim_board_set_dut(&dut);
+  smu_set_mode(CH0, FV);
+  bench_sweep(run, DAC_FV, 5.0F, 1);
+}
+
+void bench_sweep_fv_diode(bench_run_t *run) {
+  sim_dut_t dut;
+
+  sim_dut_diode(&dut, 1e-12F, 1.8F);
+  sim_board_set_dut(&dut);
+  smu_set_mode(CH0, FV);
+  bench_sweep(run, DAC_FV, 1.0F, 1);
+}
+
+void bench_sweep_fv_nosettle(bench_run_t *run) {
+  sim_dut_t dut;
+
+  sim_dut_resistor(&dut, 10e3F);
+  sim_board_set_dut(&dut);
+  smu_set_mode(CH0, FV);
+  bench_sweep(run, DAC_FV, 5.0F, 0);
+}
+
+/**************************************************
+ *
+ * Main
+ *
+ **************************************************/
+
+int main(int argc, char **argv) {
+  const char *path = (argc > 1) ? argv[1] : "bench_results.json";
+  sim_dut_t dut;
+
+  sim_dut_resistor(&dut, 10e3F);
+  log_init();
+  ws_queue_init();
+  sim_board_init(&dut);
+  smu_init();
+  bench_log_flush();
+
+  // Conversions at the programmed rate while timing compute paths
+  sim_board.adc->set_realtime(true);
+  bench_run("smu_dac_v2d",        "op",    bench_dac_v2d);
+  bench_run("smu_adc_d2v",        "op",    bench_adc_d2v);
+  bench_run("ad5522_pmuctrl",     "write", bench_pmu_pmuctrl);
+  bench_run("ad5522_sysctrl",     "write", bench_pmu_sysctrl);
+  bench_run("smu_process",        "call",  bench_smu_process);
+  bench_run("log_add",            "msg",   bench_log_add);
+
+  // Back to back conversions, sweep is limited by the firmware
+  sim_board.adc->set_realtime(false);
+  bench_run("sweep_fv_resistor",  "point", bench_sweep_fv_resistor);
+  bench_run("sweep_fv_diode",     "point", bench_sweep_fv_diode);
+  bench_run("sweep_fv_nosettle",  "point", bench_sweep_fv_nosettle);
+
+  bool ok = bench_write_json(path);
+  printf("%s %s\n", ok ? "results written to" : "failed to write", path);
+
+  // Driver tasks never return, skip static destructors
+  fflush(stdout);
+  _Exit(ok ? 0 : 1);
+}
@@ -0,0 +1,137 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "hal.h"
+
+/*
+ * Board topology, fixed at compile time (build with -DSMU_BOARD=...)
+ *  - AD5522 devices on the control bus, 4 PMU channels each
+ *  - SMU channels, each on one PMU channel with an optional in-amp
+ *    (channels without one measure MV on MEASOUT as well)
+ *  - ADC inputs of each channel's in-amp output and MEASOUT
+ *  - the tables are constexpr, NUM_CH sizes every per-channel array and
+ *    loops over channels have a count known to the compiler
+ */
+
+#define SMU_BOARD_EVAL  1     // One channel, in-amp MV (eval board)
+#define SMU_BOARD_QUAD  2     // Four channels of one AD5522, MEASOUT only
+
+#ifndef SMU_BOARD
+#define SMU_BOARD SMU_BOARD_EVAL
+#endif
+
+/****************************************
+ *  SPI
+ ***************************************/
+
+// Default VSPI(SPI3) Pins - use for ADC data
+#define SPIBUS_ADC    VSPI
+#define PIN_ADC_CS    5 // PIN_VSPI_CS
+#define PIN_ADC_SCLK 18 // PIN_VSPI_SCLK
+#define PIN_ADC_MOSI 23 // PIN_VSPI_MOSI
+#define PIN_ADC_MISO 19 // PIN_VSPI_MISO
+#define PIN_ADC_INT  17
+
+// Default HSPI(SPI2) Pins - use for control (normal SPI)
+#define PIN_HSPI_MISO 12
+#define PIN_HSPI_MOSI 13
+#define PIN_HSPI_SCLK 14
+
+/****************************************
+ *  Trigger
+ ***************************************/
+
+// External trigger input (rising edge) and output (-1 = not wired,
+//  override with build flags)
+#ifndef PIN_TRIG_IN
+#define PIN_TRIG_IN  -1
+#endif
+#ifndef PIN_TRIG_OUT
+#define PIN_TRIG_OUT -1
+#endif
+
+/****************************************
+ *  Topology
+ ***************************************/
+
+// AD5522 interface pins (devices may share reset)
+typedef struct {
+  int8_t cs;
+  int8_t rst;
+  int8_t busy;
+} board_pmu_t;
+
+typedef struct {
+  uint8_t pmu;            // AD5522 device
+  uint8_t pmu_ch;         // Channel of device (0-3)
+  int8_t  inamp_cs;       // In-amp chip select (-1 = no in-amp)
+  int8_t  inamp_fault;    // In-amp GPIO3 fault output (-1 = not wired)
+  uint8_t inamp_pos;      // ad7177_input_t of in-amp output
+  uint8_t inamp_neg;
+  uint8_t measout_pos;    // ad7177_input_t of MEASOUT
+  uint8_t measout_neg;
+} board_ch_t;
+
+#if SMU_BOARD == SMU_BOARD_EVAL
+
+#define BOARD_PMU_NUM 1
+#define NUM_CH        1
+
+constexpr board_pmu_t board_pmu[] = {
+  {32, 4, 25}
+};
+
+// MV on the in-amp (AIN0/AIN1), MI on MEASOUT (AIN2/AIN3)
+constexpr board_ch_t board_ch[] = {
+  {0, 0, 15, 26, 0, 1, 2, 3}
+};
+
+#elif SMU_BOARD == SMU_BOARD_QUAD
+
+#define BOARD_PMU_NUM 1
+#define NUM_CH        4
+
+constexpr board_pmu_t board_pmu[] = {
+  {32, 4, 25}
+};
+
+// MEASOUT of each PMU channel on AIN0-AIN3 against AIN4
+constexpr board_ch_t board_ch[] = {
+  {0, 0, -1, -1, 0, 0, 0, 4},
+  {0, 1, -1, -1, 0, 0, 1, 4},
+  {0, 2, -1, -1, 0, 0, 2, 4},
+  {0, 3, -1, -1, 0, 0, 3, 4}
+};
+
+#else
+#error "unknown SMU_BOARD"
+#endif
+
+/****************************************
+ *  Topology Checks
+ ***************************************/
+
+constexpr bool board_has_inamp(int ch) {
+  return board_ch[ch].inamp_cs >= 0;
+}
+
+// Channels i and j (and on) don't share a PMU channel
+constexpr bool board_ch_unique(int i, int j) {
+  return j >= NUM_CH
+      || (!(board_ch[i].pmu == board_ch[j].pmu && board_ch[i].pmu_ch == board_ch[j].pmu_ch)
+          && board_ch_unique(i, j + 1));
+}
+
+// Channels from i on are on a PMU channel of the board, each its own
+constexpr bool board_ch_valid(int i) {
+  return i >= NUM_CH
+      || (board_ch[i].pmu < BOARD_PMU_NUM && board_ch[i].pmu_ch < 4
+          && board_ch_unique(i, i + 1) && board_ch_valid(i + 1));
+}
+
+static_assert(sizeof(board_pmu) / sizeof(board_pmu[0]) == BOARD_PMU_NUM, "board_pmu needs BOARD_PMU_NUM entries");
+static_assert(sizeof(board_ch) / sizeof(board_ch[0]) == NUM_CH, "board_ch needs NUM_CH entries");
+static_assert(NUM_CH <= 4 * BOARD_PMU_NUM, "more channels than the PMUs have");
+static_assert(board_ch_valid(0), "board_ch has a bad or shared PMU channel");
+
+#endif
@@ -0,0 +1,65 @@
+#include "hal.h"
+#include "boot_lib.h"
+
+/*
+ * Boot phase timeline
+ *  - each phase is marked once with the time since reset (micros()),
+ *    phase names must be static strings
+ *  - marks can come from any task (e.g. first sample set from the adc
+ *    callback task)
+ */
+
+typedef struct {
+  const char *phase;
+  uint32_t    us;
+} boot_mark_t;
+
+boot_mark_t boot_marks[BOOT_MARKS_MAX];
+uint8_t boot_num = 0;
+portMUX_TYPE boot_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Record time of phase (later marks of the same phase are ignored)
+void boot_mark(const char *phase) {
+  uint32_t us = micros();
+
+  portENTER_CRITICAL(&boot_mux);
+  bool found = false;
+  for (uint8_t i = 0; i < boot_num; i++) {
+    if (strcmp(boot_marks[i].phase, phase) == 0) found = true;
+  }
+  if (!found && boot_num < BOOT_MARKS_MAX) {
+    boot_marks[boot_num].phase = phase;
+    boot_marks[boot_num].us    = us;
+    boot_num++;
+  }
+  portEXIT_CRITICAL(&boot_mux);
+}
+
+// Boot timeline as json message
+//  - ms is the time since reset, dt the time since the previous phase
+int boot_json(char *str, int size) {
+  boot_mark_t marks[BOOT_MARKS_MAX];
+  uint8_t num;
+  uint32_t prev = 0;
+
+  portENTER_CRITICAL(&boot_mux);
+  num = boot_num;
+  memcpy(marks, boot_marks, num * sizeof(boot_mark_t));
+  portEXIT_CRITICAL(&boot_mux);
+
+  int len = snprintf(str, size, "{\"type\":\"boot\",\"phases\":[");
+  for (uint8_t i = 0; i < num && len < size; i++) {
+    len += snprintf(str + len, size - len, "%s{\"phase\":\"%s\",\"ms\":%.1f,\"dt\":%.1f}",
+        i ? "," : "", marks[i].phase, marks[i].us / 1000.0F, (marks[i].us - prev) / 1000.0F);
+    prev = marks[i].us;
+  }
+
+  if (len >= size) return size;
+  return len + snprintf(str + len, size - len, "]}");
+}
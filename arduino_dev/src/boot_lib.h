@@ -0,0 +1,20 @@
+#ifndef BOOT_LIB_H
+#define BOOT_LIB_H
+
+#include "hal.h"
+
+/****************************************
+ *  Boot Timeline
+ ***************************************/
+
+#define BOOT_MARKS_MAX 16
+#define BOOT_JSON_LEN  768
+
+/****************************************
+ *  Boot Functions
+ ***************************************/
+
+void boot_mark(const char *phase);
+int boot_json(char *str, int size);
+
+#endif
@@ -0,0 +1,142 @@
+#include "hal.h"
+#include "event_lib.h"
+#include "log_lib.h"
+
+/*
+ * Event queue for the main loop
+ *  - subsystems post events (from tasks or ISRs) instead of being polled,
+ *    the loop sleeps on the queue until there is one
+ *  - periodic and delayed events come from FreeRTOS software timers, one
+ *    timer per event, the timer callback only posts the event
+ *  - a timer event is not posted again while the previous one is still
+ *    queued, so a slow handler can't fill the queue
+ */
+
+QueueHandle_t event_queue = NULL;
+TimerHandle_t event_timer[EVENT_NUM];
+event_cb_t event_cb[EVENT_NUM];
+
+// Timer events in the queue (one bit per event)
+uint32_t event_pending = 0;
+portMUX_TYPE event_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static_assert(EVENT_NUM <= 32, "event_pending has one bit per event");
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Timer callback (timer daemon task), post event unless still pending
+void event_timer_cb(TimerHandle_t timer) {
+  event_id_t id = (event_id_t) (uintptr_t) pvTimerGetTimerID(timer);
+  event_t event = {(uint8_t) id, 0, 0};
+  bool pending;
+
+  portENTER_CRITICAL(&event_mux);
+  pending = (event_pending >> id) & 1;
+  event_pending |= (1UL << id);
+  portEXIT_CRITICAL(&event_mux);
+  if (pending) return;
+
+  if (xQueueSend(event_queue, &event, 0) != pdPASS) {
+    portENTER_CRITICAL(&event_mux);
+    event_pending &= ~(1UL << id);
+    portEXIT_CRITICAL(&event_mux);
+  }
+}
+
+// Get timer of event, created on first use
+TimerHandle_t event_get_timer(event_id_t id) {
+  if (event_timer[id] == NULL) {
+    event_timer[id] = xTimerCreate("event", 1, pdFALSE, (void *) (uintptr_t) id, event_timer_cb);
+  }
+  return event_timer[id];
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+void event_init() {
+  event_queue = xQueueCreate(EVENT_QUEUE_LEN, sizeof(event_t));
+  memset(event_timer, 0, sizeof(event_timer));
+  memset(event_cb, 0, sizeof(event_cb));
+}
+
+void event_set_handler(event_id_t id, event_cb_t cb) {
+  if (id >= EVENT_NUM) return;
+  event_cb[id] = cb;
+}
+
+// Post event from a task (doesn't block, false if queue is full)
+bool event_post(event_id_t id, uint8_t ch, uint32_t arg) {
+  event_t event = {(uint8_t) id, ch, arg};
+
+  if (id >= EVENT_NUM || event_queue == NULL) return false;
+  if (xQueueSend(event_queue, &event, 0) != pdPASS) {
+    LOG_W(SMU, "event %d dropped, queue full", id);
+    return false;
+  }
+  return true;
+}
+
+bool event_post_isr(event_id_t id, uint8_t ch, uint32_t arg) {
+  event_t event = {(uint8_t) id, ch, arg};
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  BaseType_t ret;
+
+  if (id >= EVENT_NUM || event_queue == NULL) return false;
+  ret = xQueueSendFromISR(event_queue, &event, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+
+  return ret == pdPASS;
+}
+
+// Post event every period_ms (restarts the timer if already running)
+bool event_every(event_id_t id, uint32_t period_ms) {
+  if (id >= EVENT_NUM) return false;
+
+  TimerHandle_t timer = event_get_timer(id);
+  if (timer == NULL) return false;
+
+  vTimerSetReloadMode(timer, pdTRUE);
+  return xTimerChangePeriod(timer, pdMS_TO_TICKS(std::max(period_ms, (uint32_t) 1)), 0) == pdPASS;
+}
+
+// Post event once after delay_ms (replaces pending delay or period)
+bool event_after(event_id_t id, uint32_t delay_ms) {
+  if (id >= EVENT_NUM) return false;
+
+  TimerHandle_t timer = event_get_timer(id);
+  if (timer == NULL) return false;
+
+  vTimerSetReloadMode(timer, pdFALSE);
+  return xTimerChangePeriod(timer, pdMS_TO_TICKS(std::max(delay_ms, (uint32_t) 1)), 0) == pdPASS;
+}
+
+// Stop timer of event (an already queued event is still handled)
+void event_cancel(event_id_t id) {
+  if (id >= EVENT_NUM || event_timer[id] == NULL) return;
+  xTimerStop(event_timer[id], 0);
+}
+
+// Wait up to wait ticks for an event and run its handler
+//  - returns false if no event arrived
+bool event_dispatch(TickType_t wait) {
+  event_t event;
+
+  if (xQueueReceive(event_queue, &event, wait) != pdPASS) return false;
+
+  portENTER_CRITICAL(&event_mux);
+  event_pending &= ~(1UL << event.id);
+  portEXIT_CRITICAL(&event_mux);
+
+  if (event.id < EVENT_NUM && event_cb[event.id]) {
+    event_cb[event.id](&event);
+  }
+  return true;
+}
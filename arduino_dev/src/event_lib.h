@@ -0,0 +1,51 @@
+#ifndef EVENT_LIB_H
+#define EVENT_LIB_H
+
+#include "hal.h"
+
+/****************************************
+ *  Events
+ ***************************************/
+
+#define EVENT_QUEUE_LEN 16
+
+// Events handled by the main loop (one handler each)
+typedef enum {
+  EVENT_DEBUG,        // Poll RemoteDebug (periodic)
+  EVENT_OTA,          // Poll OTA (periodic)
+  EVENT_STACK_CHECK,  // Check task stacks (periodic)
+  EVENT_BENCH_DONE,   // Self benchmark finished
+  EVENT_SEQ_STEP,     // Next step of test sequence is due
+  EVENT_WIFI_UP,      // Station got IP address
+  EVENT_WIFI_DOWN,    // Station disconnected
+  EVENT_WIFI_TIMEOUT, // Saved network didn't connect in time
+  EVENT_WM,           // Poll WiFiManager config portal (periodic)
+  EVENT_INAMP_FAULT,  // In-amp raised fault line (ch)
+  EVENT_INAMP_CAL,    // Run in-amp calibration schedule (periodic)
+  EVENT_HOUSEKEEPING, // New temperature/reference reading
+  EVENT_SMU_SWITCH,   // Range/gain/auto-zero switch asked for by adc callback (ch)
+  EVENT_NUM
+} event_id_t;
+
+typedef struct {
+  uint8_t  id;
+  uint8_t  ch;
+  uint32_t arg;
+} event_t;
+
+typedef void (*event_cb_t)(const event_t *event);
+
+/****************************************
+ *  Event Functions
+ ***************************************/
+
+void event_init();
+void event_set_handler(event_id_t id, event_cb_t cb);
+bool event_post(event_id_t id, uint8_t ch = 0, uint32_t arg = 0);
+bool event_post_isr(event_id_t id, uint8_t ch = 0, uint32_t arg = 0);
+bool event_every(event_id_t id, uint32_t period_ms);
+bool event_after(event_id_t id, uint32_t delay_ms);
+void event_cancel(event_id_t id);
+bool event_dispatch(TickType_t wait);
+
+#endif
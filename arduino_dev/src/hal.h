@@ -0,0 +1,25 @@
+#ifndef HAL_H
+#define HAL_H
+
+/*
+ * Hardware abstraction for the drivers and smu code
+ *  - ESP32 builds use the Arduino core, SPI, Preferences (NVS) and
+ *    FreeRTOS directly
+ *  - native builds (SMU_NATIVE) use sim/sim_hal.h, the same API subset
+ *    backed by simulated devices on the host
+ */
+
+#ifdef SMU_NATIVE
+#include "sim/sim_hal.h"
+#else
+#include <Arduino.h>
+#include <SPI.h>
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+#include <freertos/timers.h>
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+#include "hal.h"
+#include <atomic>
+#include "log_lib.h"
+
+/*
+ * Multi-producer, single-consumer log ring
+ *  - records are preallocated and hold a format string pointer plus
+ *    raw arguments, nothing is formatted until the record is popped
+ *  - producers claim a slot with a compare-and-swap on the head, each
+ *    slot has a sequence number that marks it free/filled so producers
+ *    never block and never see a partially written record
+ *  - when the ring is full new messages are dropped and counted
+ *  - only the network task pops records
+ */
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be power of 2");
+
+typedef struct {
+  std::atomic<uint32_t> seq;    // == pos when free, pos + 1 when filled
+  uint32_t    millis;
+  const char *tag;              // Category (NULL for untagged)
+  const char *fmt;
+  uint8_t     level;
+  uint8_t     nargs;
+  log_arg_t   args[LOG_MAX_ARGS];
+} log_record_t;
+
+log_record_t log_ring[LOG_RING_SIZE];
+std::atomic<uint32_t> log_head(0);    // Next slot to claim (producers)
+uint32_t log_tail = 0;                // Next slot to pop (consumer)
+std::atomic<uint32_t> log_num_dropped(0);
+
+const char log_level_char[] = "-EWIDV";
+
+#ifdef LOG_PROFILE
+// Cycle cost of enabled call sites and of formatting records
+std::atomic<uint32_t> log_prof_calls(0);
+std::atomic<uint32_t> log_prof_cycles(0);
+std::atomic<uint32_t> log_prof_max(0);
+uint32_t log_prof_fmt_calls  = 0;
+uint32_t log_prof_fmt_cycles = 0;
+#endif
+
+/**************************************************
+ *
+ * Internal Helper Functions
+ *
+ **************************************************/
+
+// Format one argument with printf conversion spec (e.g. "%08X")
+int log_format_arg(char *buf, size_t size, const char *spec, char conv, bool is_long, log_arg_t arg) {
+  switch (conv) {
+    case 'd':
+    case 'i':
+      if (is_long) return snprintf(buf, size, spec, (long) (int32_t) arg);
+      return snprintf(buf, size, spec, (int) (int32_t) arg);
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+      if (is_long) return snprintf(buf, size, spec, (unsigned long) (uint32_t) arg);
+      return snprintf(buf, size, spec, (unsigned int) (uint32_t) arg);
+    case 'c':
+      return snprintf(buf, size, spec, (int) arg);
+    case 's':
+      return snprintf(buf, size, spec, arg ? (const char *) arg : "(null)");
+    case 'p':
+      return snprintf(buf, size, spec, (void *) arg);
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G': {
+      uint32_t bits = (uint32_t) arg;
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      return snprintf(buf, size, spec, (double) f);
+    }
+  }
+  return 0;
+}
+
+// Format record, arguments are matched to conversions in fmt
+size_t log_format(char *buf, size_t size, const log_record_t *rec) {
+  const char *p = rec->fmt;
+  uint8_t arg = 0;
+  size_t len = 0;
+
+  if (size == 0) return 0;
+
+  // Prefix tagged messages with level and category, e.g. "D PMU: "
+  if (rec->tag) {
+    int n = snprintf(buf, size, "%c %s: ", log_level_char[std::min(rec->level, (uint8_t) LOG_LEVEL_VERBOSE)], rec->tag);
+    if (n > 0) len = std::min((size_t) n, size - 1);
+  }
+
+  while (*p && len + 1 < size) {
+    if (*p != '%') {
+      buf[len++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      buf[len++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // Copy conversion spec (flags, width, precision, length)
+    char spec[16];
+    size_t spec_len = 0;
+    bool is_long = false;
+    spec[spec_len++] = *p++;
+    while (*p && strchr("-+ #0123456789.lhzjt", *p) && spec_len < sizeof(spec) - 2) {
+      if (*p == 'l') is_long = true;
+      if (*p != 'l' && *p != 'h' && *p != 'z' && *p != 'j' && *p != 't') spec[spec_len++] = *p;
+      p++;
+    }
+    if (*p == '\0') break;
+
+    char conv = *p++;
+    if (is_long && strchr("diuxXo", conv)) spec[spec_len++] = 'l';
+    spec[spec_len++] = conv;
+    spec[spec_len] = '\0';
+
+    int n = log_format_arg(buf + len, size - len, spec, conv, is_long,
+        (arg < rec->nargs) ? rec->args[arg] : 0);
+    arg++;
+    if (n > 0) len = std::min(len + n, size - 1);
+  }
+  buf[len] = '\0';
+
+  return len;
+}
+
+/**************************************************
+ *
+ * External Functions
+ *
+ **************************************************/
+
+void log_init() {
+  for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+    log_ring[i].seq.store(i, std::memory_order_relaxed);
+  }
+  log_tail = 0;
+  log_num_dropped.store(0, std::memory_order_relaxed);
+  log_head.store(0, std::memory_order_release);
+}
+
+// Claim slot and store record (any task)
+bool log_push(uint8_t level, const char *tag, const char *fmt, const log_arg_t *args, uint8_t nargs) {
+  log_record_t *rec;
+  uint32_t pos = log_head.load(std::memory_order_relaxed);
+
+  while (true) {
+    rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+    int32_t diff = (int32_t) (rec->seq.load(std::memory_order_acquire) - pos);
+
+    if (diff == 0) {
+      // Slot is free, try to claim it
+      if (log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // Ring is full
+      log_num_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      // Another producer claimed the slot
+      pos = log_head.load(std::memory_order_relaxed);
+    }
+  }
+
+  rec->millis = millis();
+  rec->tag    = tag;
+  rec->level  = level;
+  rec->fmt    = fmt;
+  rec->nargs  = std::min(nargs, (uint8_t) LOG_MAX_ARGS);
+  memcpy(rec->args, args, rec->nargs * sizeof(log_arg_t));
+
+  // Publish record to consumer
+  rec->seq.store(pos + 1, std::memory_order_release);
+
+  return true;
+}
+
+// Pop and format oldest record (single consumer), false if empty
+bool log_pop(char *buf, size_t size) {
+  log_record_t *rec = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+
+  if (rec->seq.load(std::memory_order_acquire) != log_tail + 1) return false;
+
+#ifdef LOG_PROFILE
+  uint32_t c0 = log_cycles();
+  log_format(buf, size, rec);
+  log_prof_fmt_cycles += log_cycles() - c0;
+  log_prof_fmt_calls++;
+#else
+  log_format(buf, size, rec);
+#endif
+
+  // Release slot to producers
+  rec->seq.store(log_tail + LOG_RING_SIZE, std::memory_order_release);
+  log_tail++;
+
+  return true;
+}
+
+// Return and clear number of dropped messages
+uint32_t log_dropped() {
+  return log_num_dropped.exchange(0, std::memory_order_relaxed);
+}
+
+// Free running cycle counter
+uint32_t log_cycles() {
+#ifdef ESP32
+  return ESP.getCycleCount();
+#else
+  return (uint32_t) micros();
+#endif
+}
+
+// Record cycles spent at one call site (LOG_PROFILE builds)
+void log_profile_push(uint32_t cycles) {
+#ifdef LOG_PROFILE
+  log_prof_calls.fetch_add(1, std::memory_order_relaxed);
+  log_prof_cycles.fetch_add(cycles, std::memory_order_relaxed);
+
+  uint32_t max = log_prof_max.load(std::memory_order_relaxed);
+  while (cycles > max && !log_prof_max.compare_exchange_weak(max, cycles, std::memory_order_relaxed));
+#endif
+}
+
+// Log and reset average/max call site cost and average format cost
+void log_profile_report() {
+#ifdef LOG_PROFILE
+  uint32_t calls  = log_prof_calls.exchange(0);
+  uint32_t cycles = log_prof_cycles.exchange(0);
+  uint32_t max    = log_prof_max.exchange(0);
+
+  if (calls == 0) return;
+
+  log_add("log cost: %u calls, call %u cycles avg (%u max), format %u cycles avg",
+      calls, cycles / calls, max,
+      log_prof_fmt_calls ? log_prof_fmt_cycles / log_prof_fmt_calls : 0);
+  log_prof_fmt_calls  = 0;
+  log_prof_fmt_cycles = 0;
+#endif
+}
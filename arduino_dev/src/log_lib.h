@@ -0,0 +1,132 @@
+#ifndef LOG_LIB_H
+#define LOG_LIB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+/****************************************
+ *  Log Defines
+ ***************************************/
+
+#define LOG_RING_SIZE 64      // Number of records (must be power of 2)
+#define LOG_MAX_ARGS  6       // Max arguments per message
+#define LOG_MSG_LEN   160     // Max length of formatted message
+
+// Argument slot, holds integer, float bits or pointer
+typedef uintptr_t log_arg_t;
+
+/****************************************
+ *  Log Levels
+ ***************************************/
+
+#define LOG_LEVEL_NONE    0
+#define LOG_LEVEL_ERROR   1
+#define LOG_LEVEL_WARN    2
+#define LOG_LEVEL_INFO    3
+#define LOG_LEVEL_DEBUG   4
+#define LOG_LEVEL_VERBOSE 5
+
+// Compile time level per category (override with build flag or define
+//  before including this file), call sites above the level compile out
+#ifndef LOG_LEVEL_PMU
+#define LOG_LEVEL_PMU   LOG_LEVEL_WARN
+#endif
+#ifndef LOG_LEVEL_INAMP
+#define LOG_LEVEL_INAMP LOG_LEVEL_WARN
+#endif
+#ifndef LOG_LEVEL_ADC
+#define LOG_LEVEL_ADC   LOG_LEVEL_WARN
+#endif
+#ifndef LOG_LEVEL_SMU
+#define LOG_LEVEL_SMU   LOG_LEVEL_INFO
+#endif
+#ifndef LOG_LEVEL_NET
+#define LOG_LEVEL_NET   LOG_LEVEL_INFO
+#endif
+
+// Log to category at level, e.g. LOG_D(PMU, "read = 0x%X", data)
+//  - condition is constant so disabled call sites generate no code, the
+//    arguments are still type checked
+#define LOG_AT(cat, level, fmt, ...) \
+  do { \
+    if (LOG_LEVEL_##cat >= (level)) LOG_EMIT(level, #cat, fmt, ##__VA_ARGS__); \
+  } while (0)
+
+#define LOG_E(cat, fmt, ...) LOG_AT(cat, LOG_LEVEL_ERROR,   fmt, ##__VA_ARGS__)
+#define LOG_W(cat, fmt, ...) LOG_AT(cat, LOG_LEVEL_WARN,    fmt, ##__VA_ARGS__)
+#define LOG_I(cat, fmt, ...) LOG_AT(cat, LOG_LEVEL_INFO,    fmt, ##__VA_ARGS__)
+#define LOG_D(cat, fmt, ...) LOG_AT(cat, LOG_LEVEL_DEBUG,   fmt, ##__VA_ARGS__)
+#define LOG_V(cat, fmt, ...) LOG_AT(cat, LOG_LEVEL_VERBOSE, fmt, ##__VA_ARGS__)
+
+// LOG_PROFILE build measures cycles spent at enabled call sites
+#ifdef LOG_PROFILE
+#define LOG_EMIT(level, tag, fmt, ...) \
+  do { \
+    uint32_t log_c0 = log_cycles(); \
+    log_add_tag(level, tag, fmt, ##__VA_ARGS__); \
+    log_profile_push(log_cycles() - log_c0); \
+  } while (0)
+#else
+#define LOG_EMIT(level, tag, fmt, ...) log_add_tag(level, tag, fmt, ##__VA_ARGS__)
+#endif
+
+/****************************************
+ *  Log Functions
+ ***************************************/
+
+void log_init();
+bool log_push(uint8_t level, const char *tag, const char *fmt, const log_arg_t *args, uint8_t nargs);
+bool log_pop(char *buf, size_t size);
+uint32_t log_dropped();
+uint32_t log_cycles();
+void log_profile_push(uint32_t cycles);
+void log_profile_report();
+
+/****************************************
+ *  Log Argument Capture
+ ***************************************/
+
+// Integers and enums (up to 32 bit)
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, log_arg_t>::type
+log_arg(T val) {
+  static_assert(sizeof(T) <= sizeof(uint32_t), "log arguments are limited to 32 bits");
+  return (log_arg_t) (uint32_t) val;
+}
+
+// Floats are stored as float bits (formatted with %f/%e/%g)
+inline log_arg_t log_arg(double val) {
+  float f = (float) val;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return (log_arg_t) bits;
+}
+
+// Strings must be static (message is formatted when it is flushed)
+inline log_arg_t log_arg(const char *val) {
+  return (log_arg_t) val;
+}
+
+inline log_arg_t log_arg(const void *val) {
+  return (log_arg_t) val;
+}
+
+// Add message with level and category tag to log ring
+//  - fmt must be a string literal, arguments are formatted when flushed
+//  - does not allocate or lock, safe to call from any task
+template<typename... Args>
+inline bool log_add_tag(uint8_t level, const char *tag, const char *fmt, Args... args) {
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+  const log_arg_t argv[sizeof...(Args) + 1] = { log_arg(args)..., 0 };
+  return log_push(level, tag, fmt, argv, sizeof...(Args));
+}
+
+// Add untagged message (always enabled)
+template<typename... Args>
+inline bool log_add(const char *fmt, Args... args) {
+  return log_add_tag(LOG_LEVEL_INFO, NULL, fmt, args...);
+}
+
+#endif
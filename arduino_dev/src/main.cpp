@@ -16,22 +16,464 @@
 #include "ad7177_lib.h"
 #include "utility.h"
 #include "quad_smu.h"
+#include "smu_bench.h"
+#include "event_lib.h"
+#include "seq_lib.h"
+#include "smu_store.h"
+#include "smu_wave.h"
+#include "smu_pulse.h"
+#include "smu_trig.h"
 
 #define USE_LIB_WEBSOCKET true
 #define WEBSOCKET_DISABLED true
 #include "RemoteDebug.h"
 
 
-uint8_t count;
-uint32_t millis_last;
+// RemoteDebug and OTA can only be polled, keep it infrequent
+#define DEBUG_POLL_MS      20    // Period of remote debug polling (in ms)
+#define OTA_POLL_MS        100   // Period of OTA polling (in ms)
+#define STACK_CHECK_MS     10000 // Period of task stack check (in ms)
+
+#define WIFI_CONNECT_MS    15000 // Start config portal if not connected by then (in ms)
+#define WM_POLL_MS         50    // Period of config portal polling (in ms)
+#define FAULT_CHECK_MS     100   // Period of checking an in-amp fault that persists (in ms)
+#define INAMP_CAL_MS       100   // Period of in-amp calibration schedule (in ms)
+
+#define SEQ_FILE "/sequence.txt"
+#define WS_CMD_JSON_SIZE   4096  // Parsed command (room for a wave list of ~250 points)
+
+// Names in order of smu_dac_t, smu_adc_t, smu_rate_t, smu_range_t,
+//  smu_wave_shape_t (lists have no name) and smu_trig_src_t
+const char *cmd_dac_name[]   = {"fi", "fv", "cllv", "clhv", "clli", "clhi"};
+const char *cmd_adc_name[]   = {"mv", "mi"};
+const char *cmd_rate_name[]  = {"fast", "med", "line", "slow"};
+const char *cmd_range_name[] = {"5ua", "20ua", "200ua", "2ma", "20ma", "200ma"};
+const char *cmd_wave_shape[] = {"ramp", "step", "pulse"};
+const char *cmd_trig_src[]   = {"never", "immediate", "bus", "ext", "timer", "arm", "source", "meas", "done"};
+
+bool debug_bench_pending = false;
+bool net_started = false;
+bool wm_active = false;
 
 /**********************************************************
  *
  * Callback Functions
  *
  *********************************************************/
-void websocket_connected_callback() {
-  smu_queue_update();
+void websocket_connected_callback(uint8_t num) {
+  smu_client_connect(num);
+}
+
+void websocket_disconnected_callback(uint8_t num) {
+  smu_client_disconnect(num);
+}
+
+// Get telemetry field mask from "fields" array (all fields if missing)
+uint16_t websocket_field_mask(JsonVariant fields) {
+  uint16_t mask = 0;
+
+  if (fields.isNull()) return SMU_FIELD_ALL;
+
+  for (size_t i = 0; i < fields.size(); i++) {
+    mask |= smu_field_mask(fields[i].as<const char *>());
+  }
+  return mask;
+}
+
+// Index of name in list, -1 if not found
+int cmd_find(const char *name, const char **names, int num) {
+  for (int i = 0; i < num; i++) {
+    if (strcmp(name, names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+// Trigger layer from {"src":"timer","ch":0,"count":1,"timer_us":1000}
+//  (an unknown source fails in smu_trig_config)
+void websocket_trig_layer(JsonVariant json, smu_trig_layer_t *layer) {
+  int src = cmd_find(json["src"] | "immediate", cmd_trig_src, TRIG_SRC_NUM);
+
+  layer->src      = (src < 0) ? TRIG_SRC_NUM : src;
+  layer->ch       = json["ch"] | 0;
+  layer->count    = json["count"] | 1;
+  layer->timer_us = json["timer_us"] | 0;
+}
+
+// Handle json commands from websocket clients
+//  {"cmd":"subscribe","ch":0,"fields":["mv","mi"],"period":50,"deadband":0.001}
+//  {"cmd":"unsubscribe","ch":0,"fields":["mv"]}
+//  {"cmd":"sweep","ch":0,"src":"fv","start":0,"stop":5,"points":51,"settle":1}
+//  {"cmd":"sweep_stop"}
+//  {"cmd":"wave","ch":0,"src":"fv","shape":"ramp","start":0,"stop":1,"points":100,"period_us":1000,"cycles":1}
+//      ("shape":"step"/"pulse" take "width", "list":[...] instead of a shape,
+//      "sync":true,"settle":0 measures every update)
+//  {"cmd":"wave_stop"}
+//  {"cmd":"pulse","ch":0,"src":"fv","base":0,"start":0,"stop":1,"points":11,"width_us":500,"delay_us":300,"period_us":10000,"duty":10}
+//  {"cmd":"pulse_stop"}
+//  {"cmd":"trig_config","ch":0,"arm":{"src":"immediate","count":1},"trig":{"src":"source","ch":1,"count":10},
+//      "src":"fv","list":[0,0.5,1],"delay_us":1000,"measure":true}
+//      (layer sources "immediate", "bus", "ext", "timer" with "timer_us", or
+//      "arm", "source", "meas", "done" of channel "ch", no list only measures)
+//  {"cmd":"trig_init","chs":[0,1]}     (no chs starts ch)
+//  {"cmd":"trig_bus"}
+//  {"cmd":"trig_abort"}
+//  {"cmd":"trig_out","src":"meas","ch":0}   ("never" turns it off)
+//  {"cmd":"bench"}
+//  {"cmd":"seq","script":"wait 1000\nfv 0 1\n..."}
+//  {"cmd":"seq_stop"}
+//  {"cmd":"save","name":"diode"}       (no name saves the boot record)
+//  {"cmd":"recall","name":"diode"}
+//  {"cmd":"delete","name":"diode"}
+//  {"cmd":"cal","ch":0,"dac":"fv","gain":1.001,"offset":-0.002}  ("adc":"mv" for adc)
+//  {"cmd":"rate","rate":"line"}
+//  {"cmd":"autorange","ch":0,"enable":true,"min":"5ua","max":"2ma","up":0.9,"down":0.8,"hold":2,"settle":2}
+//  {"cmd":"autogain","ch":0,"enable":true,"up":0.9,"down":0.7,"hold":2,"settle":2}
+//  {"cmd":"autozero","ch":0,"enable":true,"ratio":100,"ref":true,"settle":1,"filter":0.1}
+//  {"cmd":"inamp_cal","interval":3600,"temp":2}    ("now":true calibrates ch at the next gap)
+//  {"cmd":"housekeeping","ratio":1000}
+//  {"cmd":"meas_rate","ch":0,"adc":"mv","rate":100}  (0 stops measuring it)
+//                                      (missing settings are left as they are)
+void websocket_text_callback(uint8_t num, uint8_t *payload, size_t length) {
+  DynamicJsonDocument json(WS_CMD_JSON_SIZE);
+
+  if (deserializeJson(json, (const char *) payload, length)) return;
+
+  const char *cmd = json["cmd"] | "";
+  smu_ch_t ch = (smu_ch_t) (json["ch"] | 0);
+
+  if (strcmp(cmd, "subscribe") == 0) {
+    smu_subscribe(num, ch, websocket_field_mask(json["fields"]),
+        json["period"] | 500, json["deadband"] | 0.0F);
+  } else if (strcmp(cmd, "unsubscribe") == 0) {
+    smu_unsubscribe(num, ch, websocket_field_mask(json["fields"]));
+  } else if (strcmp(cmd, "sweep") == 0) {
+    smu_sweep_t sweep;
+    sweep.ch     = ch;
+    sweep.dac    = (strcmp(json["src"] | "fv", "fi") == 0) ? DAC_FI : DAC_FV;
+    sweep.start  = json["start"] | 0.0F;
+    sweep.stop   = json["stop"] | 0.0F;
+    sweep.points = json["points"] | 11;
+    sweep.settle = json["settle"] | 1;
+    sweep.quiet  = false;
+    if (!smu_sweep_start(&sweep)) LOG_W(SMU, "sweep not started");
+  } else if (strcmp(cmd, "sweep_stop") == 0) {
+    smu_sweep_stop();
+  } else if (strcmp(cmd, "wave") == 0) {
+    static float list[SMU_WAVE_POINTS_MAX];
+    JsonArray values = json["list"];
+    smu_wave_t wave;
+    int shape = cmd_find(json["shape"] | "ramp", cmd_wave_shape, WAVE_LIST);
+
+    wave.ch        = ch;
+    wave.dac       = (strcmp(json["src"] | "fv", "fi") == 0) ? DAC_FI : DAC_FV;
+    wave.shape     = (shape < 0) ? WAVE_RAMP : shape;
+    wave.start     = json["start"] | 0.0F;
+    wave.stop      = json["stop"] | 0.0F;
+    wave.points    = json["points"] | 11;
+    wave.width     = json["width"] | 1;
+    wave.list      = NULL;
+    wave.period_us = json["period_us"] | 1000;
+    wave.cycles    = json["cycles"] | 1;
+    wave.sync      = json["sync"] | false;
+    wave.settle    = json["settle"] | 0;
+    if (!values.isNull()) {
+      wave.shape  = WAVE_LIST;
+      wave.points = std::min(values.size(), (size_t) SMU_WAVE_POINTS_MAX);
+      wave.list   = list;
+      for (int i = 0; i < wave.points; i++) list[i] = values[i] | 0.0F;
+    }
+    if (!smu_wave_start(&wave)) LOG_W(SMU, "wave not started");
+  } else if (strcmp(cmd, "wave_stop") == 0) {
+    smu_wave_stop();
+  } else if (strcmp(cmd, "pulse") == 0) {
+    smu_pulse_t pulse;
+    pulse.ch        = ch;
+    pulse.dac       = (strcmp(json["src"] | "fv", "fi") == 0) ? DAC_FI : DAC_FV;
+    pulse.base      = json["base"] | 0.0F;
+    pulse.start     = json["start"] | 0.0F;
+    pulse.stop      = json["stop"] | 0.0F;
+    pulse.points    = json["points"] | 11;
+    pulse.width_us  = json["width_us"] | 1000;
+    pulse.delay_us  = json["delay_us"] | 500;
+    pulse.period_us = json["period_us"] | 100000;
+    pulse.duty_max  = json["duty"] | 10;
+    if (!smu_pulse_start(&pulse)) LOG_W(SMU, "pulse not started");
+  } else if (strcmp(cmd, "pulse_stop") == 0) {
+    smu_pulse_stop();
+  } else if (strcmp(cmd, "trig_config") == 0) {
+    static float list[SMU_TRIG_POINTS_MAX];
+    JsonArray values = json["list"];
+    smu_trig_cfg_t cfg;
+
+    websocket_trig_layer(json["arm"], &cfg.arm);
+    websocket_trig_layer(json["trig"], &cfg.trig);
+    cfg.dac      = (strcmp(json["src"] | "fv", "fi") == 0) ? DAC_FI : DAC_FV;
+    cfg.points   = 0;
+    cfg.list     = NULL;
+    cfg.delay_us = json["delay_us"] | 0;
+    cfg.measure  = json["measure"] | true;
+    if (!values.isNull()) {
+      cfg.points = std::min(values.size(), (size_t) SMU_TRIG_POINTS_MAX);
+      cfg.list   = list;
+      for (int i = 0; i < cfg.points; i++) list[i] = values[i] | 0.0F;
+    }
+    if (!smu_trig_config(ch, &cfg)) LOG_W(SMU, "trigger model not configured");
+  } else if (strcmp(cmd, "trig_init") == 0) {
+    JsonArray chs = json["chs"];
+    uint16_t mask = chs.isNull() ? (1 << ch) : 0;
+
+    for (size_t i = 0; i < chs.size(); i++) mask |= 1 << (chs[i] | 0);
+    if (!smu_trig_init(mask)) LOG_W(SMU, "trigger model not started");
+  } else if (strcmp(cmd, "trig_bus") == 0) {
+    smu_trig_bus();
+  } else if (strcmp(cmd, "trig_abort") == 0) {
+    smu_trig_abort();
+  } else if (strcmp(cmd, "trig_out") == 0) {
+    int src = cmd_find(json["src"] | "never", cmd_trig_src, TRIG_SRC_NUM);
+    smu_trig_out((smu_trig_src_t) ((src < 0) ? TRIG_SRC_NEVER : src), ch);
+  } else if (strcmp(cmd, "bench") == 0) {
+    if (!smu_bench_start(num)) LOG_W(SMU, "bench not started");
+  } else if (strcmp(cmd, "seq") == 0) {
+    if (seq_load(json["script"] | "")) seq_start();
+  } else if (strcmp(cmd, "seq_stop") == 0) {
+    seq_stop();
+  } else if (strcmp(cmd, "save") == 0) {
+    if (!smu_store_save(json["name"] | "")) LOG_W(SMU, "config not saved");
+  } else if (strcmp(cmd, "recall") == 0) {
+    if (!smu_store_recall(json["name"] | "")) LOG_W(SMU, "config not recalled");
+  } else if (strcmp(cmd, "delete") == 0) {
+    smu_store_remove(json["name"] | "");
+  } else if (strcmp(cmd, "cal") == 0) {
+    smu_cal_t cal;
+    int dac = cmd_find(json["dac"] | "", cmd_dac_name, SMU_DAC_NUM);
+    int adc = cmd_find(json["adc"] | "", cmd_adc_name, SMU_ADC_NUM);
+
+    smu_get_cal(ch, &cal);
+    if (dac >= 0) {
+      cal.dac_gain[dac]   = json["gain"] | cal.dac_gain[dac];
+      cal.dac_offset[dac] = json["offset"] | cal.dac_offset[dac];
+    } else if (adc >= 0) {
+      cal.adc_gain[adc]   = json["gain"] | cal.adc_gain[adc];
+      cal.adc_offset[adc] = json["offset"] | cal.adc_offset[adc];
+    }
+    smu_set_cal(ch, &cal);
+  } else if (strcmp(cmd, "rate") == 0) {
+    int rate = cmd_find(json["rate"] | "", cmd_rate_name, 4);
+    if (rate >= 0) smu_set_rate((smu_rate_t) rate);
+  } else if (strcmp(cmd, "autorange") == 0) {
+    smu_autorange_t autorange;
+    int min = cmd_find(json["min"] | "", cmd_range_name, 6);
+    int max = cmd_find(json["max"] | "", cmd_range_name, 6);
+
+    smu_get_autorange(ch, &autorange);
+    autorange.enable = json["enable"] | autorange.enable;
+    if (min >= 0) autorange.min = min;
+    if (max >= 0) autorange.max = max;
+    autorange.up     = json["up"] | autorange.up;
+    autorange.down   = json["down"] | autorange.down;
+    autorange.hold   = json["hold"] | autorange.hold;
+    autorange.settle = json["settle"] | autorange.settle;
+    if (!smu_set_autorange(ch, &autorange)) LOG_W(SMU, "autorange not set");
+  } else if (strcmp(cmd, "autogain") == 0) {
+    smu_autogain_t autogain;
+
+    smu_get_autogain(ch, &autogain);
+    autogain.enable = json["enable"] | autogain.enable;
+    autogain.up     = json["up"] | autogain.up;
+    autogain.down   = json["down"] | autogain.down;
+    autogain.hold   = json["hold"] | autogain.hold;
+    autogain.settle = json["settle"] | autogain.settle;
+    if (!smu_set_autogain(ch, &autogain)) LOG_W(SMU, "autogain not set");
+  } else if (strcmp(cmd, "autozero") == 0) {
+    smu_autozero_t autozero;
+
+    smu_get_autozero(ch, &autozero);
+    autozero.enable = json["enable"] | autozero.enable;
+    autozero.ratio  = json["ratio"] | autozero.ratio;
+    autozero.ref    = json["ref"] | autozero.ref;
+    autozero.settle = json["settle"] | autozero.settle;
+    autozero.filter = json["filter"] | autozero.filter;
+    if (!smu_set_autozero(ch, &autozero)) LOG_W(SMU, "autozero not set");
+  } else if (strcmp(cmd, "inamp_cal") == 0) {
+    smu_inamp_cal_t cal;
+
+    smu_get_inamp_cal(&cal);
+    cal.interval_s = json["interval"] | cal.interval_s;
+    cal.temp_delta = json["temp"] | cal.temp_delta;
+    smu_set_inamp_cal(&cal);
+    if (json["now"] | false) smu_inamp_cal_request(ch);
+  } else if (strcmp(cmd, "housekeeping") == 0) {
+    smu_set_hk_ratio(json["ratio"] | smu_get_hk_ratio());
+  } else if (strcmp(cmd, "meas_rate") == 0) {
+    int adc = cmd_find(json["adc"] | "", cmd_adc_name, SMU_ADC_NUM);
+
+    if (adc < 0 || !smu_set_meas_rate(ch, (smu_adc_t) adc, json["rate"] | -1.0F)) {
+      LOG_W(SMU, "measurement rate not set");
+    } else {
+      LOG_I(SMU, "ch%d %s at %.1f Hz", ch, cmd_adc_name[adc], smu_get_meas_rate(ch, (smu_adc_t) adc));
+    }
+  }
+}
+
+// Handle RemoteDebug project commands
+void debug_command_callback(const char *cmd) {
+  if (strcmp(cmd, "bench") == 0) {
+    if (smu_bench_start(SMU_BENCH_CLIENT_NONE)) {
+      debug_print("bench started (outputs HiZ), report follows when done");
+      debug_bench_pending = true;
+    } else {
+      debug_print("bench not started (bench or sweep running)");
+    }
+  } else if (strcmp(cmd, "boot") == 0) {
+    char str[BOOT_JSON_LEN];
+    boot_json(str, sizeof(str));
+    debug_print(str);
+  }
+}
+
+// WiFi driver events (WiFi event task), handled in loop()
+void wifi_event_callback(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) event_post(EVENT_WIFI_UP);
+  else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) event_post(EVENT_WIFI_DOWN);
+}
+
+/**********************************************************
+ *
+ * Event Handlers
+ *
+ *********************************************************/
+
+void debug_event(const event_t *event) {
+  debug_process();
+}
+
+void ota_event(const event_t *event) {
+  ota_process();
+}
+
+// Log tasks running low on stack
+void stack_check_event(const event_t *event) {
+  task_check_stacks();
+}
+
+// Print self benchmark report started from remote debug
+void bench_done_event(const event_t *event) {
+  if (debug_bench_pending && smu_bench_report()) {
+    debug_bench_pending = false;
+    debug_print(smu_bench_report());
+  }
+}
+
+void seq_step_event(const event_t *event) {
+  seq_step();
+}
+
+// Calibrate in-amps that are due, never while the benchmark runs
+void inamp_cal_event(const event_t *event) {
+  if (smu_bench_running()) return;
+  smu_inamp_cal_process();
+}
+
+void housekeeping_event(const event_t *event) {
+  smu_hk_process();
+}
+
+// Write range, gain and auto-zero input switches the adc callback asked for
+void smu_switch_event(const event_t *event) {
+  smu_switch_process((smu_ch_t) event->ch);
+}
+
+// Read in-amp faults, keep checking while a fault line stays high
+void inamp_fault_event(const event_t *event) {
+  if (smu_inamp_fault_process()) event_after(EVENT_INAMP_FAULT, FAULT_CHECK_MS);
+}
+
+// No connection to a saved network (or none saved), start config portal
+void wifi_timeout_event(const event_t *event) {
+  if (WiFi.isConnected() || wm_active) return;
+
+  wm_init();
+  wm_active = true;
+  event_every(EVENT_WM, WM_POLL_MS);
+}
+
+void wm_event(const event_t *event) {
+  if (wm_active && wm_process()) {
+    wm_active = false;
+    event_cancel(EVENT_WM);
+  }
+}
+
+// Attach network services once connected (they never block the smu)
+void wifi_up_event(const event_t *event) {
+  event_cancel(EVENT_WIFI_TIMEOUT);
+  if (wm_active) {
+    wm_stop();
+    wm_active = false;
+    event_cancel(EVENT_WM);
+  }
+
+  Serial.print("WiFi connected, IP ");
+  Serial.println(WiFi.localIP().toString());
+  if (net_started) return;
+  boot_mark("wifi_up");
+
+  // Configure NTP
+  #if defined(ESP32)
+  configTime(0, 0, NTP_SERVER);  // Offset is handled by TZ, so set to 0
+  #endif
+
+  // Start MDNS, remote debug and OTA service
+  dns_init();
+  debug_init();
+  debug_set_cb(debug_command_callback,
+      "bench - self benchmark (puts outputs in HiZ)\r\nboot - boot phase timeline");
+  ota_init();
+
+  // Setup webserver and websocket
+  webserver_init();
+  websocket_init();
+
+  event_every(EVENT_DEBUG, DEBUG_POLL_MS);
+  event_every(EVENT_OTA, OTA_POLL_MS);
+  net_started = true;
+  boot_mark("net");
+
+  char str[BOOT_JSON_LEN];
+  boot_json(str, sizeof(str));
+  Serial.println(str);
+}
+
+void wifi_down_event(const event_t *event) {
+  LOG_W(NET, "WiFi disconnected");
+}
+
+/**********************************************************
+ *
+ * Task Functions
+ *
+ *********************************************************/
+
+// Publishing task - sends subscribed telemetry to client queues
+//  - sleeps until a subscribed field changes or a changed field is due
+void publish_task(void *pvParameters) {
+  while (true) {
+    uint32_t wait = smu_process();
+    ulTaskNotifyTake(pdTRUE, (wait == SMU_PROCESS_IDLE) ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+  }
+}
+
+// Load test sequence from littlefs, built in demo if there is none
+void seq_load_file() {
+  if (LittleFS.exists(SEQ_FILE)) {
+    File file = LittleFS.open(SEQ_FILE, "r");
+    String script = file.readString();
+    file.close();
+
+    if (seq_load(script.c_str())) return;
+    Serial.println("Sequence file not valid, using demo sequence");
+  }
+  seq_load(seq_default);
 }
 
 /**********************************************************
@@ -42,17 +484,39 @@ void websocket_connected_callback() {
 
 
 void setup() {
-  // Start wifi in station mode
-  WiFi.mode(WIFI_STA);
+  boot_mark("setup");
+
+  // Initialize log ring before anything can log
+  log_init();
+
+  // Main loop only handles events (see loop)
+  event_init();
+  event_set_handler(EVENT_INAMP_FAULT, inamp_fault_event);
+  event_set_handler(EVENT_SMU_SWITCH, smu_switch_event);
 
   // Start serial port
   Serial.begin(115200);
 
-  // Start MDNS
-  dns_init();
+  // Initialize smu first, acquisition runs while the network comes up
+  //  - channels, calibration and rate are restored from the boot record
+  smu_config_t config;
+  bool restored = smu_store_load(SMU_STORE_BOOT, &config);
+  smu_init(restored ? &config : NULL);
+  boot_mark("smu");
 
-  // Start remote debug
-  debug_init();
+  // Publish telemetry from its own task (see task_lib.h for layout)
+  task_create(TASK_PUB, publish_task, NULL);
+
+  // Start connecting to saved network, config portal is only started if
+  //  that fails, network services attach once connected (wifi_up_event)
+  WiFi.onEvent(wifi_event_callback);
+  event_set_handler(EVENT_WIFI_UP, wifi_up_event);
+  event_set_handler(EVENT_WIFI_DOWN, wifi_down_event);
+  event_set_handler(EVENT_WIFI_TIMEOUT, wifi_timeout_event);
+  event_set_handler(EVENT_WM, wm_event);
+  if (wifi_init()) event_after(EVENT_WIFI_TIMEOUT, WIFI_CONNECT_MS);
+  else event_post(EVENT_WIFI_TIMEOUT);
+  boot_mark("wifi_start");
 
   #if defined(ESP8266)
   // Configure timezone and ntp server
@@ -62,77 +526,39 @@ void setup() {
   // Set timezone using POSIX string
   setenv("TZ", TZ, 1);  // 1 to overwrite the current value
   tzset();              // Apply the new timezone
-
-  // Configure NTP
-  configTime(0, 0, NTP_SERVER);  // Offset is handled by TZ, so set to 0
   #endif
 
-  // Setup wifimanager
-  // TODO figure out how to make this non-blocking
-  wm_init();
-
-  // Setup OTA service
-  ota_init();
-
   // Setup littlefs
   littlefs_init();
+  boot_mark("fs");
 
-  // Setup webserver and websocket
-  webserver_init();
-  websocket_init();
-
-  // Set callbacks for websocket events
-  websocket_set_cb(websocket_connected_callback,NULL,NULL);
+  // Set callbacks for websocket events (server starts once connected)
+  websocket_set_cb(websocket_connected_callback, websocket_disconnected_callback,
+      websocket_text_callback);
 
-  // Initialize smu
-  smu_init();
+  // Library polling and housekeeping run from timers
+  event_set_handler(EVENT_DEBUG, debug_event);
+  event_set_handler(EVENT_OTA, ota_event);
+  event_set_handler(EVENT_STACK_CHECK, stack_check_event);
+  event_set_handler(EVENT_BENCH_DONE, bench_done_event);
+  event_set_handler(EVENT_SEQ_STEP, seq_step_event);
+  event_set_handler(EVENT_INAMP_CAL, inamp_cal_event);
+  event_set_handler(EVENT_HOUSEKEEPING, housekeeping_event);
+  event_every(EVENT_STACK_CHECK, STACK_CHECK_MS);
+  event_every(EVENT_INAMP_CAL, INAMP_CAL_MS);
 
-  // Setup adc
+  // Start test sequence
   //TODO: test/debug stuff
-  millis_last = millis();
-
-  count = 0;
+  seq_init();
+  seq_load_file();
+  seq_start();
+  boot_mark("setup_done");
 }
 
 
 void loop() {
-  // Handle library processing functions
-  debug_process();
-  ota_process();
-  websocket_process();
-  smu_process();
-
-  //if(ad7177_data_ready()){
-    //adc_process(ad7177_get_data());
-  //}
-
-  if (millis() - millis_last > 5000) {
-    millis_last = millis();
-
-    switch(++count) {
-      case 1:
-        smu_set_state(CH0, DISABLE);
-        break;
-      case 2:
-        smu_set_dac(CH0, DAC_FV, 0);
-        smu_set_state(CH0, ENABLE);
-        break;
-      case 3:
-        smu_set_dac(CH0, DAC_FV, 1);
-        break;
-      case 4:
-        smu_set_dac(CH0, DAC_FV, 2);
-        break;
-      case 5:
-        smu_set_dac(CH0, DAC_FV, 3);
-        break;
-      default:
-        count = 0;
-    }
-
-    //String message = "{\"type\":\"test\"}";
-    //websocket.broadcastTXT(message);
-  }
-
-  yield();              // ESP processing time
+  // Sleep until an event is posted (timers, tasks or interrupts) and
+  //  run its handler, websocket processing and publishing run on their
+  //  own tasks
+  event_dispatch(portMAX_DELAY);
 }
@@ -1,10 +1,18 @@
-#include <Arduino.h>
+#include "hal.h"
 #include <time.h>
 #include "quad_smu.h"
-#include "utility.h"
 #include "ada4254_lib.h"
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+#include "boot_lib.h"
+#include "event_lib.h"
+#include "smu_sched.h"
+#include "smu_wave.h"
+#include "smu_pulse.h"
+#include "smu_trig.h"
 #include <cmath>
-#include <SPI.h>
+#include <atomic>
 
 SPIClass SPI_CTRL(HSPI); // Create an instance for the HSPI bus
 
@@ -14,11 +22,9 @@ SPIClass SPI_CTRL(HSPI); // Create an instance for the HSPI bus
 //  .web_update = 500
 //};
 
-//#define NUM_CH 4
-#define NUM_CH 1
-#define MILLIS_PROCESS 500
-
-int8_t pin_inamp_cs[] = {PIN_INAMP0_CS, -1, -1, -1};
+#define MILLIS_PROCESS 500      // Default telemetry period (in ms)
+#define SMU_SUB_PERIOD_MIN 10   // Fastest telemetry period (in ms)
+#define SMU_PROCESS_RETRY 10    // Retry publishing to a full client queue (in ms)
 
 typedef enum {
   FIELD_FV    = 0,
@@ -32,31 +38,250 @@ typedef enum {
   FIELD_RANGE = 8,
   FIELD_STATE = 9,
   FIELD_MODE  = 10,
-  FIELD_SENSE = 11
+  FIELD_SENSE = 11,
+  FIELD_NUM   = 12
 } smu_control_bitfield_t;
 
+#define FIELD_ANALOG_LAST FIELD_CLHV
+
+const char *smu_field_name[FIELD_NUM] = {
+  "fv", "fi", "mv", "mi", "clli", "clhi", "cllv", "clhv",
+  "range", "state", "mode", "sense"
+};
+
+// Per client, per channel telemetry subscription
+typedef struct {
+  uint16_t fields;                  // Subscribed fields
+  uint16_t dirty;                   // Fields changed since last publish
+  uint16_t period[FIELD_NUM];       // Minimum time between publishes (in ms)
+  uint32_t millis_last[FIELD_NUM];  // Time of last publish
+  float    deadband[FIELD_NUM];     // Minimum change to publish analog field
+  float    last[FIELD_NUM];         // Last published analog value (NAN = none yet)
+} smu_sub_t;
+
+/*
+ * Channel state is shared between the adc callback task (mv/mi) and the
+ * control/publishing code (everything else) using a seqlock per channel
+ *  - writers are serialized by smu_control_mux and only hold it while
+ *    copying values in, so they never wait on readers
+ *  - the sequence is odd while a write is in progress, readers copy the
+ *    state and retry if the sequence changed (no locks)
+ *  - the sequence doubles as a version number to detect changes
+ */
+smu_control_t smu_control[NUM_CH];
+std::atomic<uint32_t> smu_control_seq[NUM_CH];
+uint16_t smu_control_updated[NUM_CH];   // Protected by smu_control_mux
+portMUX_TYPE smu_control_mux = portMUX_INITIALIZER_UNLOCKED;
+
+smu_sub_t smu_sub[WS_CLIENT_MAX][NUM_CH];
+SemaphoreHandle_t smu_sub_lock;
+
+// Fields whose change wakes the publishing task (subscribed and not
+//  already waiting on their period), updated with smu_sub_lock held
+std::atomic<uint16_t> smu_sub_wake[NUM_CH];
+
+// Control SPI bus (PMU and inamps) and sweep state
+SemaphoreHandle_t smu_ctrl_lock;
+
+// Sample sets after a step that may hold samples converted before it
+//  (same as for a waveform update)
+#define SMU_SWEEP_SYNC_SETS SMU_WAVE_SYNC_SETS
+
+// Sweep in progress, stepped from the adc callback
+typedef struct {
+  smu_sweep_t cfg;
+  volatile bool active;
+  uint16_t point;     // Index of point being measured
+  uint32_t seq;       // Sets completed when the source was stepped
+} smu_sweep_state_t;
+
+smu_sweep_state_t smu_sweep;
+
+// In-amp of each channel (only begun on channels that have one)
+ADA4254 inamp_array[NUM_CH];
+
+// Calibration (written with smu_ctrl_lock held, read by conversions)
+smu_cal_t smu_cal[NUM_CH];
+
+// In-amp gain codes last set (0xFF = not set)
+uint8_t smu_gain_in[NUM_CH];
+uint8_t smu_gain_out[NUM_CH];
+
+// ADC rate of each smu_rate_t profile
+const ad7177_sample_rate_t smu_rate_adc[] = {
+  AD7177_1000SPS,   // RATE_FAST
+  AD7177_100SPS,    // RATE_MED
+  AD7177_20SPS,     // RATE_LINE (50 and 60Hz rejection)
+  AD7177_5SPS       // RATE_SLOW
+};
+
+// Full scale current of each smu_range_t (in A)
+const float smu_range_fs[] = {5e-6, 20e-6, 200e-6, 2e-3, 20e-3, 200e-3};
+
+// Auto-ranging (written with smu_ctrl_lock and smu_switch_mux held, the
+//  adc callback reads it under smu_switch_mux)
+smu_autorange_t smu_autorange[NUM_CH];
+uint8_t smu_autorange_low[NUM_CH];    // Sample sets below down threshold
+
+// Current clamps as set (CLLI, CLHI), before they were limited to the
+//  range, so a range change can program them again for the new range
+float smu_iclamp[NUM_CH][2];
+
+// MV auto-gain (written with smu_ctrl_lock and smu_switch_mux held, the
+//  adc callback reads it under smu_switch_mux)
+smu_autogain_t smu_autogain[NUM_CH];
+uint8_t smu_autogain_low[NUM_CH];     // Sample sets below down threshold
+
+// In-amp gains in increasing order, step = gain_in * 3 + out index
+#define SMU_GAIN_STEP_MIN (ADA4254_IX0P5 * 3)
+#define SMU_GAIN_STEP_MAX (ADA4254_IX128 * 3 + 2)
+#define SMU_ADC_CLIP      0.98F   // Fraction of ADC input range read as clipped
+
+const ada4254_gainout_t smu_gain_out_step[] = {ADA4254_OX1, ADA4254_OX1P25, ADA4254_OX1P375};
+const float smu_gain_out_mult[] = {1, 1.25F, 1.375F};
+
+// Switches asked for by the adc callback, written from the main loop by
+//  smu_switch_process (EVENT_SMU_SWITCH)
+//  - the callback doesn't write the control bus for them, it marks the
+//    switch and discards the channel's sample sets until it is written
+//  - a written switch (or range change by hand) notes the set count,
+//    sets that may hold samples converted before it and the settle sets
+//    after it are discarded too (as for a sweep step)
+#define SMU_SWITCH_RANGE     0x01
+#define SMU_SWITCH_GAIN      0x02
+#define SMU_SWITCH_ZERO      0x04     // Auto-zero input (holds MV samples only)
+#define SMU_SWITCH_SYNC_SETS SMU_WAVE_SYNC_SETS
+
+typedef struct {
+  uint8_t  pending;     // SMU_SWITCH_ bits asked for, not written yet
+  uint8_t  range_from;  // smu_range_t the range switch was asked from
+  uint8_t  range;       //  and the one it goes to
+  int8_t   gain_from;   // In-amp gain step the gain change was asked from
+  int8_t   gain;        //  and the one it goes to
+  uint8_t  zero;        // smu_az_phase_t the in-amp input goes to
+  bool     hold;        // Sets before seq are discarded
+  uint32_t seq;
+  bool     zero_hold;   // MV samples of sets before zero_seq are discarded
+  uint32_t zero_seq;
+} smu_switch_t;
+
+smu_switch_t smu_switch[NUM_CH];      // Guarded by smu_switch_mux
+portMUX_TYPE smu_switch_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// MV sample gates, MV samples are discarded unless all are open
+//  - closed while the in-amp reports a fault (fault interrupt, opened by
+//    smu_inamp_fault_process once the fault registers are clear) or runs
+//    its internal calibration
+//  - one more sample is dropped after a gate opens (it may have been
+//    converted while it was closed)
+#define SMU_GATE_OPEN    0
+#define SMU_GATE_CLOSED  1
+#define SMU_GATE_OPENING 2
+
+std::atomic<uint8_t> smu_inamp_fault[NUM_CH];
+std::atomic<uint8_t> smu_inamp_cal_gate[NUM_CH];
+
+// Board temperature (in C, NAN until measured)
+float smu_temp_c = NAN;
+
+// In-amp calibration schedule (main loop only)
+//  - a calibration not done SMU_INAMP_CAL_TIMEOUT_MS after it started is
+//    reported once, MV stays gated until the in-amp reports it done
+#define SMU_INAMP_CAL_TIMEOUT_MS 1000   // Well above the calibration itself and INAMP_CAL_MS
+
+smu_inamp_cal_t smu_inamp_cal_cfg;
+uint32_t smu_inamp_cal_ms[NUM_CH];        // Time of last calibration (0 = never)
+float    smu_inamp_cal_temp[NUM_CH];      // Temperature at last calibration
+uint32_t smu_inamp_cal_start_ms[NUM_CH];
+bool     smu_inamp_cal_busy[NUM_CH];
+bool     smu_inamp_cal_late[NUM_CH];      // Timeout reported
+bool     smu_inamp_cal_due[NUM_CH];       // Requested
+
+// MV auto-zero (config written with smu_ctrl_lock held, state is only
+//  used by the adc callback)
+#define SMU_AZ_REF 20e-3F     // Test mux reference (in V)
+
+typedef enum {
+  AZ_MEASURE,     // Input connected
+  AZ_ZERO,        // Input shorted
+  AZ_REF_P,       // Test mux +20mV
+  AZ_REF_N        // Test mux -20mV
+} smu_az_phase_t;
+
+typedef struct {
+  uint8_t  phase;       // smu_az_phase_t (input asked for)
+  uint16_t count;       // MV samples since last zero cycle
+  float    ref_p;       // +20mV sample of this cycle
+  float    offset;      // Offset at ADC input (in V)
+  float    gain;        // Measured over nominal in-amp gain
+  float    mv_gain;     // In-amp gain estimates belong to (0 = none)
+  bool     has_offset;
+  bool     has_gain;
+} smu_az_state_t;
+
+smu_autozero_t smu_autozero[NUM_CH];
+smu_az_state_t smu_az[NUM_CH];
+
+// Housekeeping readings (ratio is written by any task, the rest only by
+//  the adc callback, smu_hk is copied out under smu_hk_mux)
+#define SMU_HK_ADC_TEMP   2         // ADC channels of the readings (free
+#define SMU_HK_ADC_REF    3         //  with one SMU channel)
+#define SMU_HK_PMU_CH     0         // SMU channel whose MEASOUT is used
+#define SMU_HK_PMU_COST   5         // MEASOUT samples used by a PMU reading
+#define SMU_HK_ADC_T25    0.477F    // AD7177 temperature sensor at 25C (in V)
+#define SMU_HK_ADC_TC     1.57e-3F  // (in V/C)
+#define SMU_HK_PMU_T25    1.5F      // AD5522 thermal sensor at 25C (in V)
+#define SMU_HK_PMU_TC     4.7e-3F   // (in V/C)
+#define SMU_HK_REF_TOL    0.01F     // Reference readings further off aren't used
+#define SMU_HK_REF_FILTER 0.25F     // Weight of a new reference reading
+
+typedef enum {
+  HK_IDLE,
+  HK_PMU_MEASURE    // MEASOUT switched to the thermal sensor
+} smu_hk_phase_t;
+
+uint16_t smu_hk_ratio;
+uint32_t smu_hk_wait;       // Sample sets between this and the next reading
+uint32_t smu_hk_count;      // Sample sets since the last reading
+uint8_t  smu_hk_slot;       // Readings since the last PMU reading
+uint8_t  smu_hk_phase;      // smu_hk_phase_t
+float    smu_hk_corr;       // ADC_REF / ref, filtered (reported only)
+smu_hk_t smu_hk;
+portMUX_TYPE smu_hk_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Measurement plan (see smu_sched.h), built with smu_ctrl_lock held and
+//  handed to the adc callback through smu_plan_next, the callback takes
+//  it with the first sample set converted for it
+float smu_sched_req[NUM_CH][SMU_ADC_NUM];     // Requested rate (in Hz)
+float smu_sched_rate[NUM_CH][SMU_ADC_NUM];    // Achievable rate (in Hz)
+uint8_t smu_plan_id;
+smu_sched_plan_t smu_plan_next;               // Guarded by smu_plan_mux
+portMUX_TYPE smu_plan_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Plan being run (adc callback only)
+smu_sched_plan_t smu_plan;
+
+// MEASOUT switches of each channel (adc callback)
+//  - the callback runs behind the ADC, so a switch records the sample
+//    sets completed before and after the write, see smu_measout_at
+#define SMU_MEASOUT_HIST 4          // Switches remembered per channel
+
 typedef struct {
-  float fv;
-  float fi;
-  float mv;
-  float mi;
-  float clli;
-  float clhi;
-  float cllv;
-  float clhv;
-  smu_range_t range;
-  smu_state_t state;
-  smu_mode_t  mode;
-  smu_sense_t sense;
-  float mv_gain;
-  float mi_mult;
-} smu_control_t;
-
-volatile smu_control_t smu_control[NUM_CH];
-volatile uint16_t smu_control_updated[NUM_CH];
-volatile unsigned long smu_millis_process;
-
-ADA4254 inamp_array[4];
+  uint32_t seq0;      // Sets completed before the write
+  uint32_t seq1;      // Sets completed after it
+  uint8_t  old;       // ad5522_meas_t before (SMU_SCHED_NONE = unknown)
+  uint8_t  meas;      //  and after
+} smu_measout_rec_t;
+
+uint8_t smu_measout_cur[NUM_CH];  // Selection now (SMU_SCHED_NONE = unknown)
+smu_measout_rec_t smu_measout_hist[NUM_CH][SMU_MEASOUT_HIST];
+uint8_t smu_measout_head[NUM_CH]; // Next record
+uint8_t smu_measout_num[NUM_CH];  // Records kept
+
+// Sweep point results, MV and MI may come in different sets (adc callback)
+float smu_sweep_mv[NUM_CH];
+float smu_sweep_mi[NUM_CH];
+uint16_t smu_sweep_fields[NUM_CH];
 
 /**********************************************************
  *
@@ -64,18 +289,71 @@ ADA4254 inamp_array[4];
  *
  **********************************************************/
 
-smu_ch_t smu_int2ch(int ch) {
-  switch(ch) {
-    case 0:
-      return CH0;
-    case 1:
-      return CH1;
-    case 2:
-      return CH2;
-    case 3:
-      return CH3;
+// Start write to channel state (keep writes short, no SPI in between)
+inline void smu_write_begin(int ch) {
+  portENTER_CRITICAL(&smu_control_mux);
+  smu_control_seq[ch].fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+// Finish write to channel state and mark fields as changed
+//  - wakes the publishing task once for a subscribed field, further
+//    changes before it runs (or while the field waits on its period)
+//    don't wake it again
+inline void smu_write_end(int ch, uint16_t fields) {
+  uint16_t wake = fields & smu_sub_wake[ch].load(std::memory_order_relaxed) & ~smu_control_updated[ch];
+
+  smu_control_updated[ch] |= fields;
+  smu_control_seq[ch].fetch_add(1, std::memory_order_release);
+  portEXIT_CRITICAL(&smu_control_mux);
+
+  if (wake && task_handle(TASK_PUB)) xTaskNotifyGive(task_handle(TASK_PUB));
+}
+
+// Recompute fields of channel that wake the publishing task
+//  - call with smu_sub_lock held
+void smu_sub_update_wake(int ch) {
+  uint16_t wake = 0;
+
+  for (int c = 0; c < WS_CLIENT_MAX; c++) {
+    wake |= smu_sub[c][ch].fields & ~smu_sub[c][ch].dirty;
+  }
+  smu_sub_wake[ch].store(wake, std::memory_order_relaxed);
+}
+
+// Wake publishing task (new subscription or resend)
+void smu_process_notify() {
+  if (task_handle(TASK_PUB)) xTaskNotifyGive(task_handle(TASK_PUB));
+}
+
+// Get pointer to analog field of channel state
+float *smu_field_ptr(smu_control_t *control, int field) {
+  switch (field) {
+    case FIELD_FV:   return &control->fv;
+    case FIELD_FI:   return &control->fi;
+    case FIELD_MV:   return &control->mv;
+    case FIELD_MI:   return &control->mi;
+    case FIELD_CLLI: return &control->clli;
+    case FIELD_CLHI: return &control->clhi;
+    case FIELD_CLLV: return &control->cllv;
+    case FIELD_CLHV: return &control->clhv;
   }
-  return CH0;
+  return NULL;
+}
+
+// Write one analog field of channel state
+void smu_write_float(int ch, int field, float val) {
+  float *ptr = smu_field_ptr(&smu_control[ch], field);
+  if (ptr == NULL) return;
+
+  smu_write_begin(ch);
+  *ptr = val;
+  smu_write_end(ch, (1 << field));
+}
+
+smu_ch_t smu_int2ch(int ch) {
+  if (ch < 0 || ch >= NUM_CH) return CH0;
+  return (smu_ch_t) ch;
 }
 
 // Calibrate DAC
@@ -138,10 +416,15 @@ void smu_dac_v2d(smu_ch_t ch, smu_dac_t dac, smu_range_t range, float *val, uint
     *val = 0.25F/rsense;
   }
   // Prevent V-clamps from being programmed <500mV apart
-  if ((dac == DAC_CLLV) && (smu_control[ch].clhv - (*val) < 0.5F)) {
-    *val = smu_control[ch].clhv - 0.5F;
-  } else if ((dac == DAC_CLHV) && ((*val) - smu_control[ch].cllv < 0.5F)) {
-    *val = smu_control[ch].cllv + 0.5F;
+  if (dac == DAC_CLLV || dac == DAC_CLHV) {
+    smu_control_t control;
+    smu_get_control(ch, &control);
+
+    if ((dac == DAC_CLLV) && (control.clhv - (*val) < 0.5F)) {
+      *val = control.clhv - 0.5F;
+    } else if ((dac == DAC_CLHV) && ((*val) - control.cllv < 0.5F)) {
+      *val = control.cllv + 0.5F;
+    }
   }
 
   // Allow 12.5% over on clamps
@@ -162,8 +445,8 @@ void smu_dac_v2d(smu_ch_t ch, smu_dac_t dac, smu_range_t range, float *val, uint
     *val = val_min;
   }
 
-  //TODO calibrate DAC value
-  val_cal = *val;
+  // Calibrate DAC value
+  val_cal = (*val) * smu_cal[ch].dac_gain[dac] + smu_cal[ch].dac_offset[dac];
 
 
   if (is_idac) {
@@ -177,11 +460,16 @@ void smu_dac_v2d(smu_ch_t ch, smu_dac_t dac, smu_range_t range, float *val, uint
   *code = (uint16_t) std::min(std::max(roundf(codef), 0.0f), 65535.0f);
 }
 
+// Voltage at ADC input
+float smu_adc_volts(uint32_t code) {
+  return 2 * ADC_REF * (((float) code / ADC_RES) - 0.5F);
+}
+
 float smu_adc_d2v(smu_ch_t ch, smu_adc_t adc, smu_range_t range, uint32_t code) {
   float val;
   float rsense;
 
-  val = 2 * ADC_REF * (((float) code / ADC_RES) - 0.5F);
+  val = smu_adc_volts(code);
 
   if (adc == ADC_MI){
     switch (range) {
@@ -205,9 +493,581 @@ float smu_adc_d2v(smu_ch_t ch, smu_adc_t adc, smu_range_t range, uint32_t code)
         break;
     }
     val = (val - (0.45 * 5))/(0.2*10*rsense);
+  } else if (smu_sched_src(ch, adc).path == SMU_PATH_MEASOUT) {
+    // VSENSE on MEASOUT (attenuated like MI)
+    val = (val - (0.45 * 5))/0.2;
+  }
+
+  return val * smu_cal[ch].adc_gain[adc] + smu_cal[ch].adc_offset[adc];
+}
+
+// Source value of sweep point
+float smu_sweep_value(uint16_t point) {
+  if (smu_sweep.cfg.points < 2) return smu_sweep.cfg.start;
+  return smu_sweep.cfg.start + (smu_sweep.cfg.stop - smu_sweep.cfg.start) * point / (smu_sweep.cfg.points - 1);
+}
+
+// Set source of sweep point and note the set count (smu_ctrl_lock held)
+void smu_sweep_step() {
+  smu_set_dac(smu_sweep.cfg.ch, smu_sweep.cfg.dac, smu_sweep_value(smu_sweep.point));
+  smu_sweep.seq = ad7177_set_seq();
+}
+
+// Check if sample set seq of channel ch was converted after the source
+//  settled (sets that may hold samples from before the step, and the
+//  settle sets after it, don't count)
+bool smu_sweep_settled(int ch, uint32_t seq) {
+  if (!smu_sweep.active || smu_sweep.cfg.ch != ch) return false;
+  return (int32_t) (seq - smu_sweep.seq) >= SMU_SWEEP_SYNC_SETS + smu_sweep.cfg.settle;
+}
+
+// Record sweep point and step to the next one (called from adc callback
+//  with the sample set holding the later of MV and MI)
+//  - result is sent as never-drop message, if clients can't take it the
+//    point is measured again on the next sample set (no step)
+void smu_sweep_next(int ch, uint32_t seq, float mv, float mi) {
+  char str[160];
+
+  if (!smu_sweep.active) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  if (!smu_sweep_settled(ch, seq)) {
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+    return;
+  }
+
+  snprintf(str, sizeof(str), "{\"type\":\"sweep\",\"ch\":%d,\"i\":%u,\"n\":%u,\"src\":%e,\"mv\":%e,\"mi\":%e}",
+      ch, smu_sweep.point, smu_sweep.cfg.points, smu_sweep_value(smu_sweep.point), mv, mi);
+  if (!smu_sweep.cfg.quiet && !ws_queue_broadcast(str, WS_MSG_RESULT)) {
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+    return;
+  }
+
+  if (++smu_sweep.point >= smu_sweep.cfg.points) {
+    smu_sweep.active = false;
+    LOG_I(SMU, "ch%d sweep done (%u points)", ch, smu_sweep.cfg.points);
+  } else {
+    smu_sweep_step();
+  }
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// Discard sample sets of channel until settle sets after those converting
+//  now (call once a range or gain change is written)
+void smu_switch_settle(int ch, uint8_t settle) {
+  uint32_t seq = ad7177_set_seq() + SMU_SWITCH_SYNC_SETS + settle;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  if (!smu_switch[ch].hold || (int32_t) (seq - smu_switch[ch].seq) > 0) smu_switch[ch].seq = seq;
+  smu_switch[ch].hold = true;
+  portEXIT_CRITICAL(&smu_switch_mux);
+}
+
+// Sample set seq of channel is discarded, a switch is pending or settles
+//  (adc callback)
+bool smu_switch_held(int ch, uint32_t seq) {
+  smu_switch_t *sw = &smu_switch[ch];
+  bool held;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  if (sw->hold && (int32_t) (seq - sw->seq) >= 0) sw->hold = false;
+  held = sw->hold || (sw->pending & (SMU_SWITCH_RANGE | SMU_SWITCH_GAIN));
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  return held;
+}
+
+// MV sample of set seq is discarded, an auto-zero input is pending or
+//  settles (adc callback)
+bool smu_switch_zero_held(int ch, uint32_t seq) {
+  smu_switch_t *sw = &smu_switch[ch];
+  bool held;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  if (sw->zero_hold && (int32_t) (seq - sw->zero_seq) >= 0) sw->zero_hold = false;
+  held = sw->zero_hold || (sw->pending & SMU_SWITCH_ZERO);
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  return held;
+}
+
+// Switch of channel is asked for and not written yet
+bool smu_switch_pending(int ch, uint8_t bit) {
+  bool pending;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  pending = smu_switch[ch].pending & bit;
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  return pending;
+}
+
+// Hand switch to the main loop (adc callback, bit already marked)
+//  - if the event can't be posted the mark is dropped, the callback asks
+//    again with a later sample
+bool smu_switch_post(int ch, uint8_t bit) {
+  if (event_post(EVENT_SMU_SWITCH, ch)) return true;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_switch[ch].pending &= ~bit;
+  portEXIT_CRITICAL(&smu_switch_mux);
+  return false;
+}
+
+// Ask for a range switch if |mi| left the auto-ranging window (called
+//  from adc callback once mi is stored)
+//  - smu_switch_process writes it with smu_set_range, which programs the
+//    clamps for the new range in its glitch-free order
+//  - returns true if a switch was asked for, the channel's sample sets
+//    are discarded until it is written and settled
+bool smu_autorange_check(int ch, const smu_control_t *control, float mi) {
+  const smu_autorange_t *ar = &smu_autorange[ch];
+  int range, target;
+  float val = fabsf(mi);
+
+  if (control->mode != FV || control->state != ENABLE) return false;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  if (!ar->enable) {
+    portEXIT_CRITICAL(&smu_switch_mux);
+    return false;
+  }
+
+  range = target = control->range;
+  if (val > ar->up * smu_range_fs[range]) {
+    smu_autorange_low[ch] = 0;
+    target = range + 1;
+  } else if (range > ar->min && val < ar->down * smu_range_fs[range - 1]) {
+    if (++smu_autorange_low[ch] >= ar->hold) {
+      smu_autorange_low[ch] = 0;
+      while (target > ar->min && val < ar->down * smu_range_fs[target - 1]) target--;
+    }
+  } else {
+    smu_autorange_low[ch] = 0;
+  }
+  target = std::min(std::max(target, (int) ar->min), (int) ar->max);
+
+  if (target != range) {
+    smu_switch[ch].pending   |= SMU_SWITCH_RANGE;
+    smu_switch[ch].range_from = range;
+    smu_switch[ch].range      = target;
+  }
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  if (target == range || !smu_switch_post(ch, SMU_SWITCH_RANGE)) return false;
+
+  LOG_D(SMU, "ch%d autorange %d to %d", ch, range, target);
+  return true;
+}
+
+// Gain of in-amp gain step
+float smu_gain_step_gain(int step) {
+  return ldexpf(1.0F, step / 3 - 4) * smu_gain_out_mult[step % 3];
+}
+
+// Gain step of channel, -1 if gain isn't set
+int smu_gain_step(int ch) {
+  for (int o = 0; o < 3; o++) {
+    if (smu_gain_in[ch] != 0xFF && smu_gain_out[ch] == smu_gain_out_step[o]) return smu_gain_in[ch] * 3 + o;
+  }
+  return -1;
+}
+
+// Gain step of in-amp gain, -1 if it isn't one
+int smu_gain_step_find(float gain) {
+  for (int s = SMU_GAIN_STEP_MIN; s <= SMU_GAIN_STEP_MAX; s++) {
+    if (smu_gain_step_gain(s) == gain) return s;
+  }
+  return -1;
+}
+
+// Set in-amp gain and the MV scale together
+//  - call with smu_ctrl_lock held
+bool smu_set_gain(smu_ch_t ch, ada4254_gainin_t in, ada4254_gainout_t out) {
+  float gain;
+
+  // MV of a channel without in-amp is on MEASOUT
+  if (!board_has_inamp(ch)) return true;
+
+  gain = inamp_array[ch].set_gain(in, out);
+
+  // Failed write leaves the in-amp at its previous gain, which is the
+  //  gain mv is already scaled with
+  if (gain < 0) {
+    LOG_W(SMU, "ch%d in-amp gain not set", ch);
+    return false;
+  }
+
+  smu_gain_in[ch]  = in;
+  smu_gain_out[ch] = out;
+  smu_write_begin(ch);
+  smu_control[ch].mv_gain = gain;
+  smu_write_end(ch, 0);
+
+  return true;
+}
+
+// Ask for an in-amp gain change if MV left the auto-gain window (called
+//  from adc callback once mv is stored)
+//  - smu_switch_process writes it with smu_set_gain, mv_gain changes
+//    with the gain and the sample sets converted while the in-amp
+//    settles are discarded, so no mv is scaled with the wrong gain
+//  - the step is taken from the mv_gain mv was scaled with
+//  - returns true if a change was asked for
+bool smu_autogain_check(int ch, const smu_control_t *control, float mv) {
+  const smu_autogain_t *ag = &smu_autogain[ch];
+  int step, target;
+  float val = fabsf(mv);
+  float out = val * control->mv_gain;   // In-amp output (ADC input)
+
+  step = target = smu_gain_step_find(control->mv_gain);
+  if (step < 0) return false;
+
+  portENTER_CRITICAL(&smu_switch_mux);
+  if (!ag->enable) {
+    portEXIT_CRITICAL(&smu_switch_mux);
+    return false;
+  }
+
+  if (out > ag->up * ADC_REF) {
+    smu_autogain_low[ch] = 0;
+    target = SMU_GAIN_STEP_MIN;
+    if (out < SMU_ADC_CLIP * ADC_REF) {
+      for (int s = step - 1; s > SMU_GAIN_STEP_MIN; s--) {
+        if (val * smu_gain_step_gain(s) < ag->down * ADC_REF) {
+          target = s;
+          break;
+        }
+      }
+    }
+  } else if (step < SMU_GAIN_STEP_MAX && val * smu_gain_step_gain(step + 1) < ag->down * ADC_REF) {
+    if (++smu_autogain_low[ch] >= ag->hold) {
+      smu_autogain_low[ch] = 0;
+      while (target < SMU_GAIN_STEP_MAX && val * smu_gain_step_gain(target + 1) < ag->down * ADC_REF) target++;
+    }
+  } else {
+    smu_autogain_low[ch] = 0;
+  }
+  target = std::min(std::max(target, SMU_GAIN_STEP_MIN), SMU_GAIN_STEP_MAX);
+
+  if (target != step) {
+    smu_switch[ch].pending  |= SMU_SWITCH_GAIN;
+    smu_switch[ch].gain_from = step;
+    smu_switch[ch].gain      = target;
+  }
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  if (target == step || !smu_switch_post(ch, SMU_SWITCH_GAIN)) return false;
+
+  LOG_D(SMU, "ch%d autogain %f", ch, smu_gain_step_gain(target));
+  return true;
+}
+
+// In-amp fault line went high (arg is the channel)
+void IRAM_ATTR smu_inamp_fault_isr(void *arg) {
+  int ch = (int) (intptr_t) arg;
+
+  if (ch >= NUM_CH) return;
+  smu_inamp_fault[ch].store(SMU_GATE_CLOSED);
+  event_post_isr(EVENT_INAMP_FAULT, ch);
+}
+
+// Switch in-amp input for auto-zero phase (smu_switch_process,
+//  smu_ctrl_lock held)
+//  - MV samples are held for the settle sets after the write
+void smu_autozero_input(int ch, smu_az_phase_t phase) {
+  uint32_t seq;
+
+  switch (phase) {
+    case AZ_MEASURE:
+      inamp_array[ch].set_tmux(ADA4254_AVSS, ADA4254_AVSS);
+      inamp_array[ch].set_switch(ADA4254_IN1, ADA4254_IN1);
+      break;
+    case AZ_ZERO:
+      inamp_array[ch].set_switch(ADA4254_SHORT, ADA4254_SHORT);
+      break;
+    case AZ_REF_P:
+      inamp_array[ch].set_tmux(ADA4254_P20M, ADA4254_AVSS);
+      inamp_array[ch].set_switch(ADA4254_INT, ADA4254_INT);
+      break;
+    case AZ_REF_N:
+      inamp_array[ch].set_tmux(ADA4254_N20M, ADA4254_AVSS);
+      break;
+  }
+
+  seq = ad7177_set_seq() + SMU_SWITCH_SYNC_SETS + smu_autozero[ch].settle;
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_switch[ch].zero_seq  = seq;
+  smu_switch[ch].zero_hold = true;
+  portEXIT_CRITICAL(&smu_switch_mux);
+}
+
+// Ask for the in-amp input of auto-zero phase (adc callback)
+//  - smu_switch_process writes it, MV samples are discarded as auto-zero
+//    samples until it is written and settled
+//  - returns false if it can't be handed over, the phase stays
+bool smu_autozero_switch(int ch, smu_az_phase_t phase) {
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_switch[ch].pending |= SMU_SWITCH_ZERO;
+  smu_switch[ch].zero     = phase;
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  if (!smu_switch_post(ch, SMU_SWITCH_ZERO)) return false;
+  smu_az[ch].phase = phase;
+  return true;
+}
+
+// Running average of auto-zero estimate
+void smu_autozero_filter(float *est, bool *has, float val, float filter) {
+  *est = *has ? *est + filter * (val - *est) : val;
+  *has = true;
+}
+
+// Step auto-zero with an MV sample of set seq (in V at the ADC input,
+//  called from adc callback)
+//  - returns true if the sample belongs to auto-zero (not a measurement)
+bool smu_autozero_sample(int ch, uint32_t seq, const smu_control_t *control, float raw) {
+  smu_az_state_t *az = &smu_az[ch];
+  smu_autozero_t *cfg = &smu_autozero[ch];
+
+  if (smu_switch_zero_held(ch, seq)) return true;
+
+  // Estimates of another gain don't apply
+  if (az->mv_gain != control->mv_gain) {
+    az->mv_gain    = control->mv_gain;
+    az->offset     = 0;
+    az->gain       = 1;
+    az->has_offset = false;
+    az->has_gain   = false;
+  }
+
+  switch (az->phase) {
+    case AZ_MEASURE:
+      if (!cfg->enable || ++az->count < cfg->ratio) return false;
+      az->count = 0;
+      smu_autozero_switch(ch, AZ_ZERO);
+      return false;
+
+    case AZ_ZERO:
+      smu_autozero_filter(&az->offset, &az->has_offset, raw, cfg->filter);
+      smu_autozero_switch(ch, cfg->ref ? AZ_REF_P : AZ_MEASURE);
+      break;
+
+    case AZ_REF_P:
+      az->ref_p = raw;
+      smu_autozero_switch(ch, AZ_REF_N);
+      break;
+
+    case AZ_REF_N: {
+      float gain = (az->ref_p - raw) / (2 * SMU_AZ_REF * control->mv_gain);
+
+      // Reference out of range (clipped or gain being changed)
+      if (gain > 0.5F && gain < 1.5F) {
+        smu_autozero_filter(&az->gain, &az->has_gain, gain, cfg->filter);
+      }
+      smu_autozero_switch(ch, AZ_MEASURE);
+      LOG_D(SMU, "ch%d autozero offset %e, gain %f", ch, az->offset, az->gain);
+      break;
+    }
+  }
+  return true;
+}
+
+// MV of sample (in V at the ADC input) with auto-zero estimates applied
+float smu_autozero_apply(int ch, const smu_control_t *control, float raw) {
+  smu_az_state_t *az = &smu_az[ch];
+
+  if (!smu_autozero[ch].enable || az->mv_gain != control->mv_gain) return raw / control->mv_gain;
+  return (raw - az->offset) / (control->mv_gain * az->gain);
+}
+
+// Sample gate is open (a gate that is opening drops this sample)
+bool smu_gate_open(std::atomic<uint8_t> *gate) {
+  uint8_t state = SMU_GATE_OPENING;
+
+  if (gate->compare_exchange_strong(state, SMU_GATE_OPEN)) return false;
+  return state == SMU_GATE_OPEN;
+}
+
+// MV sample of channel is valid (called from adc callback)
+bool smu_mv_valid(int ch) {
+  bool fault = smu_gate_open(&smu_inamp_fault[ch]);
+  bool cal   = smu_gate_open(&smu_inamp_cal_gate[ch]);
+
+  return fault && cal;
+}
+
+// Switch MEASOUT of channel (adc callback)
+//  - one write without read-back (ad5522_write_meas), the callback
+//    doesn't wait on control work: if the control bus is taken the switch
+//    is skipped and the selection stays as it was, smu_sched_step tries
+//    again before the next set
+//  - a failed write leaves the selection unknown until the next switch
+bool smu_measout_set(int ch, uint8_t meas) {
+  smu_measout_rec_t *rec = &smu_measout_hist[ch][smu_measout_head[ch]];
+  bool ok;
+
+  if (xSemaphoreTakeRecursive(smu_ctrl_lock, 0) != pdTRUE) return false;
+  rec->old  = smu_measout_cur[ch];
+  rec->seq0 = ad7177_set_seq();
+  ok = ad5522_write_meas(smu2ad5522_ch(smu_int2ch(ch)), (ad5522_meas_t) meas);
+  rec->seq1 = ad7177_set_seq();
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+  rec->meas = ok ? meas : SMU_SCHED_NONE;
+
+  smu_measout_cur[ch]  = rec->meas;
+  smu_measout_head[ch] = (smu_measout_head[ch] + 1) % SMU_MEASOUT_HIST;
+  if (smu_measout_num[ch] < SMU_MEASOUT_HIST) smu_measout_num[ch]++;
+
+  if (!ok) LOG_W(PMU, "ch%d measout select %d failed", ch, meas);
+  return ok;
+}
+
+// Switch MEASOUT of channel for the plan (SMU_SCHED_NONE = keep it)
+void smu_measout_plan(int ch, uint8_t meas) {
+  if (meas == SMU_SCHED_NONE || meas == smu_measout_cur[ch]) return;
+  smu_measout_set(ch, meas);
+}
+
+// MEASOUT selection a sample set of channel was converted with
+//  - sets completed before a switch started have the old selection, sets
+//    started after it ended the new one, those in between may have either
+//    and SMU_SCHED_NONE is returned for them
+//  - the ADC runs up to one conversion ahead of the set count, so set
+//    seq1 + 2 may have started before the write ended (seq1 + 3 on is new)
+//  - sets older than the switches remembered are SMU_SCHED_NONE too
+uint8_t smu_measout_at(int ch, uint32_t seq) {
+  const smu_measout_rec_t *rec = NULL;
+
+  for (int k = 1; k <= smu_measout_num[ch]; k++) {
+    rec = &smu_measout_hist[ch][(smu_measout_head[ch] + SMU_MEASOUT_HIST - k) % SMU_MEASOUT_HIST];
+    if ((int32_t) (seq - rec->seq1) >= 3) return rec->meas;
+    if ((int32_t) (seq - rec->seq0) > 0) return SMU_SCHED_NONE;
+  }
+  if (rec == NULL) return smu_measout_cur[ch];
+  return (smu_measout_num[ch] < SMU_MEASOUT_HIST) ? rec->old : SMU_SCHED_NONE;
+}
+
+// Take plan the set belongs to (adc callback)
+//  - a new plan starts with each channel's MEASOUT on its first use (and
+//    ends a PMU temperature reading)
+//  - returns false for sets of a plan that is already replaced
+bool smu_sched_take(const ad7177_set_t *set) {
+  bool ok;
+
+  if (set->id == smu_plan.id) return true;
+
+  portENTER_CRITICAL(&smu_plan_mux);
+  ok = (set->id == smu_plan_next.id);
+  if (ok) memcpy(&smu_plan, &smu_plan_next, sizeof(smu_sched_plan_t));
+  portEXIT_CRITICAL(&smu_plan_mux);
+  if (!ok) return false;
+
+  smu_hk_phase = HK_IDLE;
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_measout_plan(i, smu_plan.meas_init[i]);
+    smu_sweep_fields[i] = 0;
+  }
+  return true;
+}
+
+// Switch MEASOUT for the plan (adc callback, before and after the set)
+//  - after the last set of a frame, for the frames that follow (the next
+//    one is converting by then, the plan only uses a channel there if it
+//    has the sets to spare)
+//  - before a set, to the frame's own selection if that didn't happen
+//    (last set of the frame missed, failed write, end of a PMU
+//    temperature reading)
+void smu_sched_step(const ad7177_set_t *set, bool before) {
+  const smu_sched_frame_t *frame = &smu_plan.frame[set->frame];
+
+  if (before) {
+    for (int i = 0; i < NUM_CH; i++) {
+      if (i == SMU_HK_PMU_CH && smu_hk_phase != HK_IDLE) continue;
+      smu_measout_plan(i, frame->use[i]);
+    }
+    return;
+  }
+
+  if (smu_plan.num < 2 || set->rep + 1 < frame->repeat) return;
+  for (int i = 0; i < NUM_CH; i++) smu_measout_plan(i, frame->meas_next[i]);
+}
+
+// Start the next housekeeping reading once it is due (adc callback, once
+//  per sample set)
+//  - ADC readings are requested from the driver and come with a later set
+//  - a PMU reading waits SMU_HK_PMU_COST times as long for the next one,
+//    so the MI samples it uses stay within the ratio
+void smu_hk_schedule() {
+  uint16_t ratio = smu_hk_ratio;
+
+  if (ratio == 0 || smu_hk_phase != HK_IDLE) return;
+  if (++smu_hk_count < smu_hk_wait) return;
+  smu_hk_count = 0;
+
+  // PMU reading needs a MEASOUT sample of the channel in every set
+  if (++smu_hk_slot >= SMU_HK_PMU_EVERY && smu_plan.num == 1
+      && smu_plan.frame[0].use[SMU_HK_PMU_CH] != SMU_SCHED_NONE
+      && smu_measout_set(SMU_HK_PMU_CH, AD5522_MEAS_THERM)) {
+    smu_hk_slot  = 0;
+    smu_hk_phase = HK_PMU_MEASURE;
+    smu_hk_wait  = (uint32_t) ratio * SMU_HK_PMU_COST;
+  } else {
+    ad7177_aux_once((1 << SMU_HK_ADC_TEMP) | (1 << SMU_HK_ADC_REF));
+    smu_hk_wait = ratio;
+  }
+}
+
+// ADC die temperature and reference readings that came with a set
+//  - the reference is measured against itself, so it reads full scale
+//    at unity ADC gain (a gain above one clips, only a low gain is seen)
+//  - a reading that can't see a high gain can't trim the gain either,
+//    the correction is reported as a health check and not applied
+void smu_hk_adc(const uint32_t *results, uint16_t valid) {
+  float ref  = NAN;
+  float temp = NAN;
+  bool ok = true;
+
+  if ((valid >> SMU_HK_ADC_REF) & 1) {
+    ref = 2 * ADC_REF * (((float) results[SMU_HK_ADC_REF] / ADC_RES) - 0.5F);
+    ok  = fabsf(ref / ADC_REF - 1) <= SMU_HK_REF_TOL;
+    if (ok) smu_hk_corr += SMU_HK_REF_FILTER * (ADC_REF / ref - smu_hk_corr);
+  }
+  if ((valid >> SMU_HK_ADC_TEMP) & 1) {
+    temp = (smu_adc_volts(results[SMU_HK_ADC_TEMP]) - SMU_HK_ADC_T25) / SMU_HK_ADC_TC + 25;
+    smu_temp_c = temp;
+  }
+
+  portENTER_CRITICAL(&smu_hk_mux);
+  if (!isnan(ref)) {
+    smu_hk.ref      = ref;
+    smu_hk.ref_ok   = ok;
+    smu_hk.ref_corr = smu_hk_corr;
   }
+  if (!isnan(temp)) smu_hk.adc_temp = temp;
+  smu_hk.ms = millis();
+  portEXIT_CRITICAL(&smu_hk_mux);
+
+  event_post(EVENT_HOUSEKEEPING);
+}
+
+// PMU temperature from a MEASOUT sample of the housekeeping channel
+//  converted with the thermal sensor selected
+//  - returns true if it ended a reading (MEASOUT goes back to the plan)
+bool smu_hk_pmu_sample(uint32_t code) {
+  float temp;
 
-  return val;
+  if (smu_hk_phase != HK_PMU_MEASURE) return false;
+  temp = (smu_adc_volts(code) - SMU_HK_PMU_T25) / SMU_HK_PMU_TC + 25;
+
+  portENTER_CRITICAL(&smu_hk_mux);
+  smu_hk.pmu_temp = temp;
+  smu_hk.ms = millis();
+  portEXIT_CRITICAL(&smu_hk_mux);
+
+  event_post(EVENT_HOUSEKEEPING);
+  smu_hk_phase = HK_IDLE;
+  return true;
 }
 
 // TODO Setup ADC callback
@@ -215,56 +1075,129 @@ float smu_adc_d2v(smu_ch_t ch, smu_adc_t adc, smu_range_t range, uint32_t code)
 //  - update mv/mi in smu_control
 //  - log temperature?
 //  - initiate next update/step during sweep
-void adc_callback(uint32_t *results, uint16_t valid) {
-  for (int k = 0; k < NUM_CH*2; k++){
-    if ((valid >> k) & 1) {
-      if (k % 2 == 0) {
-        smu_control[k/2].mv = smu_adc_d2v(smu_int2ch(k/2), ADC_MV, smu_control[k/2].range, results[k])/smu_control[k/2].mv_gain;
-        smu_control_updated[k/2] |= (1 << FIELD_MV);
-      } else {
-        smu_control[k/2].mi = smu_adc_d2v(smu_int2ch(k/2), ADC_MI, smu_control[k/2].range, results[k]);
-        //smu_control[k/2].mi = smu_adc_d2v(smu_int2ch(k/2), ADC_MV, smu_control[k/2].range, results[k]);
-        smu_control_updated[k/2] |= (1 << FIELD_MI);
+void adc_callback(uint32_t *results, uint16_t valid, const ad7177_set_t *set) {
+  static bool first = true;
+  uint32_t code[NUM_CH][SMU_ADC_NUM];
+  uint8_t have[NUM_CH];
+  const smu_sched_frame_t *frame;
+
+  // Time to first measurement
+  if (first) {
+    first = false;
+    boot_mark("adc_first");
+  }
+
+  // Housekeeping readings that came with this set
+  if (valid & ((1 << SMU_HK_ADC_TEMP) | (1 << SMU_HK_ADC_REF))) smu_hk_adc(results, valid);
+
+  // Sort results of the frame by channel and quantity
+  if (!smu_sched_take(set)) return;
+  smu_sched_step(set, true);
+  frame = &smu_plan.frame[set->frame];
+
+  memset(have, 0, sizeof(have));
+  for (int s = 0; s < frame->num; s++) {
+    int ch = frame->ch[s];
+    int q  = frame->adc[s];
+
+    if (!((valid >> s) & 1)) continue;
+
+    //  (MEASOUT samples are only kept if converted with the selection of
+    //  the quantity, a thermal sensor one may be a PMU temperature)
+    if (smu_sched_src(ch, q).path == SMU_PATH_MEASOUT) {
+      uint8_t meas = smu_measout_at(ch, set->seq);
+
+      if (meas == AD5522_MEAS_THERM && ch == SMU_HK_PMU_CH && smu_hk_pmu_sample(results[s])) {
+        smu_measout_plan(ch, frame->use[ch]);
+      }
+      if (meas != smu_sched_src(ch, q).meas) continue;
+    }
+
+    code[ch][q] = results[s];
+    have[ch] |= (1 << q);
+  }
+
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_control_t control;
+    float mv = 0, mi = 0;
+    uint16_t fields = 0;
+    bool switched = false;
+    bool inamp = board_has_inamp(i);
+
+    if (have[i] == 0) continue;
+
+    // Discard sample sets converted while a new range or gain is asked
+    //  for or settles
+    if (smu_switch_held(i, set->seq)) continue;
+
+    // Convert with a consistent range/gain, then store both results at once
+    //  (MV isn't stored while the in-amp reports a fault)
+    smu_get_control(smu_int2ch(i), &control);
+    //  (MV samples of an auto-zero cycle aren't stored either)
+    if (((have[i] >> ADC_MV) & 1) && (!inamp || smu_mv_valid(i))) {
+      float raw = smu_adc_d2v(smu_int2ch(i), ADC_MV, control.range, code[i][ADC_MV]);
+
+      if (!inamp) {
+        mv = raw;
+        fields |= (1 << FIELD_MV);
+      } else if (!smu_autozero_sample(i, set->seq, &control, raw)) {
+        mv = smu_autozero_apply(i, &control, raw);
+        fields |= (1 << FIELD_MV);
       }
     }
+    if ((have[i] >> ADC_MI) & 1) {
+      mi = smu_adc_d2v(smu_int2ch(i), ADC_MI, control.range, code[i][ADC_MI]);
+      fields |= (1 << FIELD_MI);
+    }
+
+    smu_write_begin(i);
+    if (fields & (1 << FIELD_MV)) smu_control[i].mv = mv;
+    if (fields & (1 << FIELD_MI)) smu_control[i].mi = mi;
+    smu_write_end(i, fields);
+
+    if ((fields & (1 << FIELD_MV)) && inamp) switched |= smu_autogain_check(i, &control, mv);
+    if (fields & (1 << FIELD_MI)) switched |= smu_autorange_check(i, &control, mi);
+
+    // Step sweep once both measurements of the point are in (they may
+    //  come from different frames, and the point is measured again after
+    //  a range switch or when a set from before the source settled
+    //  comes in)
+    if (fields & (1 << FIELD_MV)) smu_sweep_mv[i] = mv;
+    if (fields & (1 << FIELD_MI)) smu_sweep_mi[i] = mi;
+    if (switched || !smu_sweep_settled(i, set->seq)) smu_sweep_fields[i] = 0;
+    else smu_sweep_fields[i] |= fields;
+    uint8_t have_adc = ((fields >> FIELD_MV) & 1) << ADC_MV | ((fields >> FIELD_MI) & 1) << ADC_MI;
+    smu_wave_sample(i, set->seq, have_adc, mv, mi);
+    smu_pulse_sample(i, set->seq, have_adc, mv, mi);
+    smu_trig_sample(i, set->seq, have_adc, mv, mi);
+    if (smu_sweep_fields[i] == ((1 << FIELD_MV) | (1 << FIELD_MI))) {
+      smu_sweep_fields[i] = 0;
+      smu_sweep_next(i, set->seq, smu_sweep_mv[i], smu_sweep_mi[i]);
+    }
   }
-  //TODO initiate next update during sweep
+
+  smu_sched_step(set, false);
+  smu_hk_schedule();
 }
 
 ad5522_ch_t smu2ad5522_ch(smu_ch_t ch) {
-  switch (ch) {
-    case CH0:
-      return AD5522_CH0;
-      break;
-    case CH1:
-      return AD5522_CH1;
-      break;
-    case CH2:
-      return AD5522_CH2;
-      break;
-    case CH3:
-      return AD5522_CH3;
-      break;
-  }
-  return AD5522_CH0;
+  return (ad5522_ch_t) (board_ch[ch].pmu * 4 + board_ch[ch].pmu_ch);
 }
 
 
 // TODO Setup timeout for ADC meas after smu setting change
-//  - gate ADC samples until X time after smu setting change
+//  - gate ADC samples until X time after smu setting change (only done
+//    for range and gain switches, see smu_switch_settle)
 //  - different default times based on range
 //  - allow user setting?
 
 
 
 
-// TODO Setup sweep function
-//  - set start, step, stop, lin/log
+// TODO Extend sweep function
+//  - log steps
 //  - allow logging only certain channels to speed up sweep
 //  - allow sweeping all ch together
-//  - allow sweeping one one ch while holding others constant
-//  - adc callback initiates next sweep point
-//
 
 /**********************************************************
  *
@@ -272,8 +1205,43 @@ ad5522_ch_t smu2ad5522_ch(smu_ch_t ch) {
  *
  **********************************************************/
 
-void smu_init(){
+// Get consistent copy of channel state without locking
+//  - returns version, which changes whenever the state is written
+uint32_t smu_get_control(smu_ch_t ch, smu_control_t *control) {
+  uint32_t seq0, seq1;
+
+  do {
+    seq0 = smu_control_seq[ch].load(std::memory_order_acquire);
+    memcpy(control, &smu_control[ch], sizeof(smu_control_t));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    seq1 = smu_control_seq[ch].load(std::memory_order_relaxed);
+  } while ((seq0 & 1) || seq0 != seq1);
+
+  return seq0;
+}
+
+// Get channel state version without copying the state
+uint32_t smu_control_version(smu_ch_t ch) {
+  return smu_control_seq[ch].load(std::memory_order_acquire) & ~1UL;
+}
+
+void smu_write_dac(smu_ch_t ch, smu_dac_t dac, float val, bool skip_same);
+void smu_set_adc_rate(ad7177_sample_rate_t rate);
+bool smu_sched_apply();
+
+// Initialize hardware and restore config (defaults if NULL)
+//  - channel state starts out as the PMU after reset (HiZ, FV, 2mA),
+//    the config is then programmed in one batched pass
+void smu_init(const smu_config_t *config){
+  smu_config_t config_default;
+
+  if (config == NULL) {
+    smu_default_config(&config_default);
+    config = &config_default;
+  }
+
   for(int i = 0; i < NUM_CH; i++) {
+    smu_write_begin(i);
     smu_control[i].range = RANGE_2MA;
     smu_control[i].state = DISABLE;
     smu_control[i].mode  = FV;
@@ -282,41 +1250,115 @@ void smu_init(){
     smu_control[i].fi = 0;
     smu_control[i].mv = 0;
     smu_control[i].mi = 0;
-    smu_control[i].clli = -2.25e-3;
-    smu_control[i].clhi =  2.25e-3;
-    smu_control[i].cllv = -11.25;
-    smu_control[i].clhv =  11.25;
+    smu_control[i].clli = 0;
+    smu_control[i].clhi = 0;
+    smu_control[i].cllv = 0;
+    smu_control[i].clhv = 0;
     smu_control[i].mv_gain =  1;
     smu_control[i].mi_mult =  1e3;
+    smu_write_end(i, SMU_FIELD_ALL);
+
+    smu_cal[i] = config->cal[i];
+    smu_gain_in[i]  = 0xFF;
+    smu_gain_out[i] = 0xFF;
+
+    smu_default_autorange(&smu_autorange[i]);
+    smu_autorange_low[i] = 0;
+    smu_default_autogain(&smu_autogain[i]);
+    smu_autogain_low[i] = 0;
+    smu_inamp_fault[i].store(SMU_GATE_OPEN);
+    smu_inamp_cal_gate[i].store(SMU_GATE_OPEN);
+    smu_inamp_cal_ms[i]   = 0;
+    smu_inamp_cal_temp[i] = NAN;
+    smu_inamp_cal_busy[i] = false;
+    smu_inamp_cal_late[i] = false;
+    smu_inamp_cal_due[i]  = false;
+    smu_default_autozero(&smu_autozero[i]);
+    memset(&smu_az[i], 0, sizeof(smu_az_state_t));
+    smu_iclamp[i][0] = 0;
+    smu_iclamp[i][1] = 0;
+    memset(&smu_switch[i], 0, sizeof(smu_switch_t));
+  }
 
-    smu_control_updated[i] = 0xFFFF;
+  // In-amp calibration schedule
+  smu_inamp_cal_cfg.interval_s = SMU_INAMP_CAL_INTERVAL_S;
+  smu_inamp_cal_cfg.temp_delta = SMU_INAMP_CAL_TEMP_DELTA;
+
+  // Housekeeping readings
+  smu_hk_ratio = SMU_HK_RATIO;
+  smu_hk_wait  = SMU_HK_RATIO;
+  smu_hk_count = 0;
+  smu_hk_slot  = 0;
+  smu_hk_phase = HK_IDLE;
+  smu_hk_corr  = 1;
+  smu_hk.adc_temp = NAN;
+  smu_hk.pmu_temp = NAN;
+  smu_hk.ref      = NAN;
+  smu_hk.ref_corr = 1;
+  smu_hk.ref_ok   = true;
+  smu_hk.ms       = 0;
+
+  // Measurement plan, every quantity at the same rate (MEASOUT starts as
+  //  the PMU after reset)
+  for (int i = 0; i < NUM_CH; i++) {
+    for (int q = 0; q < SMU_ADC_NUM; q++) smu_sched_req[i][q] = SMU_SCHED_RATE_DEFAULT;
+    smu_measout_cur[i]  = AD5522_MEAS_ISENSE;
+    smu_measout_head[i] = 0;
+    smu_measout_num[i]  = 0;
+    smu_sweep_fields[i] = 0;
   }
+  memset(&smu_plan, 0, sizeof(smu_plan));
+  smu_plan_id = 0;
+
+  // Init control bus lock and sweep
+  smu_ctrl_lock = xSemaphoreCreateRecursiveMutex();
+  memset(&smu_sweep, 0, sizeof(smu_sweep));
 
-  // Init last UI updates
-  smu_millis_process = millis();
+  // Init telemetry subscriptions
+  smu_sub_lock = xSemaphoreCreateMutex();
+  memset(smu_sub, 0, sizeof(smu_sub));
 
   // Initialize ADC
   ad7177_init(SPIBUS_ADC, PIN_ADC_SCLK, PIN_ADC_MISO, PIN_ADC_MOSI, PIN_ADC_CS, PIN_ADC_INT);
   ad7177_callback(adc_callback);
-  ad7177_config_ch(AD7177_CH0, AD7177_AIN0, AD7177_AIN1, true); // inamp MV
-  ad7177_config_ch(AD7177_CH1, AD7177_AIN2, AD7177_AIN3, true); // pmu MI
+  ad7177_config_ch((ad7177_ch_t) (1 << SMU_HK_ADC_TEMP), AD7177_TEMP_POS, AD7177_TEMP_NEG, false);
+  ad7177_config_ch((ad7177_ch_t) (1 << SMU_HK_ADC_REF), AD7177_REF_POS, AD7177_REF_NEG, false);
+  ad7177_set_rate((ad7177_sample_rate_t) config->adc_rate);
+
+  // Measurement plan, programmed right away (ADC isn't running yet)
+  if (!smu_sched_apply()) LOG_E(SMU, "no measurement plan");
 
   // Setup SPI for control
   SPI_CTRL.begin(PIN_HSPI_SCLK, PIN_HSPI_MISO, PIN_HSPI_MOSI);
 
-  // Initialize PMU
-  ad5522_init(&SPI_CTRL, PIN_PMU_CS, PIN_PMU_RST, PIN_PMU_BUSY);
-
-  //TODO Add mutex for SPI_CTRL
+  // Initialize PMUs
+  for (int i = 0; i < BOARD_PMU_NUM; i++) {
+    if (!ad5522_init(i, &SPI_CTRL, board_pmu[i].cs, board_pmu[i].rst, board_pmu[i].busy)) {
+      LOG_E(SMU, "PMU%d init failed", i);
+    }
+  }
 
-  // Initialize INamp
+  // Initialize INamp, faults interrupt on GPIO3
   for (int i = 0; i < NUM_CH; i++) {
-    float gain;
-    inamp_array[i].begin(&SPI_CTRL, pin_inamp_cs[i]);
-    gain = inamp_array[i].set_gain(ADA4254_IX0P5, ADA4254_OX1);
-    if (gain < 0) gain = (1/2.0F); //TODO
-    smu_control[i].mv_gain = gain;
+    if (!board_has_inamp(i)) continue;
+    inamp_array[i].begin(&SPI_CTRL, board_ch[i].inamp_cs);
+
+    if (board_ch[i].inamp_fault >= 0) {
+      pinMode(board_ch[i].inamp_fault, INPUT);
+      attachInterruptArg(digitalPinToInterrupt(board_ch[i].inamp_fault), smu_inamp_fault_isr,
+          (void *) (intptr_t) i, RISING);
+
+      // Line already high (e.g. fault from power-on) has no edge to come
+      if (digitalRead(board_ch[i].inamp_fault)) {
+        smu_inamp_fault[i].store(SMU_GATE_CLOSED);
+        event_post(EVENT_INAMP_FAULT, i);
+      }
+    }
   }
+
+  // Program channels, ADC isn't running yet so the rate doesn't change
+  if (!smu_apply_config(config)) LOG_W(SMU, "config not fully applied");
+
   /*
 
   // Init timer to update webpage
@@ -327,68 +1369,252 @@ void smu_init(){
   ad7177_start();
 }
 
-void smu_set_state(smu_ch_t ch, smu_state_t state) {
-  smu_control[ch].state = state;
-  smu_control_updated[ch] |= (1 << FIELD_STATE);
+// Config used without a stored record
+void smu_default_config(smu_config_t *config) {
+  memset(config, 0, sizeof(smu_config_t));
 
-  switch (state) {
-    case DISABLE:
-    case STANDBY:
-      ad5522_set_state(smu2ad5522_ch(ch), AD5522_HIZ);
-    case ENABLE:
-      ad5522_set_state(smu2ad5522_ch(ch), AD5522_ENABLE);
-      break;
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_setup_t *setup = &config->setup[i];
+    setup->state    = DISABLE;
+    setup->mode     = FV;
+    setup->range    = RANGE_2MA;
+    setup->sense    = LOCAL;
+    setup->gain_in  = ADA4254_IX0P5;
+    setup->gain_out = ADA4254_OX1;
+    setup->fv   = 0;
+    setup->fi   = 0;
+    setup->clli = -2.25e-3;
+    setup->clhi =  2.25e-3;
+    setup->cllv = -11.25;
+    setup->clhv =  11.25;
+
+    for (int d = 0; d < SMU_DAC_NUM; d++) config->cal[i].dac_gain[d] = 1;
+    for (int a = 0; a < SMU_ADC_NUM; a++) config->cal[i].adc_gain[a] = 1;
   }
+  config->adc_rate = AD7177_5SPS;
 }
 
-void smu_set_mode(smu_ch_t ch, smu_mode_t mode){
-  if (smu_control[ch].mode == mode) return;
-
-  smu_control[ch].mode = mode;
-  smu_control_updated[ch] |= (1 << FIELD_MODE);
+// Current config (to store as boot record or preset)
+void smu_get_config(smu_config_t *config) {
+  memset(config, 0, sizeof(smu_config_t));
 
-  switch(mode) {
-    case FV:
-      smu_set_dac(ch, DAC_FV,   smu_control[ch].mv);
-      smu_set_dac(ch, DAC_CLLI, smu_control[ch].clli);
-      smu_set_dac(ch, DAC_CLHI, smu_control[ch].clhi);
-      ad5522_set_mode(smu2ad5522_ch(ch), AD5522_FV);
-    case FI:
-      smu_set_dac(ch, DAC_FI,   smu_control[ch].mi);
-      smu_set_dac(ch, DAC_CLLV, smu_control[ch].cllv);
-      smu_set_dac(ch, DAC_CLHV, smu_control[ch].clhv);
-      ad5522_set_mode(smu2ad5522_ch(ch), AD5522_FI);
-      break;
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_setup_t *setup = &config->setup[i];
+    smu_control_t control;
+
+    smu_get_control(smu_int2ch(i), &control);
+    setup->state    = control.state;
+    setup->mode     = control.mode;
+    setup->range    = control.range;
+    setup->sense    = control.sense;
+    setup->gain_in  = smu_gain_in[i];
+    setup->gain_out = smu_gain_out[i];
+    setup->fv   = control.fv;
+    setup->fi   = control.fi;
+    setup->clli = smu_iclamp[i][0];
+    setup->clhi = smu_iclamp[i][1];
+    setup->cllv = control.cllv;
+    setup->clhv = control.clhv;
+
+    config->cal[i] = smu_cal[i];
   }
+  config->adc_rate = ad7177_get_rate();
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
 }
 
-// FV
-//  Set I-clamp level to min value in both ranges
-//  Change range
-//  Update I-clamp level
-// FI
-//  Set new FI DAC level
+// Move channel to setup, only registers that differ are written
+//  - output is disabled first and enabled last, range and mode changes
+//    go through smu_set_range/smu_set_mode (their glitch-free ordering)
+//  - call with smu_ctrl_lock held
+void smu_apply_setup(smu_ch_t ch, const smu_setup_t *setup) {
+  smu_control_t control;
+
+  smu_get_control(ch, &control);
+
+  if (setup->state != ENABLE && setup->state != control.state) {
+    smu_set_state(ch, (smu_state_t) setup->state);
+  }
+  if (setup->range != control.range) smu_set_range(ch, (smu_range_t) setup->range);
+  if (setup->mode != control.mode) smu_set_mode(ch, (smu_mode_t) setup->mode);
+
+  // Voltage clamps are limited against each other, move away first
+  if (setup->cllv > control.clhv) {
+    smu_write_dac(ch, DAC_CLHV, setup->clhv, true);
+    smu_write_dac(ch, DAC_CLLV, setup->cllv, true);
+  } else {
+    smu_write_dac(ch, DAC_CLLV, setup->cllv, true);
+    smu_write_dac(ch, DAC_CLHV, setup->clhv, true);
+  }
+  smu_write_dac(ch, DAC_CLLI, setup->clli, true);
+  smu_write_dac(ch, DAC_CLHI, setup->clhi, true);
+  smu_write_dac(ch, DAC_FV, setup->fv, true);
+  smu_write_dac(ch, DAC_FI, setup->fi, true);
+
+  if (setup->gain_in != smu_gain_in[ch] || setup->gain_out != smu_gain_out[ch]) {
+    smu_set_gain(ch, (ada4254_gainin_t) setup->gain_in, (ada4254_gainout_t) setup->gain_out);
+  }
+
+  if (setup->sense != control.sense) {
+    smu_write_begin(ch);
+    smu_control[ch].sense = (smu_sense_t) setup->sense;
+    smu_write_end(ch, (1 << FIELD_SENSE));
+  }
+
+  if (setup->state == ENABLE && control.state != ENABLE) {
+    smu_set_state(ch, ENABLE);
+  }
+}
+
+// Apply config (boot record or preset) in one pass over the control bus
+//  - PMU and in-amp writes are verified together at the end
+//  - returns false if a sweep, waveform, pulse train or the trigger model
+//    is running or a register didn't verify
+bool smu_apply_config(const smu_config_t *config) {
+  bool ok;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  if (smu_sweep.active || smu_wave_active() || smu_pulse_active() || smu_trig_active()) {
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+    return false;
+  }
+
+  ad5522_batch_begin();
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_cal[i] = config->cal[i];
+    if (board_has_inamp(i)) inamp_array[i].batch_begin();
+    smu_apply_setup(smu_int2ch(i), &config->setup[i]);
+  }
+  ok = ad5522_batch_end();
+
+  // Gain that didn't take is written again next time
+  for (int i = 0; i < NUM_CH; i++) {
+    if (board_has_inamp(i) && !inamp_array[i].batch_end(true)) {
+      LOG_W(SMU, "ch%d in-amp verify failed", i);
+      smu_gain_in[i]  = 0xFF;
+      smu_gain_out[i] = 0xFF;
+      ok = false;
+    }
+  }
+
+  smu_set_adc_rate((ad7177_sample_rate_t) config->adc_rate);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  return ok;
+}
+
+void smu_get_cal(smu_ch_t ch, smu_cal_t *cal) {
+  if (ch >= NUM_CH) return;
+  *cal = smu_cal[ch];
+}
+
+// Set calibration, outputs are reprogrammed with the new coefficients
+void smu_set_cal(smu_ch_t ch, const smu_cal_t *cal) {
+  smu_control_t control;
+
+  if (ch >= NUM_CH) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_cal[ch] = *cal;
+
+  smu_get_control(ch, &control);
+  smu_write_dac(ch, DAC_CLLV, control.cllv, true);
+  smu_write_dac(ch, DAC_CLHV, control.clhv, true);
+  smu_write_dac(ch, DAC_CLLI, smu_iclamp[ch][0], true);
+  smu_write_dac(ch, DAC_CLHI, smu_iclamp[ch][1], true);
+  smu_write_dac(ch, DAC_FV, control.fv, true);
+  smu_write_dac(ch, DAC_FI, control.fi, true);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+void smu_set_state(smu_ch_t ch, smu_state_t state) {
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_write_begin(ch);
+  smu_control[ch].state = state;
+  smu_write_end(ch, (1 << FIELD_STATE));
+
+  switch (state) {
+    case DISABLE:
+    case STANDBY:
+      ad5522_set_state(smu2ad5522_ch(ch), AD5522_HIZ);
+      break;
+    case ENABLE:
+      ad5522_set_state(smu2ad5522_ch(ch), AD5522_ENABLE);
+      break;
+  }
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+void smu_set_mode(smu_ch_t ch, smu_mode_t mode){
+  smu_control_t control;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_get_control(ch, &control);
+  if (control.mode == mode) {
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+    return;
+  }
+
+  smu_write_begin(ch);
+  smu_control[ch].mode = mode;
+  smu_write_end(ch, (1 << FIELD_MODE));
+
+  switch(mode) {
+    case FV:
+      smu_set_dac(ch, DAC_FV,   control.mv);
+      smu_set_dac(ch, DAC_CLLI, smu_iclamp[ch][0]);
+      smu_set_dac(ch, DAC_CLHI, smu_iclamp[ch][1]);
+      ad5522_set_mode(smu2ad5522_ch(ch), AD5522_FV);
+      break;
+    case FI:
+      smu_set_dac(ch, DAC_FI,   control.mi);
+      smu_set_dac(ch, DAC_CLLV, control.cllv);
+      smu_set_dac(ch, DAC_CLHV, control.clhv);
+      ad5522_set_mode(smu2ad5522_ch(ch), AD5522_FI);
+      break;
+  }
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// FV
+//  Set I-clamp level to min value in both ranges
+//  Change range
+//  Update I-clamp level
+// FI
+//  Set new FI DAC level
 //  Chnage range
 void smu_set_range(smu_ch_t ch, smu_range_t range) {
   float val, val_clamp, mi_mult;
   uint16_t code;
   ad5522_range_t ad5522_range;
   ad5522_dac_t   ad5522_dac;
+  smu_control_t  control;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_get_control(ch, &control);
+
+  // Waveform and pulse codes are for the old range
+  if (range != control.range && smu_wave_active_ch(ch)) {
+    LOG_W(SMU, "ch%d range changed, wave stopped", ch);
+    smu_wave_stop();
+  }
+  if (range != control.range && smu_pulse_active_ch(ch)) {
+    LOG_W(SMU, "ch%d range changed, pulses stopped", ch);
+    smu_pulse_stop();
+  }
 
   // Going to larger range, same DAC val is more current, program
   //  clamps to final DAC code (lower current before to change)
-  if (smu_control[ch].mode == FV && range > smu_control[ch].range) {
-    val_clamp = smu_control[ch].clli;
+  if (control.mode == FV && range > control.range) {
+    val_clamp = smu_iclamp[ch][0];
     smu_dac_v2d(ch, DAC_CLLI, range, &val_clamp, &code);
     ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLLI, code);
-    smu_control[ch].clli = val_clamp;
-    smu_control_updated[ch] |= (1 << FIELD_CLLI);
+    smu_write_float(ch, FIELD_CLLI, val_clamp);
 
-    val_clamp = smu_control[ch].clhi;
+    val_clamp = smu_iclamp[ch][1];
     smu_dac_v2d(ch, DAC_CLHI, range, &val_clamp, &code);
     ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLHI, code);
-    smu_control[ch].clhi = val_clamp;
-    smu_control_updated[ch] |= (1 << FIELD_CLHI);
+    smu_write_float(ch, FIELD_CLHI, val_clamp);
   }
 
   // Get range key for DAC write
@@ -422,15 +1648,14 @@ void smu_set_range(smu_ch_t ch, smu_range_t range) {
   }
 
   // Set new current range DAC
-  if (smu_control[ch].mode == FI) {
-    val = smu_control[ch].fi;
+  if (control.mode == FI) {
+    val = control.fi;
     smu_dac_v2d(ch, DAC_FI, range, &val, &code);
-    smu_control[ch].fi = val;
-    smu_control_updated[ch] |= (1 << FIELD_FI);
+    smu_write_float(ch, FIELD_FI, val);
 
     // In external range and going to external range
     //  set DAC to smaller value before range change
-    if (range >= RANGE_20MA && smu_control[ch].range >= RANGE_20MA){
+    if (range >= RANGE_20MA && control.range >= RANGE_20MA){
       float tmp_val = val;
       uint16_t tmp_code = code;
       smu_dac_v2d(ch, DAC_FI, RANGE_200MA, &tmp_val, &tmp_code);
@@ -453,213 +1678,834 @@ void smu_set_range(smu_ch_t ch, smu_range_t range) {
 
   // Going to smaller range, same DAC val is less current, program
   //  clamps to final DAC code
-  if (smu_control[ch].mode == FV && range < smu_control[ch].range) {
-    val_clamp = smu_control[ch].clli;
+  if (control.mode == FV && range < control.range) {
+    val_clamp = smu_iclamp[ch][0];
     smu_dac_v2d(ch, DAC_CLLI, range, &val_clamp, &code);
     ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLLI, code);
-    smu_control[ch].clli = val_clamp;
-    smu_control_updated[ch] |= (1 << FIELD_CLLI);
+    smu_write_float(ch, FIELD_CLLI, val_clamp);
 
-    val_clamp = smu_control[ch].clhi;
+    val_clamp = smu_iclamp[ch][1];
     smu_dac_v2d(ch, DAC_CLHI, range, &val_clamp, &code);
     ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLHI, code);
-    smu_control[ch].clhi = val_clamp;
-    smu_control_updated[ch] |= (1 << FIELD_CLHI);
+    smu_write_float(ch, FIELD_CLHI, val_clamp);
   }
 
   // In external range and going to external range
   //  set DAC to final value
-  if (smu_control[ch].mode == FI && range >= RANGE_20MA
-      && smu_control[ch].range >= RANGE_20MA){
+  if (control.mode == FI && range >= RANGE_20MA
+      && control.range >= RANGE_20MA){
     ad5522_set_dac(smu2ad5522_ch(ch), ad5522_dac, code);
   }
 
+  // Range and scale change together so readers never see a mix
+  smu_write_begin(ch);
+  smu_control[ch].range   = range;
   smu_control[ch].mi_mult = mi_mult;
+  smu_write_end(ch, (1 << FIELD_RANGE));
 
+  // Discard sets converted while the new range settles (manual or auto)
+  if (range != control.range) smu_switch_settle(ch, smu_autorange[ch].settle);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
 }
 
 
-void smu_set_dac(smu_ch_t ch, smu_dac_t dac, float val){
-  uint16_t code;
-  ad5522_dac_t   ad5522_dac;
-
-  // Calibrate and get DAC code
-  smu_dac_v2d(ch, dac, smu_control[ch].range, &val, &code);
-
-  // Get correct FI DAC for range
-  switch (smu_control[ch].range) {
-    case RANGE_5UA:
-      ad5522_dac   = AD5522_DAC_FI_5UA;
-      break;
-    case RANGE_20UA:
-      ad5522_dac   = AD5522_DAC_FI_20UA;
-      break;
-    case RANGE_200UA:
-      ad5522_dac   = AD5522_DAC_FI_200UA;
-      break;
-    case RANGE_2MA:
-      ad5522_dac   = AD5522_DAC_FI_2MA;
+// PMU DAC of smu DAC (FI DAC depends on range)
+ad5522_dac_t smu_dac2ad5522(smu_dac_t dac, smu_range_t range) {
+  switch (dac) {
+    case DAC_FV:   return AD5522_DAC_FV;
+    case DAC_CLLV: return AD5522_DAC_CLLV;
+    case DAC_CLHV: return AD5522_DAC_CLHV;
+    case DAC_CLLI: return AD5522_DAC_CLLI;
+    case DAC_CLHI: return AD5522_DAC_CLHI;
+    case DAC_FI:
       break;
+  }
+
+  switch (range) {
+    case RANGE_5UA:   return AD5522_DAC_FI_5UA;
+    case RANGE_20UA:  return AD5522_DAC_FI_20UA;
+    case RANGE_200UA: return AD5522_DAC_FI_200UA;
+    case RANGE_2MA:   return AD5522_DAC_FI_2MA;
     case RANGE_20MA:
     case RANGE_200MA:
-      ad5522_dac   = AD5522_DAC_FI_EXT;
       break;
   }
+  return AD5522_DAC_FI_EXT;
+}
 
-  // Set DAC
-  switch(dac) {
-    case DAC_FI:
-      smu_control[ch].fi = val;
-      smu_control_updated[ch] |= (1 << FIELD_FI);
-      ad5522_set_dac(smu2ad5522_ch(ch), ad5522_dac, code);
-      break;
-    case DAC_FV:
-      smu_control[ch].fv = val;
-      smu_control_updated[ch] |= (1 << FIELD_FV);
-      ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_FV, code);
-      break;
-    case DAC_CLLV:
-      smu_control[ch].cllv = val;
-      smu_control_updated[ch] |= (1 << FIELD_CLLV);
-      ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLLV, code);
-      break;
-    case DAC_CLHV:
-      smu_control[ch].clhv = val;
-      smu_control_updated[ch] |= (1 << FIELD_CLHV);
-      ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLHV, code);
-      break;
-    case DAC_CLLI:
-      smu_control[ch].clli = val;
-      smu_control_updated[ch] |= (1 << FIELD_CLLI);
-      ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLLI, code);
-      break;
-    case DAC_CLHI:
-      smu_control[ch].clhi = val;
-      smu_control_updated[ch] |= (1 << FIELD_CLHI);
-      ad5522_set_dac(smu2ad5522_ch(ch), AD5522_DAC_CLHI, code);
-      break;
+// Field of channel state holding value of smu DAC
+int smu_dac2field(smu_dac_t dac) {
+  switch (dac) {
+    case DAC_FI:   return FIELD_FI;
+    case DAC_FV:   return FIELD_FV;
+    case DAC_CLLV: return FIELD_CLLV;
+    case DAC_CLHV: return FIELD_CLHV;
+    case DAC_CLLI: return FIELD_CLLI;
+    case DAC_CLHI: return FIELD_CLHI;
   }
+  return FIELD_FV;
+}
+
+// Set DAC, skip_same doesn't write a code the PMU already holds
+void smu_write_dac(smu_ch_t ch, smu_dac_t dac, float val, bool skip_same) {
+  uint16_t code, code_pmu;
+  ad5522_dac_t   ad5522_dac;
+  smu_control_t  control;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_get_control(ch, &control);
+
+  if (dac == DAC_CLLI) smu_iclamp[ch][0] = val;
+  if (dac == DAC_CLHI) smu_iclamp[ch][1] = val;
+
+  // Calibrate and get DAC code
+  smu_dac_v2d(ch, dac, control.range, &val, &code);
+  ad5522_dac = smu_dac2ad5522(dac, control.range);
+
+  smu_write_float(ch, smu_dac2field(dac), val);
+  if (!skip_same || !ad5522_get_dac(smu2ad5522_ch(ch), ad5522_dac, &code_pmu) || code_pmu != code) {
+    ad5522_set_dac(smu2ad5522_ch(ch), ad5522_dac, code);
+  }
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+void smu_set_dac(smu_ch_t ch, smu_dac_t dac, float val){
+  smu_write_dac(ch, dac, val, false);
+}
+
+// Set ADC rate, restarts conversions if it changed
+void smu_set_adc_rate(ad7177_sample_rate_t rate) {
+  smu_sched_plan_t plan;
+
+  if (rate == ad7177_get_rate()) return;
+
+  ad7177_stop();
+  ad7177_set_rate(rate);
+  ad7177_start();
+
+  // Same frames, only the achievable rates change
+  if (smu_sched_build(smu_sched_req, ad7177_rate_sps(rate), &plan)) {
+    memcpy(smu_sched_rate, plan.rate, sizeof(smu_sched_rate));
+  }
+}
+
+// Build plan for the requested rates and hand it to the ADC driver and
+//  the adc callback (smu_ctrl_lock held or ADC not running yet)
+//  - returns false (old plan kept) if no plan fits
+bool smu_sched_apply() {
+  smu_sched_plan_t plan;
+  ad7177_frame_t frames[SMU_SCHED_FRAMES];
+
+  if (!smu_sched_build(smu_sched_req, ad7177_rate_sps(ad7177_get_rate()), &plan)) return false;
+
+  // Id 0 is the driver's list before the first plan
+  if (++smu_plan_id == 0) smu_plan_id = 1;
+  plan.id = smu_plan_id;
+  smu_sched_frames(&plan, frames);
+
+  portENTER_CRITICAL(&smu_plan_mux);
+  memcpy(&smu_plan_next, &plan, sizeof(smu_sched_plan_t));
+  portEXIT_CRITICAL(&smu_plan_mux);
+  memcpy(smu_sched_rate, plan.rate, sizeof(smu_sched_rate));
+
+  LOG_I(SMU, "measurement plan %u: %u frames", plan.id, plan.num);
+  return ad7177_set_frames(plan.id, frames, plan.num);
 }
 
 void smu_set_rate(smu_rate_t rate) {
+  if (rate > RATE_SLOW) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_set_adc_rate(smu_rate_adc[rate]);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
 }
 
-void smu_queue_update() {
+// Auto-ranging defaults (off)
+void smu_default_autorange(smu_autorange_t *autorange) {
+  autorange->enable = false;
+  autorange->min    = RANGE_5UA;
+  autorange->max    = RANGE_2MA;    // Highest range without the external switch
+  autorange->up     = 0.9F;
+  autorange->down   = 0.8F;
+  autorange->hold   = 2;
+  autorange->settle = 2;
+}
+
+// Set auto-ranging of channel
+//  - returns false (unchanged) if the range window or thresholds aren't
+//    valid, up can't be above the 112.5% the clamps allow
+bool smu_set_autorange(smu_ch_t ch, const smu_autorange_t *autorange) {
+  if (ch >= NUM_CH) return false;
+  if (autorange->min > autorange->max || autorange->max > RANGE_200MA) return false;
+  if (autorange->up <= 0 || autorange->up > 1.125F) return false;
+  if (autorange->down <= 0 || autorange->down >= autorange->up) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_autorange[ch] = *autorange;
+  smu_autorange_low[ch] = 0;
+  portEXIT_CRITICAL(&smu_switch_mux);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  LOG_I(SMU, "ch%d autorange %s", ch, autorange->enable ? "on" : "off");
+  return true;
+}
+
+void smu_get_autorange(smu_ch_t ch, smu_autorange_t *autorange) {
+  if (ch >= NUM_CH) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  *autorange = smu_autorange[ch];
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// MV auto-gain defaults (off)
+void smu_default_autogain(smu_autogain_t *autogain) {
+  autogain->enable = false;
+  autogain->up     = 0.9F;
+  autogain->down   = 0.7F;
+  autogain->hold   = 2;
+  autogain->settle = 2;
+}
+
+// Set MV auto-gain of channel
+//  - returns false (unchanged) if the thresholds aren't valid
+bool smu_set_autogain(smu_ch_t ch, const smu_autogain_t *autogain) {
+  if (ch >= NUM_CH) return false;
+  if (autogain->up <= 0 || autogain->up >= SMU_ADC_CLIP) return false;
+  if (autogain->down <= 0 || autogain->down >= autogain->up) return false;
+  if (autogain->enable && !board_has_inamp(ch)) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_autogain[ch] = *autogain;
+  smu_autogain_low[ch] = 0;
+  portEXIT_CRITICAL(&smu_switch_mux);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  LOG_I(SMU, "ch%d autogain %s", ch, autogain->enable ? "on" : "off");
+  return true;
+}
+
+void smu_get_autogain(smu_ch_t ch, smu_autogain_t *autogain) {
+  if (ch >= NUM_CH) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  *autogain = smu_autogain[ch];
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// MV auto-zero defaults (off)
+void smu_default_autozero(smu_autozero_t *autozero) {
+  autozero->enable = false;
+  autozero->ratio  = 100;
+  autozero->ref    = true;
+  autozero->settle = 1;
+  autozero->filter = 0.1F;
+}
+
+// Set MV auto-zero of channel, a running zero cycle finishes first
+//  - returns false (unchanged) if ratio or filter aren't valid
+bool smu_set_autozero(smu_ch_t ch, const smu_autozero_t *autozero) {
+  if (ch >= NUM_CH) return false;
+  if (autozero->ratio == 0) return false;
+  if (autozero->filter <= 0 || autozero->filter > 1) return false;
+  if (autozero->enable && !board_has_inamp(ch)) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_autozero[ch] = *autozero;
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  LOG_I(SMU, "ch%d autozero %s", ch, autozero->enable ? "on" : "off");
+  return true;
+}
+
+void smu_get_autozero(smu_ch_t ch, smu_autozero_t *autozero) {
+  if (ch >= NUM_CH) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  *autozero = smu_autozero[ch];
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// Current auto-zero estimates (offset in V at the ADC input)
+void smu_get_zero(smu_ch_t ch, float *offset, float *gain) {
+  if (ch >= NUM_CH) return;
+
+  *offset = smu_az[ch].offset;
+  *gain   = smu_az[ch].gain;
+}
+
+// Exclusive use of the control SPI bus (PMU and inamps)
+void smu_ctrl_take() {
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+}
+
+void smu_ctrl_give() {
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// Read in-amp ID (one SPI read transaction)
+bool smu_inamp_check(smu_ch_t ch) {
+  bool ok;
+
+  if (ch >= NUM_CH || !board_has_inamp(ch)) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  ok = inamp_array[ch].check_id();
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  return ok;
+}
+
+// Write the switches the adc callback asked for on channel ch
+//  (EVENT_SMU_SWITCH handler)
+//  - a switch that no longer applies (auto-ranging or auto-gain turned
+//    off, range or gain set by hand meanwhile) is dropped, the callback
+//    checks again
+//  - an auto-zero input is always written, the callback's cycle is
+//    already in that phase
+void smu_switch_process(smu_ch_t ch) {
+  smu_switch_t sw;
+  smu_control_t control;
+
+  if (ch >= NUM_CH) return;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&smu_switch_mux);
+  sw = smu_switch[ch];
+  portEXIT_CRITICAL(&smu_switch_mux);
+
+  if (sw.pending & SMU_SWITCH_RANGE) {
+    smu_get_control(ch, &control);
+    if (smu_autorange[ch].enable && control.range == sw.range_from) {
+      smu_set_range(ch, (smu_range_t) sw.range);
+    }
+  }
+  if ((sw.pending & SMU_SWITCH_GAIN) && smu_autogain[ch].enable && smu_gain_step(ch) == sw.gain_from) {
+    if (smu_set_gain(ch, (ada4254_gainin_t) (sw.gain / 3), smu_gain_out_step[sw.gain % 3])) {
+      smu_switch_settle(ch, smu_autogain[ch].settle);
+    }
+  }
+  if (sw.pending & SMU_SWITCH_ZERO) smu_autozero_input(ch, (smu_az_phase_t) sw.zero);
+
+  // Channel's samples are taken again (settle sets once written)
+  portENTER_CRITICAL(&smu_switch_mux);
+  smu_switch[ch].pending &= ~sw.pending;
+  portEXIT_CRITICAL(&smu_switch_mux);
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+// Read and clear faults of in-amps that raised one (EVENT_INAMP_FAULT
+//  handler), faults are logged and sent as "fault" messages
+//  - a channel whose fault line is still high stays in fault
+//  - returns true if a fault is still active (check again later, the
+//    line has no new edge until it drops)
+bool smu_inamp_fault_process() {
+  bool active = false;
+  char str[96];
+
   for (int i = 0; i < NUM_CH; i++) {
-    smu_control_updated[i] = 0xFFFF;
+    uint8_t analog, digital;
+    int8_t pin = board_ch[i].inamp_fault;
+    bool line = (pin >= 0) && digitalRead(pin);
+
+    // Line high without active state is a fault raised while the last
+    //  one was being cleared
+    if (!line && smu_inamp_fault[i].load() != SMU_GATE_CLOSED) continue;
+
+    xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+    inamp_array[i].read_faults(&analog, &digital);
+    line = (pin >= 0) && digitalRead(pin);
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+    if (analog | digital) {
+      LOG_W(INAMP, "ch%d in-amp fault: analog = 0x%X, digital = 0x%X", i, analog, digital);
+      snprintf(str, sizeof(str), "{\"type\":\"fault\",\"ch\":%d,\"analog\":%u,\"digital\":%u}", i, analog, digital);
+      ws_queue_broadcast(str, WS_MSG_RESULT);
+    }
+
+    if (line) {
+      smu_inamp_fault[i].store(SMU_GATE_CLOSED);
+      active = true;
+    } else {
+      uint8_t fault = SMU_GATE_CLOSED;
+      smu_inamp_fault[i].compare_exchange_strong(fault, SMU_GATE_OPENING);
+    }
   }
-  smu_millis_process -= MILLIS_PROCESS;
+  return active;
 }
 
-void smu_process() {
-  if (millis() - smu_millis_process > MILLIS_PROCESS) {
-    smu_millis_process = millis();
+// Run scheduled in-amp calibration (EVENT_INAMP_CAL handler, periodic)
+//  - a channel is calibrated once its interval is up, the temperature
+//    moved by temp_delta since its last calibration or it was requested
+//  - only started between sweeps, waveforms, pulse trains, trigger models
+//    and auto-zero cycles (a due calibration waits for the next gap), MV
+//    samples are dropped while it runs
+//  - only a finished calibration is recorded and sent as an "inamp_cal"
+//    result, one that doesn't finish keeps MV gated
+//  - auto-zero estimates start over after a calibration
+void smu_inamp_cal_process() {
+  uint32_t now = millis();
+  char str[96];
 
-    for (int i = 0; i < NUM_CH; i++) {
-      if (smu_control_updated[i] > 0) {
-        char str[1024];
-        snprintf(str, sizeof(str),"{\"type\":\"smu\",\"ch\":\"%d\"", i);
+  for (int i = 0; i < NUM_CH; i++) {
+    bool due;
 
-        if (smu_control_updated[i] & (1 << FIELD_FV)) {
-          snprintf(str, sizeof(str), "%s,\"fv\":\"%f\"", str, smu_control[i].fv);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_FI)) {
-          snprintf(str, sizeof(str), "%s,\"fi\":\"%f\"", str, smu_control[i].fi);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_MV)) {
-          snprintf(str, sizeof(str), "%s,\"mv\":\"%f\"", str, smu_control[i].mv);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_MI)) {
-          snprintf(str, sizeof(str), "%s,\"mi\":\"%f\"", str, smu_control[i].mi * smu_control[i].mi_mult);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_CLLI)) {
-          snprintf(str, sizeof(str), "%s,\"clli\":\"%f\"", str, smu_control[i].clli);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_CLHI)) {
-          snprintf(str, sizeof(str), "%s,\"clhi\":\"%f\"", str, smu_control[i].clhi);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_CLLV)) {
-          snprintf(str, sizeof(str), "%s,\"cllv\":\"%f\"", str, smu_control[i].cllv);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_CLHV)) {
-          snprintf(str, sizeof(str), "%s,\"clhv\":\"%f\"", str, smu_control[i].clhv);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_RANGE)) {
-          const char *tmp;
-          const char *tmp_unit;
-          switch(smu_control[i].range) {
-            case RANGE_5UA:
-              tmp = "5UA";
-              tmp_unit = "uA";
-              break;
-            case RANGE_20UA:
-              tmp = "20UA";
-              tmp_unit = "uA";
-              break;
-            case RANGE_200UA:
-              tmp = "200UA";
-              tmp_unit = "uA";
-              break;
-            case RANGE_2MA:
-              tmp = "2MA";
-              tmp_unit = "mA";
-              break;
-            case RANGE_20MA:
-              tmp = "20MA";
-              tmp_unit = "mA";
-              break;
-            case RANGE_200MA:
-              tmp = "200MA";
-              tmp_unit = "mA";
-              break;
-          }
-          snprintf(str, sizeof(str), "%s,\"range\":\"%s\"", str, tmp);
-          snprintf(str, sizeof(str), "%s,\"unit\":\"%s\"", str, tmp_unit);
-        }
-        if (smu_control_updated[i] & (1 << FIELD_STATE)) {
-          const char *tmp;
-          switch(smu_control[i].state) {
-            case DISABLE:
-              tmp = "DISABLE";
-              break;
-            case STANDBY:
-              tmp = "STANDBY";
-              break;
-            case ENABLE:
-              tmp = "ENABLE";
-              break;
-          }
-          snprintf(str, sizeof(str), "%s,\"state\":\"%s\"", str, tmp);
+    if (!board_has_inamp(i)) continue;
+    if (smu_inamp_cal_busy[i]) {
+      bool done;
+
+      xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+      done = inamp_array[i].cal_done();
+      xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+      if (!done) {
+        if (!smu_inamp_cal_late[i] && now - smu_inamp_cal_start_ms[i] >= SMU_INAMP_CAL_TIMEOUT_MS) {
+          smu_inamp_cal_late[i] = true;
+          LOG_W(INAMP, "ch%d in-amp calibration not done after %u ms, MV stays gated", i, SMU_INAMP_CAL_TIMEOUT_MS);
         }
-        if (smu_control_updated[i] & (1 << FIELD_MODE)) {
-          const char *tmp;
-          switch(smu_control[i].mode) {
-            case FV:
-              tmp = "FV";
-              break;
-            case FI:
-              tmp = "FI";
-              break;
-          }
-          snprintf(str, sizeof(str), "%s,\"mode\":\"%s\"", str, tmp);
+        continue;
+      }
+
+      smu_inamp_cal_busy[i] = false;
+      smu_inamp_cal_ms[i]   = std::max(now, (uint32_t) 1);
+      smu_inamp_cal_temp[i] = smu_temp_c;
+      smu_az[i].mv_gain = 0;
+      smu_inamp_cal_gate[i].store(SMU_GATE_OPENING);
+
+      LOG_I(SMU, "ch%d in-amp calibrated", i);
+      snprintf(str, sizeof(str), "{\"type\":\"inamp_cal\",\"ch\":%d,\"ms\":%u,\"temp\":%.2f}",
+          i, (unsigned) smu_inamp_cal_ms[i], smu_inamp_cal_temp[i]);
+      ws_queue_broadcast(str, WS_MSG_RESULT);
+      continue;
+    }
+
+    // Temperature baseline before the first calibration
+    if (isnan(smu_inamp_cal_temp[i])) smu_inamp_cal_temp[i] = smu_temp_c;
+
+    due = smu_inamp_cal_due[i];
+    if (smu_inamp_cal_cfg.interval_s > 0 && now - smu_inamp_cal_ms[i] >= smu_inamp_cal_cfg.interval_s * 1000UL) {
+      due = true;
+    }
+    if (smu_inamp_cal_cfg.temp_delta > 0 && !isnan(smu_inamp_cal_temp[i])
+        && fabsf(smu_temp_c - smu_inamp_cal_temp[i]) >= smu_inamp_cal_cfg.temp_delta) {
+      due = true;
+    }
+    if (!due) continue;
+
+    xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+    if (smu_sweep.active || smu_wave_active() || smu_pulse_active() || smu_trig_active()
+        || smu_az[i].phase != AZ_MEASURE || smu_switch_pending(i, SMU_SWITCH_ZERO)) {
+      xSemaphoreGiveRecursive(smu_ctrl_lock);
+      continue;
+    }
+    smu_inamp_cal_gate[i].store(SMU_GATE_CLOSED);
+    inamp_array[i].cal_start();
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+    smu_inamp_cal_busy[i] = true;
+    smu_inamp_cal_late[i] = false;
+    smu_inamp_cal_due[i]  = false;
+    smu_inamp_cal_start_ms[i] = now;
+  }
+}
+
+// Calibrate in-amp of channel at the next gap
+void smu_inamp_cal_request(smu_ch_t ch) {
+  if (ch >= NUM_CH) return;
+  smu_inamp_cal_due[ch] = true;
+}
+
+// Time of last in-amp calibration of channel (millis, 0 = never)
+uint32_t smu_inamp_cal_last(smu_ch_t ch) {
+  if (ch >= NUM_CH) return 0;
+  return smu_inamp_cal_ms[ch];
+}
+
+void smu_set_inamp_cal(const smu_inamp_cal_t *cal) {
+  smu_inamp_cal_cfg = *cal;
+}
+
+void smu_get_inamp_cal(smu_inamp_cal_t *cal) {
+  *cal = smu_inamp_cal_cfg;
+}
+
+// Request rate of a quantity (in Hz, 0 = not measured) and rebuild the
+//  measurement plan, the rate achieved is in smu_get_meas_rate
+//  - returns false (request not changed) if no plan fits
+bool smu_set_meas_rate(smu_ch_t ch, smu_adc_t adc, float hz) {
+  bool ok;
+  float old;
+
+  if (ch >= NUM_CH || adc >= SMU_ADC_NUM || !(hz >= 0)) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  old = smu_sched_req[ch][adc];
+  smu_sched_req[ch][adc] = hz;
+  ok = smu_sched_apply();
+  if (!ok) smu_sched_req[ch][adc] = old;
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  return ok;
+}
+
+// Achievable rate of a quantity with the current plan (in Hz)
+float smu_get_meas_rate(smu_ch_t ch, smu_adc_t adc) {
+  if (ch >= NUM_CH || adc >= SMU_ADC_NUM) return 0;
+  return smu_sched_rate[ch][adc];
+}
+
+// Sample sets per housekeeping reading (0 = off)
+void smu_set_hk_ratio(uint16_t ratio) {
+  smu_hk_ratio = ratio;
+  smu_hk_wait  = ratio;
+}
+
+uint16_t smu_get_hk_ratio() {
+  return smu_hk_ratio;
+}
+
+void smu_get_hk(smu_hk_t *hk) {
+  portENTER_CRITICAL(&smu_hk_mux);
+  *hk = smu_hk;
+  portEXIT_CRITICAL(&smu_hk_mux);
+}
+
+// Publish housekeeping readings (EVENT_HOUSEKEEPING handler, posted by
+//  the adc callback after each reading)
+void smu_hk_process() {
+  static bool ref_ok = true;
+  smu_hk_t hk;
+  char str[160];
+
+  smu_get_hk(&hk);
+
+  if (hk.ref_ok != ref_ok) {
+    ref_ok = hk.ref_ok;
+    if (ref_ok) LOG_I(SMU, "ADC reference back in tolerance");
+    else LOG_W(SMU, "ADC reference reads %f V, gain not corrected", hk.ref);
+  }
+
+  const char *name[] = {"adc_temp", "pmu_temp", "ref", "ref_corr"};
+  float val[] = {hk.adc_temp, hk.pmu_temp, hk.ref, hk.ref_corr};
+  int n = snprintf(str, sizeof(str), "{\"type\":\"housekeeping\",\"ms\":%u", (unsigned) hk.ms);
+
+  // Readings not measured yet are left out
+  for (int i = 0; i < 4; i++) {
+    if (isnan(val[i])) continue;
+    n += snprintf(str + n, sizeof(str) - n, ",\"%s\":%.6g", name[i], val[i]);
+  }
+  snprintf(str + n, sizeof(str) - n, "}");
+  ws_queue_broadcast(str, WS_MSG_STATUS);
+}
+
+/**********************************************************
+ *
+ * Sweep Functions
+ *
+ **********************************************************/
+
+// Start linear sweep of FV or FI DAC on one channel
+//  - source is set to start, each point is measured once the sample sets
+//    converted around the step and settle more have been discarded, then
+//    the adc callback steps the source
+//  - results are sent as "sweep" messages, the channel stays at the last
+//    point when the sweep is done
+bool smu_sweep_start(const smu_sweep_t *sweep) {
+  if (sweep->ch >= NUM_CH) return false;
+  if (sweep->dac != DAC_FV && sweep->dac != DAC_FI) return false;
+  if (sweep->points == 0 || sweep->points > SMU_SWEEP_POINTS_MAX) return false;
+
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  if (smu_sweep.active || smu_wave_active() || smu_pulse_active() || smu_trig_active()) {
+    xSemaphoreGiveRecursive(smu_ctrl_lock);
+    return false;
+  }
+
+  smu_sweep.cfg   = *sweep;
+  smu_sweep.point = 0;
+  smu_sweep_step();
+  smu_sweep.active = true;
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+
+  LOG_I(SMU, "ch%d sweep %f to %f (%u points)", sweep->ch, sweep->start, sweep->stop, sweep->points);
+
+  return true;
+}
+
+void smu_sweep_stop() {
+  xSemaphoreTakeRecursive(smu_ctrl_lock, portMAX_DELAY);
+  smu_sweep.active = false;
+  xSemaphoreGiveRecursive(smu_ctrl_lock);
+}
+
+bool smu_sweep_active() {
+  return smu_sweep.active;
+}
+
+// Number of points measured in current (or last) sweep
+uint16_t smu_sweep_done() {
+  return smu_sweep.point;
+}
+
+/**********************************************************
+ *
+ * Telemetry Subscription Functions
+ *
+ **********************************************************/
+
+// Subscribe client to fields of a channel
+//  - fields are published at most every period ms and only when changed
+//  - analog fields are only published when they move more than deadband
+//    from the last published value (in V or A, 0 to disable)
+bool smu_subscribe(uint8_t client, smu_ch_t ch, uint16_t fields, uint16_t period, float deadband) {
+  if (client >= WS_CLIENT_MAX || ch >= NUM_CH) return false;
+
+  fields &= SMU_FIELD_ALL;
+  period = std::max(period, (uint16_t) SMU_SUB_PERIOD_MIN);
+  deadband = std::max(deadband, 0.0F);
+
+  xSemaphoreTake(smu_sub_lock, portMAX_DELAY);
+  smu_sub_t *sub = &smu_sub[client][ch];
+  for (int f = 0; f < FIELD_NUM; f++) {
+    if ((fields >> f) & 1) {
+      sub->period[f]   = period;
+      sub->deadband[f] = deadband;
+      sub->millis_last[f] = millis() - period;
+      sub->last[f]     = NAN;   // First value is sent whatever the deadband
+    }
+  }
+  sub->fields |= fields;
+  sub->dirty  |= fields;   // Send current value of new fields
+  smu_sub_update_wake(ch);
+  xSemaphoreGive(smu_sub_lock);
+
+  smu_process_notify();
+  return true;
+}
+
+void smu_unsubscribe(uint8_t client, smu_ch_t ch, uint16_t fields) {
+  if (client >= WS_CLIENT_MAX || ch >= NUM_CH) return;
+
+  xSemaphoreTake(smu_sub_lock, portMAX_DELAY);
+  smu_sub[client][ch].fields &= ~fields;
+  smu_sub[client][ch].dirty  &= ~fields;
+  smu_sub_update_wake(ch);
+  xSemaphoreGive(smu_sub_lock);
+}
+
+// New client gets default subscription (all fields every MILLIS_PROCESS)
+void smu_client_connect(uint8_t client) {
+  if (client >= WS_CLIENT_MAX) return;
+
+  smu_client_disconnect(client);
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_subscribe(client, smu_int2ch(i), SMU_FIELD_ALL, MILLIS_PROCESS, 0);
+  }
+}
+
+void smu_client_disconnect(uint8_t client) {
+  if (client >= WS_CLIENT_MAX) return;
+
+  xSemaphoreTake(smu_sub_lock, portMAX_DELAY);
+  for (int i = 0; i < NUM_CH; i++) {
+    memset(&smu_sub[client][i], 0, sizeof(smu_sub_t));
+    smu_sub_update_wake(i);
+  }
+  xSemaphoreGive(smu_sub_lock);
+}
+
+// Get field bit from name (e.g. "mv"), 0 if unknown
+uint16_t smu_field_mask(const char *name) {
+  for (int f = 0; f < FIELD_NUM; f++) {
+    if (strcmp(name, smu_field_name[f]) == 0) return (1 << f);
+  }
+  return 0;
+}
+
+// Resend all subscribed fields to all clients
+void smu_queue_update() {
+  xSemaphoreTake(smu_sub_lock, portMAX_DELAY);
+  for (int c = 0; c < WS_CLIENT_MAX; c++) {
+    for (int i = 0; i < NUM_CH; i++) {
+      smu_sub[c][i].dirty = smu_sub[c][i].fields;
+      for (int f = 0; f < FIELD_NUM; f++) {
+        smu_sub[c][i].millis_last[f] = millis() - smu_sub[c][i].period[f];
+        smu_sub[c][i].last[f] = NAN;
+      }
+    }
+  }
+  for (int i = 0; i < NUM_CH; i++) smu_sub_update_wake(i);
+  xSemaphoreGive(smu_sub_lock);
+
+  smu_process_notify();
+}
+
+// Get value of analog field
+float smu_field_value(smu_control_t *control, int field) {
+  float *ptr = smu_field_ptr(control, field);
+  return ptr ? *ptr : 0;
+}
+
+// Append field to json message, returns new length
+int smu_format_field(char *str, int len, int size, smu_control_t *control, int field) {
+  const char *tmp = NULL;
+  const char *tmp_unit = NULL;
+
+  if (len >= size) return len;
+
+  switch (field) {
+    case FIELD_MI:
+      return len + snprintf(str + len, size - len, ",\"mi\":\"%f\"", control->mi * control->mi_mult);
+    case FIELD_RANGE:
+      switch(control->range) {
+        case RANGE_5UA:
+          tmp = "5UA";
+          tmp_unit = "uA";
+          break;
+        case RANGE_20UA:
+          tmp = "20UA";
+          tmp_unit = "uA";
+          break;
+        case RANGE_200UA:
+          tmp = "200UA";
+          tmp_unit = "uA";
+          break;
+        case RANGE_2MA:
+          tmp = "2MA";
+          tmp_unit = "mA";
+          break;
+        case RANGE_20MA:
+          tmp = "20MA";
+          tmp_unit = "mA";
+          break;
+        case RANGE_200MA:
+          tmp = "200MA";
+          tmp_unit = "mA";
+          break;
+      }
+      return len + snprintf(str + len, size - len, ",\"range\":\"%s\",\"unit\":\"%s\"", tmp, tmp_unit);
+    case FIELD_STATE:
+      switch(control->state) {
+        case DISABLE:
+          tmp = "DISABLE";
+          break;
+        case STANDBY:
+          tmp = "STANDBY";
+          break;
+        case ENABLE:
+          tmp = "ENABLE";
+          break;
+      }
+      return len + snprintf(str + len, size - len, ",\"state\":\"%s\"", tmp);
+    case FIELD_MODE:
+      switch(control->mode) {
+        case FV:
+          tmp = "FV";
+          break;
+        case FI:
+          tmp = "FI";
+          break;
+      }
+      return len + snprintf(str + len, size - len, ",\"mode\":\"%s\"", tmp);
+    case FIELD_SENSE:
+      switch(control->sense) {
+        case LOCAL:
+          tmp = "LOCAL";
+          break;
+        case REMOTE:
+          tmp = "REMOTE";
+          break;
+      }
+      return len + snprintf(str + len, size - len, ",\"sense\":\"%s\"", tmp);
+    default:
+      return len + snprintf(str + len, size - len, ",\"%s\":\"%f\"", smu_field_name[field], smu_field_value(control, field));
+  }
+}
+
+// Publish subscribed fields that are due and have changed
+//  - returns time until the next changed field is due (in ms),
+//    SMU_PROCESS_IDLE if nothing is waiting (next change wakes the
+//    publishing task, see smu_write_end)
+uint32_t smu_process() {
+  uint16_t updated[NUM_CH];
+  uint32_t now = millis();
+  uint32_t wait = SMU_PROCESS_IDLE;
+
+  // Take changed fields
+  portENTER_CRITICAL(&smu_control_mux);
+  for (int i = 0; i < NUM_CH; i++) {
+    updated[i] = smu_control_updated[i];
+    smu_control_updated[i] = 0;
+  }
+  portEXIT_CRITICAL(&smu_control_mux);
+
+  xSemaphoreTake(smu_sub_lock, portMAX_DELAY);
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_control_t control;
+    bool pending = false;
+
+    // Merge changes into subscriptions
+    for (int c = 0; c < WS_CLIENT_MAX; c++) {
+      smu_sub[c][i].dirty |= updated[i] & smu_sub[c][i].fields;
+      if (smu_sub[c][i].dirty) pending = true;
+    }
+    if (!pending) {
+      smu_sub_update_wake(i);
+      continue;
+    }
+
+    // Publish from one consistent snapshot of the channel
+    uint32_t version = smu_get_control(smu_int2ch(i), &control);
+
+    for (int c = 0; c < WS_CLIENT_MAX; c++) {
+      smu_sub_t *sub = &smu_sub[c][i];
+      uint16_t send = 0;
+
+      if (sub->dirty == 0) continue;
+
+      // Get fields which are due and moved outside their deadband
+      for (int f = 0; f < FIELD_NUM; f++) {
+        if (!((sub->dirty >> f) & 1)) continue;
+        if (now - sub->millis_last[f] < sub->period[f]) {
+          wait = std::min(wait, sub->period[f] - (now - sub->millis_last[f]));
+          continue;
         }
-        if (smu_control_updated[i] & (1 << FIELD_SENSE)) {
-          const char *tmp;
-          switch(smu_control[i].sense) {
-            case LOCAL:
-              tmp = "LOCAL";
-              break;
-            case REMOTE:
-              tmp = "REMOTE";
-              break;
-          }
-          snprintf(str, sizeof(str), "%s,\"sense\":\"%s\"", str, tmp);
+
+        if (f <= FIELD_ANALOG_LAST && sub->deadband[f] > 0
+            && fabsf(smu_field_value(&control, f) - sub->last[f]) <= sub->deadband[f]) {
+          sub->dirty &= ~(1 << f);
+          continue;
         }
+        send |= (1 << f);
+      }
+      if (send == 0) continue;
+
+      char str[1024];
+      int len = snprintf(str, sizeof(str), "{\"type\":\"smu\",\"ch\":\"%d\",\"ver\":%u", i, version);
+      for (int f = 0; f < FIELD_NUM; f++) {
+        if (!((send >> f) & 1)) continue;
 
-        snprintf(str, sizeof(str), "%s}", str);
-        websocket_send(str);
-        smu_control_updated[i] = 0;
+        len = smu_format_field(str, len, sizeof(str), &control, f);
+      }
+      if (len < (int) sizeof(str)) snprintf(str + len, sizeof(str) - len, "}");
+
+      // Fields stay dirty if the client queue can't take the message
+      if (ws_queue_send(c, str, WS_MSG_STATUS)) {
+        for (int f = 0; f < FIELD_NUM; f++) {
+          if (!((send >> f) & 1)) continue;
+          if (f <= FIELD_ANALOG_LAST) sub->last[f] = smu_field_value(&control, f);
+          sub->millis_last[f] = now;
+        }
+        sub->dirty &= ~send;
+      } else {
+        wait = std::min(wait, (uint32_t) SMU_PROCESS_RETRY);
       }
     }
+    smu_sub_update_wake(i);
   }
+  xSemaphoreGive(smu_sub_lock);
+
+  return wait;
 }
@@ -1,36 +1,12 @@
 #ifndef QUAD_SMU_H
 #define QUAD_SMU_H
 
+#include "board.h"
 #include "ad7177_lib.h"
 #include "ad5522_lib.h"
 
 #define HOST_NAME "quad_smu"
 
-/****************************************
- *  SPI
- ***************************************/
-
-// Default VSPI(SPI3) Pins - use for ADC data
-#define SPIBUS_ADC    VSPI
-#define PIN_ADC_CS    5 // PIN_VSPI_CS
-#define PIN_ADC_SCLK 18 // PIN_VSPI_SCLK
-#define PIN_ADC_MOSI 23 // PIN_VSPI_MOSI
-#define PIN_ADC_MISO 19 // PIN_VSPI_MISO
-#define PIN_ADC_INT  17
-
-// Default HSPI(SPI2) Pins - use for control (normal SPI)
-#define PIN_HSPI_MISO 12
-#define PIN_HSPI_MOSI 13
-#define PIN_HSPI_SCLK 14
-
-// PMU interface pins
-#define PIN_PMU_CS    32
-#define PIN_PMU_RST   4
-#define PIN_PMU_BUSY  25
-
-// Inamp interface pins
-#define PIN_INAMP0_CS  15
-
 /****************************************
  *  System Parameters
  ***************************************/
@@ -42,7 +18,9 @@
  *  SMU Defines
  ***************************************/
 
-typedef enum {
+// NUM_CH comes from the board topology (board.h), channels past CH3
+//  are numbered on
+typedef enum : uint8_t {
   CH0 = 0,
   CH1 = 1,
   CH2 = 2,
@@ -88,6 +66,99 @@ typedef enum {
   DAC_CLHI
 } smu_dac_t;
 
+// Telemetry field mask for all fields (see smu_field_mask)
+#define SMU_FIELD_ALL 0x0FFF
+
+// smu_process() has nothing waiting on a period
+#define SMU_PROCESS_IDLE 0xFFFFFFFF
+
+// Sweep definition (see smu_sweep_start)
+#define SMU_SWEEP_POINTS_MAX 10000
+
+typedef struct {
+  smu_ch_t  ch;
+  smu_dac_t dac;        // DAC_FV or DAC_FI
+  float     start;
+  float     stop;
+  uint16_t  points;
+  uint8_t   settle;     // Sample sets discarded after each step
+  bool      quiet;      // Don't send results (self benchmark)
+} smu_sweep_t;
+
+// Current auto-ranging in FV (see smu_set_autorange)
+//  - ranges up as soon as |mi| is above up * full scale of the range
+//  - ranges down once |mi| has been below down * full scale of a lower
+//    range for hold sample sets (straight to the lowest such range)
+//  - up/down is the hysteresis band, down must be below up
+typedef struct {
+  bool    enable;
+  uint8_t min;        // smu_range_t, lowest range used
+  uint8_t max;        // smu_range_t, highest range used
+  float   up;         // Fraction of full scale
+  float   down;       // Fraction of full scale of the lower range
+  uint8_t hold;       // Sample sets below down before ranging down
+  uint8_t settle;     // Sample sets discarded after a switch (manual too)
+} smu_autorange_t;
+
+// MV auto-gain of the in-amp (see smu_set_autogain)
+//  - gain steps down as soon as the in-amp output is above up * ADC_REF
+//  - gain steps up once the output at the higher gain would have been
+//    below down * ADC_REF for hold sample sets (straight to the highest
+//    such gain)
+//  - gains from IX0P5/OX1 (full +-10V) to IX128/OX1P375
+typedef struct {
+  bool    enable;
+  float   up;         // Fraction of ADC input range
+  float   down;       // Fraction of ADC input range (< up)
+  uint8_t hold;       // Sample sets below down before more gain
+  uint8_t settle;     // Sample sets discarded after a gain change
+} smu_autogain_t;
+
+// MV auto-zero (see smu_set_autozero)
+//  - every ratio MV samples the in-amp input is shorted for one sample
+//    (offset), then switched to the +20mV and -20mV test mux for one
+//    sample each (gain), before going back to the input
+//  - offset and gain are running averages, subtracted/divided out of
+//    every MV sample (reset when the in-amp gain changes)
+typedef struct {
+  bool     enable;
+  uint16_t ratio;     // MV samples measured per zero cycle
+  bool     ref;       // Measure gain on the test mux as well
+  uint8_t  settle;    // Sample sets whose MV is discarded after each input switch
+  float    filter;    // Weight of a new estimate (0-1]
+} smu_autozero_t;
+
+// In-amp internal calibration schedule (see smu_inamp_cal_process)
+#define SMU_INAMP_CAL_INTERVAL_S 3600   // Default interval (in s)
+#define SMU_INAMP_CAL_TEMP_DELTA 2.0F   // Default temperature change (in C)
+
+typedef struct {
+  uint32_t interval_s;    // Calibrate every interval (in s, 0 = off)
+  float    temp_delta;    // Calibrate when temperature moved (in C, 0 = off)
+} smu_inamp_cal_t;
+
+// Housekeeping readings (see smu_set_hk_ratio)
+//  - slip into the sample stream once every ratio sample sets, each one
+//    costs about one sample set: ADC die temperature and reference are
+//    two extra ADC conversions along with a set, every SMU_HK_PMU_EVERY
+//    readings the PMU die temperature takes the MI sample of CH0 instead
+//    (MEASOUT on the thermal sensor, the samples converted while it
+//    switches are dropped, the next reading waits longer to make up)
+//  - the ADC die temperature is the board temperature of the in-amp
+//    calibration schedule, the reference reading is a health check of
+//    the ADC (not applied to readings)
+#define SMU_HK_RATIO     1000   // Default sample sets per reading (0 = off)
+#define SMU_HK_PMU_EVERY 4      // Readings per PMU temperature reading
+
+typedef struct {
+  float    adc_temp;    // ADC die temperature (in C, NAN until measured)
+  float    pmu_temp;    // PMU die temperature (in C, NAN until measured)
+  float    ref;         // Reference measured by the ADC (in V)
+  float    ref_corr;    // ADC_REF / ref, filtered (not applied)
+  bool     ref_ok;      // Last reference reading was within tolerance
+  uint32_t ms;          // Time of last reading (millis)
+} smu_hk_t;
+
 typedef enum {
   RATE_FAST,
   RATE_MED,
@@ -95,20 +166,118 @@ typedef enum {
   RATE_SLOW
 } smu_rate_t;
 
+#define SMU_DAC_NUM 6     // smu_dac_t
+#define SMU_ADC_NUM 2     // smu_adc_t
+
+// Channel calibration, applied as val * gain + offset
+//  - dac: before converting a set value to a code
+//  - adc: after converting a code to a measured value
+typedef struct {
+  float dac_gain[SMU_DAC_NUM];
+  float dac_offset[SMU_DAC_NUM];  // (in V or A)
+  float adc_gain[SMU_ADC_NUM];
+  float adc_offset[SMU_ADC_NUM];  // (in V or A)
+} smu_cal_t;
+
+// Channel setup restored at boot or from a preset
+typedef struct {
+  uint8_t state;      // smu_state_t
+  uint8_t mode;       // smu_mode_t
+  uint8_t range;      // smu_range_t
+  uint8_t sense;      // smu_sense_t
+  uint8_t gain_in;    // ada4254_gainin_t
+  uint8_t gain_out;   // ada4254_gainout_t
+  float fv;
+  float fi;
+  float clli;
+  float clhi;
+  float cllv;
+  float clhv;
+} smu_setup_t;
+
+// Everything persisted (see smu_store.h)
+typedef struct {
+  smu_setup_t setup[NUM_CH];
+  smu_cal_t   cal[NUM_CH];
+  uint16_t    adc_rate;   // ad7177_sample_rate_t
+} smu_config_t;
+
+// Channel state (read with smu_get_control)
+typedef struct {
+  float fv;
+  float fi;
+  float mv;
+  float mi;
+  float clli;
+  float clhi;
+  float cllv;
+  float clhv;
+  smu_range_t range;
+  smu_state_t state;
+  smu_mode_t  mode;
+  smu_sense_t sense;
+  float mv_gain;
+  float mi_mult;
+} smu_control_t;
+
 /****************************************
  *  SMU Functions
  ***************************************/
 
-void adc_callback(int64_t *results, uint16_t valid);
-void smu_init();
+void adc_callback(uint32_t *results, uint16_t valid, const ad7177_set_t *set);
+void smu_init(const smu_config_t *config = NULL);
+void smu_default_config(smu_config_t *config);
+void smu_get_config(smu_config_t *config);
+bool smu_apply_config(const smu_config_t *config);
+void smu_get_cal(smu_ch_t ch, smu_cal_t *cal);
+void smu_set_cal(smu_ch_t ch, const smu_cal_t *cal);
 void smu_set_state(smu_ch_t ch, smu_state_t state);
 void smu_set_mode(smu_ch_t ch, smu_mode_t mode);
 void smu_set_range(smu_ch_t ch, smu_range_t range);
 void smu_set_dac(smu_ch_t ch, smu_dac_t dac, float val);
 void smu_set_rate(smu_rate_t rate);
+void smu_default_autorange(smu_autorange_t *autorange);
+bool smu_set_autorange(smu_ch_t ch, const smu_autorange_t *autorange);
+void smu_get_autorange(smu_ch_t ch, smu_autorange_t *autorange);
+void smu_default_autogain(smu_autogain_t *autogain);
+bool smu_set_autogain(smu_ch_t ch, const smu_autogain_t *autogain);
+void smu_get_autogain(smu_ch_t ch, smu_autogain_t *autogain);
+void smu_default_autozero(smu_autozero_t *autozero);
+bool smu_set_autozero(smu_ch_t ch, const smu_autozero_t *autozero);
+void smu_get_autozero(smu_ch_t ch, smu_autozero_t *autozero);
+void smu_get_zero(smu_ch_t ch, float *offset, float *gain);
+void smu_ctrl_take();
+void smu_ctrl_give();
+bool smu_inamp_check(smu_ch_t ch);
+void smu_switch_process(smu_ch_t ch);
+bool smu_inamp_fault_process();
+void smu_inamp_cal_process();
+void smu_inamp_cal_request(smu_ch_t ch);
+uint32_t smu_inamp_cal_last(smu_ch_t ch);
+void smu_set_inamp_cal(const smu_inamp_cal_t *cal);
+void smu_get_inamp_cal(smu_inamp_cal_t *cal);
+bool smu_set_meas_rate(smu_ch_t ch, smu_adc_t adc, float hz);
+float smu_get_meas_rate(smu_ch_t ch, smu_adc_t adc);
+void smu_set_hk_ratio(uint16_t ratio);
+uint16_t smu_get_hk_ratio();
+void smu_get_hk(smu_hk_t *hk);
+void smu_hk_process();
 void smu_dac_v2d(smu_ch_t ch, smu_dac_t dac, smu_range_t range, float *val, uint16_t *code);
+ad5522_ch_t smu2ad5522_ch(smu_ch_t ch);
+ad5522_dac_t smu_dac2ad5522(smu_dac_t dac, smu_range_t range);
 float smu_adc_d2v(smu_ch_t ch, smu_adc_t adc, smu_range_t range, uint32_t code);
+bool smu_sweep_start(const smu_sweep_t *sweep);
+void smu_sweep_stop();
+bool smu_sweep_active();
+uint16_t smu_sweep_done();
+uint32_t smu_get_control(smu_ch_t ch, smu_control_t *control);
+uint32_t smu_control_version(smu_ch_t ch);
 void smu_queue_update();
-void smu_process();
+uint32_t smu_process();
+bool smu_subscribe(uint8_t client, smu_ch_t ch, uint16_t fields, uint16_t period, float deadband);
+void smu_unsubscribe(uint8_t client, smu_ch_t ch, uint16_t fields);
+void smu_client_connect(uint8_t client);
+void smu_client_disconnect(uint8_t client);
+uint16_t smu_field_mask(const char *name);
 
 #endif
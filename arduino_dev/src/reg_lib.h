@@ -0,0 +1,115 @@
+#ifndef REG_LIB_H
+#define REG_LIB_H
+
+#include <stdint.h>
+
+/*
+ * Register layout description
+ *  - a field is WIDTH bits at OFFSET of a register, with its reset value
+ *    and access rights, a register is the list of its fields
+ *  - packing, unpacking, diff and read-back masks are constexpr, so a
+ *    write of constant fields is one constant and the verify mask of a
+ *    register follows its fields
+ *  - a description checks itself when it is used (fields fit 32 bits and
+ *    don't overlap, values fit their field), it has no target dependency
+ *    so it builds on the host as well
+ */
+
+/****************************************
+ *  Fields
+ ***************************************/
+
+typedef enum : uint8_t {
+  REG_RW,     // Reads back as written
+  REG_RO,     // Status, writes are ignored
+  REG_WO      // Command, reads back something else (or clears itself)
+} reg_access_t;
+
+template <uint8_t OFFSET, uint8_t WIDTH, uint32_t RESET = 0, reg_access_t ACCESS = REG_RW>
+struct reg_field {
+  static_assert(WIDTH > 0 && OFFSET + WIDTH <= 32, "field must fit 32 bits");
+  static_assert(RESET < (1ULL << WIDTH), "reset value must fit field");
+
+  static constexpr uint8_t      offset = OFFSET;
+  static constexpr uint8_t      width  = WIDTH;
+  static constexpr reg_access_t access = ACCESS;
+  static constexpr uint32_t     mask   = (uint32_t) ((1ULL << WIDTH) - 1) << OFFSET;
+  static constexpr uint32_t     reset  = RESET << OFFSET;
+
+  // Value in place, bits above the field width are dropped
+  static constexpr uint32_t pack(uint32_t val) {
+    return (val << OFFSET) & mask;
+  }
+
+  // Value of field in register
+  static constexpr uint32_t unpack(uint32_t reg) {
+    return (reg & mask) >> OFFSET;
+  }
+
+  // Register with field replaced
+  static constexpr uint32_t set(uint32_t reg, uint32_t val) {
+    return (reg & ~mask) | pack(val);
+  }
+};
+
+template <uint8_t OFFSET, uint8_t WIDTH, uint32_t RESET, reg_access_t ACCESS>
+constexpr uint32_t reg_field<OFFSET, WIDTH, RESET, ACCESS>::mask;
+template <uint8_t OFFSET, uint8_t WIDTH, uint32_t RESET, reg_access_t ACCESS>
+constexpr uint32_t reg_field<OFFSET, WIDTH, RESET, ACCESS>::reset;
+
+/****************************************
+ *  Registers
+ ***************************************/
+
+// Register of fields F (listed in any order, pack takes the values in
+//  the same order)
+template <typename... F>
+struct reg_map;
+
+template <>
+struct reg_map<> {
+  static constexpr uint32_t mask   = 0;
+  static constexpr uint32_t reset  = 0;
+  static constexpr uint32_t write  = 0;
+  static constexpr uint32_t verify = 0;
+
+  static constexpr uint32_t pack() {
+    return 0;
+  }
+};
+
+template <typename F, typename... R>
+struct reg_map<F, R...> {
+  typedef reg_map<R...> rest;
+
+  static_assert((F::mask & rest::mask) == 0, "register fields overlap");
+
+  static constexpr uint32_t mask   = F::mask | rest::mask;      // Bits of all fields
+  static constexpr uint32_t reset  = F::reset | rest::reset;    // Value after reset
+  static constexpr uint32_t write  = (F::access != REG_RO ? F::mask : 0) | rest::write;
+  static constexpr uint32_t verify = (F::access == REG_RW ? F::mask : 0) | rest::verify;
+
+  // Register from one value per field (a value count that doesn't match
+  //  the fields doesn't compile)
+  template <typename... V>
+  static constexpr uint32_t pack(uint32_t val, V... vals) {
+    return F::pack(val) | rest::pack(vals...);
+  }
+
+  // Writable bits that differ between two register values
+  static constexpr uint32_t diff(uint32_t a, uint32_t b) {
+    return (a ^ b) & write;
+  }
+
+  // Read-back matches what was written (bits that read back as written)
+  static constexpr bool check(uint32_t written, uint32_t read) {
+    return ((written ^ read) & verify) == 0;
+  }
+};
+
+template <typename F, typename... R> constexpr uint32_t reg_map<F, R...>::mask;
+template <typename F, typename... R> constexpr uint32_t reg_map<F, R...>::reset;
+template <typename F, typename... R> constexpr uint32_t reg_map<F, R...>::write;
+template <typename F, typename... R> constexpr uint32_t reg_map<F, R...>::verify;
+
+#endif
@@ -0,0 +1,260 @@
+#include "hal.h"
+#include <strings.h>
+#include "seq_lib.h"
+#include "event_lib.h"
+#include "smu_bench.h"
+#include "log_lib.h"
+
+/*
+ * Scripted test sequence
+ *  - a script is parsed into steps once (seq_load), steps run from the
+ *    EVENT_SEQ_STEP handler in the main loop
+ *  - steps run back to back up to the next wait, which schedules the
+ *    next EVENT_SEQ_STEP
+ *  - steps are held off while the self benchmark keeps outputs in HiZ
+ *  - loading, stopping and stepping are guarded by seq_lock (websocket
+ *    commands come from the network task)
+ */
+
+const char *seq_default =
+  "# Step CH0 through 0-3V every 5s\n"
+  "wait 5000\n"
+  "state 0 disable\n"
+  "wait 5000\n"
+  "fv 0 0\n"
+  "state 0 enable\n"
+  "wait 5000\n"
+  "fv 0 1\n"
+  "wait 5000\n"
+  "fv 0 2\n"
+  "wait 5000\n"
+  "fv 0 3\n"
+  "wait 5000\n"
+  "repeat\n";
+
+seq_step_t seq_steps[SEQ_STEPS_MAX];
+uint8_t seq_num = 0;
+uint8_t seq_index = 0;
+bool seq_active = false;
+SemaphoreHandle_t seq_lock;
+
+const char *seq_state_name[] = {"disable", "standby", "enable"};
+const char *seq_mode_name[]  = {"fv", "fi"};
+const char *seq_range_name[] = {"5ua", "20ua", "200ua", "2ma", "20ma", "200ma"};
+
+// Order of smu_dac_t
+const char *seq_dac_name[]   = {"fi", "fv", "cllv", "clhv", "clli", "clhi"};
+
+#define SEQ_NAMES(names) (sizeof(names) / sizeof(names[0]))
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Index of name in list, -1 if not found
+int seq_find(const char *name, const char **names, int num) {
+  for (int i = 0; i < num; i++) {
+    if (strcasecmp(name, names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+// Parse one script line into step
+//  - returns 1 for a step, 0 for an empty line, -1 on error
+int seq_parse_line(char *line, seq_step_t *step) {
+  char cmd[8] = "";
+  char arg[8] = "";
+  unsigned ch;
+  int n;
+
+  char *comment = strchr(line, '#');
+  if (comment) *comment = '\0';
+
+  n = sscanf(line, "%7s", cmd);
+  if (n < 1) return 0;
+
+  memset(step, 0, sizeof(seq_step_t));
+
+  if (strcasecmp(cmd, "repeat") == 0) {
+    step->op = SEQ_REPEAT;
+    return 1;
+  }
+
+  if (strcasecmp(cmd, "wait") == 0) {
+    step->op = SEQ_WAIT;
+    return (sscanf(line, "%*s %u", &step->ms) == 1) ? 1 : -1;
+  }
+
+  if (sscanf(line, "%*s %u %7s", &ch, arg) != 2 || ch >= NUM_CH) return -1;
+  step->ch = ch;
+
+  if (strcasecmp(cmd, "state") == 0) {
+    step->op = SEQ_STATE;
+    n = seq_find(arg, seq_state_name, SEQ_NAMES(seq_state_name));
+  } else if (strcasecmp(cmd, "mode") == 0) {
+    step->op = SEQ_MODE;
+    n = seq_find(arg, seq_mode_name, SEQ_NAMES(seq_mode_name));
+  } else if (strcasecmp(cmd, "range") == 0) {
+    step->op = SEQ_RANGE;
+    n = seq_find(arg, seq_range_name, SEQ_NAMES(seq_range_name));
+  } else {
+    step->op = SEQ_DAC;
+    n = seq_find(cmd, seq_dac_name, SEQ_NAMES(seq_dac_name));
+    if (sscanf(line, "%*s %*u %f", &step->val) != 1) return -1;
+  }
+  if (n < 0) return -1;
+
+  step->arg = n;
+  return 1;
+}
+
+void seq_run(const seq_step_t *step) {
+  switch (step->op) {
+    case SEQ_STATE:
+      smu_set_state((smu_ch_t) step->ch, (smu_state_t) step->arg);
+      break;
+    case SEQ_MODE:
+      smu_set_mode((smu_ch_t) step->ch, (smu_mode_t) step->arg);
+      break;
+    case SEQ_RANGE:
+      smu_set_range((smu_ch_t) step->ch, (smu_range_t) step->arg);
+      break;
+    case SEQ_DAC:
+      smu_set_dac((smu_ch_t) step->ch, (smu_dac_t) step->arg, step->val);
+      break;
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+void seq_init() {
+  seq_lock = xSemaphoreCreateMutex();
+  seq_num = 0;
+  seq_index = 0;
+  seq_active = false;
+}
+
+// Parse script and replace current sequence (stops it)
+//  - returns false (sequence unchanged) on a bad line or too many steps
+bool seq_load(const char *script) {
+  static seq_step_t steps[SEQ_STEPS_MAX];
+  char line[64];
+  uint8_t num = 0;
+  int line_num = 0;
+
+  while (*script) {
+    const char *end = strchr(script, '\n');
+    size_t len = end ? (size_t) (end - script) : strlen(script);
+    seq_step_t step;
+
+    line_num++;
+    if (len >= sizeof(line)) {
+      LOG_W(SMU, "sequence line %d too long", line_num);
+      return false;
+    }
+    memcpy(line, script, len);
+    line[len] = '\0';
+    script += end ? len + 1 : len;
+
+    int ret = seq_parse_line(line, &step);
+    if (ret < 0) {
+      LOG_W(SMU, "sequence line %d not valid", line_num);
+      return false;
+    }
+    if (ret == 0) continue;
+
+    if (num >= SEQ_STEPS_MAX) {
+      LOG_W(SMU, "sequence longer than %d steps", SEQ_STEPS_MAX);
+      return false;
+    }
+    steps[num++] = step;
+  }
+
+  seq_stop();
+
+  xSemaphoreTake(seq_lock, portMAX_DELAY);
+  memcpy(seq_steps, steps, num * sizeof(seq_step_t));
+  seq_num = num;
+  seq_index = 0;
+  xSemaphoreGive(seq_lock);
+
+  LOG_I(SMU, "sequence loaded, %d steps", num);
+  return true;
+}
+
+// Start loaded sequence from its first step
+bool seq_start() {
+  xSemaphoreTake(seq_lock, portMAX_DELAY);
+  bool ret = (seq_num > 0);
+  seq_index = 0;
+  seq_active = ret;
+  xSemaphoreGive(seq_lock);
+
+  if (ret) event_post(EVENT_SEQ_STEP);
+  return ret;
+}
+
+void seq_stop() {
+  xSemaphoreTake(seq_lock, portMAX_DELAY);
+  seq_active = false;
+  event_cancel(EVENT_SEQ_STEP);
+  xSemaphoreGive(seq_lock);
+}
+
+bool seq_running() {
+  return seq_active;
+}
+
+// Run steps up to the next wait (EVENT_SEQ_STEP handler)
+void seq_step() {
+  bool repeated = false;
+
+  xSemaphoreTake(seq_lock, portMAX_DELAY);
+  if (!seq_active) {
+    xSemaphoreGive(seq_lock);
+    return;
+  }
+
+  // Benchmark keeps outputs in HiZ, try again later
+  if (smu_bench_running()) {
+    event_after(EVENT_SEQ_STEP, SEQ_HOLD_MS);
+    xSemaphoreGive(seq_lock);
+    return;
+  }
+
+  while (seq_active) {
+    if (seq_index >= seq_num) {
+      LOG_I(SMU, "sequence done");
+      seq_active = false;
+      break;
+    }
+
+    seq_step_t *step = &seq_steps[seq_index++];
+
+    if (step->op == SEQ_WAIT) {
+      event_after(EVENT_SEQ_STEP, step->ms);
+      break;
+    }
+
+    if (step->op == SEQ_REPEAT) {
+      // Sequence without a wait would never give the loop back
+      if (repeated) {
+        LOG_W(SMU, "sequence repeats without wait, stopped");
+        seq_active = false;
+        break;
+      }
+      repeated = true;
+      seq_index = 0;
+      continue;
+    }
+
+    seq_run(step);
+  }
+  xSemaphoreGive(seq_lock);
+}
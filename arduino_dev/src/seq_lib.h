@@ -0,0 +1,55 @@
+#ifndef SEQ_LIB_H
+#define SEQ_LIB_H
+
+#include "hal.h"
+#include "quad_smu.h"
+
+/****************************************
+ *  Test Sequence
+ ***************************************/
+
+#define SEQ_STEPS_MAX 64
+#define SEQ_HOLD_MS   100     // Retry period while benchmark holds outputs (in ms)
+
+/*
+ * Script, one command per line ('#' starts a comment)
+ *   wait <ms>
+ *   state <ch> disable|standby|enable
+ *   mode <ch> fv|fi
+ *   range <ch> 5ua|20ua|200ua|2ma|20ma|200ma
+ *   fv|fi|cllv|clhv|clli|clhi <ch> <val>
+ *   repeat                    (start again from the first line)
+ */
+
+typedef enum {
+  SEQ_WAIT,
+  SEQ_STATE,
+  SEQ_MODE,
+  SEQ_RANGE,
+  SEQ_DAC,
+  SEQ_REPEAT
+} seq_op_t;
+
+typedef struct {
+  uint8_t  op;        // seq_op_t
+  uint8_t  ch;
+  uint8_t  arg;       // State, mode, range or dac
+  float    val;       // Dac value (in V or A)
+  uint32_t ms;        // Wait time
+} seq_step_t;
+
+// Demo sequence run when no /sequence.txt is found
+extern const char *seq_default;
+
+/****************************************
+ *  Sequence Functions
+ ***************************************/
+
+void seq_init();
+bool seq_load(const char *script);
+bool seq_start();
+void seq_stop();
+bool seq_running();
+void seq_step();
+
+#endif
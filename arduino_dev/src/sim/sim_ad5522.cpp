@@ -0,0 +1,263 @@
+#include "sim_devices.h"
+
+/*
+ * AD5522 model
+ *  - 29-bit frames (rw, ch mask, mode, 22-bit data) are shifted in while
+ *    SYNC is low and decoded when SYNC goes high
+ *  - a read frame loads the register into the shift register, it is
+ *    clocked out (24 bits) in the next SYNC frame
+ *  - only X1 is used for the DAC outputs (the driver writes X1, M/C are
+ *    stored for read-back)
+ *  - BUSY is always high (DAC updates complete instantly)
+ */
+
+#define AD5522_MODE_REG   0
+#define AD5522_MODE_M     1
+#define AD5522_MODE_C     2
+#define AD5522_MODE_X1    3
+
+// DAC addresses (see ad5522_dac_t)
+#define AD5522_ADDR_FI    0x08    // + range
+#define AD5522_ADDR_FV    0x0D
+#define AD5522_ADDR_CLLI  0x14
+#define AD5522_ADDR_CLLV  0x15
+#define AD5522_ADDR_CLHI  0x1C
+#define AD5522_ADDR_CLHV  0x1D
+
+// PMU register bits
+#define PMU_CH_EN         (1UL << 21)
+#define PMU_HIZ           (1UL << 20)
+#define PMU_FI            (1UL << 19)
+#define PMU_RANGE(r)      (((r) >> 15) & 7)
+#define PMU_MEAS_SEL(r)   (((r) >> 13) & 3)
+#define PMU_CLAMP_EN      (1UL << 9)
+#define PMU_ALARM_BAR     (3UL << 5)
+#define PMU_WRITE_MASK    0x3FFF80
+
+#define SYS_MEAS_GAIN(r)  (((r) >> 6) & 3)
+
+#define AD5522_V_MAX      12.0F   // Output swing limit (supplies)
+
+SimAD5522::SimAD5522(int8_t busy) {
+  writes = 0;
+  reads  = 0;
+
+  _sysctrl = (1 << 5);    // Thermal shutdown enabled
+  for (int ch = 0; ch < 4; ch++) {
+    _pmuctrl[ch] = (3UL << 15) | (3UL << 13);
+    for (int addr = 0; addr < 64; addr++) {
+      _x1[ch][addr] = 0x8000;
+      _m[ch][addr]  = 0xFFFF;
+      _c[ch][addr]  = 0x8000;
+    }
+    _x1[ch][AD5522_ADDR_CLLI] = 0x0000;
+    _x1[ch][AD5522_ADDR_CLLV] = 0x0000;
+    _x1[ch][AD5522_ADDR_CLHI] = 0xFFFF;
+    _x1[ch][AD5522_ADDR_CLHV] = 0xFFFF;
+    _dut[ch] = NULL;
+  }
+  _offset     = 0xA492;
+  _rsense_ext = 50;
+  _temp_c     = 25;
+
+  _frame = 0;
+  _count = 0;
+  _read_pending = false;
+  _reading      = false;
+  _read_data    = 0;
+
+  sim_pin_drive(busy, HIGH);
+}
+
+/**************************************************
+ *
+ * SPI Interface
+ *
+ **************************************************/
+
+void SimAD5522::select() {
+  _frame = 0;
+  _count = 0;
+  _reading = _read_pending;
+  _read_pending = false;
+}
+
+void SimAD5522::deselect() {
+  if (!_reading && _count == 4) frame(_frame & 0x1FFFFFFF);
+  _reading = false;
+  _count = 0;
+}
+
+uint8_t SimAD5522::transfer(uint8_t mosi) {
+  uint8_t miso = 0;
+
+  if (_reading) {
+    if (_count < 3) miso = (_read_data >> (8*(2 - _count))) & 0xFF;
+    if (_count == 2) reads++;
+  } else {
+    _frame = (_frame << 8) | mosi;
+  }
+  _count++;
+
+  return miso;
+}
+
+/**************************************************
+ *
+ * Frame Decode
+ *
+ **************************************************/
+
+void SimAD5522::frame(uint32_t word) {
+  bool     rw   = (word >> 28) & 1;
+  uint8_t  ch   = (word >> 24) & 0xF;
+  uint8_t  mode = (word >> 22) & 3;
+  uint32_t data = word & 0x3FFFFF;
+  uint8_t  addr = (data >> 16) & 0x3F;
+
+  writes++;
+
+  // Read back selected register (first channel in mask)
+  if (rw) {
+    int rch = 0;
+    while (rch < 3 && !((ch >> rch) & 1)) rch++;
+
+    if (mode == AD5522_MODE_REG) {
+      _read_data = (ch == 0) ? _sysctrl : (_pmuctrl[rch] | PMU_ALARM_BAR);
+    } else {
+      uint16_t *reg = (mode == AD5522_MODE_X1) ? _x1[rch] : (mode == AD5522_MODE_M) ? _m[rch] : _c[rch];
+      _read_data = ((uint32_t) addr << 16) | reg[addr];
+    }
+    _read_pending = true;
+    return;
+  }
+
+  if (mode == AD5522_MODE_REG) {
+    if (ch == 0) {
+      _sysctrl = data;
+    } else {
+      for (int i = 0; i < 4; i++) {
+        if ((ch >> i) & 1) _pmuctrl[i] = data & PMU_WRITE_MASK;
+      }
+    }
+    return;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    if (!((ch >> i) & 1)) continue;
+
+    switch (mode) {
+      case AD5522_MODE_X1: _x1[i][addr] = data & 0xFFFF; break;
+      case AD5522_MODE_M:  _m[i][addr]  = data & 0xFFFF; break;
+      case AD5522_MODE_C:  _c[i][addr]  = data & 0xFFFF; break;
+    }
+  }
+}
+
+/**************************************************
+ *
+ * Analog Model
+ *
+ **************************************************/
+
+float SimAD5522::rsense(int ch) {
+  switch (PMU_RANGE(_pmuctrl[ch])) {
+    case 0: return 200e3F;
+    case 1: return 50e3F;
+    case 2: return 5e3F;
+    case 3: return 500;
+  }
+  return _rsense_ext;
+}
+
+// Voltage DAC output (FV and voltage clamps)
+float SimAD5522::dac_v(uint16_t code) {
+  return 4.5F * SIM_VREF * code / 65536 - 3.5F * SIM_VREF * _offset / 65536;
+}
+
+// Current DAC output (FI and current clamps) for channel's range
+float SimAD5522::dac_i(int ch, uint16_t code) {
+  return 4.5F * SIM_VREF * ((int32_t) code - 32768) / 65536 / (10 * rsense(ch));
+}
+
+void SimAD5522::set_dut(int ch, sim_dut_t *dut) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _dut[ch & 3] = dut;
+}
+
+void SimAD5522::set_rsense_ext(float r) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _rsense_ext = r;
+}
+
+void SimAD5522::set_temp(float temp_c) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _temp_c = temp_c;
+}
+
+bool SimAD5522::output(int ch, float *v, float *i) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  uint32_t pmu = _pmuctrl[ch];
+  sim_dut_t *dut = _dut[ch];
+
+  *v = 0;
+  *i = 0;
+  if (!(pmu & PMU_CH_EN) || (pmu & PMU_HIZ) || dut == NULL) return false;
+
+  bool  clamp = pmu & PMU_CLAMP_EN;
+  float clli = dac_i(ch, _x1[ch][AD5522_ADDR_CLLI]);
+  float clhi = dac_i(ch, _x1[ch][AD5522_ADDR_CLHI]);
+  float cllv = dac_v(_x1[ch][AD5522_ADDR_CLLV]);
+  float clhv = dac_v(_x1[ch][AD5522_ADDR_CLHV]);
+
+  if (pmu & PMU_FI) {
+    // Force current, voltage clamp takes over when DUT voltage is outside
+    *i = dac_i(ch, _x1[ch][AD5522_ADDR_FI + std::min(PMU_RANGE(pmu), (uint32_t) 4)]);
+    sim_dut_force_i(dut, *i, v);
+    float vmax = clamp ? std::min(clhv, AD5522_V_MAX) : AD5522_V_MAX;
+    float vmin = clamp ? std::max(cllv, -AD5522_V_MAX) : -AD5522_V_MAX;
+    if (*v > vmax || *v < vmin) {
+      *v = std::min(std::max(*v, vmin), vmax);
+      sim_dut_force_v(dut, *v, i);
+    }
+  } else {
+    // Force voltage, current clamp takes over when DUT current is outside
+    *v = dac_v(_x1[ch][AD5522_ADDR_FV]);
+    sim_dut_force_v(dut, *v, i);
+    if (clamp && (*i > clhi || *i < clli)) {
+      *i = std::min(std::max(*i, clli), clhi);
+      sim_dut_force_i(dut, *i, v);
+      *v = std::min(std::max(*v, -AD5522_V_MAX), AD5522_V_MAX);
+    }
+  }
+
+  return true;
+}
+
+// MEASOUT voltage for channel (attenuated gain adds 0.45 * VREF offset)
+float SimAD5522::measout(int ch) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  float v, i, out;
+
+  output(ch, &v, &i);
+
+  switch (PMU_MEAS_SEL(_pmuctrl[ch])) {
+    case 0:
+      out = i * rsense(ch) * 10;
+      break;
+    case 1:
+      out = v;
+      break;
+    case 2:
+      // Temperature sensor (approximately 1.5V at 25C, 4.7mV/C)
+      return 1.5F + 4.7e-3F * (_temp_c - 25);
+    default:
+      return 0;
+  }
+
+  if (SYS_MEAS_GAIN(_sysctrl) & 2) {
+    out = out * 0.2F + 0.45F * SIM_VREF;
+  }
+
+  return out;
+}
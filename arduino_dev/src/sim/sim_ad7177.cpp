@@ -0,0 +1,265 @@
+#include "sim_devices.h"
+
+/*
+ * AD7177 model
+ *  - communications byte (R/W bit 6, address 5:0) followed by the
+ *    register bytes, 64 ones reset the interface and registers
+ *  - continuous conversion through the enabled channels (CH0-3) using the
+ *    rate in FILTCON0
+ *  - the data register is read as 24-bit code plus status byte (channel in
+ *    bits 1:0), the format the driver expects
+ *  - DOUT/RDY falls when a conversion completes while CS is low, or when
+ *    CS goes low with an unread conversion
+ */
+
+#define AD7177_REG_STATUS   0x00
+#define AD7177_REG_ADCMODE  0x01
+#define AD7177_REG_IFMODE   0x02
+#define AD7177_REG_DATA     0x04
+#define AD7177_REG_GPIOCON  0x06
+#define AD7177_REG_ID       0x07
+#define AD7177_REG_CH0      0x10
+#define AD7177_REG_SETUP0   0x20
+#define AD7177_REG_FILTCON0 0x28
+
+#define AD7177_CH_EN        (1 << 15)
+#define AD7177_CODE_MAX     ((1UL << 24) - 1)
+
+// Output data rate by FILTCON ODR code (sinc5 + sinc1)
+const float sim_ad7177_odr[] = {
+  10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000,
+  5000, 2500, 1000, 500, 397.5F, 200, 100, 59.92F,
+  49.96F, 20, 16.63F, 10, 5
+};
+
+SimAD7177::SimAD7177(int8_t rdy, sim_ain_fn_t ain) {
+  conversions = 0;
+  reads       = 0;
+  overruns    = 0;
+
+  _pin_rdy    = rdy;
+  _ain        = ain;
+  _selected   = false;
+  _realtime   = false;
+  _noise_v    = 0;
+  _noise_seed = 1;
+  _temp_c     = 25;
+  _count      = 0;
+  reset();
+
+  sim_pin_drive(_pin_rdy, HIGH);
+
+  _run = true;
+  _thread = std::thread(&SimAD7177::convert_task, this);
+}
+
+SimAD7177::~SimAD7177() {
+  {
+    std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+    _run = false;
+  }
+  _cv.notify_all();
+  _thread.join();
+}
+
+void SimAD7177::reset() {
+  memset(_reg, 0, sizeof(_reg));
+  _reg[AD7177_REG_STATUS]  = 0x80;
+  _reg[AD7177_REG_ADCMODE] = 0x2000;
+  _reg[AD7177_REG_GPIOCON] = 0x0800;
+  _reg[AD7177_REG_ID]      = 0x4FD0;
+  _reg[AD7177_REG_CH0]     = AD7177_CH_EN | 0x0001;
+  for (int i = 1; i < 4; i++) _reg[AD7177_REG_CH0 + i] = 0x0001;
+  for (int i = 0; i < 4; i++) {
+    _reg[AD7177_REG_SETUP0 + i]   = 0x1320;
+    _reg[AD7177_REG_FILTCON0 + i] = 0x0507;
+  }
+  _data    = 0;
+  _ready   = false;
+  _next_ch = 0;
+  _reset   = false;
+}
+
+/**************************************************
+ *
+ * SPI Interface
+ *
+ **************************************************/
+
+uint8_t SimAD7177::reg_size(uint8_t addr) {
+  if (addr == AD7177_REG_STATUS) return 1;
+  if (addr == AD7177_REG_DATA) return 4;
+  if (addr >= 0x30) return 3;
+  return 2;
+}
+
+void SimAD7177::select() {
+  _selected = true;
+  _count = 0;
+
+  // DOUT shows RDY while CS is low
+  if (_ready) sim_pin_drive(_pin_rdy, LOW);
+}
+
+void SimAD7177::deselect() {
+  _selected = false;
+  _count = 0;
+  sim_pin_drive(_pin_rdy, HIGH);
+}
+
+uint8_t SimAD7177::transfer(uint8_t mosi) {
+  uint8_t addr = _cmd & 0x3F;
+  bool rw = (_cmd >> 6) & 1;
+  uint8_t miso = 0xFF;
+
+  // Communications byte
+  if (_count == 0) {
+    _cmd   = mosi;
+    _count = 1;
+    _shift = 0;
+    _reset = (mosi == 0xFF);
+
+    addr = _cmd & 0x3F;
+    if ((_cmd >> 6) & 1) {
+      _shift = (addr == AD7177_REG_DATA) ? _data : _reg[addr];
+    }
+    return miso;
+  }
+
+  // Reset after 64 consecutive ones
+  if (_reset) {
+    if (mosi != 0xFF) _reset = false;
+    else if (++_count >= 8) reset();
+    return miso;
+  }
+
+  uint8_t size = reg_size(addr);
+  uint8_t n = _count - 1;
+
+  if (n < size) {
+    if (rw) {
+      miso = (_shift >> (8*(size - 1 - n))) & 0xFF;
+    } else {
+      _shift = (_shift << 8) | mosi;
+    }
+  }
+  _count++;
+
+  // Register complete
+  if (n + 1 == size) {
+    if (rw && addr == AD7177_REG_DATA) {
+      reads++;
+      _ready = false;
+      _reg[AD7177_REG_STATUS] |= 0x80;
+      sim_pin_drive(_pin_rdy, HIGH);
+      _cv.notify_all();
+    } else if (!rw && addr != AD7177_REG_ID && addr != AD7177_REG_DATA && addr != AD7177_REG_STATUS) {
+      _reg[addr] = _shift & 0xFFFF;
+    }
+  }
+
+  return miso;
+}
+
+/**************************************************
+ *
+ * Conversions
+ *
+ **************************************************/
+
+void SimAD7177::set_realtime(bool realtime) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _realtime = realtime;
+  _cv.notify_all();
+}
+
+void SimAD7177::set_noise(float noise_v) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _noise_v = noise_v;
+}
+
+void SimAD7177::set_temp(float temp_c) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _temp_c = temp_c;
+}
+
+float SimAD7177::rate() {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  uint8_t odr = _reg[AD7177_REG_FILTCON0] & 0x1F;
+
+  if (odr >= sizeof(sim_ad7177_odr)/sizeof(float)) odr = sizeof(sim_ad7177_odr)/sizeof(float) - 1;
+  return sim_ad7177_odr[odr];
+}
+
+// Voltage on input, AIN0-4 come from the board, others are internal
+float SimAD7177::input(uint8_t ain) {
+  switch (ain) {
+    case 0x11: return 0.477F + 1.57e-3F * (_temp_c - 25);  // TEMP+
+    case 0x15: return SIM_VREF;                             // REF+
+  }
+  if (ain <= 4) return _ain(ain);
+  return 0;
+}
+
+// Convert next enabled channel, false if no channel is enabled
+bool SimAD7177::convert() {
+  uint8_t ch = _next_ch;
+  int k;
+
+  for (k = 0; k < 4; k++, ch = (ch + 1) & 3) {
+    if (_reg[AD7177_REG_CH0 + ch] & AD7177_CH_EN) break;
+  }
+  if (k == 4) return false;
+  _next_ch = (ch + 1) & 3;
+
+  uint16_t chreg = _reg[AD7177_REG_CH0 + ch];
+  float v = input((chreg >> 5) & 0x1F) - input(chreg & 0x1F);
+
+  // Uniform noise (deterministic)
+  if (_noise_v > 0) {
+    _noise_seed = _noise_seed * 1664525 + 1013904223;
+    v += _noise_v * (((_noise_seed >> 8) / 8388608.0F) - 1);
+  }
+
+  float codef = (v / (2 * SIM_VREF) + 0.5F) * AD7177_CODE_MAX;
+  uint32_t code = (uint32_t) std::min(std::max(codef, 0.0F), (float) AD7177_CODE_MAX);
+
+  if (_ready) overruns++;
+  _data  = (code << 8) | ch;
+  _ready = true;
+  _reg[AD7177_REG_STATUS] = ch;
+  conversions++;
+
+  // New data pulses RDY
+  if (_selected) {
+    sim_pin_drive(_pin_rdy, HIGH);
+    sim_pin_drive(_pin_rdy, LOW);
+  }
+
+  return true;
+}
+
+void SimAD7177::convert_task() {
+  std::unique_lock<std::recursive_mutex> guard(sim_mutex());
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
+  while (_run) {
+    if (_realtime) {
+      std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<float>(1.0F / rate()));
+      next += period;
+
+      // Fell behind (e.g. rate changed), restart from now
+      if (next < std::chrono::steady_clock::now()) next = std::chrono::steady_clock::now() + period;
+
+      _cv.wait_until(guard, next, [this] { return !_run || !_realtime; });
+    } else {
+      _cv.wait_for(guard, std::chrono::milliseconds(1), [this] { return !_run || _realtime || !_ready; });
+      next = std::chrono::steady_clock::now();
+      if (_ready) continue;
+    }
+    if (!_run) break;
+
+    convert();
+  }
+}
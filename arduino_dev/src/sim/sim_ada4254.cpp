@@ -0,0 +1,124 @@
+#include "sim_devices.h"
+
+/*
+ * ADA4254 model
+ *  - command (read bit 7, address 6:0) then data, the address increments
+ *    after each data byte (burst access)
+ *  - register file with reset values, ID (0x2F) reads 0x30
+ *  - output is the selected input pair times the PGIA gain
+ *  - internal calibration (TEST_MUX CAL_EN) finishes right away
+ *  - fault registers are write 1 to clear, GPIO3 is high while a fault
+ *    bit is set and the fault output (SF_CFG) is on
+ */
+
+#define ADA4254_REG_GAIN_MUX  0x00
+#define ADA4254_REG_DIG_ERR   0x03
+#define ADA4254_REG_ANA_ERR   0x04
+#define ADA4254_REG_SF_CFG    0x0C
+#define ADA4254_REG_INPUT_MUX 0x06
+#define ADA4254_REG_TEST_MUX  0x0E
+#define ADA4254_CAL_EN        (1 << 5)
+#define ADA4254_REG_ID        0x2F
+
+#define ADA4254_V_MAX         5.0F    // Output swing limit
+
+// Test mux voltages (AVSS, DVSS, +20mV, -20mV) relative to ground
+const float sim_ada4254_tmux[] = {0, 0, 20e-3F, -20e-3F};
+
+// Output gain by OUT_GAIN code (code 1 is not used by the driver)
+const float sim_ada4254_gainout[] = {1.0F, 1.0F, 1.25F, 1.375F};
+
+SimADA4254::SimADA4254(int8_t fault) {
+  _pin_fault = fault;
+  _offset = 0;
+  writes = 0;
+  reads  = 0;
+
+  memset(_reg, 0, sizeof(_reg));
+  _reg[ADA4254_REG_INPUT_MUX] = 0x60;
+  _reg[ADA4254_REG_ID]        = 0x30;
+
+  _cmd   = 0;
+  _count = 0;
+}
+
+void SimADA4254::select() {
+  _count = 0;
+}
+
+uint8_t SimADA4254::transfer(uint8_t mosi) {
+  uint8_t miso = 0;
+
+  if (_count == 0) {
+    _cmd = mosi;
+  } else {
+    uint8_t addr = (_cmd & 0x7F) + _count - 1;
+
+    if (addr < sizeof(_reg)) {
+      if (_cmd & 0x80) {
+        miso = _reg[addr];
+        reads++;
+      } else if (addr == ADA4254_REG_DIG_ERR || addr == ADA4254_REG_ANA_ERR) {
+        _reg[addr] &= ~mosi;
+        writes++;
+        update_fault();
+      } else if (addr == ADA4254_REG_TEST_MUX) {
+        _reg[addr] = mosi & ~ADA4254_CAL_EN;
+        writes++;
+      } else if (addr != ADA4254_REG_ID) {
+        _reg[addr] = mosi;
+        writes++;
+        update_fault();
+      }
+    }
+  }
+  if (_count < 0xFF) _count++;
+
+  return miso;
+}
+
+void SimADA4254::set_fault(uint8_t analog) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _reg[ADA4254_REG_ANA_ERR] |= analog;
+  update_fault();
+}
+
+void SimADA4254::set_offset(float v) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  _offset = v;
+}
+
+void SimADA4254::update_fault() {
+  bool fault = (_reg[ADA4254_REG_ANA_ERR] | _reg[ADA4254_REG_DIG_ERR]) != 0;
+
+  if (_pin_fault < 0) return;
+  sim_pin_drive(_pin_fault, (fault && (_reg[ADA4254_REG_SF_CFG] & (1 << 3))) ? HIGH : LOW);
+}
+
+float SimADA4254::gain() {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  uint8_t in  = (_reg[ADA4254_REG_GAIN_MUX] >> 3) & 0xF;
+  uint8_t out = ((_reg[ADA4254_REG_GAIN_MUX] >> 7) & 1) | (((_reg[ADA4254_REG_TEST_MUX] >> 7) & 1) << 1);
+
+  return ldexpf(1.0F, std::min((int) in, 11) - 4) * sim_ada4254_gainout[out];
+}
+
+// IN1 and IN2 negative inputs are grounded on the board
+float SimADA4254::output(float in1, float in2) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  uint8_t mux  = _reg[ADA4254_REG_INPUT_MUX];
+  uint8_t tmux = _reg[ADA4254_REG_TEST_MUX];
+  float p = 0;
+  float n = 0;
+
+  // Inputs shorted
+  if (mux == 0x01) return std::min(std::max(_offset * gain(), -ADA4254_V_MAX), ADA4254_V_MAX);
+
+  if (mux & (1 << 6))      p = in1;
+  else if (mux & (1 << 4)) p = in2;
+  else if (mux & (1 << 2)) p = sim_ada4254_tmux[tmux & 3];
+
+  if (mux & (1 << 1)) n = sim_ada4254_tmux[(tmux >> 2) & 3];
+
+  return std::min(std::max((p - n + _offset) * gain(), -ADA4254_V_MAX), ADA4254_V_MAX);
+}
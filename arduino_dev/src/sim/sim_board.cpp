@@ -0,0 +1,44 @@
+#include "sim_board.h"
+#include "../quad_smu.h"
+
+sim_board_t sim_board;
+
+// ADC input wiring
+float sim_board_ain(uint8_t ain) {
+  for (int ch = 0; ch < NUM_CH; ch++) {
+    SimAD5522 *pmu = sim_board.pmu[board_ch[ch].pmu];
+    float v, i;
+
+    if (sim_board.inamp[ch] && ain == board_ch[ch].inamp_pos) {
+      pmu->output(board_ch[ch].pmu_ch, &v, &i);
+      return sim_board.inamp[ch]->output(v, 0);
+    }
+    if (ain == board_ch[ch].measout_pos) return pmu->measout(board_ch[ch].pmu_ch);
+  }
+  return 0;
+}
+
+// Create devices, must run before smu_init()
+void sim_board_init(const sim_dut_t *dut) {
+  sim_board.dut = *dut;
+
+  for (int i = 0; i < BOARD_PMU_NUM; i++) {
+    sim_board.pmu[i] = new SimAD5522(board_pmu[i].busy);
+    sim_attach(sim_board.pmu[i], HSPI, board_pmu[i].cs);
+  }
+  for (int ch = 0; ch < NUM_CH; ch++) {
+    sim_board.inamp[ch] = NULL;
+    if (!board_has_inamp(ch)) continue;
+    sim_board.inamp[ch] = new SimADA4254(board_ch[ch].inamp_fault);
+    sim_attach(sim_board.inamp[ch], HSPI, board_ch[ch].inamp_cs);
+  }
+  sim_board.adc = new SimAD7177(PIN_ADC_INT, sim_board_ain);
+  sim_attach(sim_board.adc, SPIBUS_ADC, PIN_ADC_CS);
+
+  sim_board.pmu[board_ch[0].pmu]->set_dut(board_ch[0].pmu_ch, &sim_board.dut);
+}
+
+void sim_board_set_dut(const sim_dut_t *dut) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_board.dut = *dut;
+}
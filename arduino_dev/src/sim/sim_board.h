@@ -0,0 +1,28 @@
+#ifndef SIM_BOARD_H
+#define SIM_BOARD_H
+
+#include "sim_devices.h"
+#include "sim_dut.h"
+#include "../board.h"
+
+/****************************************
+ *  Simulated Board
+ ***************************************/
+
+// Devices of the board topology (board.h)
+//  - SMU channel 0 drives the DUT
+//  - ADC inputs are wired as in board_ch, an in-amp's IN1 senses the
+//    voltage of its channel
+typedef struct {
+  SimAD5522  *pmu[BOARD_PMU_NUM];
+  SimAD7177  *adc;
+  SimADA4254 *inamp[NUM_CH];    // NULL on channels without in-amp
+  sim_dut_t   dut;
+} sim_board_t;
+
+extern sim_board_t sim_board;
+
+void sim_board_init(const sim_dut_t *dut);
+void sim_board_set_dut(const sim_dut_t *dut);
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef SIM_DEVICES_H
+#define SIM_DEVICES_H
+
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include "sim_hal.h"
+#include "sim_dut.h"
+
+/*
+ * Register level models of the board's SPI devices
+ *  - each model decodes the frames the driver sends (same bit layout as
+ *    the datasheet) and keeps the register file, so read-back verifies
+ *    against what was really written
+ *  - analog behaviour is ideal and only as detailed as the firmware
+ *    conversions need (DAC transfer functions, MEASOUT scaling, PGIA gain)
+ *  - all state is guarded by sim_mutex()
+ */
+
+#define SIM_VREF 5.0F
+
+/****************************************
+ *  AD5522 (quad PMU)
+ ***************************************/
+
+class SimAD5522 : public SimSpiDevice {
+public:
+  SimAD5522(int8_t busy);
+
+  void select();
+  void deselect();
+  uint8_t transfer(uint8_t mosi);
+
+  void set_dut(int ch, sim_dut_t *dut);
+  void set_rsense_ext(float r);
+  void set_temp(float temp_c);
+
+  // Solve DUT operating point, false if channel is off or HiZ
+  bool output(int ch, float *v, float *i);
+  float measout(int ch);
+
+  uint32_t writes;          // Frames written (including readback requests)
+  uint32_t reads;           // Frames read back
+
+private:
+  uint32_t _sysctrl;
+  uint32_t _pmuctrl[4];
+  uint16_t _x1[4][64];      // DAC X1 registers by address
+  uint16_t _m[4][64];
+  uint16_t _c[4][64];
+  uint16_t _offset;         // Offset DAC (reset value)
+  float    _rsense_ext;
+  float    _temp_c;
+  sim_dut_t *_dut[4];
+
+  uint32_t _frame;          // Bits shifted in
+  uint8_t  _count;          // Bytes shifted in/out
+  bool     _read_pending;   // Read frame received, data on next select
+  bool     _reading;
+  uint32_t _read_data;
+
+  void frame(uint32_t word);
+  float rsense(int ch);
+  float dac_v(uint16_t code);
+  float dac_i(int ch, uint16_t code);
+};
+
+/****************************************
+ *  AD7177 (ADC)
+ ***************************************/
+
+// Voltage on analog input AIN0-4 (board wiring)
+typedef std::function<float(uint8_t ain)> sim_ain_fn_t;
+
+class SimAD7177 : public SimSpiDevice {
+public:
+  SimAD7177(int8_t rdy, sim_ain_fn_t ain);
+  ~SimAD7177();
+
+  void select();
+  void deselect();
+  uint8_t transfer(uint8_t mosi);
+
+  // Real time conversions at the programmed rate, or back to back
+  //  conversions as soon as the previous result was read
+  void set_realtime(bool realtime);
+  void set_noise(float noise_v);
+  void set_temp(float temp_c);
+  float rate();
+
+  uint32_t conversions;     // Conversions completed
+  uint32_t reads;           // Data register reads
+  uint32_t overruns;        // Conversions overwritten before they were read
+
+private:
+  int8_t   _pin_rdy;
+  sim_ain_fn_t _ain;
+  uint16_t _reg[0x40];
+  uint32_t _data;           // Data register (24 bit code << 8 | status)
+  bool     _ready;
+  bool     _selected;
+  bool     _realtime;
+  float    _noise_v;
+  uint32_t _noise_seed;
+  float    _temp_c;
+  uint8_t  _next_ch;
+
+  uint8_t  _cmd;
+  uint8_t  _count;
+  uint64_t _shift;
+  bool     _reset;
+
+  bool _run;
+  std::condition_variable_any _cv;
+  std::thread _thread;
+
+  void reset();
+  uint8_t reg_size(uint8_t addr);
+  float input(uint8_t ain);
+  bool convert();
+  void convert_task();
+};
+
+/****************************************
+ *  ADA4254 (PGIA)
+ ***************************************/
+
+class SimADA4254 : public SimSpiDevice {
+public:
+  SimADA4254(int8_t fault);
+
+  void select();
+  uint8_t transfer(uint8_t mosi);
+
+  // Raise analog fault bits (GPIO3 goes high if the fault output is on)
+  void set_fault(uint8_t analog);
+
+  // Input referred offset (in V), seen with the inputs shorted as well
+  void set_offset(float v);
+
+  // Output voltage for the voltages on the IN1 and IN2 pairs
+  float output(float in1, float in2);
+  float gain();
+
+  uint32_t writes;
+  uint32_t reads;
+
+private:
+  uint8_t _reg[0x30];
+  uint8_t _cmd;
+  uint8_t _count;
+  int8_t  _pin_fault;
+  float   _offset;
+
+  void update_fault();
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "sim_hal.h"
+#include "sim_dut.h"
+
+#define SIM_DUT_VT     0.02585F   // Thermal voltage at 300K (in V)
+#define SIM_DUT_V_OPEN 1e3F       // Voltage of open/reverse biased DUT (clamped by SMU)
+
+/**************************************************
+ *
+ * Internal Helper Functions
+ *
+ **************************************************/
+
+// Time since last update (in s), RC state evolves with real time
+float sim_dut_dt(sim_dut_t *dut) {
+  uint32_t now = micros();
+  float dt = (now - dut->micros_last) * 1e-6F;
+
+  dut->micros_last = now;
+  return dt;
+}
+
+/**************************************************
+ *
+ * External Functions
+ *
+ **************************************************/
+
+void sim_dut_resistor(sim_dut_t *dut, float r) {
+  memset(dut, 0, sizeof(sim_dut_t));
+  dut->type = SIM_DUT_RESISTOR;
+  dut->r    = r;
+}
+
+void sim_dut_diode(sim_dut_t *dut, float is, float n) {
+  memset(dut, 0, sizeof(sim_dut_t));
+  dut->type = SIM_DUT_DIODE;
+  dut->is   = is;
+  dut->n    = n;
+}
+
+void sim_dut_rc(sim_dut_t *dut, float r, float c) {
+  memset(dut, 0, sizeof(sim_dut_t));
+  dut->type = SIM_DUT_RC;
+  dut->r    = r;
+  dut->c    = c;
+  dut->micros_last = micros();
+}
+
+// Set DUT from name: open, resistor, diode, rc (default values)
+bool sim_dut_parse(sim_dut_t *dut, const char *name) {
+  if (strcmp(name, "open") == 0) {
+    memset(dut, 0, sizeof(sim_dut_t));
+  } else if (strcmp(name, "resistor") == 0) {
+    sim_dut_resistor(dut, 10e3F);
+  } else if (strcmp(name, "diode") == 0) {
+    sim_dut_diode(dut, 1e-12F, 1.8F);
+  } else if (strcmp(name, "rc") == 0) {
+    sim_dut_rc(dut, 10e3F, 1e-6F);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Current into DUT with voltage v forced
+void sim_dut_force_v(sim_dut_t *dut, float v, float *i) {
+  switch (dut->type) {
+    case SIM_DUT_RESISTOR:
+      *i = v / dut->r;
+      break;
+    case SIM_DUT_DIODE:
+      *i = dut->is * (expf(std::min(v / (dut->n * SIM_DUT_VT), 80.0F)) - 1);
+      break;
+    case SIM_DUT_RC: {
+      // Capacitor charges towards v through r
+      float dt = sim_dut_dt(dut);
+      *i = (v - dut->vc) / dut->r;
+      dut->vc += (v - dut->vc) * (1 - expf(-dt / (dut->r * dut->c)));
+      break;
+    }
+    default:
+      *i = 0;
+  }
+}
+
+// Voltage across DUT with current i forced
+void sim_dut_force_i(sim_dut_t *dut, float i, float *v) {
+  switch (dut->type) {
+    case SIM_DUT_RESISTOR:
+      *v = i * dut->r;
+      break;
+    case SIM_DUT_DIODE:
+      if (i <= -dut->is) *v = -SIM_DUT_V_OPEN;
+      else *v = dut->n * SIM_DUT_VT * logf(1 + i / dut->is);
+      break;
+    case SIM_DUT_RC: {
+      // Capacitor ramps with constant current
+      float dt = sim_dut_dt(dut);
+      dut->vc += i * dt / dut->c;
+      *v = dut->vc + i * dut->r;
+      break;
+    }
+    default:
+      *v = (i >= 0) ? SIM_DUT_V_OPEN : -SIM_DUT_V_OPEN;
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef SIM_DUT_H
+#define SIM_DUT_H
+
+#include <stdint.h>
+
+/****************************************
+ *  Simulated DUT Defines
+ ***************************************/
+
+typedef enum {
+  SIM_DUT_OPEN     = 0,
+  SIM_DUT_RESISTOR = 1,   // r
+  SIM_DUT_DIODE    = 2,   // is, n (anode on the SMU output)
+  SIM_DUT_RC       = 3    // r in series with c to ground
+} sim_dut_type_t;
+
+typedef struct {
+  sim_dut_type_t type;
+  float    r;             // Resistance (in ohm)
+  float    is;            // Diode saturation current (in A)
+  float    n;             // Diode ideality factor
+  float    c;             // Capacitance (in F)
+  float    vc;            // Capacitor voltage (state)
+  uint32_t micros_last;   // Time of last update (state)
+} sim_dut_t;
+
+/****************************************
+ *  Simulated DUT Functions
+ ***************************************/
+
+void sim_dut_resistor(sim_dut_t *dut, float r);
+void sim_dut_diode(sim_dut_t *dut, float is, float n);
+void sim_dut_rc(sim_dut_t *dut, float r, float c);
+bool sim_dut_parse(sim_dut_t *dut, const char *name);
+void sim_dut_force_v(sim_dut_t *dut, float v, float *i);
+void sim_dut_force_i(sim_dut_t *dut, float i, float *v);
+
+#endif
@@ -0,0 +1,671 @@
+#include "sim_hal.h"
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+
+typedef std::chrono::steady_clock sim_clock;
+
+typedef struct {
+  uint8_t mode;
+  uint8_t level;
+  bool    driven;           // Level set by a device (input pin)
+  void  (*isr)(void);
+  void  (*isr_arg)(void *);   // attachInterruptArg
+  void   *arg;
+  int     isr_mode;
+  SimSpiDevice *dev;        // Device selected by this pin (chip select)
+  uint8_t bus;              // Bus of device
+} sim_pin_t;
+
+struct sim_task_s {
+  std::mutex lock;
+  std::condition_variable cv;
+  uint32_t notify;
+  TaskFunction_t fn;
+  void *param;
+  const char *name;
+  uint32_t stack;
+};
+
+struct sim_sem_s {
+  std::recursive_timed_mutex lock;
+};
+
+struct sim_queue_s {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t size;
+};
+
+// Preferences namespace/key -> value
+static std::mutex sim_nvs_lock;
+static std::map<std::string, std::vector<uint8_t>> *sim_nvs = new std::map<std::string, std::vector<uint8_t>>();
+
+struct sim_timer_s {
+  TickType_t period;
+  bool reload;
+  bool active;
+  sim_clock::time_point next;
+  void *id;
+  TimerCallbackFunction_t cb;
+};
+
+// Timer thread state (plain array, the thread still runs during exit)
+#define SIM_TIMER_MAX 32
+
+static std::mutex sim_timer_lock;
+static std::condition_variable sim_timer_cv;
+static sim_timer_s *sim_timers[SIM_TIMER_MAX];
+static int sim_timer_num = 0;
+
+// Hardware timer, the alarm runs on a thread per timer
+struct sim_hw_timer_s {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::chrono::nanoseconds tick;
+  sim_clock::time_point zero;   // Time the counter was 0
+  uint64_t alarm;               // (in ticks)
+  bool     reload;
+  bool     enabled;
+  void   (*fn)(void);
+};
+
+#define SIM_HW_TIMER_NUM 4
+
+static sim_hw_timer_s *sim_hw_timers[SIM_HW_TIMER_NUM];
+
+static sim_clock::time_point sim_start = sim_clock::now();
+
+static sim_pin_t sim_pin[SIM_PIN_NUM];
+static sim_spi_stats_t sim_spi[4];
+static std::recursive_mutex sim_spi_bus[4];
+
+static thread_local sim_task_s *sim_task_current = NULL;
+
+/**************************************************
+ *
+ * Internal Helper Functions
+ *
+ **************************************************/
+
+// Set pin level, notify chip select device and call interrupt on edges
+static void sim_pin_set(uint8_t pin, uint8_t val) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin_t *p = &sim_pin[pin];
+  uint8_t prev = p->level;
+
+  p->level = val ? HIGH : LOW;
+  if (p->level == prev) return;
+
+  if (p->dev) {
+    if (p->level == LOW) p->dev->select();
+    else p->dev->deselect();
+  }
+
+  if (p->isr || p->isr_arg) {
+    bool falling = (prev == HIGH && p->level == LOW);
+    if ((falling && (p->isr_mode & FALLING)) || (!falling && (p->isr_mode & RISING))) {
+      if (p->isr) p->isr();
+      else p->isr_arg(p->arg);
+    }
+  }
+}
+
+static void sim_task_entry(sim_task_s *task) {
+  sim_task_current = task;
+  task->fn(task->param);
+}
+
+/**************************************************
+ *
+ * Arduino Functions
+ *
+ **************************************************/
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(sim_clock::now() - sim_start).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(sim_clock::now() - sim_start).count();
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Busy wait like the ESP32 (sleeping would take far longer than asked)
+void delayMicroseconds(uint32_t us) {
+  sim_clock::time_point end = sim_clock::now() + std::chrono::microseconds(us);
+  while (sim_clock::now() < end);
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[pin].mode = mode;
+  if (!sim_pin[pin].driven && mode == INPUT_PULLUP) sim_pin[pin].level = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin >= SIM_PIN_NUM) return;
+  sim_pin_set(pin, val);
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= SIM_PIN_NUM) return LOW;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  return sim_pin[pin].level;
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode) {
+  if (pin >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[pin].isr = isr;
+  sim_pin[pin].isr_arg = NULL;
+  sim_pin[pin].isr_mode = mode;
+}
+
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int mode) {
+  if (pin >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[pin].isr = NULL;
+  sim_pin[pin].isr_arg = isr;
+  sim_pin[pin].arg = arg;
+  sim_pin[pin].isr_mode = mode;
+}
+
+void detachInterrupt(uint8_t pin) {
+  if (pin >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[pin].isr = NULL;
+  sim_pin[pin].isr_arg = NULL;
+}
+
+/**************************************************
+ *
+ * SPI Functions
+ *
+ **************************************************/
+
+void SPIClass::beginTransaction(SPISettings settings) {
+  sim_spi_bus[_bus & 3].lock();
+  _clock = settings.clock;
+}
+
+void SPIClass::endTransaction() {
+  sim_spi_bus[_bus & 3].unlock();
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_spi_stats_t *stats = &sim_spi[_bus & 3];
+
+  stats->bytes++;
+  stats->bus_ns += 8000000000ULL / _clock;
+
+  for (int i = 0; i < SIM_PIN_NUM; i++) {
+    if (sim_pin[i].dev && sim_pin[i].bus == _bus && sim_pin[i].level == LOW) {
+      return sim_pin[i].dev->transfer(data);
+    }
+  }
+
+  // Nothing selected, MISO floats high
+  return 0xFF;
+}
+
+/**************************************************
+ *
+ * Preferences Functions
+ *
+ **************************************************/
+
+static std::string sim_nvs_key(const char *ns, const char *key) {
+  return std::string(ns) + "/" + key;
+}
+
+bool Preferences::begin(const char *name, bool read_only) {
+  if (strlen(name) >= sizeof(_ns)) return false;
+
+  strcpy(_ns, name);
+  _read_only = read_only;
+  return true;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+  if (_read_only || strlen(key) > 15) return 0;
+
+  std::lock_guard<std::mutex> guard(sim_nvs_lock);
+  (*sim_nvs)[sim_nvs_key(_ns, key)].assign((const uint8_t *) value, (const uint8_t *) value + len);
+  return len;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t len) {
+  std::lock_guard<std::mutex> guard(sim_nvs_lock);
+  auto it = sim_nvs->find(sim_nvs_key(_ns, key));
+  if (it == sim_nvs->end() || it->second.size() > len) return 0;
+
+  memcpy(buf, it->second.data(), it->second.size());
+  return it->second.size();
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  std::lock_guard<std::mutex> guard(sim_nvs_lock);
+  auto it = sim_nvs->find(sim_nvs_key(_ns, key));
+  return (it == sim_nvs->end()) ? 0 : it->second.size();
+}
+
+bool Preferences::isKey(const char *key) {
+  std::lock_guard<std::mutex> guard(sim_nvs_lock);
+  return sim_nvs->count(sim_nvs_key(_ns, key)) > 0;
+}
+
+bool Preferences::remove(const char *key) {
+  if (_read_only) return false;
+
+  std::lock_guard<std::mutex> guard(sim_nvs_lock);
+  return sim_nvs->erase(sim_nvs_key(_ns, key)) > 0;
+}
+
+/**************************************************
+ *
+ * FreeRTOS Functions
+ *
+ **************************************************/
+
+void sim_critical_enter(portMUX_TYPE *mux) {
+  while (mux->locked.exchange(true, std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+}
+
+void sim_critical_exit(portMUX_TYPE *mux) {
+  mux->locked.store(false, std::memory_order_release);
+}
+
+// Core and priority are ignored, every task is a host thread
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+    void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+  sim_task_s *task = new sim_task_s();
+
+  task->notify = 0;
+  task->fn     = fn;
+  task->param  = param;
+  task->name   = name;
+  task->stack  = stack;
+  if (handle) *handle = task;
+
+  std::thread(sim_task_entry, task).detach();
+
+  return pdPASS;
+}
+
+// Buffers are unused, the host thread has its own stack
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+    void *param, UBaseType_t priority, StackType_t *stack_buf, StaticTask_t *tcb, BaseType_t core) {
+  TaskHandle_t handle = NULL;
+
+  xTaskCreatePinnedToCore(fn, name, stack, param, priority, &handle, core);
+  if (handle) handle->stack = stack;
+
+  return handle;
+}
+
+// Stack use isn't tracked, reports the whole stack as free
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  return task ? task->stack : 0;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  sim_task_s *task = sim_task_current;
+  uint32_t ret;
+
+  if (task == NULL) {
+    // Called outside a task (e.g. from main), nothing can notify it
+    if (ticks != portMAX_DELAY) vTaskDelay(ticks);
+    return 0;
+  }
+
+  std::unique_lock<std::mutex> guard(task->lock);
+  if (ticks == portMAX_DELAY) {
+    task->cv.wait(guard, [task] { return task->notify > 0; });
+  } else {
+    task->cv.wait_for(guard, std::chrono::milliseconds(ticks), [task] { return task->notify > 0; });
+  }
+
+  ret = task->notify;
+  if (ret > 0) task->notify = clear ? 0 : ret - 1;
+
+  return ret;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  if (task == NULL) return pdFAIL;
+
+  {
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->notify++;
+  }
+  task->cv.notify_one();
+
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) {
+  xTaskNotifyGive(task);
+  if (woken) *woken = pdTRUE;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount() {
+  return (TickType_t) millis();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new sim_sem_s();
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+  return new sim_sem_s();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+  if (ticks == portMAX_DELAY) {
+    sem->lock.lock();
+    return pdTRUE;
+  }
+  return sem->lock.try_lock_for(std::chrono::milliseconds(ticks)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  sem->lock.unlock();
+  return pdTRUE;
+}
+
+// Send blocks (portMAX_DELAY) or waits up to ticks for space
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size) {
+  sim_queue_s *queue = new sim_queue_s();
+
+  queue->length = length;
+  queue->size   = size;
+
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  auto space = [queue] { return queue->items.size() < queue->length; };
+
+  if (ticks == portMAX_DELAY) queue->cv.wait(guard, space);
+  else if (!queue->cv.wait_for(guard, std::chrono::milliseconds(ticks), space)) return pdFAIL;
+
+  const uint8_t *bytes = (const uint8_t *) item;
+  queue->items.emplace_back(bytes, bytes + queue->size);
+  queue->cv.notify_all();
+
+  return pdPASS;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken) {
+  if (woken) *woken = pdTRUE;
+  return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  auto ready = [queue] { return !queue->items.empty(); };
+
+  if (ticks == portMAX_DELAY) queue->cv.wait(guard, ready);
+  else if (!queue->cv.wait_for(guard, std::chrono::milliseconds(ticks), ready)) return pdFAIL;
+
+  memcpy(item, queue->items.front().data(), queue->size);
+  queue->items.pop_front();
+  queue->cv.notify_all();
+
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->items.size();
+}
+
+// Run expired timer callbacks (without the timer lock held)
+static void sim_timer_thread() {
+  std::unique_lock<std::mutex> guard(sim_timer_lock);
+
+  while (true) {
+    sim_clock::time_point now = sim_clock::now();
+    sim_clock::time_point next = now + std::chrono::seconds(1);
+    sim_timer_s *expired = NULL;
+
+    for (int i = 0; i < sim_timer_num; i++) {
+      sim_timer_s *timer = sim_timers[i];
+      if (!timer->active) continue;
+      if (timer->next <= now) {
+        expired = timer;
+        break;
+      }
+      next = std::min(next, timer->next);
+    }
+
+    if (expired == NULL) {
+      sim_timer_cv.wait_until(guard, next);
+      continue;
+    }
+
+    if (expired->reload) expired->next += std::chrono::milliseconds(expired->period);
+    else expired->active = false;
+
+    guard.unlock();
+    expired->cb(expired);
+    guard.lock();
+  }
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+    void *id, TimerCallbackFunction_t cb) {
+  std::lock_guard<std::mutex> guard(sim_timer_lock);
+  if (sim_timer_num >= SIM_TIMER_MAX) return NULL;
+
+  sim_timer_s *timer = new sim_timer_s();
+  timer->period = std::max(period, (TickType_t) 1);
+  timer->reload = reload;
+  timer->active = false;
+  timer->id     = id;
+  timer->cb     = cb;
+
+  if (sim_timer_num == 0) std::thread(sim_timer_thread).detach();
+  sim_timers[sim_timer_num++] = timer;
+
+  return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks) {
+  std::lock_guard<std::mutex> guard(sim_timer_lock);
+  timer->active = true;
+  timer->next = sim_clock::now() + std::chrono::milliseconds(timer->period);
+  sim_timer_cv.notify_all();
+
+  return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks) {
+  std::lock_guard<std::mutex> guard(sim_timer_lock);
+  timer->active = false;
+
+  return pdPASS;
+}
+
+// Like FreeRTOS, changing the period also starts the timer
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks) {
+  {
+    std::lock_guard<std::mutex> guard(sim_timer_lock);
+    timer->period = std::max(period, (TickType_t) 1);
+  }
+  return xTimerStart(timer, ticks);
+}
+
+void vTimerSetReloadMode(TimerHandle_t timer, UBaseType_t reload) {
+  std::lock_guard<std::mutex> guard(sim_timer_lock);
+  timer->reload = reload;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+  return timer->id;
+}
+
+// Call alarm interrupt of timer when the counter reaches the alarm (an
+//  alarm below the counter goes off right away), reload sets the counter
+//  back to 0
+static void sim_hw_timer_thread(sim_hw_timer_s *timer) {
+  std::unique_lock<std::mutex> guard(timer->lock);
+
+  while (true) {
+    if (!timer->enabled) {
+      timer->cv.wait(guard);
+      continue;
+    }
+    sim_clock::time_point due = timer->zero + timer->alarm * timer->tick;
+    if (sim_clock::now() < due) {
+      timer->cv.wait_until(guard, due);
+      continue;
+    }
+
+    if (timer->reload) {
+      timer->zero = due;
+    } else {
+      timer->enabled = false;
+    }
+
+    void (*fn)(void) = timer->fn;
+    guard.unlock();
+    if (fn) fn();
+    guard.lock();
+  }
+}
+
+hw_timer_t *timerBegin(uint8_t num, uint16_t divider, bool countUp) {
+  if (num >= SIM_HW_TIMER_NUM) return NULL;
+
+  if (sim_hw_timers[num] == NULL) {
+    sim_hw_timers[num] = new sim_hw_timer_s();
+    std::thread(sim_hw_timer_thread, sim_hw_timers[num]).detach();
+  }
+
+  sim_hw_timer_s *timer = sim_hw_timers[num];
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->tick    = std::chrono::nanoseconds(std::max(divider, (uint16_t) 2) * 1000000000ULL / SIM_APB_HZ);
+  timer->zero    = sim_clock::now();
+  timer->alarm   = 0;
+  timer->enabled = false;
+  timer->fn      = NULL;
+
+  return timer;
+}
+
+void timerEnd(hw_timer_t *timer) {
+  timerAlarmDisable(timer);
+  timerDetachInterrupt(timer);
+}
+
+void timerAttachInterrupt(hw_timer_t *timer, void (*fn)(void), bool edge) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->fn = fn;
+}
+
+void timerDetachInterrupt(hw_timer_t *timer) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->fn = NULL;
+}
+
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarm_value, bool autoreload) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->alarm  = alarm_value;
+  timer->reload = autoreload;
+  timer->cv.notify_all();
+}
+
+void timerAlarmEnable(hw_timer_t *timer) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->enabled = true;
+  timer->cv.notify_all();
+}
+
+void timerAlarmDisable(hw_timer_t *timer) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->enabled = false;
+  timer->cv.notify_all();
+}
+
+void timerWrite(hw_timer_t *timer, uint64_t val) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  timer->zero = sim_clock::now() - val * timer->tick;
+  timer->cv.notify_all();
+}
+
+uint64_t timerRead(hw_timer_t *timer) {
+  std::lock_guard<std::mutex> guard(timer->lock);
+  return (sim_clock::now() - timer->zero) / timer->tick;
+}
+
+/**************************************************
+ *
+ * Simulator Control Functions
+ *
+ **************************************************/
+
+// Pins, devices and bus stats are guarded by this lock (recursive so an
+//  interrupt raised while a pin changes can change pins itself)
+std::recursive_mutex &sim_mutex() {
+  static std::recursive_mutex lock;
+  return lock;
+}
+
+// Connect device on bus (HSPI/VSPI) to chip select pin (pin idles high)
+void sim_attach(SimSpiDevice *dev, uint8_t bus, int8_t cs) {
+  if (cs < 0 || cs >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[cs].dev = dev;
+  sim_pin[cs].bus = bus;
+  sim_pin[cs].level = HIGH;
+}
+
+// Device drives an input pin (e.g. busy, data ready)
+void sim_pin_drive(uint8_t pin, uint8_t val) {
+  if (pin >= SIM_PIN_NUM) return;
+
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  sim_pin[pin].driven = true;
+  sim_pin_set(pin, val);
+}
+
+void sim_spi_stats(uint8_t bus, sim_spi_stats_t *stats) {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  *stats = sim_spi[bus & 3];
+}
+
+void sim_spi_stats_reset() {
+  std::lock_guard<std::recursive_mutex> guard(sim_mutex());
+  memset(sim_spi, 0, sizeof(sim_spi));
+}
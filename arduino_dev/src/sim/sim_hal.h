@@ -0,0 +1,249 @@
+#ifndef SIM_HAL_H
+#define SIM_HAL_H
+
+/*
+ * Native (host) implementation of the Arduino, SPI and FreeRTOS subset
+ * used by the drivers and quad_smu.cpp
+ *  - pins are a table of levels, devices drive their output pins and are
+ *    told when their chip select changes
+ *  - SPI transfers go to the device on the same bus whose chip select
+ *    is low, a transaction holds its bus like the ESP32 SPI driver's bus
+ *    lock (tasks writing devices of one bus without a lock of their own
+ *    get whole transactions)
+ *  - tasks are host threads, notifications and semaphores are built on
+ *    mutex/condition variables, critical sections are spinlocks
+ *  - an attached pin interrupt is called from the thread that made the
+ *    pin fall (e.g. the simulated ADC conversion thread)
+ *  - a hardware timer alarm interrupt is called from a thread of its own
+ *  - pin, bus and device state is guarded by one recursive lock
+ *    (sim_mutex), devices are only called with it held
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+/****************************************
+ *  Arduino
+ ***************************************/
+
+#define IRAM_ATTR
+
+#define HIGH 1
+#define LOW  0
+
+#define INPUT        0x01
+#define OUTPUT       0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING  0x01
+#define FALLING 0x02
+#define CHANGE  0x03
+
+#define SIM_PIN_NUM 64
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode);
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int mode);
+void detachInterrupt(uint8_t pin);
+
+// Hardware timers (80MHz APB clock through divider, counter and alarm in
+//  ticks, the counter runs from timerBegin)
+#define SIM_APB_HZ 80000000
+
+typedef struct sim_hw_timer_s hw_timer_t;
+
+hw_timer_t *timerBegin(uint8_t num, uint16_t divider, bool countUp);
+void timerEnd(hw_timer_t *timer);
+void timerAttachInterrupt(hw_timer_t *timer, void (*fn)(void), bool edge);
+void timerDetachInterrupt(hw_timer_t *timer);
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarm_value, bool autoreload);
+void timerAlarmEnable(hw_timer_t *timer);
+void timerAlarmDisable(hw_timer_t *timer);
+void timerWrite(hw_timer_t *timer, uint64_t val);
+uint64_t timerRead(hw_timer_t *timer);
+
+/****************************************
+ *  SPI
+ ***************************************/
+
+#define HSPI 2
+#define VSPI 3
+
+#define MSBFIRST 1
+
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+
+struct SPISettings {
+  SPISettings() : clock(1000000), bit_order(MSBFIRST), data_mode(SPI_MODE0) {}
+  SPISettings(uint32_t clock, uint8_t bit_order, uint8_t data_mode)
+    : clock(clock), bit_order(bit_order), data_mode(data_mode) {}
+
+  uint32_t clock;
+  uint8_t  bit_order;
+  uint8_t  data_mode;
+};
+
+class SPIClass {
+public:
+  SPIClass(uint8_t bus = HSPI) : _bus(bus), _clock(1000000) {}
+  void begin(int8_t sck = -1, int8_t miso = -1, int8_t mosi = -1, int8_t ss = -1) {}
+  void end() {}
+  void beginTransaction(SPISettings settings);
+  void endTransaction();
+  uint8_t transfer(uint8_t data);
+
+private:
+  uint8_t  _bus;
+  uint32_t _clock;
+};
+
+/****************************************
+ *  Preferences (NVS)
+ ***************************************/
+
+// Key/value store in host memory (lost when the program exits)
+class Preferences {
+public:
+  bool begin(const char *name, bool read_only = false);
+  void end() {}
+  size_t putBytes(const char *key, const void *value, size_t len);
+  size_t getBytes(const char *key, void *buf, size_t len);
+  size_t getBytesLength(const char *key);
+  bool isKey(const char *key);
+  bool remove(const char *key);
+
+private:
+  char _ns[16];
+  bool _read_only;
+};
+
+/****************************************
+ *  FreeRTOS
+ ***************************************/
+
+typedef int          BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t     TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY      0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t) (ms))
+
+#define portYIELD_FROM_ISR(x) (void) (x)
+
+// Critical section (spinlock, interrupts are host threads)
+typedef struct {
+  std::atomic<bool> locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {}
+
+void sim_critical_enter(portMUX_TYPE *mux);
+void sim_critical_exit(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux)     sim_critical_enter(mux)
+#define portEXIT_CRITICAL(mux)      sim_critical_exit(mux)
+#define portENTER_CRITICAL_ISR(mux) sim_critical_enter(mux)
+#define portEXIT_CRITICAL_ISR(mux)  sim_critical_exit(mux)
+
+// Tasks (no run time stats, stack sizes are not enforced)
+#define configUSE_TRACE_FACILITY       0
+#define configGENERATE_RUN_TIME_STATS  0
+
+typedef struct sim_task_s *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef uint8_t StackType_t;
+typedef struct { int unused; } StaticTask_t;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+    void *param, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+    void *param, UBaseType_t priority, StackType_t *stack_buf, StaticTask_t *tcb, BaseType_t core);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+// Semaphores (mutexes only)
+typedef struct sim_sem_s *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+#define xSemaphoreTakeRecursive(sem, ticks) xSemaphoreTake(sem, ticks)
+#define xSemaphoreGiveRecursive(sem)        xSemaphoreGive(sem)
+
+// Queues (items are copied)
+typedef struct sim_queue_s *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+// Software timers (callbacks run on one timer thread like the daemon task)
+typedef struct sim_timer_s *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+    void *id, TimerCallbackFunction_t cb);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks);
+void vTimerSetReloadMode(TimerHandle_t timer, UBaseType_t reload);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+/****************************************
+ *  Simulator Control
+ ***************************************/
+
+// SPI device on the simulated board
+class SimSpiDevice {
+public:
+  virtual ~SimSpiDevice() {}
+  virtual void select() {}
+  virtual void deselect() {}
+  virtual uint8_t transfer(uint8_t mosi) = 0;
+};
+
+typedef struct {
+  uint32_t bytes;       // Bytes transferred
+  uint64_t bus_ns;      // Time the transfers would take at the set SPI clock
+} sim_spi_stats_t;
+
+std::recursive_mutex &sim_mutex();
+void sim_attach(SimSpiDevice *dev, uint8_t bus, int8_t cs);
+void sim_pin_drive(uint8_t pin, uint8_t val);
+void sim_spi_stats(uint8_t bus, sim_spi_stats_t *stats);
+void sim_spi_stats_reset();
+
+#endif
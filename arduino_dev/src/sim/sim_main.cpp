@@ -0,0 +1,475 @@
+#include "sim_hal.h"
+#include "sim_board.h"
+#include "../quad_smu.h"
+#include "../ws_queue.h"
+#include "../log_lib.h"
+#include "../smu_wave.h"
+#include "../smu_pulse.h"
+#include "../smu_trig.h"
+#include <functional>
+
+/*
+ * Native simulation run
+ *   .pio/build/native/program [open|resistor|diode|rc]
+ *  - boots the smu on the simulated board and measures conversion,
+ *    sweep, waveform, pulse, trigger model and streaming throughput of
+ *    the firmware on the host
+ *  - sweep, synchronized waveform, pulse and trigger model results are
+ *    checked against the DUT model for the resistor
+ *  - returns non-zero if init logged an error or a check failed
+ */
+
+#define SIM_RUN_MS        1000    // Duration of conversion/streaming runs
+#define SIM_SWEEP_POINTS  101
+#define SIM_SWEEP_STOP    5.0F    // (in V)
+#define SIM_SWEEP_TIMEOUT 10000   // (in ms)
+#define SIM_CLIENTS       4       // Streaming clients
+#define SIM_TOL           0.01F   // Relative tolerance of sweep check
+#define SIM_WAVE_POINTS   21
+#define SIM_WAVE_PERIOD   20000   // Shortest period (in us)
+#define SIM_PULSE_POINTS  11
+#define SIM_PULSE_WIDTH   20000   // Shortest width (in us)
+#define SIM_PULSE_DELAY   5000    // (in us)
+#define SIM_PULSE_PERIOD  100000  // Shortest period (in us)
+#define SIM_PULSE_HOLD    20      // Control work holding smu_ctrl_lock (in ms)
+#define SIM_PULSE_HOLD_EVERY 25   // Period of the control work (in ms)
+#define SIM_TRIG_ARMS     2
+#define SIM_TRIG_POINTS   6
+#define SIM_TRIG_TIMER    20000   // (in us)
+#define SIM_TRIG_DELAY    2000    // (in us)
+
+sim_dut_t sim_dut;
+uint32_t sim_errors   = 0;
+uint32_t sim_messages = 0;
+uint32_t sim_bytes    = 0;
+uint32_t sim_points   = 0;
+uint32_t sim_bad      = 0;
+const char *sim_point_type = "sweep";   // Result messages checked
+
+/**************************************************
+ *
+ * Helper Functions
+ *
+ **************************************************/
+
+// Print log messages, count errors
+void sim_log_flush() {
+  char line[LOG_MSG_LEN];
+
+  while (log_pop(line, sizeof(line))) {
+    if (line[0] == 'E' && line[1] == ' ') sim_errors++;
+    printf("  log: %s\n", line);
+  }
+}
+
+// Check sweep or waveform result against resistor model
+void sim_check_point(const char *message) {
+  unsigned int ch, i, n;
+  float src, mv, mi;
+  char type[8];
+
+  if (sscanf(message, "{\"type\":\"%7[a-z]\",\"ch\":%u,\"i\":%u,\"n\":%u,\"src\":%e,\"mv\":%e,\"mi\":%e}",
+        type, &ch, &i, &n, &src, &mv, &mi) != 7) return;
+  if (strcmp(type, sim_point_type) != 0) return;
+
+  sim_points++;
+  if (sim_dut.type != SIM_DUT_RESISTOR) return;
+
+  float mi_exp = src / sim_dut.r;
+  float mi_tol = SIM_TOL * fabsf(SIM_SWEEP_STOP / sim_dut.r);
+  if (fabsf(mv - src) > SIM_TOL * SIM_SWEEP_STOP || fabsf(mi - mi_exp) > mi_tol) {
+    if (sim_bad++ < 5) printf("  bad point %u: src %f, mv %f, mi %e (expected %e)\n", i, src, mv, mi, mi_exp);
+  }
+}
+
+// Client socket, counts messages and checks sweep results
+bool sim_send(uint8_t num, const char *message, size_t length) {
+  sim_messages++;
+  sim_bytes += length;
+  if (num == 0) sim_check_point(message);
+  return true;
+}
+
+float sim_rate(uint32_t count, uint32_t us) {
+  return us ? count * 1e6F / us : 0;
+}
+
+// Time for sets measurements of channel 0 at the plan's rate, at least
+//  min_us (in us, the quad board shares the ADC between its channels)
+uint32_t sim_sets_us(uint32_t sets, uint32_t min_us) {
+  float rate = std::min(smu_get_meas_rate(CH0, ADC_MV), smu_get_meas_rate(CH0, ADC_MI));
+
+  if (!(rate > 0)) return min_us;
+  return std::max(min_us, (uint32_t) ceilf(sets * 1e6F / rate));
+}
+
+// Drain results of type to client 0 while a run is active
+//  - start begins the run (false if it can't), active polls it, results
+//    are drained until it ends or SIM_SWEEP_TIMEOUT has passed
+//  - polls sleep, so the run's timed tasks get the host's core
+//  - returns false if the run didn't start
+bool sim_run_results(const char *type, const std::function<bool()> &start, const std::function<bool()> &active) {
+  bool started;
+
+  ws_queue_open(0);
+  sim_point_type = type;
+  sim_points = 0;
+  sim_bad    = 0;
+
+  uint32_t t0 = millis();
+  started = start();
+  if (!started) printf("%s: not started\n", type);
+  while (started && active() && millis() - t0 < SIM_SWEEP_TIMEOUT) {
+    ws_queue_drain(sim_send);
+    delay(1);
+  }
+  while (ws_queue_drain(sim_send) > 0);
+  ws_queue_close(0);
+  sim_point_type = "sweep";
+
+  return started;
+}
+
+// Points of the last run were within tolerance
+bool sim_points_ok(const char *type) {
+  if (sim_bad == 0) return true;
+  printf("%s: %u points outside tolerance\n", type, sim_bad);
+  return false;
+}
+
+/**************************************************
+ *
+ * Runs
+ *
+ **************************************************/
+
+// ADC conversions and complete sample sets handed to adc_callback
+void sim_run_conversion() {
+  uint32_t conv0 = sim_board.adc->conversions;
+  uint32_t over0 = sim_board.adc->overruns;
+  uint32_t ver0  = smu_control_version(CH0);
+  uint32_t t0    = micros();
+
+  delay(SIM_RUN_MS);
+
+  uint32_t us   = micros() - t0;
+  uint32_t conv = sim_board.adc->conversions - conv0;
+  uint32_t sets = (smu_control_version(CH0) - ver0) / 2;
+
+  printf("conversion: %.0f conv/s, %.0f sample sets/s, %u overruns\n",
+      sim_rate(conv, us), sim_rate(sets, us), sim_board.adc->overruns - over0);
+}
+
+// FV sweep on channel 0, results drained by client 0
+bool sim_run_sweep() {
+  sim_spi_stats_t spi;
+  smu_sweep_t sweep;
+
+  smu_set_dac(CH0, DAC_FV, 0);
+  smu_set_state(CH0, ENABLE);
+
+  sweep.ch     = CH0;
+  sweep.dac    = DAC_FV;
+  sweep.start  = 0;
+  sweep.stop   = SIM_SWEEP_STOP;
+  sweep.points = SIM_SWEEP_POINTS;
+  sweep.settle = 1;
+  sweep.quiet  = false;
+
+  ws_queue_open(0);
+  sim_points = 0;
+  sim_bad    = 0;
+  sim_spi_stats_reset();
+
+  uint32_t start = millis();
+  uint32_t t0 = micros();
+  if (!smu_sweep_start(&sweep)) {
+    printf("sweep: not started\n");
+    return false;
+  }
+  while (smu_sweep_active() && millis() - start < SIM_SWEEP_TIMEOUT) {
+    ws_queue_drain(sim_send);
+    delayMicroseconds(50);
+  }
+  uint32_t us = micros() - t0;
+  while (ws_queue_drain(sim_send) > 0);
+  ws_queue_close(0);
+
+  sim_spi_stats(HSPI, &spi);
+  printf("sweep: %u/%u points in %.1f ms, %.0f points/s, control bus %.1f us/point at set clock\n",
+      sim_points, sweep.points, us / 1e3F, sim_rate(sim_points, us),
+      sim_points ? spi.bus_ns / 1e3F / sim_points : 0);
+
+  if (sim_points != sweep.points) return false;
+  if (sim_bad > 0) {
+    printf("sweep: %u points outside tolerance\n", sim_bad);
+    return false;
+  }
+  return true;
+}
+
+// Synchronized FV ramp on channel 0, timer paced, every update measured
+bool sim_run_wave() {
+  smu_wave_stats_t stats;
+  smu_wave_t wave;
+
+  wave.ch        = CH0;
+  wave.dac       = DAC_FV;
+  wave.shape     = WAVE_RAMP;
+  wave.start     = 0;
+  wave.stop      = SIM_SWEEP_STOP;
+  wave.points    = SIM_WAVE_POINTS;
+  wave.width     = 1;
+  wave.list      = NULL;
+  wave.cycles    = 1;
+  wave.sync      = true;
+  wave.settle    = 1;
+
+  // Period check uses the nominal rate, conversions stay back to back
+  //  (one set to spare over what smu_wave_start asks for)
+  smu_set_rate(RATE_FAST);
+  wave.period_us = sim_sets_us(SMU_WAVE_SYNC_SETS + wave.settle + 2, SIM_WAVE_PERIOD);
+  bool started = sim_run_results("wave", [&] { return smu_wave_start(&wave); }, smu_wave_active);
+  smu_set_rate(RATE_SLOW);
+  if (!started) return false;
+
+  smu_wave_get_stats(&stats);
+  printf("wave: %u updates every %u us, %u missed, %u/%u points measured\n",
+      stats.updates, wave.period_us, stats.missed, sim_points, wave.points);
+
+  if (stats.errors > 0 || sim_points + stats.missed < wave.points) return false;
+  return sim_points_ok("wave");
+}
+
+// FV pulses on channel 0 from 0V, each measured inside the pulse
+bool sim_run_pulse() {
+  smu_pulse_stats_t stats;
+  smu_pulse_t pulse;
+
+  pulse.ch        = CH0;
+  pulse.dac       = DAC_FV;
+  pulse.base      = 0;
+  pulse.start     = SIM_SWEEP_STOP / (SIM_PULSE_POINTS - 1);
+  pulse.stop      = SIM_SWEEP_STOP;
+  pulse.points    = SIM_PULSE_POINTS;
+  pulse.delay_us  = SIM_PULSE_DELAY;
+  pulse.duty_max  = 25;
+
+  // Window after the delay holds a set to spare over what smu_pulse_start
+  //  asks for, the period keeps the duty cycle
+  smu_set_rate(RATE_FAST);
+  pulse.width_us  = pulse.delay_us + sim_sets_us(SMU_PULSE_SYNC_SETS + 2, SIM_PULSE_WIDTH - SIM_PULSE_DELAY);
+  pulse.period_us = std::max((uint32_t) SIM_PULSE_PERIOD, pulse.width_us * 100 / pulse.duty_max);
+
+  // Control work on the main loop holds smu_ctrl_lock most of the time,
+  //  the edges don't wait for it: the latest stays within the delay (the
+  //  window opens inside the pulse), on the host the lag is its thread
+  //  wake latency rather than the SMU_PULSE_LATE of the board
+  uint32_t hold = millis();
+  auto active = [&] {
+    if (millis() - hold >= SIM_PULSE_HOLD_EVERY) {
+      smu_ctrl_take();
+      delay(SIM_PULSE_HOLD);
+      smu_ctrl_give();
+      hold = millis();
+    }
+    return smu_pulse_active();
+  };
+  bool started = sim_run_results("pulse", [&] { return smu_pulse_start(&pulse); }, active);
+  smu_set_rate(RATE_SLOW);
+  if (!started) return false;
+
+  smu_pulse_get_stats(&stats);
+  printf("pulse: %u pulses of %u us, %u/%u measured, %u late edges (latest %u us)\n",
+      stats.pulses, pulse.width_us, sim_points, pulse.points, stats.late, stats.lag_max);
+
+  if (stats.errors > 0 || stats.pulses < pulse.points || sim_points < pulse.points) return false;
+  if (stats.lag_max >= pulse.delay_us) {
+    printf("pulse: edge %u us late\n", stats.lag_max);
+    return false;
+  }
+  return sim_points_ok("pulse");
+}
+
+// Trigger model on channel 0, two arm passes of a timer paced source
+//  list, each point measured after the delay
+bool sim_run_trig() {
+  float list[SIM_TRIG_POINTS];
+  smu_trig_stats_t stats;
+  smu_trig_cfg_t cfg;
+  uint32_t n = SIM_TRIG_ARMS * SIM_TRIG_POINTS;
+
+  for (int i = 0; i < SIM_TRIG_POINTS; i++) list[i] = SIM_SWEEP_STOP * i / (SIM_TRIG_POINTS - 1);
+
+  cfg.arm.src       = TRIG_SRC_IMMEDIATE;
+  cfg.arm.ch        = 0;
+  cfg.arm.count     = SIM_TRIG_ARMS;
+  cfg.arm.timer_us  = 0;
+  cfg.trig.src      = TRIG_SRC_TIMER;
+  cfg.trig.ch       = 0;
+  cfg.trig.count    = SIM_TRIG_POINTS;
+  cfg.trig.timer_us = SIM_TRIG_TIMER;
+  cfg.dac           = DAC_FV;
+  cfg.points        = SIM_TRIG_POINTS;
+  cfg.list          = list;
+  cfg.delay_us      = SIM_TRIG_DELAY;
+  cfg.measure       = true;
+
+  if (!sim_run_results("trig", [&] { return smu_trig_config(CH0, &cfg) && smu_trig_init(1 << CH0); },
+        smu_trig_active)) {
+    return false;
+  }
+
+  smu_trig_get_stats(&stats);
+  printf("trig: %u events, %u/%u points measured, %u missed, %u late deadlines (latest %u us)\n",
+      stats.events, sim_points, n, stats.missed, stats.late, stats.lag_max);
+
+  if (smu_trig_active() || stats.overflows > 0 || stats.missed > 0 || sim_points < n) {
+    smu_trig_abort();
+    return false;
+  }
+  return sim_points_ok("trig");
+}
+
+// Channel 1 steps a timer paced source list, each source written
+//  triggers a measurement of channel 0 (boards with more than one
+//  channel)
+bool sim_run_trig_route() {
+  float list[SIM_TRIG_POINTS];
+  smu_trig_stats_t stats;
+  smu_trig_cfg_t src, meas;
+  smu_control_t control;
+
+  if (NUM_CH < 2) return true;
+
+  for (int i = 0; i < SIM_TRIG_POINTS; i++) list[i] = SIM_SWEEP_STOP * i / (SIM_TRIG_POINTS - 1);
+
+  src.arm.src       = TRIG_SRC_IMMEDIATE;
+  src.arm.ch        = 0;
+  src.arm.count     = 1;
+  src.arm.timer_us  = 0;
+  src.trig.src      = TRIG_SRC_TIMER;
+  src.trig.ch       = 0;
+  src.trig.count    = SIM_TRIG_POINTS;
+  src.trig.timer_us = SIM_TRIG_TIMER;
+  src.dac           = DAC_FV;
+  src.points        = SIM_TRIG_POINTS;
+  src.list          = list;
+  src.delay_us      = 0;
+  src.measure       = false;
+
+  // Channel 0 measures at its present source
+  meas          = src;
+  meas.trig.src = TRIG_SRC_SOURCE;
+  meas.trig.ch  = CH1;
+  meas.points   = 0;
+  meas.list     = NULL;
+  meas.delay_us = SIM_TRIG_DELAY;
+  meas.measure  = true;
+
+  if (!sim_run_results("trig", [&] {
+        return smu_trig_config(CH1, &src) && smu_trig_config(CH0, &meas) && smu_trig_init((1 << CH0) | (1 << CH1));
+      }, smu_trig_active)) {
+    return false;
+  }
+
+  smu_trig_get_stats(&stats);
+  smu_get_control(CH1, &control);
+  printf("trig route: %u events, %u/%u points measured, %u missed, ch1 at %f V\n",
+      stats.events, sim_points, SIM_TRIG_POINTS, stats.missed, control.fv);
+
+  if (smu_trig_active() || stats.overflows > 0 || stats.missed > 0 || sim_points < SIM_TRIG_POINTS
+      || fabsf(control.fv - list[SIM_TRIG_POINTS - 1]) > SIM_TOL * SIM_SWEEP_STOP) {
+    smu_trig_abort();
+    return false;
+  }
+  return sim_points_ok("trig");
+}
+
+// Telemetry to SIM_CLIENTS clients at the fastest period
+void sim_run_streaming() {
+  uint32_t process_us = 0;
+  uint32_t calls = 0;
+
+  for (int c = 0; c < SIM_CLIENTS; c++) {
+    ws_queue_open(c);
+    smu_client_connect(c);
+    smu_subscribe(c, CH0, SMU_FIELD_ALL, 0, 0);
+  }
+  sim_messages = 0;
+  sim_bytes    = 0;
+
+  uint32_t t0 = micros();
+  while (micros() - t0 < SIM_RUN_MS * 1000UL) {
+    uint32_t t1 = micros();
+    smu_process();
+    process_us += micros() - t1;
+    calls++;
+
+    ws_queue_drain(sim_send);
+    delayMicroseconds(100);
+  }
+  uint32_t us = micros() - t0;
+
+  for (int c = 0; c < SIM_CLIENTS; c++) {
+    smu_client_disconnect(c);
+    ws_queue_close(c);
+  }
+
+  printf("streaming: %u clients, %.0f messages/s, %.0f bytes/s, smu_process %.1f us/call\n",
+      SIM_CLIENTS, sim_rate(sim_messages, us), sim_rate(sim_bytes, us),
+      calls ? (float) process_us / calls : 0);
+}
+
+/**************************************************
+ *
+ * Main
+ *
+ **************************************************/
+
+int main(int argc, char **argv) {
+  const char *name = (argc > 1) ? argv[1] : "resistor";
+  bool ok = true;
+
+  if (!sim_dut_parse(&sim_dut, name)) {
+    printf("usage: %s [open|resistor|diode|rc]\n", argv[0]);
+    return 2;
+  }
+  printf("dut: %s\n", name);
+
+  log_init();
+  ws_queue_init();
+  sim_board_init(&sim_dut);
+
+  smu_init();
+  sim_log_flush();
+  if (sim_errors > 0) {
+    printf("init: %u errors\n", sim_errors);
+    ok = false;
+  }
+
+  sim_run_conversion();
+  ok &= sim_run_sweep();
+  ok &= sim_run_wave();
+  ok &= sim_run_pulse();
+  ok &= sim_run_trig();
+  ok &= sim_run_trig_route();
+  sim_run_streaming();
+  sim_log_flush();
+
+  uint32_t pmu_writes = 0, pmu_reads = 0, inamp_writes = 0;
+  for (int i = 0; i < BOARD_PMU_NUM; i++) {
+    pmu_writes += sim_board.pmu[i]->writes;
+    pmu_reads  += sim_board.pmu[i]->reads;
+  }
+  for (int i = 0; i < NUM_CH; i++) {
+    if (sim_board.inamp[i]) inamp_writes += sim_board.inamp[i]->writes;
+  }
+  printf("pmu: %u frames, %u reads, inamp: %u writes, adc: %u conversions, %u reads\n",
+      pmu_writes, pmu_reads, inamp_writes, sim_board.adc->conversions, sim_board.adc->reads);
+  printf("%s\n", ok ? "PASS" : "FAIL");
+
+  // Driver tasks never return, skip static destructors
+  fflush(stdout);
+  _Exit(ok ? 0 : 1);
+}
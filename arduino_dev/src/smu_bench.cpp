@@ -0,0 +1,254 @@
+#include "hal.h"
+#include "smu_bench.h"
+#include "quad_smu.h"
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+#include "event_lib.h"
+
+/*
+ * Self benchmark of the real hardware
+ *  - all outputs are put in HiZ first and left there
+ *  - AD5522 DAC writes with and without read-back, ADA4254 read
+ *    transactions, AD7177 samples/s and ISR to callback latency for each
+ *    sample rate, and a quiet FV sweep at the fastest rate
+ *  - runs on the control task, the report (json) is sent to the client that
+ *    asked for it and kept for smu_bench_report()
+ */
+
+#define SMU_BENCH_PMU_WRITES    200
+#define SMU_BENCH_INAMP_TXNS    500
+#define SMU_BENCH_ADC_MS        250     // Minimum time per sample rate
+#define SMU_BENCH_ADC_SAMPLES   8       // Minimum samples per sample rate
+#define SMU_BENCH_SWEEP_POINTS  101
+#define SMU_BENCH_SWEEP_MS      10000   // Sweep timeout
+
+typedef struct {
+  ad7177_sample_rate_t rate;
+  float odr;                  // Nominal output data rate (in SPS)
+} smu_bench_rate_t;
+
+const smu_bench_rate_t smu_bench_rates[] = {
+  {AD7177_10000SP, 10000}, {AD7177_5000SPS, 5000}, {AD7177_2500SPS, 2500},
+  {AD7177_1000SPS, 1000},  {AD7177_500SPS,  500},  {AD7177_397SPS,  397.5F},
+  {AD7177_200SPS,  200},   {AD7177_100SPS,  100},  {AD7177_60SPS,   59.92F},
+  {AD7177_50SPS,   49.96F},{AD7177_20SPS,   20},   {AD7177_17SPS,   16.66F},
+  {AD7177_10SPS,   10},    {AD7177_5SPS,    5}
+};
+
+#define SMU_BENCH_RATES (sizeof(smu_bench_rates) / sizeof(smu_bench_rates[0]))
+
+TaskHandle_t smu_bench_task_handle = NULL;
+portMUX_TYPE smu_bench_mux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool smu_bench_busy = false;
+volatile bool smu_bench_done = false;
+uint8_t smu_bench_client;
+char smu_bench_str[SMU_BENCH_REPORT_LEN];
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+inline float smu_bench_rate(uint32_t count, uint32_t us) {
+  return us ? count * 1e6F / us : 0;
+}
+
+// PMU DAC writes/s with read-back verify (smu path) and without
+int smu_bench_pmu(char *str, int len, int size) {
+  uint32_t ok_verify = 0, ok_raw = 0;
+  uint32_t t0, us_verify, us_raw;
+
+  smu_ctrl_take();
+
+  // Rewrite the current FV code, output is HiZ anyway
+  int32_t code = ad5522_read(0, 1 << AD5522_CH0, 3, AD5522_DAC_FV);
+  if (code < 0) code = 0x8000;
+
+  t0 = micros();
+  for (int n = 0; n < SMU_BENCH_PMU_WRITES; n++) {
+    ok_verify += ad5522_set_dac(AD5522_CH0, AD5522_DAC_FV, code & 0xFFFF);
+  }
+  us_verify = micros() - t0;
+
+  t0 = micros();
+  for (int n = 0; n < SMU_BENCH_PMU_WRITES; n++) {
+    ok_raw += ad5522_write(0, 1 << AD5522_CH0, 3, AD5522_DAC_FV, code & 0xFFFF);
+  }
+  us_raw = micros() - t0;
+
+  smu_ctrl_give();
+
+  LOG_I(SMU, "bench pmu: %f writes/s verified, %f writes/s raw",
+      smu_bench_rate(ok_verify, us_verify), smu_bench_rate(ok_raw, us_raw));
+
+  return len + snprintf(str + len, size - len,
+      ",\"pmu\":{\"n\":%d,\"ok\":%u,\"write_verify\":%.0f,\"write\":%.0f}",
+      SMU_BENCH_PMU_WRITES, ok_verify + ok_raw,
+      smu_bench_rate(ok_verify, us_verify), smu_bench_rate(ok_raw, us_raw));
+}
+
+// In-amp read transactions/s
+int smu_bench_inamp(char *str, int len, int size) {
+  uint32_t ok = 0;
+  uint32_t t0, us;
+
+  smu_ctrl_take();
+  t0 = micros();
+  for (int n = 0; n < SMU_BENCH_INAMP_TXNS; n++) {
+    ok += smu_inamp_check(CH0);
+  }
+  us = micros() - t0;
+  smu_ctrl_give();
+
+  LOG_I(SMU, "bench inamp: %f transactions/s", smu_bench_rate(ok, us));
+
+  return len + snprintf(str + len, size - len, ",\"inamp\":{\"n\":%d,\"ok\":%u,\"txn\":%.0f}",
+      SMU_BENCH_INAMP_TXNS, ok, smu_bench_rate(ok, us));
+}
+
+// Effective samples/s, sample sets/s and callback latency for each rate
+int smu_bench_adc(char *str, int len, int size) {
+  len += snprintf(str + len, size - len, ",\"adc\":[");
+
+  for (size_t r = 0; r < SMU_BENCH_RATES && len < size; r++) {
+    const smu_bench_rate_t *rate = &smu_bench_rates[r];
+    uint32_t ms = std::max((uint32_t) SMU_BENCH_ADC_MS, (uint32_t) (SMU_BENCH_ADC_SAMPLES * 1000 / rate->odr));
+    ad7177_stats_t stats;
+
+    ad7177_stop();
+    ad7177_set_rate(rate->rate);
+    ad7177_reset_stats();
+    uint32_t t0 = micros();
+    ad7177_start();
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    ad7177_get_stats(&stats);
+    uint32_t us = micros() - t0;
+
+    LOG_I(SMU, "bench adc %f SPS: %f samples/s, %f sets/s, latency %u us (max %u us)",
+        rate->odr, smu_bench_rate(stats.samples, us), smu_bench_rate(stats.sets, us),
+        stats.sets ? stats.latency_sum / stats.sets : 0, stats.latency_max);
+
+    len += snprintf(str + len, size - len,
+        "%s{\"odr\":%g,\"sps\":%.1f,\"sets\":%.1f,\"lat_us\":%u,\"lat_max_us\":%u}",
+        r ? "," : "", rate->odr, smu_bench_rate(stats.samples, us), smu_bench_rate(stats.sets, us),
+        stats.sets ? stats.latency_sum / stats.sets : 0, stats.latency_max);
+  }
+
+  if (len >= size) return len;
+  return len + snprintf(str + len, size - len, "]");
+}
+
+// Quiet FV sweep on channel 0 (output HiZ) at the fastest rate
+int smu_bench_sweep(char *str, int len, int size) {
+  smu_sweep_t sweep;
+  uint32_t t0, us;
+
+  ad7177_stop();
+  ad7177_set_rate(smu_bench_rates[0].rate);
+  ad7177_start();
+
+  sweep.ch     = CH0;
+  sweep.dac    = DAC_FV;
+  sweep.start  = 0;
+  sweep.stop   = 1;
+  sweep.points = SMU_BENCH_SWEEP_POINTS;
+  sweep.settle = 1;
+  sweep.quiet  = true;
+
+  t0 = micros();
+  if (smu_sweep_start(&sweep)) {
+    while (smu_sweep_active() && micros() - t0 < SMU_BENCH_SWEEP_MS * 1000UL) {
+      vTaskDelay(1);
+    }
+    smu_sweep_stop();
+  }
+  us = micros() - t0;
+
+  LOG_I(SMU, "bench sweep: %u/%u points, %f points/s", smu_sweep_done(), sweep.points,
+      smu_bench_rate(smu_sweep_done(), us));
+
+  return len + snprintf(str + len, size - len,
+      ",\"sweep\":{\"odr\":%g,\"points\":%u,\"done\":%u,\"pts\":%.1f}",
+      smu_bench_rates[0].odr, sweep.points, smu_sweep_done(), smu_bench_rate(smu_sweep_done(), us));
+}
+
+void smu_bench_run() {
+  char *str = smu_bench_str;
+  int size = sizeof(smu_bench_str);
+  int len;
+  ad7177_sample_rate_t rate = ad7177_get_rate();
+
+  LOG_I(SMU, "bench started, outputs HiZ");
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_set_state((smu_ch_t) i, DISABLE);
+  }
+
+  len = snprintf(str, size, "{\"type\":\"bench\",\"outputs\":\"hiz\"");
+  len = smu_bench_pmu(str, len, size);
+  len = smu_bench_inamp(str, len, size);
+  len = smu_bench_adc(str, len, size);
+  len = smu_bench_sweep(str, len, size);
+  if (len < size) snprintf(str + len, size - len, "}");
+
+  // Restore sample rate
+  ad7177_stop();
+  ad7177_set_rate(rate);
+  ad7177_start();
+
+  if (len >= size - 1) LOG_W(SMU, "bench report truncated");
+  LOG_I(SMU, "bench done");
+}
+
+void smu_bench_task(void *pvParameters) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    smu_bench_run();
+    if (smu_bench_client != SMU_BENCH_CLIENT_NONE) {
+      ws_queue_send(smu_bench_client, smu_bench_str, WS_MSG_RESULT);
+    }
+
+    smu_bench_done = true;
+    smu_bench_busy = false;
+    event_post(EVENT_BENCH_DONE);
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Start benchmark, report is sent to client when done
+//  - false if a benchmark or sweep is already running
+bool smu_bench_start(uint8_t client) {
+  if (smu_sweep_active()) return false;
+
+  portENTER_CRITICAL(&smu_bench_mux);
+  bool busy = smu_bench_busy;
+  smu_bench_busy = true;
+  portEXIT_CRITICAL(&smu_bench_mux);
+  if (busy) return false;
+
+  if (smu_bench_task_handle == NULL) {
+    smu_bench_task_handle = task_create(TASK_CTRL, smu_bench_task, NULL);
+  }
+
+  smu_bench_client = client;
+  smu_bench_done = false;
+  xTaskNotifyGive(smu_bench_task_handle);
+
+  return true;
+}
+
+bool smu_bench_running() {
+  return smu_bench_busy;
+}
+
+// Report of last benchmark (json), NULL if none finished yet
+const char *smu_bench_report() {
+  return smu_bench_done ? smu_bench_str : NULL;
+}
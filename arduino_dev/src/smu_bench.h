@@ -0,0 +1,17 @@
+#ifndef SMU_BENCH_H
+#define SMU_BENCH_H
+
+#include "hal.h"
+
+/****************************************
+ *  Self Benchmark
+ ***************************************/
+
+#define SMU_BENCH_CLIENT_NONE 0xFF  // Keep report for smu_bench_report() only
+#define SMU_BENCH_REPORT_LEN  2048
+
+bool smu_bench_start(uint8_t client);
+bool smu_bench_running();
+const char *smu_bench_report();
+
+#endif
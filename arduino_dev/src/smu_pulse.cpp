@@ -0,0 +1,335 @@
+#include "hal.h"
+#include "smu_pulse.h"
+#include "smu_trig.h"
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+
+/*
+ * Pulsed measurement (pulsed IV of devices that heat up)
+ *  - the channel sits at base, each pulse goes to the next level of
+ *    start..stop for width_us, pulses start period_us apart
+ *  - edges are at fixed times of a hardware timer counter started with
+ *    the train, so late edges don't push the ones after them out; the
+ *    timer interrupt wakes the pulse task, which spins on the counter for
+ *    edges due within SMU_PULSE_SPIN
+ *  - the measurement window opens delay_us into the pulse and closes with
+ *    the falling edge, the pulse is measured by the first sample sets
+ *    converted wholly inside it (set sequence, as for a waveform update)
+ *  - the ADC runs on, so its rate must fit the window: start checks the
+ *    channel's measurement rates against width_us - delay_us
+ *  - the channel state shows base, pulses are single DAC writes without
+ *    read-back (ad5522_write_dac)
+ *  - edges don't take smu_ctrl_lock, control work on the main loop (a
+ *    verified set, a range change) would hold them for its whole length;
+ *    the train is guarded by smu_pulse_lock and an edge waits at most for
+ *    the bus transaction in progress (the SPI bus lock)
+ */
+
+typedef enum {
+  PULSE_RISE,       // Next edge starts a pulse
+  PULSE_OPEN,       // Next edge opens the measurement window
+  PULSE_FALL        // Next edge ends the pulse
+} smu_pulse_phase_t;
+
+typedef struct {
+  smu_pulse_t  cfg;
+  volatile bool active;
+  uint8_t      phase;       // smu_pulse_phase_t
+  uint16_t     index;       // Pulse
+  uint64_t     next;        // Time of next edge (in timer ticks)
+  uint64_t     rise;        // Time of pulse start
+  ad5522_ch_t  pmu_ch;
+  ad5522_dac_t pmu_dac;
+  uint16_t     base_code;
+
+  // Window of the pulse (guarded by smu_pulse_mux)
+  uint16_t     point;       // Pulse measured
+  uint16_t     measured;    // Pulses measured so far
+  bool         open;
+  bool         closed;
+  uint32_t     seq_open;    // Sets completed when it opened
+  uint32_t     seq_close;   // Sets completed before the falling edge
+  uint8_t      have;        // smu_adc_t bits measured
+  bool         sent;
+  float        mv;
+  float        mi;
+} smu_pulse_state_t;
+
+smu_pulse_state_t smu_pulse;
+smu_pulse_stats_t smu_pulse_stats;
+portMUX_TYPE smu_pulse_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Code and calibrated value of each pulse level
+uint16_t smu_pulse_code[SMU_PULSE_POINTS_MAX];
+float    smu_pulse_val[SMU_PULSE_POINTS_MAX];
+
+hw_timer_t *smu_pulse_timer = NULL;
+TaskHandle_t smu_pulse_task_handle = NULL;
+SemaphoreHandle_t smu_pulse_lock = NULL;
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Timer alarm, wake the pulse task
+void IRAM_ATTR smu_pulse_isr() {
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(smu_pulse_task_handle, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+void smu_pulse_write(uint16_t code) {
+  if (!ad5522_write_dac(smu_pulse.pmu_ch, smu_pulse.pmu_dac, code)) smu_pulse_stats.errors++;
+}
+
+// Stop timer and leave the channel at base (smu_pulse_lock held)
+void smu_pulse_finish() {
+  timerAlarmDisable(smu_pulse_timer);
+  if (smu_pulse.phase != PULSE_RISE) smu_pulse_write(smu_pulse.base_code);
+
+  portENTER_CRITICAL(&smu_pulse_mux);
+  smu_pulse.active = false;
+  smu_pulse_stats.missed = smu_pulse_stats.pulses - smu_pulse.measured;
+  portEXIT_CRITICAL(&smu_pulse_mux);
+
+  LOG_I(SMU, "ch%d pulses done (%u pulses, %u missed, %u late, %u us latest, %u errors)", smu_pulse.cfg.ch,
+      smu_pulse_stats.pulses, smu_pulse_stats.missed, smu_pulse_stats.late, smu_pulse_stats.lag_max,
+      smu_pulse_stats.errors);
+}
+
+// Write edge that is due (smu_pulse_lock held)
+void smu_pulse_edge() {
+  uint32_t seq;
+
+  switch (smu_pulse.phase) {
+    case PULSE_RISE:
+      // Train is done one period after the last pulse started (duty
+      //  cycle holds up to a following start)
+      if (smu_pulse.index >= smu_pulse.cfg.points) {
+        smu_pulse_finish();
+        return;
+      }
+
+      portENTER_CRITICAL(&smu_pulse_mux);
+      smu_pulse.point  = smu_pulse.index;
+      smu_pulse.open   = false;
+      smu_pulse.closed = false;
+      smu_pulse.have   = 0;
+      smu_pulse.sent   = false;
+      portEXIT_CRITICAL(&smu_pulse_mux);
+
+      smu_pulse_write(smu_pulse_code[smu_pulse.index]);
+      smu_pulse_stats.pulses++;
+      smu_pulse.rise  = smu_pulse.next;
+      smu_pulse.next  = smu_pulse.rise + smu_pulse.cfg.delay_us;
+      smu_pulse.phase = PULSE_OPEN;
+      break;
+
+    case PULSE_OPEN:
+      seq = ad7177_set_seq();
+      portENTER_CRITICAL(&smu_pulse_mux);
+      smu_pulse.seq_open = seq;
+      smu_pulse.open     = true;
+      portEXIT_CRITICAL(&smu_pulse_mux);
+
+      smu_pulse.next  = smu_pulse.rise + smu_pulse.cfg.width_us;
+      smu_pulse.phase = PULSE_FALL;
+      break;
+
+    case PULSE_FALL:
+      // Sets completed before the base is written are all inside
+      seq = ad7177_set_seq();
+      portENTER_CRITICAL(&smu_pulse_mux);
+      smu_pulse.seq_close = seq;
+      smu_pulse.closed    = true;
+      portEXIT_CRITICAL(&smu_pulse_mux);
+
+      smu_pulse_write(smu_pulse.base_code);
+      smu_pulse.index++;
+      smu_pulse.next  = smu_pulse.rise + smu_pulse.cfg.period_us;
+      smu_pulse.phase = PULSE_RISE;
+      break;
+  }
+}
+
+// Write the edges that are due, then set the alarm for the next one
+//  (smu_pulse_lock held)
+//  - an edge within SMU_PULSE_SPIN is spun on, so the alarm is never set
+//    behind the counter
+void smu_pulse_run() {
+  while (smu_pulse.active) {
+    uint64_t now = timerRead(smu_pulse_timer);
+
+    if (now + SMU_PULSE_SPIN < smu_pulse.next) {
+      timerAlarmWrite(smu_pulse_timer, smu_pulse.next, false);
+      timerAlarmEnable(smu_pulse_timer);
+      return;
+    }
+
+    while (now < smu_pulse.next) now = timerRead(smu_pulse_timer);
+    uint32_t lag = (uint32_t) (now - smu_pulse.next);
+    if (lag > SMU_PULSE_LATE) smu_pulse_stats.late++;
+    if (lag > smu_pulse_stats.lag_max) smu_pulse_stats.lag_max = lag;
+
+    smu_pulse_edge();
+  }
+}
+
+// Pulse task, edges per timer alarm
+void smu_pulse_task(void *pvParameters) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    xSemaphoreTake(smu_pulse_lock, portMAX_DELAY);
+    smu_pulse_run();
+    xSemaphoreGive(smu_pulse_lock);
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Start pulse train (the channel's range, mode and state are left as set)
+//  - the channel goes to base right away (verified), the first pulse
+//    starts SMU_PULSE_START later
+//  - returns false if the pulses aren't valid, the duty cycle is above
+//    duty_max, a waveform, sweep, the trigger model or other train is
+//    running, auto-ranging is on for the channel (codes are for one
+//    range) or the measurement rates of the channel can't fit the sets
+//    the window needs
+bool smu_pulse_start(const smu_pulse_t *pulse) {
+  smu_autorange_t autorange;
+  smu_control_t control;
+  float rate;
+
+  if (pulse->ch >= NUM_CH) return false;
+  if (pulse->dac != DAC_FV && pulse->dac != DAC_FI) return false;
+  if (pulse->points == 0 || pulse->points > SMU_PULSE_POINTS_MAX) return false;
+  if (pulse->width_us < SMU_PULSE_WIDTH_MIN || pulse->delay_us >= pulse->width_us) return false;
+  if (pulse->duty_max > SMU_PULSE_DUTY_MAX) return false;
+  if ((uint64_t) pulse->width_us * 100 > (uint64_t) pulse->duty_max * pulse->period_us) {
+    LOG_W(SMU, "ch%d pulse duty cycle above %u%%", pulse->ch, pulse->duty_max);
+    return false;
+  }
+
+  // ADC rate against the window (sets run on at the plan's rate)
+  rate = std::min(smu_get_meas_rate(pulse->ch, ADC_MV), smu_get_meas_rate(pulse->ch, ADC_MI));
+  if (!(rate * (pulse->width_us - pulse->delay_us) / 1e6F >= SMU_PULSE_SYNC_SETS + 1)) {
+    LOG_W(SMU, "ch%d pulse window of %u us too short for ADC at %f SPS (%f Hz per channel)", pulse->ch,
+        pulse->width_us - pulse->delay_us, ad7177_rate_sps(ad7177_get_rate()), rate);
+    return false;
+  }
+
+  smu_ctrl_take();
+  smu_get_autorange(pulse->ch, &autorange);
+  if (smu_pulse.active || smu_wave_active() || smu_sweep_active() || smu_trig_active() || autorange.enable) {
+    smu_ctrl_give();
+    return false;
+  }
+
+  // Codes for the present range and calibration
+  smu_get_control(pulse->ch, &control);
+  for (uint32_t i = 0; i < pulse->points; i++) {
+    float val = (pulse->points < 2) ? pulse->start
+        : pulse->start + (pulse->stop - pulse->start) * i / (pulse->points - 1);
+    smu_dac_v2d(pulse->ch, pulse->dac, control.range, &val, &smu_pulse_code[i]);
+    smu_pulse_val[i] = val;
+  }
+  float base = pulse->base;
+  smu_dac_v2d(pulse->ch, pulse->dac, control.range, &base, &smu_pulse.base_code);
+
+  smu_pulse.cfg     = *pulse;
+  smu_pulse.phase   = PULSE_RISE;
+  smu_pulse.index   = 0;
+  smu_pulse.measured = 0;
+  smu_pulse.next    = SMU_PULSE_START;
+  smu_pulse.pmu_ch  = smu2ad5522_ch(pulse->ch);
+  smu_pulse.pmu_dac = smu_dac2ad5522(pulse->dac, control.range);
+  memset(&smu_pulse_stats, 0, sizeof(smu_pulse_stats));
+
+  if (smu_pulse_lock == NULL) smu_pulse_lock = xSemaphoreCreateMutex();
+  if (smu_pulse_task_handle == NULL) {
+    smu_pulse_task_handle = task_create(TASK_PULSE, smu_pulse_task, NULL);
+  }
+  if (smu_pulse_timer == NULL) {
+    smu_pulse_timer = timerBegin(SMU_PULSE_TIMER, SMU_PULSE_TIMER_DIV, true);
+    timerAttachInterrupt(smu_pulse_timer, smu_pulse_isr, true);
+  }
+
+  smu_set_dac(pulse->ch, pulse->dac, pulse->base);
+  xSemaphoreTake(smu_pulse_lock, portMAX_DELAY);
+  smu_pulse.active = true;
+  timerWrite(smu_pulse_timer, 0);
+  smu_pulse_run();
+  xSemaphoreGive(smu_pulse_lock);
+  smu_ctrl_give();
+
+  LOG_I(SMU, "ch%d %u pulses of %u us every %u us, measured from %u us", pulse->ch,
+      pulse->points, pulse->width_us, pulse->period_us, pulse->delay_us);
+  return true;
+}
+
+void smu_pulse_stop() {
+  if (smu_pulse_lock == NULL) return;
+
+  xSemaphoreTake(smu_pulse_lock, portMAX_DELAY);
+  if (smu_pulse.active) smu_pulse_finish();
+  xSemaphoreGive(smu_pulse_lock);
+}
+
+bool smu_pulse_active() {
+  return smu_pulse.active;
+}
+
+bool smu_pulse_active_ch(smu_ch_t ch) {
+  return smu_pulse.active && smu_pulse.cfg.ch == ch;
+}
+
+// Stats of the present (or last) pulse train
+void smu_pulse_get_stats(smu_pulse_stats_t *stats) {
+  memcpy(stats, &smu_pulse_stats, sizeof(smu_pulse_stats_t));
+}
+
+// Measurement of channel ch from sample set seq (adc callback, have is a
+//  bit per smu_adc_t)
+//  - sets that may hold samples converted before the window opened, or
+//    completed after the falling edge, don't count
+//  - the pulse is sent once MV and MI are in, as a "pulse" result
+void smu_pulse_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi) {
+  char str[160];
+  uint16_t index;
+  bool ready;
+
+  if (!smu_pulse.active || smu_pulse.cfg.ch != ch) return;
+
+  portENTER_CRITICAL(&smu_pulse_mux);
+  if (smu_pulse.sent || !smu_pulse.open
+      || (int32_t) (seq - smu_pulse.seq_open) < SMU_PULSE_SYNC_SETS
+      || (smu_pulse.closed && (int32_t) (seq - smu_pulse.seq_close) > 0)) {
+    portEXIT_CRITICAL(&smu_pulse_mux);
+    return;
+  }
+  if ((have >> ADC_MV) & 1) smu_pulse.mv = mv;
+  if ((have >> ADC_MI) & 1) smu_pulse.mi = mi;
+  smu_pulse.have |= have;
+
+  ready = smu_pulse.have == ((1 << ADC_MV) | (1 << ADC_MI));
+  smu_pulse.sent = ready;
+  if (ready) smu_pulse.measured++;
+  index = smu_pulse.point;
+  mv    = smu_pulse.mv;
+  mi    = smu_pulse.mi;
+  portEXIT_CRITICAL(&smu_pulse_mux);
+
+  if (!ready) return;
+
+  snprintf(str, sizeof(str), "{\"type\":\"pulse\",\"ch\":%d,\"i\":%u,\"n\":%u,\"src\":%e,\"mv\":%e,\"mi\":%e}",
+      ch, index, smu_pulse.cfg.points, smu_pulse_val[index], mv, mi);
+  if (ws_queue_broadcast(str, WS_MSG_RESULT)) smu_pulse_stats.results++;
+}
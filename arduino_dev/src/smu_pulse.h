@@ -0,0 +1,60 @@
+#ifndef SMU_PULSE_H
+#define SMU_PULSE_H
+
+#include "hal.h"
+#include "quad_smu.h"
+#include "smu_wave.h"
+
+/****************************************
+ *  Pulsed Measurement
+ ***************************************/
+
+#define SMU_PULSE_POINTS_MAX  256     // Pulse levels (code table size)
+#define SMU_PULSE_WIDTH_MIN   50      // Shortest pulse (in us)
+#define SMU_PULSE_TIMER       1       // Hardware timer used for the edges
+#define SMU_PULSE_TIMER_DIV   80      // 1us timer ticks (80MHz APB clock)
+#define SMU_PULSE_START       200     // First pulse after start (in us)
+#define SMU_PULSE_SPIN        20      // Edges closer than this are spun on (in us)
+#define SMU_PULSE_LATE        20      // Edge counted late after (in us)
+#define SMU_PULSE_DUTY_MAX    50      // Highest duty cycle allowed (in %)
+
+// Sample sets after the measurement delay that may hold samples
+//  converted before it (same as for a waveform update)
+#define SMU_PULSE_SYNC_SETS   SMU_WAVE_SYNC_SETS
+
+// Pulses on the FV or FI DAC of one channel, from base to each level of
+//  start..stop in turn (see smu_pulse_start)
+typedef struct {
+  smu_ch_t  ch;
+  smu_dac_t dac;          // DAC_FV or DAC_FI
+  float     base;         // Level between pulses (in V or A)
+  float     start;        // Level of first pulse
+  float     stop;         // Level of last pulse
+  uint16_t  points;       // Pulses
+  uint32_t  width_us;     // Pulse width
+  uint32_t  delay_us;     // Measurement window opens (from pulse start)
+  uint32_t  period_us;    // Pulse start to pulse start
+  uint8_t   duty_max;     // Highest width to period (in %, at most SMU_PULSE_DUTY_MAX)
+} smu_pulse_t;
+
+typedef struct {
+  uint32_t pulses;        // Pulses sent
+  uint32_t results;       // Pulses measured
+  uint32_t missed;        // Pulses without a set inside the window
+  uint32_t late;          // Edges written more than SMU_PULSE_LATE after their time
+  uint32_t lag_max;       // Latest edge (in us)
+  uint32_t errors;        // Failed DAC writes
+} smu_pulse_stats_t;
+
+/****************************************
+ *  Pulse Functions
+ ***************************************/
+
+bool smu_pulse_start(const smu_pulse_t *pulse);
+void smu_pulse_stop();
+bool smu_pulse_active();
+bool smu_pulse_active_ch(smu_ch_t ch);
+void smu_pulse_get_stats(smu_pulse_stats_t *stats);
+void smu_pulse_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi);
+
+#endif
@@ -0,0 +1,188 @@
+#include "hal.h"
+#include "smu_sched.h"
+#include "ad5522_lib.h"
+#include <cmath>
+
+/*
+ * Measurement scheduler
+ *  - the ADC has four channel slots and two are left for housekeeping,
+ *    so the requested (channel, quantity) pairs are spread over frames,
+ *    sample sets the ADC driver converts in turn (ad7177_set_frames)
+ *  - quantities read through a PMU MEASOUT share its pin, a frame can
+ *    only use one MEASOUT selection per channel
+ *  - frames are converted repeat sets in a row, in proportion to their
+ *    fastest request
+ *  - a channel's MEASOUT is switched once a frame using it is done, for
+ *    its next use, so only a frame right after one that needs another
+ *    selection loses its first samples of that channel
+ *  - ADC inputs of each quantity come from the board (smu_sched_src)
+ *  - the plan is only built here, quad_smu runs it from the adc callback
+ */
+
+static_assert(SMU_SCHED_FRAMES <= AD7177_FRAMES_MAX, "plan frames go to the ADC driver");
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Quantity can be added to frame
+bool smu_sched_fits(const smu_sched_frame_t *frame, int ch, const smu_sched_src_t *src) {
+  if (frame->num >= SMU_SCHED_SLOTS) return false;
+  if (src->path != SMU_PATH_MEASOUT) return true;
+  return frame->use[ch] == SMU_SCHED_NONE || frame->use[ch] == src->meas;
+}
+
+// MEASOUT switches after each frame (for the next frame using the
+//  channel) and the sets slots lose to them
+//  - a switch follows the last set of a frame, the next SMU_SCHED_SETTLE
+//    sets may have either selection, frames in between take some of them
+//  - a frame that loses sets gets at least one more (this only adds sets
+//    in between for the other switches, their counts stay safe)
+void smu_sched_switches(smu_sched_plan_t *plan) {
+  for (int f = 0; f < plan->num; f++) {
+    smu_sched_frame_t *frame = &plan->frame[f];
+
+    for (int ch = 0; ch < NUM_CH; ch++) {
+      int between = 0;
+
+      frame->meas_next[ch] = SMU_SCHED_NONE;
+      if (frame->use[ch] == SMU_SCHED_NONE) continue;
+
+      for (int k = 1; k < plan->num; k++) {
+        int g = (f + k) % plan->num;
+        smu_sched_frame_t *next = &plan->frame[g];
+        int lost;
+
+        if (next->use[ch] == SMU_SCHED_NONE) {
+          between += next->repeat;
+          continue;
+        }
+        if (next->use[ch] == frame->use[ch]) break;
+
+        frame->meas_next[ch] = next->use[ch];
+        lost = SMU_SCHED_SETTLE - between;
+        if (lost <= 0) break;
+
+        for (int s = 0; s < next->num; s++) {
+          if (next->ch[s] == ch && smu_sched_src(ch, next->adc[s]).path == SMU_PATH_MEASOUT) {
+            next->lost[s] = std::max((int) next->lost[s], lost);
+          }
+        }
+        if (next->repeat <= lost) next->repeat = lost + 1;
+        break;
+      }
+    }
+  }
+
+  // Selection at the start is the first use
+  for (int ch = 0; ch < NUM_CH; ch++) {
+    plan->meas_init[ch] = SMU_SCHED_NONE;
+    for (int f = 0; f < plan->num && plan->meas_init[ch] == SMU_SCHED_NONE; f++) {
+      plan->meas_init[ch] = plan->frame[f].use[ch];
+    }
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Build plan for the requested rates (in Hz, 0 = not measured)
+//  - sps is the ADC output data rate, one conversion per slot plus one
+//    dropped conversion per frame switch
+//  - the MEASOUT switches are written by the adc callback while the ADC
+//    runs on, a set completing during a write is lost as well (see
+//    smu_measout_at), on average that costs the conversions the writes
+//    take, so their bus time counts against the achievable rates
+//  - quantities are added quantity by quantity, so MV and MI of a
+//    channel sharing MEASOUT end up in frames apart from each other
+//  - returns false if nothing is requested or it needs too many frames
+bool smu_sched_build(const float req[NUM_CH][SMU_ADC_NUM], float sps, smu_sched_plan_t *plan) {
+  float frame_rate[SMU_SCHED_FRAMES];
+  float min_rate = 0;
+  float conv = 0;
+  uint32_t switches = 0;
+
+  memset(plan, 0, sizeof(smu_sched_plan_t));
+
+  for (int q = 0; q < SMU_ADC_NUM; q++) {
+    for (int ch = 0; ch < NUM_CH; ch++) {
+      const smu_sched_src_t src = smu_sched_src(ch, q);
+      smu_sched_frame_t *frame;
+      int f;
+
+      if (!(req[ch][q] > 0)) continue;
+
+      for (f = 0; f < plan->num; f++) {
+        if (smu_sched_fits(&plan->frame[f], ch, &src)) break;
+      }
+      if (f == plan->num) {
+        if (f >= SMU_SCHED_FRAMES) return false;
+        plan->num++;
+        memset(plan->frame[f].use, SMU_SCHED_NONE, sizeof(plan->frame[f].use));
+        frame_rate[f] = 0;
+      }
+
+      frame = &plan->frame[f];
+      frame->ch[frame->num]  = ch;
+      frame->adc[frame->num] = q;
+      frame->num++;
+      if (src.path == SMU_PATH_MEASOUT) frame->use[ch] = src.meas;
+      frame_rate[f] = std::max(frame_rate[f], req[ch][q]);
+    }
+  }
+  if (plan->num == 0) return false;
+
+  // Frames with faster requests get more sets in a row
+  for (int f = 0; f < plan->num; f++) {
+    if (f == 0 || frame_rate[f] < min_rate) min_rate = frame_rate[f];
+  }
+  for (int f = 0; f < plan->num; f++) {
+    smu_sched_frame_t *frame = &plan->frame[f];
+    long repeat = lroundf(frame_rate[f] / min_rate);
+
+    frame->repeat = std::min(std::max(repeat, 1L), (long) SMU_SCHED_REPEAT_MAX);
+    if (plan->num == 1) frame->repeat = 1;
+  }
+  smu_sched_switches(plan);
+
+  for (int f = 0; f < plan->num; f++) {
+    conv += plan->frame[f].repeat * plan->frame[f].num + (plan->num > 1 ? 1 : 0);
+    for (int ch = 0; ch < NUM_CH && plan->num > 1; ch++) {
+      if (plan->frame[f].meas_next[ch] != SMU_SCHED_NONE) switches++;
+    }
+  }
+  conv += switches * SMU_SCHED_SWITCH_US * sps / 1e6F;
+
+  // Achievable rate of each quantity
+  for (int f = 0; f < plan->num; f++) {
+    smu_sched_frame_t *frame = &plan->frame[f];
+
+    for (int s = 0; s < frame->num; s++) {
+      int sets = frame->repeat - frame->lost[s];
+      plan->rate[frame->ch[s]][frame->adc[s]] = sps * sets / conv;
+    }
+  }
+  return true;
+}
+
+// ADC driver frames of plan (frames has room for plan->num)
+void smu_sched_frames(const smu_sched_plan_t *plan, ad7177_frame_t *frames) {
+  for (int f = 0; f < plan->num; f++) {
+    const smu_sched_frame_t *frame = &plan->frame[f];
+
+    memset(&frames[f], 0, sizeof(ad7177_frame_t));
+    for (int s = 0; s < frame->num; s++) {
+      const smu_sched_src_t src = smu_sched_src(frame->ch[s], frame->adc[s]);
+
+      frames[f].ch |= (1 << s);
+      frames[f].ainpos[s] = src.ainpos;
+      frames[f].ainneg[s] = src.ainneg;
+    }
+    frames[f].repeat = frame->repeat;
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef SMU_SCHED_H
+#define SMU_SCHED_H
+
+#include "hal.h"
+#include "quad_smu.h"
+
+/****************************************
+ *  Measurement Scheduler
+ ***************************************/
+
+#define SMU_SCHED_SLOTS      2      // ADC channels per frame (2 and 3 are housekeeping)
+#define SMU_SCHED_FRAMES     8      // (at most AD7177_FRAMES_MAX)
+#define SMU_SCHED_REPEAT_MAX 16     // Most sample sets of one frame in a row
+#define SMU_SCHED_NONE       0xFF   // No MEASOUT selection
+#define SMU_SCHED_SETTLE     2      // Sets lost after a MEASOUT switch
+#define SMU_SCHED_SWITCH_US  40     // Bus time of a MEASOUT switch (one PMU write at 1MHz)
+
+// Default requested rate of every quantity (in Hz, only the ratios
+//  between requests shape the plan)
+#define SMU_SCHED_RATE_DEFAULT 1000.0F
+
+typedef enum {
+  SMU_PATH_INAMP,     // In-amp output
+  SMU_PATH_MEASOUT    // PMU MEASOUT, needs the channel's meas_sel
+} smu_path_t;
+
+// Where a quantity is converted (board wiring)
+typedef struct {
+  uint8_t path;       // smu_path_t
+  uint8_t meas;       // ad5522_meas_t (SMU_PATH_MEASOUT)
+  uint8_t ainpos;     // ad7177_input_t
+  uint8_t ainneg;
+} smu_sched_src_t;
+
+// One ADC sample set, converted repeat times in a row
+typedef struct {
+  uint8_t num;                      // Slots used (ADC channels 0..num-1)
+  uint8_t ch[SMU_SCHED_SLOTS];      // smu_ch_t of slot
+  uint8_t adc[SMU_SCHED_SLOTS];     // smu_adc_t of slot
+  uint8_t repeat;
+  uint8_t lost[SMU_SCHED_SLOTS];    // Sets a slot loses at the start (MEASOUT switched just before)
+  uint8_t use[NUM_CH];              // MEASOUT selection used per channel
+  uint8_t meas_next[NUM_CH];        // MEASOUT selection once the frame is done
+} smu_sched_frame_t;
+
+typedef struct {
+  uint8_t id;                       // Frame list id of the ADC driver
+  uint8_t num;                      // Frames
+  smu_sched_frame_t frame[SMU_SCHED_FRAMES];
+  uint8_t meas_init[NUM_CH];        // MEASOUT selection when the plan starts
+  float   rate[NUM_CH][SMU_ADC_NUM];  // Achievable rate (in Hz, 0 = not measured)
+} smu_sched_plan_t;
+
+// Where quantity adc of channel ch is converted (board wiring, MV is on
+//  MEASOUT too for a channel without in-amp)
+constexpr smu_sched_src_t smu_sched_src(int ch, int adc) {
+  return (adc == ADC_MV && board_has_inamp(ch))
+      ? smu_sched_src_t{SMU_PATH_INAMP, SMU_SCHED_NONE, board_ch[ch].inamp_pos, board_ch[ch].inamp_neg}
+      : smu_sched_src_t{SMU_PATH_MEASOUT,
+            (uint8_t) ((adc == ADC_MV) ? AD5522_MEAS_VSENSE : AD5522_MEAS_ISENSE),
+            board_ch[ch].measout_pos, board_ch[ch].measout_neg};
+}
+
+/****************************************
+ *  Scheduler Functions
+ ***************************************/
+
+bool smu_sched_build(const float req[NUM_CH][SMU_ADC_NUM], float sps, smu_sched_plan_t *plan);
+void smu_sched_frames(const smu_sched_plan_t *plan, ad7177_frame_t *frames);
+
+#endif
@@ -0,0 +1,131 @@
+#include "hal.h"
+#include "smu_store.h"
+#include "log_lib.h"
+
+/*
+ * Channel setups, calibration and ADC rate kept in NVS
+ *  - one binary record per name: the boot record (restored by
+ *    smu_init) and named presets ("p_<name>" keys)
+ *  - a record is only used if magic, version, size and CRC match,
+ *    otherwise the caller falls back to the defaults
+ *  - recalling a preset only writes registers that differ from the
+ *    current setup (smu_apply_config)
+ */
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// CRC-32 (IEEE, bitwise, records are small)
+uint32_t smu_store_crc(const void *data, size_t len) {
+  const uint8_t *ptr = (const uint8_t *) data;
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i = 0; i < len; i++) {
+    crc ^= ptr[i];
+    for (int b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// NVS key of record, false if name is too long
+bool smu_store_key(const char *name, char *key, size_t size) {
+  if (name == NULL || name[0] == '\0') {
+    snprintf(key, size, "boot");
+    return true;
+  }
+  if (strlen(name) > SMU_STORE_NAME_LEN) return false;
+
+  snprintf(key, size, "p_%s", name);
+  return true;
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Read record (NULL = boot record), false if missing or not valid
+bool smu_store_load(const char *name, smu_config_t *config) {
+  smu_record_t record;
+  Preferences prefs;
+  char key[16];
+
+  if (!smu_store_key(name, key, sizeof(key))) return false;
+  if (!prefs.begin(SMU_STORE_NS, true)) return false;
+
+  size_t len = prefs.getBytesLength(key);
+  if (len == 0) {
+    prefs.end();
+    return false;
+  }
+  if (len != sizeof(record)) {
+    prefs.end();
+    LOG_W(SMU, "config record wrong size (%u bytes)", (unsigned) len);
+    return false;
+  }
+  prefs.getBytes(key, &record, sizeof(record));
+  prefs.end();
+
+  if (record.magic != SMU_STORE_MAGIC || record.version != SMU_STORE_VERSION
+      || record.size != sizeof(smu_config_t)) {
+    LOG_W(SMU, "config record version %d not supported", record.version);
+    return false;
+  }
+  if (record.crc != smu_store_crc(&record.config, sizeof(smu_config_t))) {
+    LOG_W(SMU, "config record checksum failed");
+    return false;
+  }
+
+  memcpy(config, &record.config, sizeof(smu_config_t));
+  return true;
+}
+
+// Save current config as record (NULL = boot record)
+bool smu_store_save(const char *name) {
+  smu_record_t record;
+  Preferences prefs;
+  char key[16];
+
+  if (!smu_store_key(name, key, sizeof(key))) return false;
+
+  memset(&record, 0, sizeof(record));
+  smu_get_config(&record.config);
+  record.magic   = SMU_STORE_MAGIC;
+  record.version = SMU_STORE_VERSION;
+  record.size    = sizeof(smu_config_t);
+  record.crc     = smu_store_crc(&record.config, sizeof(smu_config_t));
+
+  if (!prefs.begin(SMU_STORE_NS, false)) return false;
+  bool ok = (prefs.putBytes(key, &record, sizeof(record)) == sizeof(record));
+  prefs.end();
+
+  if (!ok) LOG_W(SMU, "config record not saved");
+  return ok;
+}
+
+// Switch to stored record (only differing registers are written)
+bool smu_store_recall(const char *name) {
+  smu_config_t config;
+
+  if (!smu_store_load(name, &config)) return false;
+  return smu_apply_config(&config);
+}
+
+bool smu_store_remove(const char *name) {
+  Preferences prefs;
+  char key[16];
+
+  if (!smu_store_key(name, key, sizeof(key))) return false;
+  if (!prefs.begin(SMU_STORE_NS, false)) return false;
+
+  bool ok = prefs.remove(key);
+  prefs.end();
+
+  return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef SMU_STORE_H
+#define SMU_STORE_H
+
+#include "hal.h"
+#include "quad_smu.h"
+
+/****************************************
+ *  Config Store
+ ***************************************/
+
+#define SMU_STORE_NS       "smu"        // NVS namespace
+#define SMU_STORE_BOOT     NULL         // Record restored at boot
+#define SMU_STORE_NAME_LEN 12           // Max preset name length
+#define SMU_STORE_MAGIC    0x554D5335   // "5SMU"
+
+// Bump when smu_config_t changes, older records are ignored
+#define SMU_STORE_VERSION  1
+
+// Stored record, config is only used if everything checks out
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;          // sizeof(smu_config_t)
+  uint32_t crc;           // CRC-32 of config
+  smu_config_t config;
+} smu_record_t;
+
+/****************************************
+ *  Config Store Functions
+ ***************************************/
+
+bool smu_store_load(const char *name, smu_config_t *config);
+bool smu_store_save(const char *name);
+bool smu_store_recall(const char *name);
+bool smu_store_remove(const char *name);
+
+#endif
@@ -0,0 +1,553 @@
+#include "hal.h"
+#include "smu_trig.h"
+#include "smu_pulse.h"
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+
+/*
+ * Trigger model (arm / trigger / source / delay / measure per channel)
+ *  - each channel waits for its arm source, then runs trig.count
+ *    triggers, each waits for the trigger source, sources the next list
+ *    value, waits delay_us and measures; after arm.count arm passes the
+ *    channel is done
+ *  - every step posts an event on a bus (armed, source written, measured,
+ *    done), a layer can wait on the event of another channel, so e.g. CH1
+ *    source written triggers CH0
+ *  - events are routed by the trigger task in the order they were posted,
+ *    to the channels in channel order, an event no layer is waiting on is
+ *    dropped (events aren't latched)
+ *  - delays and timer sources are deadlines of a hardware timer counter
+ *    started with the model, the timer interrupt wakes the task, which
+ *    spins on the counter for deadlines due within SMU_TRIG_SPIN
+ *  - measurements use the first sample sets converted wholly after the
+ *    delay (set sequence, as for a waveform update), each is sent as a
+ *    "trig" result
+ *  - a window that isn't in after SMU_TRIG_MEAS_SETS sets at the
+ *    channel's measurement rates (e.g. MV gated off by an in-amp fault)
+ *    is closed, counted in stats.missed, and the channel goes on as if
+ *    it had measured
+ *  - an external input edge is an event, any event can pulse the external
+ *    output (PIN_TRIG_IN and PIN_TRIG_OUT, when wired)
+ */
+
+typedef enum {
+  TRIG_IDLE,        // Not started, done or aborted
+  TRIG_ARM,         // Waiting for arm source
+  TRIG_WAIT,        // Waiting for trigger source
+  TRIG_DELAY,       // Source written, waiting to measure
+  TRIG_MEASURE      // Measurement window open
+} smu_trig_state_t;
+
+typedef struct {
+  uint8_t src;
+  uint8_t ch;
+} smu_trig_ev_t;
+
+typedef struct {
+  smu_trig_cfg_t cfg;
+  bool     configured;
+  uint8_t  state;       // smu_trig_state_t
+  bool     go;          // Layer waits on TRIG_SRC_IMMEDIATE
+  bool     timed;       // Layer or delay waits on due
+  uint64_t due;         // (in timer ticks)
+  uint64_t arm_last;    // Last pass of each layer (TRIG_SRC_TIMER)
+  uint64_t trig_last;
+  uint32_t arms;        // Arm passes done
+  uint32_t trigs;       // Trigger passes of the present arm pass
+  uint32_t index;       // Triggers done (source list position)
+  float    src;         // Source value of the present trigger
+  uint32_t window_us;   // Measurement window before it is missed
+} smu_trig_ch_t;
+
+// Measurement window of a channel (guarded by smu_trig_mux)
+typedef struct {
+  volatile bool open;
+  volatile bool ready;  // MV and MI in, for the trigger task
+  uint32_t seq;         // Sets completed when it opened
+  uint8_t  have;        // smu_adc_t bits measured
+  float    mv;
+  float    mi;
+} smu_trig_meas_t;
+
+smu_trig_ch_t smu_trig_ch[NUM_CH];
+smu_trig_meas_t smu_trig_meas[NUM_CH];
+float smu_trig_list[NUM_CH][SMU_TRIG_POINTS_MAX];
+smu_trig_ev_t smu_trig_out_ev = {TRIG_SRC_NEVER, 0};
+smu_trig_stats_t smu_trig_stats;
+volatile bool smu_trig_running = false;
+portMUX_TYPE smu_trig_mux = portMUX_INITIALIZER_UNLOCKED;
+
+QueueHandle_t smu_trig_queue = NULL;
+hw_timer_t *smu_trig_timer = NULL;
+TaskHandle_t smu_trig_task_handle = NULL;
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Timer alarm, wake the trigger task
+void IRAM_ATTR smu_trig_isr() {
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(smu_trig_task_handle, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+// External input edge, post it and wake the trigger task
+void IRAM_ATTR smu_trig_ext_isr() {
+  smu_trig_ev_t ev = {TRIG_SRC_EXT, 0};
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+  if (!smu_trig_running) return;
+  xQueueSendFromISR(smu_trig_queue, &ev, &xHigherPriorityTaskWoken);
+  vTaskNotifyGiveFromISR(smu_trig_task_handle, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+// Post event on the bus (routed by the trigger task after the ones
+//  before it)
+void smu_trig_post(uint8_t src, uint8_t ch) {
+  smu_trig_ev_t ev = {src, ch};
+  if (xQueueSend(smu_trig_queue, &ev, 0) != pdTRUE) smu_trig_stats.overflows++;
+}
+
+// Layer of channel waits on its source (first pass of a timer source
+//  goes right away)
+void smu_trig_wait(int ch, const smu_trig_layer_t *layer, bool first, uint64_t last) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+
+  c->go    = (layer->src == TRIG_SRC_IMMEDIATE);
+  c->timed = (layer->src == TRIG_SRC_TIMER);
+  if (c->timed) c->due = first ? timerRead(smu_trig_timer) : last + layer->timer_us;
+}
+
+void smu_trig_arm_enter(int ch) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+
+  if (c->cfg.arm.count > 0 && c->arms >= c->cfg.arm.count) {
+    c->state = TRIG_IDLE;
+    c->go    = false;
+    c->timed = false;
+    smu_trig_post(TRIG_SRC_DONE, ch);
+    return;
+  }
+  c->state = TRIG_ARM;
+  smu_trig_wait(ch, &c->cfg.arm, c->arms == 0, c->arm_last);
+}
+
+void smu_trig_trig_enter(int ch) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+
+  if (c->cfg.trig.count > 0 && c->trigs >= c->cfg.trig.count) {
+    c->arms++;
+    smu_trig_arm_enter(ch);
+    return;
+  }
+  c->state = TRIG_WAIT;
+  smu_trig_wait(ch, &c->cfg.trig, c->trigs == 0, c->trig_last);
+}
+
+// Measure step done, send result and wait for the next trigger
+void smu_trig_meas_done(int ch, bool measured) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+  smu_trig_meas_t *m = &smu_trig_meas[ch];
+  char str[160];
+
+  if (measured) {
+    snprintf(str, sizeof(str), "{\"type\":\"trig\",\"ch\":%d,\"i\":%u,\"n\":%u,\"src\":%e,\"mv\":%e,\"mi\":%e}",
+        ch, c->index, c->cfg.arm.count * c->cfg.trig.count, c->src, m->mv, m->mi);
+    if (ws_queue_broadcast(str, WS_MSG_RESULT)) smu_trig_stats.results++;
+  }
+  smu_trig_post(TRIG_SRC_MEAS, ch);
+
+  c->trigs++;
+  c->index++;
+  smu_trig_trig_enter(ch);
+}
+
+// Open measurement window (or skip the step), it times out after
+//  window_us
+void smu_trig_measure(int ch) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+  smu_trig_meas_t *m = &smu_trig_meas[ch];
+  uint32_t seq;
+
+  if (!c->cfg.measure) {
+    smu_trig_meas_done(ch, false);
+    return;
+  }
+
+  seq = ad7177_set_seq();
+  portENTER_CRITICAL(&smu_trig_mux);
+  m->seq   = seq;
+  m->have  = 0;
+  m->ready = false;
+  m->open  = true;
+  portEXIT_CRITICAL(&smu_trig_mux);
+
+  c->state = TRIG_MEASURE;
+  c->go    = false;
+  c->timed = true;
+  c->due   = timerRead(smu_trig_timer) + c->window_us;
+}
+
+// Pass the layer, delay or window channel ch waits on (its source came
+//  or it is due, smu_ctrl_lock held)
+void smu_trig_pass(int ch) {
+  smu_trig_ch_t *c = &smu_trig_ch[ch];
+  smu_trig_meas_t *m = &smu_trig_meas[ch];
+  uint64_t now = timerRead(smu_trig_timer);
+  smu_control_t control;
+  bool measured;
+
+  switch (c->state) {
+    case TRIG_ARM:
+      // A timer source keeps its period if a pass was late
+      c->arm_last = c->timed ? c->due : now;
+      c->trigs    = 0;
+      smu_trig_post(TRIG_SRC_ARM, ch);
+      smu_trig_trig_enter(ch);
+      break;
+
+    case TRIG_WAIT:
+      c->trig_last = c->timed ? c->due : now;
+      if (c->cfg.points > 0) {
+        c->src = smu_trig_list[ch][c->index % c->cfg.points];
+        smu_set_dac((smu_ch_t) ch, c->cfg.dac, c->src);
+      } else {
+        smu_get_control((smu_ch_t) ch, &control);
+        c->src = (c->cfg.dac == DAC_FI) ? control.fi : control.fv;
+      }
+      smu_trig_post(TRIG_SRC_SOURCE, ch);
+
+      if (c->cfg.delay_us == 0) {
+        smu_trig_measure(ch);
+        break;
+      }
+      c->state = TRIG_DELAY;
+      c->go    = false;
+      c->timed = true;
+      c->due   = timerRead(smu_trig_timer) + c->cfg.delay_us;
+      break;
+
+    case TRIG_DELAY:
+      smu_trig_measure(ch);
+      break;
+
+    case TRIG_MEASURE:
+      // Window timed out (unless it came in since the task looked)
+      portENTER_CRITICAL(&smu_trig_mux);
+      measured = m->ready;
+      m->open  = false;
+      m->ready = false;
+      portEXIT_CRITICAL(&smu_trig_mux);
+      if (!measured) smu_trig_stats.missed++;
+      smu_trig_meas_done(ch, measured);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Hand event to the channels waiting on it, pulse external output
+void smu_trig_route(const smu_trig_ev_t *ev) {
+  smu_trig_stats.events++;
+
+#if PIN_TRIG_OUT >= 0
+  if (ev->src == smu_trig_out_ev.src && (ev->src < TRIG_SRC_ARM || ev->ch == smu_trig_out_ev.ch)) {
+    digitalWrite(PIN_TRIG_OUT, HIGH);
+    delayMicroseconds(SMU_TRIG_OUT_WIDTH);
+    digitalWrite(PIN_TRIG_OUT, LOW);
+  }
+#endif
+
+  for (int i = 0; i < NUM_CH; i++) {
+    const smu_trig_layer_t *layer;
+
+    if (smu_trig_ch[i].state == TRIG_ARM) layer = &smu_trig_ch[i].cfg.arm;
+    else if (smu_trig_ch[i].state == TRIG_WAIT) layer = &smu_trig_ch[i].cfg.trig;
+    else continue;
+
+    if (layer->src != ev->src) continue;
+    if (ev->src >= TRIG_SRC_ARM && layer->ch != ev->ch) continue;
+    smu_trig_pass(i);
+  }
+}
+
+// Route posted events, then measurements that are in, immediate passes
+//  and deadlines that are due, and set the alarm for the next deadline (smu_ctrl_lock held)
+//  - returns true if SMU_TRIG_BURST steps were taken and there may be
+//    more (the task lets the other tasks run first)
+//  - a deadline within SMU_TRIG_SPIN is spun on, so the alarm is never
+//    set behind the counter
+bool smu_trig_run() {
+  smu_trig_ev_t ev;
+  int steps = 0;
+
+  while (smu_trig_running) {
+    int next = -1;
+
+    if (steps++ >= SMU_TRIG_BURST) return true;
+
+    if (xQueueReceive(smu_trig_queue, &ev, 0) == pdTRUE) {
+      smu_trig_route(&ev);
+      continue;
+    }
+
+    for (int i = 0; i < NUM_CH && next < 0; i++) {
+      if (smu_trig_meas[i].ready) next = i;
+    }
+    if (next >= 0) {
+      smu_trig_meas[next].ready = false;
+      if (smu_trig_ch[next].state == TRIG_MEASURE) smu_trig_meas_done(next, true);
+      continue;
+    }
+
+    for (int i = 0; i < NUM_CH && next < 0; i++) {
+      if (smu_trig_ch[i].go) next = i;
+    }
+    if (next >= 0) {
+      smu_trig_ch[next].go = false;
+      smu_trig_pass(next);
+      continue;
+    }
+
+    for (int i = 0; i < NUM_CH; i++) {
+      if (smu_trig_ch[i].timed && (next < 0 || smu_trig_ch[i].due < smu_trig_ch[next].due)) next = i;
+    }
+    if (next >= 0) {
+      uint64_t due = smu_trig_ch[next].due;
+      uint64_t now = timerRead(smu_trig_timer);
+
+      if (now + SMU_TRIG_SPIN < due) {
+        timerAlarmWrite(smu_trig_timer, due, false);
+        timerAlarmEnable(smu_trig_timer);
+        return false;
+      }
+
+      while (now < due) now = timerRead(smu_trig_timer);
+      uint32_t lag = (uint32_t) (now - due);
+      if (lag > SMU_TRIG_LATE) smu_trig_stats.late++;
+      if (lag > smu_trig_stats.lag_max) smu_trig_stats.lag_max = lag;
+
+      smu_trig_pass(next);
+      continue;
+    }
+
+    // Nothing due, the model is done once every channel is
+    for (int i = 0; i < NUM_CH; i++) {
+      if (smu_trig_ch[i].state != TRIG_IDLE) return false;
+    }
+    smu_trig_running = false;
+    LOG_I(SMU, "trigger model done (%u events, %u results, %u missed, %u late, %u us latest)",
+        smu_trig_stats.events, smu_trig_stats.results, smu_trig_stats.missed, smu_trig_stats.late,
+        smu_trig_stats.lag_max);
+  }
+
+  return false;
+}
+
+// Trigger task, runs the model on events and alarms
+void smu_trig_task(void *pvParameters) {
+  bool more;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    do {
+      smu_ctrl_take();
+      more = smu_trig_run();
+      smu_ctrl_give();
+      if (more) vTaskDelay(1);
+    } while (more);
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Set trigger model of channel (not while the model runs)
+//  - returns false if the layers or source aren't valid
+bool smu_trig_config(smu_ch_t ch, const smu_trig_cfg_t *cfg) {
+  if (ch >= NUM_CH) return false;
+  if (cfg->arm.src >= TRIG_SRC_NUM || cfg->trig.src >= TRIG_SRC_NUM) return false;
+  if ((cfg->arm.src >= TRIG_SRC_ARM && cfg->arm.ch >= NUM_CH)
+      || (cfg->trig.src >= TRIG_SRC_ARM && cfg->trig.ch >= NUM_CH)) return false;
+  if ((cfg->arm.src == TRIG_SRC_TIMER && cfg->arm.timer_us == 0)
+      || (cfg->trig.src == TRIG_SRC_TIMER && cfg->trig.timer_us == 0)) return false;
+  if (cfg->dac != DAC_FV && cfg->dac != DAC_FI) return false;
+  if (cfg->points > SMU_TRIG_POINTS_MAX || (cfg->points > 0 && cfg->list == NULL)) return false;
+
+  smu_ctrl_take();
+  if (smu_trig_running) {
+    smu_ctrl_give();
+    return false;
+  }
+  smu_trig_ch[ch].cfg = *cfg;
+  smu_trig_ch[ch].cfg.list = NULL;
+  if (cfg->points > 0) memcpy(smu_trig_list[ch], cfg->list, cfg->points * sizeof(float));
+  smu_trig_ch[ch].configured = true;
+  smu_ctrl_give();
+
+  return true;
+}
+
+// Start trigger model of the channels in mask (each bit a channel)
+//  - channels start waiting for their arm source, the others stay idle
+//  - measurement windows are sized from the channel's measurement rates
+//    now (SMU_TRIG_MEAS_SETS sets)
+//  - returns false if a channel isn't configured, has auto-ranging on or
+//    measures without MV and MI in the measurement plan, or the model, a
+//    waveform, pulse train or sweep is running
+bool smu_trig_init(uint16_t mask) {
+  smu_autorange_t autorange;
+  smu_trig_ev_t ev;
+  float rate;
+
+  mask &= (1 << NUM_CH) - 1;
+  if (mask == 0) return false;
+
+  smu_ctrl_take();
+  if (smu_trig_running || smu_wave_active() || smu_pulse_active() || smu_sweep_active()) {
+    smu_ctrl_give();
+    return false;
+  }
+  for (int i = 0; i < NUM_CH; i++) {
+    if (!((mask >> i) & 1)) continue;
+    smu_get_autorange((smu_ch_t) i, &autorange);
+    rate = std::min(smu_get_meas_rate((smu_ch_t) i, ADC_MV), smu_get_meas_rate((smu_ch_t) i, ADC_MI));
+    if (!smu_trig_ch[i].configured || autorange.enable || (smu_trig_ch[i].cfg.measure && !(rate > 0))) {
+      smu_ctrl_give();
+      return false;
+    }
+    if (smu_trig_ch[i].cfg.measure) smu_trig_ch[i].window_us = (uint32_t) ceilf(SMU_TRIG_MEAS_SETS * 1e6F / rate);
+  }
+
+  if (smu_trig_queue == NULL) {
+    smu_trig_queue = xQueueCreate(SMU_TRIG_QUEUE_LEN, sizeof(smu_trig_ev_t));
+#if PIN_TRIG_IN >= 0
+    pinMode(PIN_TRIG_IN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(PIN_TRIG_IN), smu_trig_ext_isr, RISING);
+#endif
+#if PIN_TRIG_OUT >= 0
+    pinMode(PIN_TRIG_OUT, OUTPUT);
+    digitalWrite(PIN_TRIG_OUT, LOW);
+#endif
+  }
+  if (smu_trig_task_handle == NULL) {
+    smu_trig_task_handle = task_create(TASK_TRIG, smu_trig_task, NULL);
+  }
+  if (smu_trig_timer == NULL) {
+    smu_trig_timer = timerBegin(SMU_TRIG_TIMER, SMU_TRIG_TIMER_DIV, true);
+    timerAttachInterrupt(smu_trig_timer, smu_trig_isr, true);
+  }
+
+  while (xQueueReceive(smu_trig_queue, &ev, 0) == pdTRUE);
+  memset(&smu_trig_stats, 0, sizeof(smu_trig_stats));
+  timerWrite(smu_trig_timer, 0);
+
+  for (int i = 0; i < NUM_CH; i++) {
+    smu_trig_ch_t *c = &smu_trig_ch[i];
+
+    c->state = TRIG_IDLE;
+    c->go    = false;
+    c->timed = false;
+    if (!((mask >> i) & 1)) continue;
+
+    c->arms      = 0;
+    c->trigs     = 0;
+    c->index     = 0;
+    c->arm_last  = 0;
+    c->trig_last = 0;
+    smu_trig_arm_enter(i);
+  }
+  smu_trig_running = true;
+  smu_ctrl_give();
+
+  // The task runs the model from here
+  xTaskNotifyGive(smu_trig_task_handle);
+
+  LOG_I(SMU, "trigger model started (channels 0x%X)", mask);
+  return true;
+}
+
+// Stop model, channels stay at their last source value
+void smu_trig_abort() {
+  smu_ctrl_take();
+  if (smu_trig_running) {
+    timerAlarmDisable(smu_trig_timer);
+    for (int i = 0; i < NUM_CH; i++) {
+      smu_trig_ch[i].state = TRIG_IDLE;
+      smu_trig_ch[i].go    = false;
+      smu_trig_ch[i].timed = false;
+      smu_trig_meas[i].open  = false;
+      smu_trig_meas[i].ready = false;
+    }
+    smu_trig_running = false;
+    LOG_I(SMU, "trigger model aborted");
+  }
+  smu_ctrl_give();
+}
+
+// Software trigger (TRIG_SRC_BUS event)
+bool smu_trig_bus() {
+  smu_trig_ev_t ev = {TRIG_SRC_BUS, 0};
+
+  if (!smu_trig_running) return false;
+  if (xQueueSend(smu_trig_queue, &ev, 0) != pdTRUE) return false;
+  xTaskNotifyGive(smu_trig_task_handle);
+  return true;
+}
+
+// Event that pulses the external output (TRIG_SRC_NEVER = off)
+void smu_trig_out(smu_trig_src_t src, uint8_t ch) {
+  smu_ctrl_take();
+  smu_trig_out_ev.src = src;
+  smu_trig_out_ev.ch  = ch;
+  smu_ctrl_give();
+}
+
+bool smu_trig_active() {
+  return smu_trig_running;
+}
+
+// Stats of the present (or last) run of the model
+void smu_trig_get_stats(smu_trig_stats_t *stats) {
+  memcpy(stats, &smu_trig_stats, sizeof(smu_trig_stats_t));
+}
+
+// Measurement of channel ch from sample set seq (adc callback, have is a
+//  bit per smu_adc_t)
+//  - sets that may hold samples converted before the window opened don't
+//    count, the window closes once MV and MI are in and the trigger task
+//    takes them
+void smu_trig_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi) {
+  smu_trig_meas_t *m = &smu_trig_meas[ch];
+  bool ready;
+
+  if (!m->open) return;
+
+  portENTER_CRITICAL(&smu_trig_mux);
+  if (!m->open || (int32_t) (seq - m->seq) < SMU_TRIG_SYNC_SETS) {
+    portEXIT_CRITICAL(&smu_trig_mux);
+    return;
+  }
+  if ((have >> ADC_MV) & 1) m->mv = mv;
+  if ((have >> ADC_MI) & 1) m->mi = mi;
+  m->have |= have;
+
+  ready = m->have == ((1 << ADC_MV) | (1 << ADC_MI));
+  if (ready) {
+    m->open  = false;
+    m->ready = true;
+  }
+  portEXIT_CRITICAL(&smu_trig_mux);
+
+  if (ready) xTaskNotifyGive(smu_trig_task_handle);
+}
@@ -0,0 +1,86 @@
+#ifndef SMU_TRIG_H
+#define SMU_TRIG_H
+
+#include "hal.h"
+#include "quad_smu.h"
+#include "smu_wave.h"
+
+/****************************************
+ *  Trigger Model
+ ***************************************/
+
+#define SMU_TRIG_POINTS_MAX   256     // Source list per channel
+#define SMU_TRIG_QUEUE_LEN    32      // Events waiting to be routed
+#define SMU_TRIG_TIMER        2       // Hardware timer used for delays and timer sources
+#define SMU_TRIG_TIMER_DIV    80      // 1us timer ticks (80MHz APB clock)
+#define SMU_TRIG_SPIN         20      // Deadlines closer than this are spun on (in us)
+#define SMU_TRIG_LATE         20      // Deadline counted late after (in us)
+#define SMU_TRIG_OUT_WIDTH    2       // External output pulse (in us)
+#define SMU_TRIG_BURST        64      // Steps before other tasks get the core
+
+// Sample sets after the delay that may hold samples converted before it
+//  (same as for a waveform update)
+#define SMU_TRIG_SYNC_SETS    SMU_WAVE_SYNC_SETS
+
+// Sample sets at the channel's measurement rates before a measurement
+//  window is missed (the sync sets and then some to spare)
+#define SMU_TRIG_MEAS_SETS    (SMU_TRIG_SYNC_SETS + 4)
+
+// Event sources of a layer (and events on the bus, ARM to DONE are per
+//  channel)
+typedef enum {
+  TRIG_SRC_NEVER,       // Waits until aborted (external output off)
+  TRIG_SRC_IMMEDIATE,   // Passes right away
+  TRIG_SRC_BUS,         // Software trigger (smu_trig_bus)
+  TRIG_SRC_EXT,         // External input edge
+  TRIG_SRC_TIMER,       // First pass right away, then every timer_us
+  TRIG_SRC_ARM,         // Channel ch armed
+  TRIG_SRC_SOURCE,      // Channel ch wrote its source
+  TRIG_SRC_MEAS,        // Channel ch measured
+  TRIG_SRC_DONE,        // Channel ch went through all its counts
+  TRIG_SRC_NUM
+} smu_trig_src_t;
+
+typedef struct {
+  uint8_t  src;         // smu_trig_src_t
+  uint8_t  ch;          // Channel of TRIG_SRC_ARM to TRIG_SRC_DONE
+  uint32_t count;       // Passes (0 = until aborted)
+  uint32_t timer_us;    // TRIG_SRC_TIMER period
+} smu_trig_layer_t;
+
+// Trigger model of one channel, each arm pass runs trig.count triggers
+//  and each trigger sources the next list value, waits delay_us and
+//  measures (see smu_trig_init)
+typedef struct {
+  smu_trig_layer_t arm;
+  smu_trig_layer_t trig;
+  smu_dac_t    dac;         // DAC_FV or DAC_FI
+  uint16_t     points;      // Source list (0 = no source action)
+  const float *list;        // (copied)
+  uint32_t     delay_us;    // Source to measure
+  bool         measure;
+} smu_trig_cfg_t;
+
+typedef struct {
+  uint32_t events;      // Events routed
+  uint32_t overflows;   // Events lost (queue full)
+  uint32_t results;     // Measurements sent
+  uint32_t missed;      // Measurement windows that timed out
+  uint32_t late;        // Deadlines handled more than SMU_TRIG_LATE after their time
+  uint32_t lag_max;     // Latest deadline (in us)
+} smu_trig_stats_t;
+
+/****************************************
+ *  Trigger Functions
+ ***************************************/
+
+bool smu_trig_config(smu_ch_t ch, const smu_trig_cfg_t *cfg);
+bool smu_trig_init(uint16_t mask);
+void smu_trig_abort();
+bool smu_trig_bus();
+void smu_trig_out(smu_trig_src_t src, uint8_t ch);
+bool smu_trig_active();
+void smu_trig_get_stats(smu_trig_stats_t *stats);
+void smu_trig_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi);
+
+#endif
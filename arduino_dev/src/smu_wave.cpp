@@ -0,0 +1,286 @@
+#include "hal.h"
+#include "smu_wave.h"
+#include "smu_pulse.h"
+#include "smu_trig.h"
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+
+/*
+ * Waveform source (steps, ramps, pulses and lists on the FV or FI DAC)
+ *  - every point is converted to a DAC code once, at start, with the
+ *    channel range and calibration of that moment (smu_dac_v2d)
+ *  - a hardware timer paces the updates, its interrupt wakes the wave
+ *    task, which writes the next code without read-back (one control bus
+ *    write, ad5522_write_dac)
+ *  - updates the task was too late for are skipped rather than sent late,
+ *    so the waveform keeps its timing (counted in stats.missed)
+ *  - with sync, each update is measured: the adc callback hands in MV
+ *    and MI of the first sample sets converted wholly after it
+ *    (smu_wave_sample), the point is sent as a "wave" result
+ *  - the channel state shows the source value once the waveform is done
+ *    or stopped, not every update
+ */
+
+typedef struct {
+  smu_wave_t   cfg;
+  volatile bool active;
+  uint16_t     len;         // Updates per cycle
+  uint32_t     total;       // Updates of all cycles (0 = until stopped)
+  uint32_t     index;       // Next update (counts on over cycles)
+  ad5522_ch_t  pmu_ch;
+  ad5522_dac_t pmu_dac;
+
+  // Update being measured (sync, guarded by smu_wave_mux)
+  uint32_t     point;
+  uint32_t     seq;         // Sets completed when it was written
+  uint8_t      have;        // smu_adc_t bits measured
+  bool         sent;
+  float        mv;
+  float        mi;
+} smu_wave_state_t;
+
+smu_wave_state_t smu_wave;
+smu_wave_stats_t smu_wave_stats;
+portMUX_TYPE smu_wave_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Code and calibrated value of each update of a cycle
+uint16_t smu_wave_code[SMU_WAVE_POINTS_MAX];
+float    smu_wave_val[SMU_WAVE_POINTS_MAX];
+
+hw_timer_t *smu_wave_timer = NULL;
+TaskHandle_t smu_wave_task_handle = NULL;
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+// Updates per cycle of waveform
+uint32_t smu_wave_len(const smu_wave_t *wave) {
+  return (wave->shape == WAVE_STEP) ? (uint32_t) wave->points * wave->width : wave->points;
+}
+
+// Source value of update i of a cycle
+float smu_wave_value(const smu_wave_t *wave, uint32_t i) {
+  uint32_t level = i;
+
+  switch (wave->shape) {
+    case WAVE_PULSE:
+      return (i < wave->width) ? wave->stop : wave->start;
+    case WAVE_LIST:
+      return wave->list[i];
+    case WAVE_STEP:
+      level = i / wave->width;
+      break;
+    default:
+      break;
+  }
+
+  if (wave->points < 2) return wave->start;
+  return wave->start + (wave->stop - wave->start) * level / (wave->points - 1);
+}
+
+// Timer alarm, wake the wave task
+void IRAM_ATTR smu_wave_isr() {
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(smu_wave_task_handle, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+// Write next update (smu_ctrl_lock held)
+void smu_wave_update() {
+  uint32_t i = smu_wave.index % smu_wave.len;
+  bool ok = ad5522_write_dac(smu_wave.pmu_ch, smu_wave.pmu_dac, smu_wave_code[i]);
+  uint32_t seq = ad7177_set_seq();
+
+  portENTER_CRITICAL(&smu_wave_mux);
+  smu_wave.point = smu_wave.index;
+  smu_wave.seq   = seq;
+  smu_wave.have  = 0;
+  smu_wave.sent  = false;
+  portEXIT_CRITICAL(&smu_wave_mux);
+
+  if (ok) smu_wave_stats.updates++;
+  else    smu_wave_stats.errors++;
+  smu_wave.index++;
+}
+
+// Stop timer and leave the channel at the last update (smu_ctrl_lock held)
+void smu_wave_finish() {
+  uint32_t last = (smu_wave.index + smu_wave.len - 1) % smu_wave.len;
+
+  timerAlarmDisable(smu_wave_timer);
+  smu_wave.active = false;
+
+  // Channel state and PMU shadow get the value through the verified path
+  smu_set_dac(smu_wave.cfg.ch, smu_wave.cfg.dac, smu_wave_val[last]);
+
+  LOG_I(SMU, "ch%d wave done (%u updates, %u missed, %u errors)", smu_wave.cfg.ch,
+      smu_wave_stats.updates, smu_wave_stats.missed, smu_wave_stats.errors);
+}
+
+// Wave task, one update per timer alarm
+void smu_wave_task(void *pvParameters) {
+  while (true) {
+    uint32_t alarms = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    smu_ctrl_take();
+    if (!smu_wave.active) {
+      smu_ctrl_give();
+      continue;
+    }
+
+    // Alarms that passed while the task was held up are skipped
+    if (alarms > 1) {
+      smu_wave.index += alarms - 1;
+      smu_wave_stats.missed += alarms - 1;
+    }
+
+    // Last update had its period
+    if (smu_wave.total > 0 && smu_wave.index >= smu_wave.total) {
+      smu_wave.index = smu_wave.total;
+      smu_wave_finish();
+    } else {
+      smu_wave_update();
+    }
+    smu_ctrl_give();
+  }
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Start waveform (the channel's range, mode and state are left as set)
+//  - the first update is written right away, then one every period_us
+//  - returns false if the waveform isn't valid, another waveform, a pulse
+//    train, the trigger model or a sweep is running, auto-ranging is on
+//    for the channel (codes are for one range) or sync is asked for with
+//    a period shorter than the sets it needs at the channel's
+//    measurement rates
+bool smu_wave_start(const smu_wave_t *wave) {
+  smu_autorange_t autorange;
+  smu_control_t control;
+  uint32_t len = smu_wave_len(wave);
+
+  if (wave->ch >= NUM_CH) return false;
+  if (wave->dac != DAC_FV && wave->dac != DAC_FI) return false;
+  if (wave->shape > WAVE_LIST || wave->period_us < SMU_WAVE_PERIOD_MIN) return false;
+  if (len == 0 || len > SMU_WAVE_POINTS_MAX) return false;
+  if ((wave->shape == WAVE_STEP || wave->shape == WAVE_PULSE) && wave->width == 0) return false;
+  if (wave->shape == WAVE_LIST && wave->list == NULL) return false;
+  if (wave->cycles > 0xFFFFFFFFUL / len) return false;
+
+  if (wave->sync) {
+    float rate = std::min(smu_get_meas_rate(wave->ch, ADC_MV), smu_get_meas_rate(wave->ch, ADC_MI));
+
+    if (!(rate * wave->period_us / 1e6F >= SMU_WAVE_SYNC_SETS + wave->settle + 1)) {
+      LOG_W(SMU, "ch%d wave period too short to measure (%f Hz)", wave->ch, rate);
+      return false;
+    }
+  }
+
+  smu_ctrl_take();
+  smu_get_autorange(wave->ch, &autorange);
+  if (smu_wave.active || smu_pulse_active() || smu_sweep_active() || smu_trig_active() || autorange.enable) {
+    smu_ctrl_give();
+    return false;
+  }
+
+  // Codes for the present range and calibration
+  smu_get_control(wave->ch, &control);
+  for (uint32_t i = 0; i < len; i++) {
+    float val = smu_wave_value(wave, i);
+    smu_dac_v2d(wave->ch, wave->dac, control.range, &val, &smu_wave_code[i]);
+    smu_wave_val[i] = val;
+  }
+
+  smu_wave.cfg      = *wave;
+  smu_wave.cfg.list = NULL;
+  smu_wave.len      = len;
+  smu_wave.total    = wave->cycles * len;
+  smu_wave.index    = 0;
+  smu_wave.pmu_ch   = smu2ad5522_ch(wave->ch);
+  smu_wave.pmu_dac  = smu_dac2ad5522(wave->dac, control.range);
+  memset(&smu_wave_stats, 0, sizeof(smu_wave_stats));
+
+  if (smu_wave_task_handle == NULL) {
+    smu_wave_task_handle = task_create(TASK_WAVE, smu_wave_task, NULL);
+  }
+  if (smu_wave_timer == NULL) {
+    smu_wave_timer = timerBegin(SMU_WAVE_TIMER, SMU_WAVE_TIMER_DIV, true);
+    timerAttachInterrupt(smu_wave_timer, smu_wave_isr, true);
+  }
+
+  // Counter kept running since the last waveform, first alarm one
+  //  period from this update; the callback measures nothing until the
+  //  update has noted its set (it doesn't wait on smu_ctrl_lock)
+  smu_wave_update();
+  smu_wave.active = true;
+  timerWrite(smu_wave_timer, 0);
+  timerAlarmWrite(smu_wave_timer, wave->period_us, true);
+  timerAlarmEnable(smu_wave_timer);
+  smu_ctrl_give();
+
+  LOG_I(SMU, "ch%d wave of %u points every %u us (%u cycles)", wave->ch, len, wave->period_us, wave->cycles);
+  return true;
+}
+
+void smu_wave_stop() {
+  smu_ctrl_take();
+  if (smu_wave.active) smu_wave_finish();
+  smu_ctrl_give();
+}
+
+bool smu_wave_active() {
+  return smu_wave.active;
+}
+
+bool smu_wave_active_ch(smu_ch_t ch) {
+  return smu_wave.active && smu_wave.cfg.ch == ch;
+}
+
+// Stats of the present (or last) waveform
+void smu_wave_get_stats(smu_wave_stats_t *stats) {
+  memcpy(stats, &smu_wave_stats, sizeof(smu_wave_stats_t));
+}
+
+// Measurement of channel ch from sample set seq (adc callback, have is a
+//  bit per smu_adc_t)
+//  - sets that may hold samples converted before the update, and the
+//    settle sets after it, don't count
+//  - the point is sent once MV and MI are in (they may come from
+//    different frames), a point the clients can't take is dropped
+void smu_wave_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi) {
+  char str[160];
+  uint32_t point;
+  bool ready;
+
+  if (!smu_wave.active || !smu_wave.cfg.sync || smu_wave.cfg.ch != ch) return;
+
+  portENTER_CRITICAL(&smu_wave_mux);
+  if (smu_wave.sent || (int32_t) (seq - smu_wave.seq) < SMU_WAVE_SYNC_SETS + smu_wave.cfg.settle) {
+    portEXIT_CRITICAL(&smu_wave_mux);
+    return;
+  }
+  if ((have >> ADC_MV) & 1) smu_wave.mv = mv;
+  if ((have >> ADC_MI) & 1) smu_wave.mi = mi;
+  smu_wave.have |= have;
+
+  ready = smu_wave.have == ((1 << ADC_MV) | (1 << ADC_MI));
+  smu_wave.sent = ready;
+  point = smu_wave.point;
+  mv    = smu_wave.mv;
+  mi    = smu_wave.mi;
+  portEXIT_CRITICAL(&smu_wave_mux);
+
+  if (!ready) return;
+
+  snprintf(str, sizeof(str), "{\"type\":\"wave\",\"ch\":%d,\"i\":%u,\"n\":%u,\"src\":%e,\"mv\":%e,\"mi\":%e}",
+      ch, point, smu_wave.total, smu_wave_val[point % smu_wave.len], mv, mi);
+  if (ws_queue_broadcast(str, WS_MSG_RESULT)) smu_wave_stats.results++;
+}
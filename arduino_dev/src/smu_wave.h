@@ -0,0 +1,61 @@
+#ifndef SMU_WAVE_H
+#define SMU_WAVE_H
+
+#include "hal.h"
+#include "quad_smu.h"
+
+/****************************************
+ *  Waveform Source
+ ***************************************/
+
+#define SMU_WAVE_POINTS_MAX   1024    // Updates per cycle (code table size)
+#define SMU_WAVE_PERIOD_MIN   100     // Shortest update period (in us)
+#define SMU_WAVE_TIMER        0       // Hardware timer used for pacing
+#define SMU_WAVE_TIMER_DIV    80      // 1us timer ticks (80MHz APB clock)
+
+// Sample sets after an update that may hold samples converted before it
+//  (the ADC can be one conversion ahead of the completed sets)
+#define SMU_WAVE_SYNC_SETS    3
+
+typedef enum {
+  WAVE_RAMP,    // points from start to stop
+  WAVE_STEP,    // points levels from start to stop, each held width updates
+  WAVE_PULSE,   // width updates at stop, then points - width at start
+  WAVE_LIST     // points values of list
+} smu_wave_shape_t;
+
+// Waveform on the FV or FI DAC of one channel (see smu_wave_start)
+typedef struct {
+  smu_ch_t     ch;
+  smu_dac_t    dac;         // DAC_FV or DAC_FI
+  uint8_t      shape;       // smu_wave_shape_t
+  float        start;       // (in V or A)
+  float        stop;
+  uint16_t     points;
+  uint16_t     width;       // WAVE_STEP and WAVE_PULSE
+  const float *list;        // WAVE_LIST (copied at start)
+  uint32_t     period_us;   // Time between updates
+  uint32_t     cycles;      // 0 = until stopped
+  bool         sync;        // Measure each update (see smu_wave_sample)
+  uint8_t      settle;      // Sample sets discarded after an update (sync)
+} smu_wave_t;
+
+typedef struct {
+  uint32_t updates;     // DAC updates written
+  uint32_t missed;      // Updates skipped (task late for its timer)
+  uint32_t errors;      // Failed DAC writes
+  uint32_t results;     // Points measured (sync)
+} smu_wave_stats_t;
+
+/****************************************
+ *  Waveform Functions
+ ***************************************/
+
+bool smu_wave_start(const smu_wave_t *wave);
+void smu_wave_stop();
+bool smu_wave_active();
+bool smu_wave_active_ch(smu_ch_t ch);
+void smu_wave_get_stats(smu_wave_stats_t *stats);
+void smu_wave_sample(int ch, uint32_t seq, uint8_t have, float mv, float mi);
+
+#endif
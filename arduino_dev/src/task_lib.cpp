@@ -0,0 +1,178 @@
+#include "hal.h"
+#include "task_lib.h"
+#include "log_lib.h"
+
+/*
+ * Firmware tasks are created from one table so the layout (core,
+ * priority, stack) is visible in one place
+ *  - stacks and task control blocks are statically allocated
+ *  - stats list every task with stack headroom and, when FreeRTOS run
+ *    time stats are enabled, CPU use since the previous call
+ *  - run time stats need CONFIG_FREERTOS_USE_TRACE_FACILITY and
+ *    CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS in sdkconfig, the Arduino
+ *    core's prebuilt FreeRTOS has them off (see platformio.ini), cpu is
+ *    null until then
+ */
+
+typedef struct {
+  const char *name;
+  uint32_t    stack;        // (in bytes)
+  UBaseType_t priority;
+  BaseType_t  core;
+  StackType_t *stack_buf;
+  StaticTask_t *tcb;
+  TaskHandle_t handle;
+  bool        warned;       // Low stack already logged
+} task_entry_t;
+
+#define TASK_STATIC(id, size) \
+  StackType_t task_stack_##id[(size) / sizeof(StackType_t)]; \
+  StaticTask_t task_tcb_##id;
+
+TASK_STATIC(adc,    TASK_ADC_STACK)
+TASK_STATIC(adc_cb, TASK_ADC_CB_STACK)
+TASK_STATIC(ctrl,   TASK_CTRL_STACK)
+TASK_STATIC(wave,   TASK_WAVE_STACK)
+TASK_STATIC(pulse,  TASK_PULSE_STACK)
+TASK_STATIC(trig,   TASK_TRIG_STACK)
+TASK_STATIC(net,    TASK_NET_STACK)
+TASK_STATIC(pub,    TASK_PUB_STACK)
+
+task_entry_t task_table[TASK_NUM] = {
+  {"ad7177_task",    TASK_ADC_STACK,    TASK_ACQ_PRIORITY,     TASK_ACQ_CORE,  task_stack_adc,    &task_tcb_adc,    NULL, false},
+  {"adc_cb_task",    TASK_ADC_CB_STACK, TASK_ACQ_PRIORITY - 1, TASK_ACQ_CORE,  task_stack_adc_cb, &task_tcb_adc_cb, NULL, false},
+  {"ctrl_task",      TASK_CTRL_STACK,   TASK_CTRL_PRIORITY,    TASK_CTRL_CORE, task_stack_ctrl,   &task_tcb_ctrl,   NULL, false},
+  {"wave_task",      TASK_WAVE_STACK,   TASK_WAVE_PRIORITY,    TASK_ACQ_CORE,  task_stack_wave,   &task_tcb_wave,   NULL, false},
+  {"pulse_task",     TASK_PULSE_STACK,  TASK_WAVE_PRIORITY,    TASK_ACQ_CORE,  task_stack_pulse,  &task_tcb_pulse,  NULL, false},
+  {"trig_task",      TASK_TRIG_STACK,   TASK_WAVE_PRIORITY,    TASK_ACQ_CORE,  task_stack_trig,   &task_tcb_trig,   NULL, false},
+  {"websocket_task", TASK_NET_STACK,    TASK_NET_PRIORITY,     TASK_NET_CORE,  task_stack_net,    &task_tcb_net,    NULL, false},
+  {"publish_task",   TASK_PUB_STACK,    TASK_PUB_PRIORITY,     TASK_PUB_CORE,  task_stack_pub,    &task_tcb_pub,    NULL, false}
+};
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+TaskStatus_t task_status[TASK_STATS_MAX];
+TaskHandle_t task_prev_handle[TASK_STATS_MAX];
+uint32_t     task_prev_runtime[TASK_STATS_MAX];
+uint32_t     task_prev_total = 0;
+UBaseType_t  task_prev_num = 0;
+#endif
+
+/**********************************************************
+ *
+ * Helper Functions
+ *
+ **********************************************************/
+
+task_entry_t *task_find(TaskHandle_t handle) {
+  for (int i = 0; i < TASK_NUM; i++) {
+    if (task_table[i].handle != NULL && task_table[i].handle == handle) return &task_table[i];
+  }
+  return NULL;
+}
+
+int task_json_entry(char *str, int len, int size, const char *name, int core, UBaseType_t priority,
+    task_entry_t *entry, uint32_t free, float cpu) {
+  if (len >= size) return len;
+
+  len += snprintf(str + len, size - len, "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,",
+      (str[len - 1] == '[') ? "" : ",", name, core, (unsigned) priority);
+  if (len >= size) return len;
+
+  if (entry) len += snprintf(str + len, size - len, "\"stack\":%u,", entry->stack);
+  else       len += snprintf(str + len, size - len, "\"stack\":null,");
+  if (len >= size) return len;
+
+  if (cpu >= 0) len += snprintf(str + len, size - len, "\"free\":%u,\"cpu\":%.1f}", free, cpu);
+  else          len += snprintf(str + len, size - len, "\"free\":%u,\"cpu\":null}", free);
+
+  return len;
+}
+
+/**********************************************************
+ *
+ * Global Functions
+ *
+ **********************************************************/
+
+// Create task with the layout and static stack of id
+TaskHandle_t task_create(task_id_t id, TaskFunction_t fn, void *param) {
+  task_entry_t *entry = &task_table[id];
+
+  if (entry->handle != NULL) return entry->handle;
+
+  entry->handle = xTaskCreateStaticPinnedToCore(fn, entry->name, entry->stack, param,
+      entry->priority, entry->stack_buf, entry->tcb, entry->core);
+  if (entry->handle == NULL) LOG_E(SMU, "%s not created", entry->name);
+
+  return entry->handle;
+}
+
+TaskHandle_t task_handle(task_id_t id) {
+  return task_table[id].handle;
+}
+
+// Task stats as json message
+//  - cpu is the percentage of one core used since the previous call
+//    (null without FreeRTOS run time stats)
+//  - free is the minimum free stack seen (in bytes)
+//  - keeps the previous run times, only call from one task (/tasks handler)
+int task_stats_json(char *str, int size) {
+  int len = snprintf(str, size, "{\"type\":\"tasks\",\"millis\":%lu,\"tasks\":[", (unsigned long) millis());
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+  uint32_t total;
+  UBaseType_t num = uxTaskGetSystemState(task_status, TASK_STATS_MAX, &total);
+  uint32_t elapsed = total - task_prev_total;
+
+  for (UBaseType_t i = 0; i < num; i++) {
+    TaskStatus_t *status = &task_status[i];
+    uint32_t runtime = status->ulRunTimeCounter;
+
+    // Subtract runtime at previous call (if task existed then)
+    for (UBaseType_t p = 0; p < task_prev_num; p++) {
+      if (task_prev_handle[p] == status->xHandle) {
+        runtime -= task_prev_runtime[p];
+        break;
+      }
+    }
+
+    BaseType_t core = xTaskGetAffinity(status->xHandle);
+
+    len = task_json_entry(str, len, size, status->pcTaskName,
+        (core < portNUM_PROCESSORS) ? (int) core : -1, status->uxCurrentPriority, task_find(status->xHandle),
+        status->usStackHighWaterMark, elapsed ? 100.0F * runtime / elapsed : 0);
+  }
+
+  for (UBaseType_t i = 0; i < num; i++) {
+    task_prev_handle[i]  = task_status[i].xHandle;
+    task_prev_runtime[i] = task_status[i].ulRunTimeCounter;
+  }
+  task_prev_num   = num;
+  task_prev_total = total;
+#else
+  for (int i = 0; i < TASK_NUM; i++) {
+    task_entry_t *entry = &task_table[i];
+    if (entry->handle == NULL) continue;
+
+    len = task_json_entry(str, len, size, entry->name, entry->core, entry->priority,
+        entry, uxTaskGetStackHighWaterMark(entry->handle), -1);
+  }
+#endif
+
+  if (len >= size) return size;
+  return len + snprintf(str + len, size - len, "]}");
+}
+
+// Log tasks whose free stack dropped below TASK_STACK_MARGIN (once each)
+void task_check_stacks() {
+  for (int i = 0; i < TASK_NUM; i++) {
+    task_entry_t *entry = &task_table[i];
+    if (entry->handle == NULL || entry->warned) continue;
+
+    uint32_t free = uxTaskGetStackHighWaterMark(entry->handle);
+    if (free < TASK_STACK_MARGIN) {
+      LOG_W(SMU, "%s stack low: %u of %u bytes free", entry->name, free, entry->stack);
+      entry->warned = true;
+    }
+  }
+}
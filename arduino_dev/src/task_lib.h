@@ -0,0 +1,89 @@
+#ifndef TASK_LIB_H
+#define TASK_LIB_H
+
+#include "hal.h"
+
+/****************************************
+ *  Task Layout
+ ***************************************/
+
+// Core and priority per subsystem (override with build flags)
+//  - acquisition owns core 1, the Arduino loop() (RemoteDebug/OTA) also
+//    runs there at priority 1 so it only gets the time left over
+//  - network and publishing share core 0 with WiFi, bursts of messages
+//    can't delay acquisition
+//  - control SPI jobs (self benchmark) run below acquisition on core 1
+//  - waveform updates, pulse edges and trigger model steps (hardware
+//    timer paced) run above acquisition on core 1, a step is a short
+//    control bus write
+#ifndef TASK_ACQ_CORE
+#define TASK_ACQ_CORE       1
+#endif
+#ifndef TASK_ACQ_PRIORITY
+#define TASK_ACQ_PRIORITY   5     // ADC read task, callback task runs one below
+#endif
+#ifndef TASK_CTRL_CORE
+#define TASK_CTRL_CORE      1
+#endif
+#ifndef TASK_CTRL_PRIORITY
+#define TASK_CTRL_PRIORITY  2
+#endif
+#ifndef TASK_WAVE_PRIORITY
+#define TASK_WAVE_PRIORITY  (TASK_ACQ_PRIORITY + 1)
+#endif
+#ifndef TASK_NET_CORE
+#define TASK_NET_CORE       0
+#endif
+#ifndef TASK_NET_PRIORITY
+#define TASK_NET_PRIORITY   1
+#endif
+#ifndef TASK_PUB_CORE
+#define TASK_PUB_CORE       0
+#endif
+#ifndef TASK_PUB_PRIORITY
+#define TASK_PUB_PRIORITY   1
+#endif
+
+// Stack sizes (in bytes), check headroom with task_stats_json()
+//  - acquisition tasks keep the size they were created with before the
+//    task table, trim only from free stack measured on the board
+//  - wave, pulse and trigger sizes are not measured on the board yet,
+//    the comments give the deepest call path's own frames (-fstack-usage
+//    of the native build), the rest is for Xtensa window spills and the
+//    context save
+#define TASK_ADC_STACK      4096
+#define TASK_ADC_CB_STACK   4096
+#define TASK_CTRL_STACK     4096
+#define TASK_WAVE_STACK     2048  // ~600, verified set when done
+#define TASK_PULSE_STACK    2048  // ~400, edge write and log when done
+#define TASK_TRIG_STACK     3072  // ~750, verified source set, and a
+                                  //  "trig" result (~500 and newlib %e)
+#define TASK_NET_STACK      4096
+#define TASK_PUB_STACK      4096
+
+#define TASK_STACK_MARGIN   512   // Warn when free stack drops below (in bytes)
+#define TASK_STATS_MAX      24    // Max tasks listed in stats
+#define TASK_STATS_LEN      2560  // Size of stats json message
+
+typedef enum {
+  TASK_ADC,         // AD7177 sample read (acquisition)
+  TASK_ADC_CB,      // Sample set callback (acquisition)
+  TASK_CTRL,        // Control SPI jobs
+  TASK_WAVE,        // Waveform DAC updates
+  TASK_PULSE,       // Pulse edges
+  TASK_TRIG,        // Trigger model
+  TASK_NET,         // WebSocket server and send queues
+  TASK_PUB,         // Telemetry publishing (smu_process)
+  TASK_NUM
+} task_id_t;
+
+/****************************************
+ *  Task Functions
+ ***************************************/
+
+TaskHandle_t task_create(task_id_t id, TaskFunction_t fn, void *param);
+TaskHandle_t task_handle(task_id_t id);
+int task_stats_json(char *str, int size);
+void task_check_stacks();
+
+#endif
@@ -12,8 +12,8 @@
 #include <ArduinoJson.h>
 #include "ad7177_lib.h"
 #include "utility.h"
-#include <string>
-#include <deque>
+#include "ws_queue.h"
+#include "log_lib.h"
 
 
 #define USE_LIB_WEBSOCKET true
@@ -42,8 +42,16 @@ AsyncWebServer server(80);
 /****************************************
  * WebSocketsServer
  ***************************************/
+#define WS_TASK_POLL     10   // Max time between processing passes (in ms)
+#define WS_TASK_BUSY     2    // Time between passes while queues drain (in ms)
+#define WS_STATS_MS      5000 // Period of queue statistics message (in ms)
+
+static_assert(WS_CLIENT_MAX == WEBSOCKETS_SERVER_CLIENT_MAX, "WS_CLIENT_MAX must match WebSockets library");
+
 WebSocketsServer websocket(81);
-bool is_websocket_connected = false;
+volatile bool is_websocket_connected = false;
+TaskHandle_t websocket_task_handle;
+uint32_t websocket_millis_stats;
 
 ws_conn_cb_t ws_disconnected_cb = NULL;
 ws_conn_cb_t ws_connected_cb = NULL;
@@ -59,14 +67,13 @@ ws_text_cb_t ws_text_cb = NULL;
   RemoteDebug Debug;
 #endif
 
+debug_cmd_cb_t debug_cmd_cb = NULL;
+
 /****************************************
  *  Logging
  ***************************************/
 
-#define MAX_LOG_ENTRIES 50
-
-// Queue to store log messages using std::string
-std::deque<std::string> log_buffer;
+#define LOG_FLUSH_MAX 8     // Max log messages sent per websocket pass
 
 
 
@@ -76,17 +83,8 @@ std::deque<std::string> log_buffer;
  *
  *********************************************************/
 
-// Setup multicast DNS name
+// Setup multicast DNS name (once connected, see wifi_init for hostname)
 void dns_init() {
-  String hostNameWifi = HOST_NAME;
-  hostNameWifi.concat(".local");
-
-  #if defined(ESP8266)
-    WiFi.hostname(hostNameWifi);
-  #elif  defined(ESP32)
-    WiFi.setHostname(hostNameWifi.c_str());
-  #endif
-
   if (MDNS.begin(HOST_NAME)) {
     Serial.print("* MDNS responder started. Hostname -> ");
     Serial.println(HOST_NAME);
@@ -98,8 +96,40 @@ void dns_init() {
  * Wifi Manager Functions
  *
  *********************************************************/
+
+// Start connecting to saved network in station mode (doesn't wait)
+//  - returns false if there are no saved credentials (start wm_init)
+bool wifi_init() {
+  String hostNameWifi = HOST_NAME;
+  hostNameWifi.concat(".local");
+
+  #if defined(ESP8266)
+    WiFi.hostname(hostNameWifi);
+  #elif  defined(ESP32)
+    WiFi.setHostname(hostNameWifi.c_str());
+  #endif
+
+  WiFi.mode(WIFI_STA);
+  if (!wm.getWiFiIsSaved()) return false;
+
+  WiFi.begin();
+  return true;
+}
+
+// Start config portal without blocking, poll with wm_process()
 void wm_init() {
-  wm.autoConnect("SetupSMU5522");
+  wm.setConfigPortalBlocking(false);
+  wm.startConfigPortal(WM_PORTAL_NAME);
+  Serial.println("WiFi config portal started");
+}
+
+// Handle config portal, returns true once it connected to a network
+bool wm_process() {
+  return wm.process();
+}
+
+void wm_stop() {
+  wm.stopConfigPortal();
 }
 
 /**********************************************************
@@ -205,6 +235,25 @@ void webserver_init() {
     request->send(LittleFS, "/styles.css", "text/css");
   });
 
+  // Boot phase timeline
+  server.on("/boot", HTTP_GET, [](AsyncWebServerRequest *request){
+    char str[BOOT_JSON_LEN];
+    boot_json(str, sizeof(str));
+    request->send(200, "application/json", str);
+  });
+
+  // Task layout, cpu and stack headroom
+  server.on("/tasks", HTTP_GET, [](AsyncWebServerRequest *request){
+    char *str = (char *) malloc(TASK_STATS_LEN);
+    if (str == NULL) {
+      request->send(503, "text/plain", "Out of memory");
+      return;
+    }
+    task_stats_json(str, TASK_STATS_LEN);
+    request->send(200, "application/json", str);
+    free(str);
+  });
+
   server.onNotFound(webserver_notfound);
 
   // Start server
@@ -217,30 +266,39 @@ void webserver_init() {
  *
  *********************************************************/
 
-// Function to log messages
-void log_add(const std::string& message) {
-  std::string json_msg = "{\"log\": \"" + message + "\"}";
-
-  // If a client is connected, send the message immediately
-  if (is_websocket_connected) {
-    websocket.broadcastTXT(json_msg.c_str());
-  } else {
-    // Store message in the buffer
-    log_buffer.push_back(json_msg);
-
-    // If the buffer exceeds MAX_LOG_ENTRIES, remove the oldest message
-    if (log_buffer.size() > MAX_LOG_ENTRIES) {
-      log_buffer.pop_front();
+// Copy message into json log object, escaping special characters
+void log_json(char *json, size_t size, const char *message) {
+  size_t len = snprintf(json, size, "{\"log\": \"");
+
+  for (const char *p = message; *p && len + 8 < size; p++) {
+    if (*p == '"' || *p == '\\') {
+      json[len++] = '\\';
+      json[len++] = *p;
+    } else if ((uint8_t) *p < 0x20) {
+      len += snprintf(json + len, size - len, "\\u%04x", *p);
+    } else {
+      json[len++] = *p;
     }
   }
+  snprintf(json + len, size - len, "\"}");
 }
 
-// Function to flush the buffer when a client connects
+// Send pending log messages to clients (called from websocket task)
+//  - messages stay in the log ring until a client is connected
 void log_flush() {
-  for (const auto& message : log_buffer) {
-    websocket.broadcastTXT(message.c_str());
+  char message[LOG_MSG_LEN];
+  char json[2*LOG_MSG_LEN];
+  uint32_t dropped;
+
+  if (!is_websocket_connected) return;
+
+  dropped = log_dropped();
+  if (dropped) log_add("%u log messages dropped", dropped);
+
+  for (int i = 0; i < LOG_FLUSH_MAX && log_pop(message, sizeof(message)); i++) {
+    log_json(json, sizeof(json), message);
+    ws_queue_broadcast(json, WS_MSG_LOG);
   }
-  log_buffer.clear();
 }
 
 /**********************************************************
@@ -260,47 +318,118 @@ void websocket_event(uint8_t num, WStype_t type, uint8_t * payload, size_t lengt
 
   switch (type) {
     case WStype_DISCONNECTED:             // if the websocket is disconnected
-      is_websocket_connected = false;
-      debugD("[%u] Disconnected!\n", num);
-      if (ws_disconnected_cb) ws_disconnected_cb();
+      ws_queue_close(num);
+      is_websocket_connected = (ws_queue_count() > 0);
+      LOG_D(NET, "[%u] Disconnected", num);
+      if (ws_disconnected_cb) ws_disconnected_cb(num);
       break;
     case WStype_CONNECTED:                // if a new websocket connection is established
+      ws_queue_open(num);
       is_websocket_connected = true;
       {  // set scope for ip
         IPAddress ip = websocket.remoteIP(num);
-        debugD("[%u] Connected from %d.%d.%d.%d url: %s\n", num, ip[0], ip[1], ip[2], ip[3], payload);
+        LOG_D(NET, "[%u] Connected from %d.%d.%d.%d", num, ip[0], ip[1], ip[2], ip[3]);
       }
       log_add("Client connected.");
-      log_flush();
-      if (ws_connected_cb) ws_connected_cb();
+      if (ws_connected_cb) ws_connected_cb(num);
       break;
     case WStype_TEXT:                    // if new text data is received
-      debugD("[%u] get Text: %s\n", num, payload);
-      {  // set scope for json_str
-        String json_str = String((char*) payload);
-        DynamicJsonDocument json(1024);
-        deserializeJson(json, json_str);
-      }
-      if (ws_text_cb) ws_text_cb(payload, length);
+      LOG_D(NET, "[%u] Text received, %u bytes", num, (uint32_t) length);
+      if (ws_text_cb) ws_text_cb(num, payload, length);
       break;
     default:
       break;
   }
 }
 
+// Send function for draining client queues (only called from websocket task)
+bool websocket_send_client(uint8_t num, const char *message, size_t length) {
+  return websocket.sendTXT(num, message, length);
+}
+
+// Network task - owns the websocket server, only this task touches sockets
+//  - sleeps until a message is queued, or WS_TASK_POLL as the library
+//    has to be polled for incoming data
+//  - keeps draining every WS_TASK_BUSY while messages are being sent
+void websocket_task(void *pvParameters) {
+  while (true) {
+    uint8_t sent = websocket_process();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(sent ? WS_TASK_BUSY : WS_TASK_POLL));
+  }
+}
+
 // WebSocket init
 void websocket_init() {
+  ws_queue_init();
+  websocket_millis_stats = millis();
+
   // Setup WebSocket server
   websocket.begin();
   websocket.onEvent(websocket_event);
+
+  // Create websocket task (network core, see task_lib.h)
+  websocket_task_handle = task_create(TASK_NET, websocket_task, NULL);
+  ws_queue_set_notify(websocket_task_handle);
 }
 
-void websocket_process() {
+// Returns number of messages sent
+uint8_t websocket_process() {
+  int8_t stalled;
+  uint8_t sent;
+
   websocket.loop();     // Check for websocket events
+
+  // Format pending log messages and send queued messages
+  log_flush();
+  sent = ws_queue_drain(websocket_send_client);
+
+  // Drop client that hasn't been able to receive anything
+  stalled = ws_queue_stalled();
+  if (stalled >= 0) {
+    LOG_W(NET, "[%d] Send queue stalled, disconnecting", stalled);
+    websocket.disconnect(stalled);
+  }
+
+  if (millis() - websocket_millis_stats > WS_STATS_MS) {
+    websocket_millis_stats = millis();
+    websocket_send_stats();
+    log_profile_report();
+  }
+
+  return sent;
 }
 
-void websocket_send(const char *message) {
-  websocket.broadcastTXT(message);
+// Queue message for all clients
+//  - returns false if a never-drop message could not be queued (retry later)
+bool websocket_send(const char *message, ws_msg_class_t cls) {
+  return ws_queue_broadcast(message, cls);
+}
+
+// Send queue depth and drop counters for each connected client
+void websocket_send_stats() {
+  char str[512];
+  int len;
+
+  if (!is_websocket_connected) return;
+
+  len = snprintf(str, sizeof(str), "{\"type\":\"ws_stats\",\"clients\":[");
+  for (int i = 0; i < WS_CLIENT_MAX; i++) {
+    ws_queue_stats_t stats;
+
+    ws_queue_get_stats(i, &stats);
+    if (!stats.connected) continue;
+
+    len += snprintf(str + len, sizeof(str) - len,
+        "%s{\"num\":%d,\"depth\":%u,\"depth_max\":%u,\"sent\":%u,"
+        "\"drop_status\":%u,\"drop_log\":%u,\"drop_result\":%u,\"rejected\":%u}",
+        (str[len - 1] == '[') ? "" : ",", i, stats.depth, stats.depth_max, stats.sent,
+        stats.dropped[WS_MSG_STATUS], stats.dropped[WS_MSG_LOG], stats.dropped[WS_MSG_RESULT],
+        stats.rejected);
+    if (len >= (int) sizeof(str)) return;
+  }
+  snprintf(str + len, sizeof(str) - len, "]}");
+
+  websocket_send(str, WS_MSG_STATUS);
 }
 
 
@@ -318,10 +447,26 @@ void debug_init() {
   MDNS.addService("telnet", "tcp", 23);
 }
 
+// Set handler for project commands (not handled by RemoteDebug itself)
+void debug_set_cb(debug_cmd_cb_t cmd_cb, const char *help) {
+  debug_cmd_cb = cmd_cb;
+  Debug.setHelpProjectsCmds(help);
+}
+
 void debug_process() {
   Debug.handle();       // remote debug
   String last_cmd = Debug.getLastCommand();
   Debug.clearLastCommand();
+
+  last_cmd.trim();
+  if (debug_cmd_cb && last_cmd.length() > 0) {
+    debug_cmd_cb(last_cmd.c_str());
+  }
+}
+
+// Print to remote debug session (only call from loop())
+void debug_print(const char *message) {
+  Debug.println(message);
 }
 
 /**********************************************************
@@ -340,7 +485,7 @@ void adc_process(int64_t data){
   sprintf(buf_hex, "%016X", data);
 
   String message = "{\"type\":\"data\", \"hex\":\"0x" + String(buf_hex) + "\", \"int64\":" + String(data) + ", \"uint64\":" + String(udata) + "}";
-  websocket.broadcastTXT(message);
+  websocket_send(message.c_str(), WS_MSG_RESULT);
 }
 
 //void adc_process(uint32_t data){
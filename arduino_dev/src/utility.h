@@ -15,7 +15,10 @@
 #include <ArduinoJson.h>
 #include "ad7177_lib.h"
 #include "quad_smu.h"
-#include <string>
+#include "ws_queue.h"
+#include "log_lib.h"
+#include "task_lib.h"
+#include "boot_lib.h"
 
 #define USE_LIB_WEBSOCKET true
 #define WEBSOCKET_DISABLED true
@@ -30,6 +33,11 @@
 #define NTP_SERVER "pool.ntp.org"
 #define TZ "EST5EDT,M3.2.0,M11.1.0" // https://github.com/nayarsystems/posix_tz_db/blob/master/zones.csv
 
+/****************************************
+ * WiFi
+ ***************************************/
+#define WM_PORTAL_NAME "SetupSMU5522"
+
 /****************************************
  * OTA Service
  ***************************************/
@@ -40,8 +48,14 @@
  * WebSocketsServer
  ***************************************/
 
-typedef void (*ws_conn_cb_t)();
-typedef void (*ws_text_cb_t)(uint8_t *payload, size_t length);
+typedef void (*ws_conn_cb_t)(uint8_t num);
+typedef void (*ws_text_cb_t)(uint8_t num, uint8_t *payload, size_t length);
+
+/****************************************
+ * RemoteDebug
+ ***************************************/
+
+typedef void (*debug_cmd_cb_t)(const char *cmd);
 
 /****************************************
  * Function Prototypes
@@ -50,20 +64,25 @@ typedef void (*ws_text_cb_t)(uint8_t *payload, size_t length);
 void dns_init();
 void ota_init();
 void ota_process();
+bool wifi_init();
 void wm_init();
+bool wm_process();
+void wm_stop();
 void littlefs_init();
 void littlefs_listdir(fs::FS &fs, const char * dirname, uint8_t levels);
 void webserver_notfound(AsyncWebServerRequest *request);
-void websocket_send(const char *message);
+bool websocket_send(const char *message, ws_msg_class_t cls = WS_MSG_STATUS);
+void websocket_send_stats();
 void webserver_init();
 void websocket_set_cb(ws_conn_cb_t connected_cb, ws_conn_cb_t disconnected_cb, ws_text_cb_t text_cb);
 void websocket_event(uint8_t num, WStype_t type, uint8_t * payload, size_t length);
 void websocket_init();
-void websocket_process();
+uint8_t websocket_process();
 void debug_init();
 void debug_process();
+void debug_set_cb(debug_cmd_cb_t cmd_cb, const char *help);
+void debug_print(const char *message);
 void adc_process(int64_t data);
-void log_add(const std::string& message);
 void log_flush();
 
 #endif
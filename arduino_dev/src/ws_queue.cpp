@@ -0,0 +1,369 @@
+#include "hal.h"
+#include "ws_queue.h"
+
+/*
+ * Per-client outbound message queues
+ *  - producers (loop, adc callback, logging) only enqueue, they never
+ *    touch the socket so a slow client can't stall them
+ *  - the network task drains the queues round-robin
+ *  - a message is allocated once and shared between all client queues
+ *    with a reference count
+ *  - queue state is protected by a spinlock, the lock is never held
+ *    while allocating, freeing or sending
+ *  - a queued message notifies the network task (if set) so it doesn't
+ *    have to poll the queues
+ */
+
+typedef struct {
+  uint8_t  refs;        // Number of queues (or drainers) holding the message
+  uint8_t  cls;         // ws_msg_class_t
+  uint16_t len;
+  char     data[1];     // Null terminated message (allocated to len + 1)
+} ws_msg_t;
+
+typedef struct {
+  bool      open;
+  uint8_t   head;                     // Index of oldest message
+  uint8_t   count;                    // Number of queued messages
+  uint32_t  full_since;               // millis() when queue became full (0 = not full)
+  ws_msg_t *msg[WS_QUEUE_DEPTH];
+  ws_queue_stats_t stats;
+} ws_client_queue_t;
+
+ws_client_queue_t ws_queue[WS_CLIENT_MAX];
+portMUX_TYPE ws_queue_mux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t ws_queue_notify_task = NULL;
+
+ws_policy_t ws_policy[WS_MSG_NUM] = {
+  WS_DROP_OLDEST,   // WS_MSG_STATUS
+  WS_DROP_OLDEST,   // WS_MSG_LOG
+  WS_DROP_NEVER     // WS_MSG_RESULT
+};
+
+/**************************************************
+ *
+ * Internal Helper Functions
+ *
+ **************************************************/
+
+ws_msg_t *ws_msg_alloc(const char *message, ws_msg_class_t cls) {
+  size_t len = strlen(message);
+  if (len > 0xFFFF) return NULL;
+
+  ws_msg_t *msg = (ws_msg_t *) malloc(sizeof(ws_msg_t) + len);
+  if (msg == NULL) return NULL;
+
+  msg->refs = 0;
+  msg->cls  = cls;
+  msg->len  = len;
+  memcpy(msg->data, message, len + 1);
+
+  return msg;
+}
+
+// Drop one reference (call with lock held), returns message if it must be freed
+ws_msg_t *ws_msg_unref(ws_msg_t *msg) {
+  if (--msg->refs == 0) return msg;
+  return NULL;
+}
+
+inline ws_msg_t *ws_queue_at(ws_client_queue_t *q, uint8_t i) {
+  return q->msg[(q->head + i) % WS_QUEUE_DEPTH];
+}
+
+// Remove entry i (0 = oldest) from queue (call with lock held)
+ws_msg_t *ws_queue_remove(ws_client_queue_t *q, uint8_t i) {
+  ws_msg_t *msg = ws_queue_at(q, i);
+
+  // Shift newer entries down to close the gap
+  for (uint8_t k = i; k + 1 < q->count; k++) {
+    q->msg[(q->head + k) % WS_QUEUE_DEPTH] = ws_queue_at(q, k + 1);
+  }
+  q->count--;
+
+  return msg;
+}
+
+// Remove oldest entry (call with lock held)
+ws_msg_t *ws_queue_pop(ws_client_queue_t *q) {
+  ws_msg_t *msg = q->msg[q->head];
+
+  q->head = (q->head + 1) % WS_QUEUE_DEPTH;
+  q->count--;
+
+  return msg;
+}
+
+// Find oldest message that may be evicted, -1 if none (call with lock held)
+int8_t ws_queue_find_droppable(ws_client_queue_t *q) {
+  for (uint8_t i = 0; i < q->count; i++) {
+    if (ws_policy[ws_queue_at(q, i)->cls] != WS_DROP_NEVER) return i;
+  }
+  return -1;
+}
+
+// Check if a message of class cls would be accepted (call with lock held)
+bool ws_queue_accepts(ws_client_queue_t *q, ws_msg_class_t cls) {
+  if (q->count < WS_QUEUE_DEPTH) return true;
+  if (ws_policy[cls] != WS_DROP_NEVER) return true;
+  return ws_queue_find_droppable(q) >= 0;
+}
+
+// Add message to queue applying drop policy (call with lock held)
+//  - returns message that must be freed after the lock is released
+ws_msg_t *ws_queue_push(ws_client_queue_t *q, ws_msg_t *msg) {
+  ws_msg_t *release = NULL;
+
+  if (q->count >= WS_QUEUE_DEPTH) {
+    int8_t idx = -1;
+
+    if (q->full_since == 0) q->full_since = millis() | 1;
+
+    if (ws_policy[msg->cls] != WS_DROP_NEWEST) {
+      idx = ws_queue_find_droppable(q);
+    }
+
+    // Nothing to evict, drop the new message
+    if (idx < 0) {
+      q->stats.dropped[msg->cls]++;
+      return NULL;
+    }
+
+    ws_msg_t *old = ws_queue_remove(q, idx);
+    q->stats.dropped[old->cls]++;
+    release = ws_msg_unref(old);
+  }
+
+  q->msg[(q->head + q->count) % WS_QUEUE_DEPTH] = msg;
+  q->count++;
+  msg->refs++;
+
+  if (q->count > q->stats.depth_max) q->stats.depth_max = q->count;
+
+  return release;
+}
+
+/**************************************************
+ *
+ * External Functions
+ *
+ **************************************************/
+
+void ws_queue_init() {
+  for (int i = 0; i < WS_CLIENT_MAX; i++) {
+    memset(&ws_queue[i], 0, sizeof(ws_client_queue_t));
+  }
+}
+
+void ws_queue_set_policy(ws_msg_class_t cls, ws_policy_t policy) {
+  if (cls >= WS_MSG_NUM) return;
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  ws_policy[cls] = policy;
+  portEXIT_CRITICAL(&ws_queue_mux);
+}
+
+// Task notified when a message is queued (network task)
+void ws_queue_set_notify(TaskHandle_t task) {
+  ws_queue_notify_task = task;
+}
+
+void ws_queue_open(uint8_t num) {
+  if (num >= WS_CLIENT_MAX) return;
+
+  // Drop anything left from a previous client with the same number
+  ws_queue_close(num);
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  memset(&ws_queue[num].stats, 0, sizeof(ws_queue_stats_t));
+  ws_queue[num].open = true;
+  portEXIT_CRITICAL(&ws_queue_mux);
+}
+
+void ws_queue_close(uint8_t num) {
+  ws_msg_t *release[WS_QUEUE_DEPTH];
+  uint8_t num_release = 0;
+
+  if (num >= WS_CLIENT_MAX) return;
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  ws_client_queue_t *q = &ws_queue[num];
+  while (q->count > 0) {
+    ws_msg_t *msg = ws_msg_unref(ws_queue_pop(q));
+    if (msg) release[num_release++] = msg;
+  }
+  q->open = false;
+  q->head = 0;
+  q->full_since = 0;
+  portEXIT_CRITICAL(&ws_queue_mux);
+
+  for (uint8_t i = 0; i < num_release; i++) free(release[i]);
+}
+
+bool ws_queue_is_open(uint8_t num) {
+  if (num >= WS_CLIENT_MAX) return false;
+  return ws_queue[num].open;
+}
+
+uint8_t ws_queue_count() {
+  uint8_t count = 0;
+  for (int i = 0; i < WS_CLIENT_MAX; i++) {
+    if (ws_queue[i].open) count++;
+  }
+  return count;
+}
+
+// Queue message for one client
+//  - returns false if the message was not queued (closed, rejected or
+//    dropped by a full WS_DROP_NEWEST queue)
+bool ws_queue_send(uint8_t num, const char *message, ws_msg_class_t cls) {
+  ws_msg_t *release = NULL;
+  bool queued = false;
+  bool ret = true;
+
+  if (num >= WS_CLIENT_MAX || cls >= WS_MSG_NUM) return false;
+
+  ws_msg_t *msg = ws_msg_alloc(message, cls);
+  if (msg == NULL) return false;
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  ws_client_queue_t *q = &ws_queue[num];
+  if (!q->open) {
+    ret = false;
+  } else if (!ws_queue_accepts(q, cls)) {
+    q->stats.rejected++;
+    ret = false;
+  } else {
+    release = ws_queue_push(q, msg);
+  }
+  queued = (msg->refs > 0);
+  portEXIT_CRITICAL(&ws_queue_mux);
+
+  ret = ret && queued;
+  if (release) free(release);
+  if (!queued) free(msg);
+  if (ret && ws_queue_notify_task) xTaskNotifyGive(ws_queue_notify_task);
+
+  return ret;
+}
+
+// Queue message for all connected clients
+//  - never-drop messages are queued for all clients or for none, so the
+//    producer can retry without sending duplicates
+//  - returns false if no client queued the message
+bool ws_queue_broadcast(const char *message, ws_msg_class_t cls) {
+  ws_msg_t *release[WS_CLIENT_MAX];
+  uint8_t num_release = 0;
+  bool queued = false;
+  bool ret = true;
+
+  if (cls >= WS_MSG_NUM) return false;
+  if (ws_queue_count() == 0) return true;
+
+  ws_msg_t *msg = ws_msg_alloc(message, cls);
+  if (msg == NULL) return false;
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  for (int i = 0; i < WS_CLIENT_MAX; i++) {
+    if (ws_queue[i].open && !ws_queue_accepts(&ws_queue[i], cls)) {
+      ws_queue[i].stats.rejected++;
+      ret = false;
+    }
+  }
+  if (ret) {
+    for (int i = 0; i < WS_CLIENT_MAX; i++) {
+      if (!ws_queue[i].open) continue;
+
+      ws_msg_t *old = ws_queue_push(&ws_queue[i], msg);
+      if (old) release[num_release++] = old;
+    }
+  }
+  queued = (msg->refs > 0);
+  portEXIT_CRITICAL(&ws_queue_mux);
+
+  ret = ret && queued;
+  for (uint8_t i = 0; i < num_release; i++) free(release[i]);
+  if (!queued) free(msg);
+  if (ret && ws_queue_notify_task) xTaskNotifyGive(ws_queue_notify_task);
+
+  return ret;
+}
+
+// Send queued messages, one per client per pass (called by network task)
+//  - returns number of messages sent
+uint8_t ws_queue_drain(ws_send_fn_t send) {
+  uint8_t sent = 0;
+  uint8_t failed = 0;   // Clients whose socket failed this drain (bit per client)
+
+  for (int pass = 0; pass < WS_DRAIN_BUDGET; pass++) {
+    bool pending = false;
+
+    for (int i = 0; i < WS_CLIENT_MAX; i++) {
+      ws_msg_t *msg = NULL;
+
+      if (failed & (1 << i)) continue;
+
+      // Borrow oldest message, it stays queued until the send succeeds
+      portENTER_CRITICAL(&ws_queue_mux);
+      ws_client_queue_t *q = &ws_queue[i];
+      if (q->open && q->count > 0) {
+        msg = ws_queue_at(q, 0);
+        msg->refs++;
+      }
+      portEXIT_CRITICAL(&ws_queue_mux);
+
+      if (msg == NULL) continue;
+
+      // Socket write happens without the lock held
+      bool ok = send(i, msg->data, msg->len);
+
+      ws_msg_t *release = NULL;
+      portENTER_CRITICAL(&ws_queue_mux);
+      if (ok) {
+        // Message may have been evicted or the queue closed meanwhile
+        if (q->count > 0 && ws_queue_at(q, 0) == msg) {
+          ws_queue_pop(q);
+          q->full_since = 0;
+          ws_msg_unref(msg);
+        }
+        q->stats.sent++;
+        sent++;
+      } else {
+        // Retry on the next drain
+        failed |= (1 << i);
+      }
+      release = ws_msg_unref(msg);
+      if (ok && q->count > 0) pending = true;
+      portEXIT_CRITICAL(&ws_queue_mux);
+
+      if (release) free(release);
+    }
+
+    if (!pending) break;
+  }
+
+  return sent;
+}
+
+// Return client that has been unable to drain for WS_STALL_MS, -1 if none
+int8_t ws_queue_stalled() {
+  uint32_t now = millis();
+
+  for (int i = 0; i < WS_CLIENT_MAX; i++) {
+    uint32_t full_since = ws_queue[i].full_since;
+    if (ws_queue[i].open && full_since != 0 && now - full_since > WS_STALL_MS) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void ws_queue_get_stats(uint8_t num, ws_queue_stats_t *stats) {
+  if (num >= WS_CLIENT_MAX) return;
+
+  portENTER_CRITICAL(&ws_queue_mux);
+  *stats = ws_queue[num].stats;
+  stats->connected = ws_queue[num].open;
+  stats->depth     = ws_queue[num].count;
+  portEXIT_CRITICAL(&ws_queue_mux);
+}
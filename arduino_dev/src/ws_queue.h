@@ -0,0 +1,66 @@
+#ifndef WS_QUEUE_H
+#define WS_QUEUE_H
+
+#include "hal.h"
+
+/****************************************
+ *  WebSocket Send Queue Defines
+ ***************************************/
+
+// Must match WEBSOCKETS_SERVER_CLIENT_MAX of the WebSockets library
+#define WS_CLIENT_MAX      5
+
+// Messages held per client before the drop policy applies
+#define WS_QUEUE_DEPTH     16
+
+// Messages sent to one client per drain pass (keeps clients round-robin)
+#define WS_DRAIN_BUDGET    2
+
+// Client is dropped after its queue has been full this long (in ms)
+#define WS_STALL_MS        10000
+
+// Message classes, each class has its own drop policy
+typedef enum {
+  WS_MSG_STATUS = 0,    // Periodic smu status (superseded by next update)
+  WS_MSG_LOG    = 1,    // Log messages
+  WS_MSG_RESULT = 2,    // Sweep/measurement results
+  WS_MSG_NUM    = 3
+} ws_msg_class_t;
+
+typedef enum {
+  WS_DROP_OLDEST = 0,   // Full queue evicts oldest droppable message
+  WS_DROP_NEWEST = 1,   // Full queue rejects the new message
+  WS_DROP_NEVER  = 2    // Full queue evicts droppable messages, otherwise
+                        //  the send fails and the producer must retry
+} ws_policy_t;
+
+typedef struct {
+  bool     connected;
+  uint8_t  depth;                 // Messages currently queued
+  uint8_t  depth_max;             // High-water mark
+  uint32_t sent;                  // Messages handed to the socket
+  uint32_t dropped[WS_MSG_NUM];   // Messages dropped per class
+  uint32_t rejected;              // Never-drop sends refused (backpressure)
+} ws_queue_stats_t;
+
+// Send function used to drain a queue (returns false if the socket failed)
+typedef bool (*ws_send_fn_t)(uint8_t num, const char *message, size_t length);
+
+/****************************************
+ *  WebSocket Send Queue Functions
+ ***************************************/
+
+void ws_queue_init();
+void ws_queue_set_policy(ws_msg_class_t cls, ws_policy_t policy);
+void ws_queue_set_notify(TaskHandle_t task);
+void ws_queue_open(uint8_t num);
+void ws_queue_close(uint8_t num);
+bool ws_queue_is_open(uint8_t num);
+uint8_t ws_queue_count();
+bool ws_queue_send(uint8_t num, const char *message, ws_msg_class_t cls);
+bool ws_queue_broadcast(const char *message, ws_msg_class_t cls);
+uint8_t ws_queue_drain(ws_send_fn_t send);
+int8_t ws_queue_stalled();
+void ws_queue_get_stats(uint8_t num, ws_queue_stats_t *stats);
+
+#endif